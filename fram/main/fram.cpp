@@ -10,10 +10,14 @@
 
 #include "fram.h"
 #include <vector>
+#include <algorithm>
 #include <cstring>
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_check.h"
+#include "esp_timer.h"
 #include "driver/spi_master.h"
+#include "freertos/task.h"
 
 static const char *TAG = "FRAM_C++";
 
@@ -26,31 +30,64 @@ static constexpr uint8_t FRAM_CMD_READ = 0x03;
 static constexpr uint8_t FRAM_CMD_WRITE = 0x02;
 static constexpr uint8_t FRAM_CMD_RDID = 0x9F;
 
+// status register bits
+static constexpr uint8_t FRAM_SR_BP_SHIFT = 2;
+static constexpr uint8_t FRAM_SR_BP_MASK = 0x0C;
+static constexpr uint8_t FRAM_SR_WPEN = 0x80;
+static constexpr uint8_t FRAM_SR_WRITABLE = FRAM_SR_WPEN | FRAM_SR_BP_MASK;
+
+// mirrored reads from this size on are split across both chips
+static constexpr size_t MIRROR_SPLIT_MIN = 64;
+
+// fill/copy/move: bounce buffer size and transfers kept in flight (devcfg.queue_size)
+static constexpr size_t BULK_CHUNK = 256;
+static constexpr size_t BULK_QUEUE = 3;
+// wire bytes a move piece adds to a slice: the second command and address, WREN, WRDI
+static constexpr size_t MOVE_EXTRA = 5;
+
+// largest single transaction (buscfg.max_transfer_sz)
+static constexpr size_t MAX_TRANSFER = 4096;
+
 FRAM::FRAM(spi_host_device_t host, gpio_num_t cs, gpio_num_t sclk, gpio_num_t mosi, gpio_num_t miso, int freq_hz)
     : host_(host), cs_(cs), sclk_(sclk), mosi_(mosi), miso_(miso), freq_hz_(freq_hz)
 {}
 
+FRAM::FRAM(spi_host_device_t host, gpio_num_t cs, int freq_hz)
+    : host_(host), cs_(cs), sclk_(GPIO_NUM_NC), mosi_(GPIO_NUM_NC), miso_(GPIO_NUM_NC), freq_hz_(freq_hz),
+      shared_(true), max_hold_us_(SHARED_MAX_HOLD_US)
+{}
+
 FRAM::~FRAM()
 {
+    if (mirror_lock_) vSemaphoreDelete(mirror_lock_);
+    if (sr_lock_) vSemaphoreDelete(sr_lock_);
     if (dev_) {
         spi_bus_remove_device(dev_);
         dev_ = nullptr;
     }
-    // try to free bus (ignore errors in dtor)
-    spi_bus_free(host_);
+    // try to free bus (ignore errors in dtor); a shared bus stays with its owner
+    if (!shared_) spi_bus_free(host_);
 }
 
 esp_err_t FRAM::init()
 {
-    spi_bus_config_t buscfg = {};
-    buscfg.mosi_io_num     = mosi_;
-    buscfg.miso_io_num     = miso_;
-    buscfg.sclk_io_num     = sclk_;
-    buscfg.quadwp_io_num   = -1;
-    buscfg.quadhd_io_num   = -1;
-    buscfg.max_transfer_sz = 4096;
-    buscfg.flags           = SPICOMMON_BUSFLAG_MASTER;
-    ESP_RETURN_ON_ERROR(spi_bus_initialize(host_, &buscfg, SPI_DMA_CH_AUTO), TAG, "spi_bus_initialize");
+    if (!shared_) {
+        spi_bus_config_t buscfg = {};
+        buscfg.mosi_io_num     = mosi_;
+        buscfg.miso_io_num     = miso_;
+        buscfg.sclk_io_num     = sclk_;
+        buscfg.quadwp_io_num   = -1;
+        buscfg.quadhd_io_num   = -1;
+        buscfg.max_transfer_sz = MAX_TRANSFER;
+        buscfg.flags           = SPICOMMON_BUSFLAG_MASTER;
+        ESP_RETURN_ON_ERROR(spi_bus_initialize(host_, &buscfg, SPI_DMA_CH_AUTO), TAG, "spi_bus_initialize");
+        max_len_ = MAX_TRANSFER;
+    } else {
+        // the owner picked max_transfer_sz, possibly smaller than ours
+        ESP_RETURN_ON_FALSE(spi_bus_get_max_transaction_len(host_, &max_len_) == ESP_OK, ESP_ERR_INVALID_STATE,
+                            TAG, "shared bus %d not initialized", (int)host_);
+        ESP_LOGI(TAG, "attached to shared bus %d, max transfer %u", (int)host_, (unsigned)max_len_);
+    }
 
     spi_device_interface_config_t devcfg = {};
     devcfg.clock_speed_hz = freq_hz_;
@@ -58,31 +95,144 @@ esp_err_t FRAM::init()
     devcfg.spics_io_num   = cs_;
     devcfg.queue_size     = 3;
     devcfg.flags          = 0;
+    devcfg.pre_cb         = on_trans_start;
+    devcfg.post_cb        = on_trans_done;
     ESP_RETURN_ON_ERROR(spi_bus_add_device(host_, &devcfg, &dev_), TAG, "spi_bus_add_device");
+    update_slice();
+    reset_bus_stats();
 
-    // sanity: read RDID
+    // sanity: read RDID; with the bus held the driver leaves this device's
+    // clock, mode and CS set up in the host registers for the direct backend
     uint8_t id[4] = {0};
-    if (rdid(id, sizeof id) == ESP_OK) {
+    ESP_RETURN_ON_ERROR(acquire_bus(), TAG, "acquire bus");
+    esp_err_t err = rdid(id, sizeof id);
+    if (err == ESP_OK) capture_regs();
+    release_bus();
+    if (err == ESP_OK) {
         ESP_LOGI(TAG, "RDID: %02X %02X %02X %02X", id[0], id[1], id[2], id[3]);
     } else {
         ESP_LOGW(TAG, "RDID failed");
     }
 
-    // status reg read (sanity)
-    uint8_t tx[2] = { FRAM_CMD_RDSR, 0x00 }, rx[2] = {0};
-    spi_transaction_t t = {};
-    t.length = 16;
-    t.tx_buffer = tx;
-    t.rx_buffer = rx;
-    ESP_ERROR_CHECK(spi_device_transmit(dev_, &t));
-    ESP_LOGI(TAG, "SR=0x%02X", rx[1]);
+    // status reg read (sanity); the BP bits are non-volatile, so protection
+    // set up in an earlier run is in force from here on
+    uint8_t sr = 0;
+    ESP_ERROR_CHECK(read_sr(sr));
+    ESP_LOGI(TAG, "SR=0x%02X", sr);
+    sr_ = sr & FRAM_SR_WRITABLE;
+    bp_ = static_cast<Protect>((sr_ & FRAM_SR_BP_MASK) >> FRAM_SR_BP_SHIFT);
+    if (!sr_lock_) {
+        sr_lock_ = xSemaphoreCreateMutex();
+        ESP_RETURN_ON_FALSE(sr_lock_, ESP_ERR_NO_MEM, TAG, "mutex");
+    }
+
+    return ESP_OK;
+}
+
+/* -------------------------------------------------------------------------
+ * Bus sharing
+ * ----------------------------------------------------------------------*/
+
+template <typename Op>
+esp_err_t FRAM::sliced(size_t len, bool backward, Op op, size_t piece)
+{
+    if (!slice_) piece = len;
+    else if (!piece) piece = slice_;
+    for (size_t done = 0; done < len;) {
+        const size_t n = std::min(piece, len - done);
+        const size_t off = backward ? len - done - n : done;
+        esp_err_t err = op(off, n);
+        if (err != ESP_OK) return err;
+        done += n;
+    }
+    return ESP_OK;
+}
+
+void FRAM::update_slice()
+{
+    if (!shared_ && !max_hold_us_) {
+        slice_ = 0;
+        return;
+    }
+    // command and address take 3 bytes of every piece
+    size_t n = max_len_ > 3 ? max_len_ - 3 : 1;
+    if (max_hold_us_) {
+        int khz = freq_hz_ / 1000;
+        if (dev_) spi_device_get_actual_freq(dev_, &khz);
+        const size_t fit = static_cast<size_t>(max_hold_us_) * khz / 8000;
+        n = std::min(n, fit > 3 ? fit - 3 : 1);
+    }
+    slice_ = n;
+}
+
+void FRAM::set_max_hold_us(uint32_t us)
+{
+    max_hold_us_ = us;
+    if (!max_len_) max_len_ = MAX_TRANSFER;
+    update_slice();
+}
 
+esp_err_t FRAM::acquire_bus()
+{
+    ESP_RETURN_ON_ERROR(spi_device_acquire_bus(dev_, portMAX_DELAY), TAG, "acquire bus");
+    session_t0_ = esp_timer_get_time();
     return ESP_OK;
 }
 
+void FRAM::release_bus()
+{
+    const int64_t t0 = session_t0_;
+    session_t0_ = 0;
+    spi_device_release_bus(dev_);
+    account(-1, esp_timer_get_time() - t0);
+}
+
+// the callbacks run in the driver interrupt, which may be in IRAM: no flash code here
+IRAM_ATTR void FRAM::on_trans_start(spi_transaction_t *t)
+{
+    auto *f = static_cast<FRAM *>(t->user);
+    if (f) f->wire_t0_ = esp_timer_get_time();
+}
+
+IRAM_ATTR void FRAM::on_trans_done(spi_transaction_t *t)
+{
+    auto *f = static_cast<FRAM *>(t->user);
+    if (!f) return;
+    const int64_t us = esp_timer_get_time() - f->wire_t0_;
+    // inside a CS-held session the whole session is the hold (release_bus())
+    f->account(us, f->session_t0_ ? 0 : us);
+}
+
+IRAM_ATTR void FRAM::account(int64_t wire_us, int64_t hold_us)
+{
+    portENTER_CRITICAL_SAFE(&stats_lock_);
+    if (wire_us >= 0) {
+        ++bus_stats_.transactions;
+        bus_stats_.busy_us += wire_us;
+    }
+    if (hold_us > bus_stats_.longest_hold_us) bus_stats_.longest_hold_us = static_cast<uint32_t>(hold_us);
+    portEXIT_CRITICAL_SAFE(&stats_lock_);
+}
+
+FRAM::BusStats FRAM::bus_stats() const
+{
+    portENTER_CRITICAL(&stats_lock_);
+    BusStats s = bus_stats_;
+    portEXIT_CRITICAL(&stats_lock_);
+    return s;
+}
+
+void FRAM::reset_bus_stats()
+{
+    portENTER_CRITICAL(&stats_lock_);
+    bus_stats_ = {};
+    portEXIT_CRITICAL(&stats_lock_);
+}
+
 esp_err_t FRAM::cmd8(uint8_t cmd)
 {
     spi_transaction_t t = {};
+    t.user = this;
     t.length = 8;
     t.tx_buffer = &cmd;
     return spi_device_transmit(dev_, &t);
@@ -96,11 +246,13 @@ esp_err_t FRAM::wren(bool en)
 esp_err_t FRAM::rdid(uint8_t *out, size_t n)
 {
     ESP_RETURN_ON_FALSE(out && n > 0, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    DriverGuard bus;
     size_t txlen = 1 + n;
     std::vector<uint8_t> tx(txlen, 0), rx(txlen, 0);
     tx[0] = FRAM_CMD_RDID;
 
     spi_transaction_t t = {};
+    t.user = this;
     t.length = 8 * txlen;
     t.tx_buffer = tx.data();
     t.rx_buffer = rx.data();
@@ -116,7 +268,37 @@ esp_err_t FRAM::read(addr_t addr, void *buf, size_t len)
 {
     ESP_RETURN_ON_FALSE(buf && len, ESP_ERR_INVALID_ARG, TAG, "bad args");
     if ((uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    if (direct_ && !mirror_ && len <= DIRECT_MAX) {
+        esp_err_t err = direct_read(addr, buf, len);
+        if (err != ESP_ERR_NOT_FINISHED) return err;
+    }
+    uint8_t *p = static_cast<uint8_t *>(buf);
+    return sliced(len, false, [&](size_t off, size_t n) {
+        DriverGuard bus;
+        const addr_t a = static_cast<addr_t>(addr + off);
+        return mirror_ ? read_mirrored(a, p + off, n) : read_raw(a, p + off, n);
+    });
+}
 
+esp_err_t FRAM::write(addr_t addr, const void *buf, size_t len)
+{
+    ESP_RETURN_ON_FALSE(buf && len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    if ((uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    ESP_RETURN_ON_ERROR(check_writable(addr, len), TAG, "write");
+    if (direct_ && !mirror_ && len <= DIRECT_MAX) {
+        esp_err_t err = direct_write(addr, buf, len);
+        if (err != ESP_ERR_NOT_FINISHED) return err;
+    }
+    const uint8_t *p = static_cast<const uint8_t *>(buf);
+    return sliced(len, false, [&](size_t off, size_t n) {
+        DriverGuard bus;
+        const addr_t a = static_cast<addr_t>(addr + off);
+        return mirror_ ? write_mirrored(a, p + off, n) : write_raw(a, p + off, n);
+    });
+}
+
+esp_err_t FRAM::read_raw(addr_t addr, void *buf, size_t len)
+{
     size_t txlen = 3 + len;
     std::vector<uint8_t> tx(txlen, 0), rx(txlen, 0);
     tx[0] = FRAM_CMD_READ;
@@ -124,6 +306,7 @@ esp_err_t FRAM::read(addr_t addr, void *buf, size_t len)
     tx[2] = static_cast<uint8_t>(addr & 0xFF);
 
     spi_transaction_t t = {};
+    t.user = this;
     t.length = 8 * txlen;
     t.tx_buffer = tx.data();
     t.rx_buffer = rx.data();
@@ -133,11 +316,8 @@ esp_err_t FRAM::read(addr_t addr, void *buf, size_t len)
     return err;
 }
 
-esp_err_t FRAM::write(addr_t addr, const void *buf, size_t len)
+esp_err_t FRAM::write_raw(addr_t addr, const void *buf, size_t len)
 {
-    ESP_RETURN_ON_FALSE(buf && len, ESP_ERR_INVALID_ARG, TAG, "bad args");
-    if ((uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
-
     ESP_RETURN_ON_ERROR(wren(true), TAG, "WREN");
 
     size_t txlen = 3 + len;
@@ -148,10 +328,725 @@ esp_err_t FRAM::write(addr_t addr, const void *buf, size_t len)
     memcpy(tx.data() + 3, buf, len);
 
     spi_transaction_t t = {};
+    t.user = this;
     t.length = 8 * txlen;
     t.tx_buffer = tx.data();
 
     esp_err_t err = spi_device_transmit(dev_, &t);
     if (err == ESP_OK) err = wren(false);
     return err;
-}
\ No newline at end of file
+}
+
+/* -------------------------------------------------------------------------
+ * Mirroring
+ * ----------------------------------------------------------------------*/
+
+esp_err_t FRAM::start_read(addr_t addr, size_t len, Xfer &x)
+{
+    x.len = len;
+    x.tx.assign(3 + len, 0);
+    x.rx.assign(3 + len, 0);
+    x.tx[0] = FRAM_CMD_READ;
+    x.tx[1] = static_cast<uint8_t>(addr >> 8);
+    x.tx[2] = static_cast<uint8_t>(addr & 0xFF);
+    x.t = {};
+    x.t.user = this;
+    x.t.length = 8 * x.tx.size();
+    x.t.tx_buffer = x.tx.data();
+    x.t.rx_buffer = x.rx.data();
+    return spi_device_queue_trans(dev_, &x.t, portMAX_DELAY);
+}
+
+esp_err_t FRAM::start_write(addr_t addr, const void *buf, size_t len, Xfer &x)
+{
+    ESP_RETURN_ON_ERROR(wren(true), TAG, "WREN");
+    x.len = 0;
+    x.tx.resize(3 + len);
+    x.tx[0] = FRAM_CMD_WRITE;
+    x.tx[1] = static_cast<uint8_t>(addr >> 8);
+    x.tx[2] = static_cast<uint8_t>(addr & 0xFF);
+    memcpy(x.tx.data() + 3, buf, len);
+    x.rx.clear();
+    x.t = {};
+    x.t.user = this;
+    x.t.length = 8 * x.tx.size();
+    x.t.tx_buffer = x.tx.data();
+    return spi_device_queue_trans(dev_, &x.t, portMAX_DELAY);
+}
+
+esp_err_t FRAM::finish(Xfer &x)
+{
+    spi_transaction_t *done = nullptr;
+    ESP_RETURN_ON_ERROR(spi_device_get_trans_result(dev_, &done, portMAX_DELAY), TAG, "trans result");
+    // a write is closed with WRDI, a read has nothing to close
+    return x.rx.empty() ? wren(false) : ESP_OK;
+}
+
+esp_err_t FRAM::set_mirror(FRAM *mirror)
+{
+    ESP_RETURN_ON_FALSE(mirror != this, ESP_ERR_INVALID_ARG, TAG, "cannot mirror onto itself");
+    ESP_RETURN_ON_FALSE(!mirror || (dev_ && mirror->dev_), ESP_ERR_INVALID_STATE, TAG, "init both chips first");
+    if (mirror && !mirror_lock_) {
+        mirror_lock_ = xSemaphoreCreateMutex();
+        ESP_RETURN_ON_FALSE(mirror_lock_, ESP_ERR_NO_MEM, TAG, "mutex");
+    }
+    mirror_ = mirror;
+    stale_ = -1;
+    ESP_LOGI(TAG, "mirroring %s", mirror ? "enabled" : "disabled");
+    return ESP_OK;
+}
+
+void FRAM::mark_stale(uint8_t s)
+{
+    if (!mirror_ || s > 1) return;
+    if (stale_ != s) ESP_LOGW(TAG, "mirror side %u marked stale", s);
+    stale_ = s;
+}
+
+esp_err_t FRAM::read_side(uint8_t s, addr_t addr, void *buf, size_t len)
+{
+    ESP_RETURN_ON_FALSE(buf && len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    if ((uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    DriverGuard bus;
+    if (s == 0 && !mirror_) return read_raw(addr, buf, len);
+    ESP_RETURN_ON_FALSE(mirror_ && s <= 1 && stale_ != s, ESP_ERR_INVALID_STATE, TAG, "side %u unavailable", s);
+    return side(s).read_raw(addr, buf, len);
+}
+
+esp_err_t FRAM::read_mirrored(addr_t addr, void *buf, size_t len)
+{
+    uint8_t *out = static_cast<uint8_t *>(buf);
+    // the halves of a split read come from different chips: a mirrored write
+    // landing between them would leave old data in one and new in the other
+    const bool split = stale_ < 0 && len >= MIRROR_SPLIT_MIN;
+    if (split) xSemaphoreTake(mirror_lock_, portMAX_DELAY);
+    const int stale = stale_;
+
+    if (split && stale < 0) {
+        // first half from side 0, second half from side 1, transfers overlap
+        const size_t half = len / 2;
+        Xfer a, b;
+        esp_err_t ea = start_read(addr, half, a);
+        esp_err_t eb = mirror_->start_read(static_cast<addr_t>(addr + half), len - half, b);
+        if (ea == ESP_OK) ea = finish(a);
+        if (eb == ESP_OK) eb = mirror_->finish(b);
+        esp_err_t err = ESP_OK;
+        if (ea == ESP_OK && eb == ESP_OK) {
+            memcpy(out, a.rx.data() + 3, half);
+            memcpy(out + half, b.rx.data() + 3, len - half);
+            ++mirror_stats_.split_reads;
+        } else {
+            // one side failed: everything from the other one
+            uint8_t bad = ea != ESP_OK ? 0 : 1;
+            mark_stale(bad);
+            ++mirror_stats_.failovers;
+            err = side(bad ^ 1).read_raw(addr, buf, len);
+        }
+        xSemaphoreGive(mirror_lock_);
+        return err;
+    }
+    if (split) xSemaphoreGive(mirror_lock_);
+
+    uint8_t s = stale >= 0 ? static_cast<uint8_t>(stale ^ 1) : (next_side_ ^= 1);
+    esp_err_t err = side(s).read_raw(addr, buf, len);
+    if (err == ESP_OK) {
+        ++mirror_stats_.reads[s];
+        return ESP_OK;
+    }
+    if (stale >= 0) return err;
+    mark_stale(s);
+    ++mirror_stats_.failovers;
+    return side(s ^ 1).read_raw(addr, buf, len);
+}
+
+esp_err_t FRAM::write_mirrored(addr_t addr, const void *buf, size_t len)
+{
+    xSemaphoreTake(mirror_lock_, portMAX_DELAY);
+    Xfer a, b;
+    esp_err_t ea = start_write(addr, buf, len, a);
+    esp_err_t eb = mirror_->start_write(addr, buf, len, b);
+    if (ea == ESP_OK) ea = finish(a);
+    if (eb == ESP_OK) eb = mirror_->finish(b);
+    // a failed side is marked stale before a split read can pick it again
+    const esp_err_t err = mirror_outcome(ea, eb);
+    xSemaphoreGive(mirror_lock_);
+    return err;
+}
+
+esp_err_t FRAM::mirror_outcome(esp_err_t ea, esp_err_t eb)
+{
+    if (ea == ESP_OK && eb == ESP_OK) return ESP_OK;
+    if (ea != ESP_OK && eb != ESP_OK) return ea;
+    const uint8_t bad = ea != ESP_OK ? 0 : 1;
+    // the side that succeeded is still waiting for a resync: no good copy left
+    if (stale_ >= 0 && stale_ != bad) return bad ? eb : ea;
+    // degraded: the surviving side holds the data, the other needs a resync
+    mark_stale(bad);
+    ++mirror_stats_.failovers;
+    return ESP_OK;
+}
+
+esp_err_t FRAM::resync(size_t chunk)
+{
+    ESP_RETURN_ON_FALSE(mirror_ && chunk > 0, ESP_ERR_INVALID_STATE, TAG, "no mirror");
+    if (slice_) chunk = std::min(chunk, slice_);
+    // without a known-bad side, side 0 is the reference
+    if (stale_ < 0) mark_stale(1);
+    const uint8_t dst = static_cast<uint8_t>(stale_), src = dst ^ 1;
+    ESP_LOGI(TAG, "resync: side %u -> side %u", src, dst);
+
+    std::vector<uint8_t> buf(chunk);
+    int64_t t0 = esp_timer_get_time();
+    for (size_t a = 0; a < FRAM_SIZE_BYTES; a += chunk) {
+        size_t n = std::min(chunk, FRAM_SIZE_BYTES - a);
+        xSemaphoreTake(mirror_lock_, portMAX_DELAY);
+        esp_err_t err;
+        {
+            // per chunk, so that fast ops get the bus in between
+            DriverGuard bus;
+            err = side(src).read_raw(static_cast<addr_t>(a), buf.data(), n);
+            if (err == ESP_OK) err = side(dst).write_raw(static_cast<addr_t>(a), buf.data(), n);
+        }
+        xSemaphoreGive(mirror_lock_);
+        ESP_RETURN_ON_ERROR(err, TAG, "resync at 0x%04X", (unsigned)a);
+        taskYIELD();
+    }
+    stale_ = -1;
+    ESP_LOGI(TAG, "resync done in %lld us", (long long)(esp_timer_get_time() - t0));
+    return ESP_OK;
+}
+
+/* -------------------------------------------------------------------------
+ * Bulk operations
+ * ----------------------------------------------------------------------*/
+
+template <typename Op>
+esp_err_t FRAM::both_sides(Op op)
+{
+    xSemaphoreTake(mirror_lock_, portMAX_DELAY);
+    esp_err_t ea = op(*this);
+    esp_err_t eb = op(*mirror_);
+    const esp_err_t err = mirror_outcome(ea, eb);
+    xSemaphoreGive(mirror_lock_);
+    return err;
+}
+
+esp_err_t FRAM::wait_queued(size_t n)
+{
+    esp_err_t err = ESP_OK;
+    for (; n; --n) {
+        spi_transaction_t *done = nullptr;
+        esp_err_t e = spi_device_get_trans_result(dev_, &done, portMAX_DELAY);
+        if (err == ESP_OK) err = e;
+    }
+    return err;
+}
+
+esp_err_t FRAM::fill_raw(addr_t addr, uint8_t value, size_t len)
+{
+    // the same pattern buffer is sent again and again inside one WRITE
+    std::vector<uint8_t> pattern(std::min(len, BULK_CHUNK), value);
+    spi_transaction_ext_t t[BULK_QUEUE] = {};
+
+    ESP_RETURN_ON_ERROR(acquire_bus(), TAG, "acquire bus");
+    esp_err_t err = wren(true);
+    size_t inflight = 0, k = 0;
+    for (size_t off = 0; err == ESP_OK && off < len; ++k) {
+        const size_t n = std::min(pattern.size(), len - off);
+        if (inflight == BULK_QUEUE) {
+            err = wait_queued(1);
+            --inflight;
+            if (err != ESP_OK) break;
+        }
+        spi_transaction_ext_t &x = t[k % BULK_QUEUE];
+        x = {};
+        x.base.user = this;
+        if (off == 0) {
+            x.base.flags = SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR;
+            x.base.cmd = FRAM_CMD_WRITE;
+            x.base.addr = addr;
+            x.command_bits = 8;
+            x.address_bits = 16;
+        }
+        off += n;
+        if (off < len) x.base.flags |= SPI_TRANS_CS_KEEP_ACTIVE;
+        x.base.length = 8 * n;
+        x.base.tx_buffer = pattern.data();
+        err = spi_device_queue_trans(dev_, &x.base, portMAX_DELAY);
+        if (err == ESP_OK) ++inflight;
+    }
+    esp_err_t e = wait_queued(inflight);
+    if (err == ESP_OK) err = e;
+    if (err == ESP_OK) err = wren(false);
+    release_bus();
+    return err;
+}
+
+esp_err_t FRAM::transfer_raw(addr_t dst, addr_t src, size_t len, bool backward)
+{
+    // chunk k is read into buf[k & 1] while chunk k - 1 is written from the other one
+    struct Slot {
+        spi_transaction_ext_t rd, wr;
+        spi_transaction_t wren;
+    };
+    const size_t chunk = std::min(len, BULK_CHUNK);
+    const size_t count = (len + chunk - 1) / chunk;
+    std::vector<uint8_t> buf(2 * chunk);
+    Slot slot[2] = {};
+
+    auto range = [&](size_t k, size_t &off, size_t &n) {
+        if (!backward) {
+            off = k * chunk;
+            n = std::min(chunk, len - off);
+        } else {
+            const size_t end = len - k * chunk;
+            off = end > chunk ? end - chunk : 0;
+            n = end - off;
+        }
+    };
+    auto queue_read = [&](size_t k) {
+        size_t off, n;
+        range(k, off, n);
+        spi_transaction_ext_t &x = slot[k & 1].rd;
+        x = {};
+        x.base.user = this;
+        x.base.flags = SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR;
+        x.base.cmd = FRAM_CMD_READ;
+        x.base.addr = src + off;
+        x.command_bits = 8;
+        x.address_bits = 16;
+        x.base.length = 8 * n;
+        x.base.rx_buffer = buf.data() + (k & 1) * chunk;
+        return spi_device_queue_trans(dev_, &x.base, portMAX_DELAY);
+    };
+    auto queue_write = [&](size_t k, size_t &queued) {
+        size_t off, n;
+        range(k, off, n);
+        Slot &s = slot[k & 1];
+        s.wren = {};
+        s.wren.user = this;
+        s.wren.flags = SPI_TRANS_USE_TXDATA;
+        s.wren.tx_data[0] = FRAM_CMD_WREN;
+        s.wren.length = 8;
+        ESP_RETURN_ON_ERROR(spi_device_queue_trans(dev_, &s.wren, portMAX_DELAY), TAG, "queue WREN");
+        ++queued;
+        s.wr = {};
+        s.wr.base.user = this;
+        s.wr.base.flags = SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR;
+        s.wr.base.cmd = FRAM_CMD_WRITE;
+        s.wr.base.addr = dst + off;
+        s.wr.command_bits = 8;
+        s.wr.address_bits = 16;
+        s.wr.base.length = 8 * n;
+        s.wr.base.tx_buffer = buf.data() + (k & 1) * chunk;
+        esp_err_t err = spi_device_queue_trans(dev_, &s.wr.base, portMAX_DELAY);
+        if (err == ESP_OK) ++queued;
+        return err;
+    };
+
+    ESP_RETURN_ON_ERROR(acquire_bus(), TAG, "acquire bus");
+    esp_err_t err = queue_read(0);
+    if (err == ESP_OK) err = wait_queued(1);
+    for (size_t k = 0; k < count && err == ESP_OK; ++k) {
+        // chunk k is in RAM: queue its write and the read of chunk k + 1 behind it
+        size_t queued = 0;
+        err = queue_write(k, queued);
+        if (err == ESP_OK && k + 1 < count) {
+            err = queue_read(k + 1);
+            if (err == ESP_OK) ++queued;
+        }
+        esp_err_t e = wait_queued(queued);
+        if (err == ESP_OK) err = e;
+    }
+    if (err == ESP_OK) err = wren(false);
+    release_bus();
+    return err;
+}
+
+esp_err_t FRAM::fill(addr_t addr, uint8_t value, size_t len)
+{
+    ESP_RETURN_ON_FALSE(len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    if ((uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    ESP_RETURN_ON_ERROR(check_writable(addr, len), TAG, "fill");
+    return sliced(len, false, [&](size_t off, size_t n) {
+        DriverGuard bus;
+        const addr_t a = static_cast<addr_t>(addr + off);
+        if (!mirror_) return fill_raw(a, value, n);
+        return both_sides([&](FRAM &f) { return f.fill_raw(a, value, n); });
+    });
+}
+
+esp_err_t FRAM::copy(addr_t dst, addr_t src, size_t len)
+{
+    ESP_RETURN_ON_FALSE(len && (dst + len <= src || src + len <= dst), ESP_ERR_INVALID_ARG, TAG,
+                        "overlapping ranges, use move()");
+    return move(dst, src, len);
+}
+
+esp_err_t FRAM::move(addr_t dst, addr_t src, size_t len)
+{
+    ESP_RETURN_ON_FALSE(len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    if ((uint32_t)dst + len > FRAM_SIZE_BYTES || (uint32_t)src + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    if (dst == src) return ESP_OK;
+    ESP_RETURN_ON_ERROR(check_writable(dst, len), TAG, "move");
+    // like memmove: copy from the end when the destination lies above the source;
+    // pieces go in the same order, so none reads what an earlier one has written
+    const bool backward = dst > src;
+    // a piece is read and written back in one hold: each byte crosses the wire twice
+    const size_t piece = slice_ > MOVE_EXTRA + 2 ? (slice_ - MOVE_EXTRA) / 2 : 1;
+    return sliced(len, backward, [&](size_t off, size_t n) {
+        DriverGuard bus;
+        const addr_t d = static_cast<addr_t>(dst + off), s = static_cast<addr_t>(src + off);
+        if (!mirror_) return transfer_raw(d, s, n, backward);
+        return both_sides([&](FRAM &f) { return f.transfer_raw(d, s, n, backward); });
+    }, piece);
+}
+
+esp_err_t FRAM::stream_raw(addr_t addr, const IoVec *iov, size_t n, bool write)
+{
+    // every buffer is a transfer of its own inside one READ/WRITE, CS held in between
+    size_t last = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (iov[i].len) last = i;
+    }
+    spi_transaction_ext_t t[BULK_QUEUE] = {};
+
+    ESP_RETURN_ON_ERROR(acquire_bus(), TAG, "acquire bus");
+    esp_err_t err = write ? wren(true) : ESP_OK;
+    size_t inflight = 0, k = 0;
+    for (size_t i = 0; err == ESP_OK && i <= last; ++i) {
+        uint8_t *p = static_cast<uint8_t *>(iov[i].base);
+        for (size_t off = 0; err == ESP_OK && off < iov[i].len; ++k) {
+            const size_t m = std::min(MAX_TRANSFER, iov[i].len - off);
+            if (inflight == BULK_QUEUE) {
+                err = wait_queued(1);
+                --inflight;
+                if (err != ESP_OK) break;
+            }
+            spi_transaction_ext_t &x = t[k % BULK_QUEUE];
+            x = {};
+            x.base.user = this;
+            if (k == 0) {
+                x.base.flags = SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR;
+                x.base.cmd = write ? FRAM_CMD_WRITE : FRAM_CMD_READ;
+                x.base.addr = addr;
+                x.command_bits = 8;
+                x.address_bits = 16;
+            }
+            if (i < last || off + m < iov[i].len) x.base.flags |= SPI_TRANS_CS_KEEP_ACTIVE;
+            x.base.length = 8 * m;
+            if (write) {
+                x.base.tx_buffer = p + off;
+            } else {
+                x.base.rx_buffer = p + off;
+            }
+            off += m;
+            err = spi_device_queue_trans(dev_, &x.base, portMAX_DELAY);
+            if (err == ESP_OK) ++inflight;
+        }
+    }
+    esp_err_t e = wait_queued(inflight);
+    if (err == ESP_OK) err = e;
+    if (err == ESP_OK && write) err = wren(false);
+    release_bus();
+    return err;
+}
+
+// total length of a scatter/gather list, 0 if it is malformed or empty
+static size_t iov_total(const FRAM::IoVec *iov, size_t n)
+{
+    if (!iov) return 0;
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!iov[i].base && iov[i].len) return 0;
+        len += iov[i].len;
+    }
+    return len;
+}
+
+// the bytes [off, off + len) of a scatter/gather list, as a list of their own
+static void iov_range(const FRAM::IoVec *iov, size_t n, size_t off, size_t len, std::vector<FRAM::IoVec> &out)
+{
+    out.clear();
+    for (size_t i = 0; i < n && len; ++i) {
+        if (off >= iov[i].len) {
+            off -= iov[i].len;
+            continue;
+        }
+        const size_t m = std::min(len, iov[i].len - off);
+        out.push_back({static_cast<uint8_t *>(iov[i].base) + off, m});
+        len -= m;
+        off = 0;
+    }
+}
+
+esp_err_t FRAM::readv(addr_t addr, const IoVec *iov, size_t n)
+{
+    const size_t len = iov_total(iov, n);
+    ESP_RETURN_ON_FALSE(len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    if ((uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    if (!slice_ || len <= slice_) return readv_piece(addr, iov, n);
+    std::vector<IoVec> part;
+    return sliced(len, false, [&](size_t off, size_t m) {
+        iov_range(iov, n, off, m, part);
+        return readv_piece(static_cast<addr_t>(addr + off), part.data(), part.size());
+    });
+}
+
+esp_err_t FRAM::readv_piece(addr_t addr, const IoVec *iov, size_t n)
+{
+    DriverGuard bus;
+    if (!mirror_) return stream_raw(addr, iov, n, false);
+
+    const int stale = stale_;
+    uint8_t s = stale >= 0 ? static_cast<uint8_t>(stale ^ 1) : (next_side_ ^= 1);
+    esp_err_t err = side(s).stream_raw(addr, iov, n, false);
+    if (err == ESP_OK) {
+        ++mirror_stats_.reads[s];
+        return ESP_OK;
+    }
+    if (stale >= 0) return err;
+    mark_stale(s);
+    ++mirror_stats_.failovers;
+    return side(s ^ 1).stream_raw(addr, iov, n, false);
+}
+
+esp_err_t FRAM::writev(addr_t addr, const IoVec *iov, size_t n)
+{
+    const size_t len = iov_total(iov, n);
+    ESP_RETURN_ON_FALSE(len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    if ((uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    ESP_RETURN_ON_ERROR(check_writable(addr, len), TAG, "writev");
+    if (!slice_ || len <= slice_) return writev_piece(addr, iov, n);
+    std::vector<IoVec> part;
+    return sliced(len, false, [&](size_t off, size_t m) {
+        iov_range(iov, n, off, m, part);
+        return writev_piece(static_cast<addr_t>(addr + off), part.data(), part.size());
+    });
+}
+
+esp_err_t FRAM::writev_piece(addr_t addr, const IoVec *iov, size_t n)
+{
+    DriverGuard bus;
+    if (!mirror_) return stream_raw(addr, iov, n, true);
+    return both_sides([&](FRAM &f) { return f.stream_raw(addr, iov, n, true); });
+}
+
+esp_err_t FRAM::batch_raw(const Segment *segs, size_t n)
+{
+    // WREN, WRITE, WREN, WRITE, ... queued back to back; the chip clears WEL after each WRITE
+    spi_transaction_ext_t t[BULK_QUEUE] = {};
+
+    ESP_RETURN_ON_ERROR(acquire_bus(), TAG, "acquire bus");
+    esp_err_t err = ESP_OK;
+    size_t inflight = 0, k = 0;
+    for (size_t i = 0; err == ESP_OK && i < n; ++i) {
+        const uint8_t *p = static_cast<const uint8_t *>(segs[i].buf);
+        for (size_t off = 0; err == ESP_OK && off < segs[i].len;) {
+            const size_t m = std::min(MAX_TRANSFER, segs[i].len - off);
+            for (int phase = 0; phase < 2 && err == ESP_OK; ++phase, ++k) {
+                if (inflight == BULK_QUEUE) {
+                    err = wait_queued(1);
+                    --inflight;
+                    if (err != ESP_OK) break;
+                }
+                spi_transaction_ext_t &x = t[k % BULK_QUEUE];
+                x = {};
+                x.base.user = this;
+                if (phase == 0) {
+                    x.base.flags = SPI_TRANS_USE_TXDATA;
+                    x.base.tx_data[0] = FRAM_CMD_WREN;
+                    x.base.length = 8;
+                } else {
+                    x.base.flags = SPI_TRANS_VARIABLE_CMD | SPI_TRANS_VARIABLE_ADDR;
+                    x.base.cmd = FRAM_CMD_WRITE;
+                    x.base.addr = segs[i].addr + off;
+                    x.command_bits = 8;
+                    x.address_bits = 16;
+                    x.base.length = 8 * m;
+                    x.base.tx_buffer = p + off;
+                }
+                err = spi_device_queue_trans(dev_, &x.base, portMAX_DELAY);
+                if (err == ESP_OK) ++inflight;
+            }
+            off += m;
+        }
+    }
+    esp_err_t e = wait_queued(inflight);
+    if (err == ESP_OK) err = e;
+    if (err == ESP_OK) err = wren(false);
+    release_bus();
+    return err;
+}
+
+esp_err_t FRAM::write_batch(const Segment *segs, size_t n)
+{
+    ESP_RETURN_ON_FALSE(segs && n, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    for (size_t i = 0; i < n; ++i) {
+        const Segment &s = segs[i];
+        ESP_RETURN_ON_FALSE(s.buf && s.len && (uint32_t)s.addr + s.len <= FRAM_SIZE_BYTES, ESP_ERR_INVALID_ARG, TAG,
+                            "bad segment %u", (unsigned)i);
+        ESP_RETURN_ON_ERROR(check_writable(s.addr, s.len), TAG, "write_batch");
+    }
+    if (!slice_) return batch_piece(segs, n);
+
+    // bounded holds: the ranges, split where needed, regrouped into batches of slice_ bytes
+    std::vector<Segment> part;
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t *p = static_cast<const uint8_t *>(segs[i].buf);
+        for (size_t off = 0; off < segs[i].len;) {
+            const size_t m = std::min(slice_ - bytes, segs[i].len - off);
+            part.push_back({static_cast<addr_t>(segs[i].addr + off), p + off, m});
+            bytes += m;
+            off += m;
+            if (bytes == slice_) {
+                ESP_RETURN_ON_ERROR(batch_piece(part.data(), part.size()), TAG, "write_batch");
+                part.clear();
+                bytes = 0;
+            }
+        }
+    }
+    return part.empty() ? ESP_OK : batch_piece(part.data(), part.size());
+}
+
+esp_err_t FRAM::batch_piece(const Segment *segs, size_t n)
+{
+    DriverGuard bus;
+    if (!mirror_) return batch_raw(segs, n);
+    return both_sides([&](FRAM &f) { return f.batch_raw(segs, n); });
+}
+
+/* -------------------------------------------------------------------------
+ * Write protection
+ * ----------------------------------------------------------------------*/
+
+esp_err_t FRAM::read_sr(uint8_t &sr)
+{
+    if (direct_) {
+        uint8_t io[2] = { FRAM_CMD_RDSR, 0x00 };
+        esp_err_t err = direct_xfer(io, sizeof io);
+        if (err == ESP_OK) sr = io[1];
+        if (err != ESP_ERR_NOT_FINISHED) return err;
+    }
+    DriverGuard bus;
+    uint8_t tx[2] = { FRAM_CMD_RDSR, 0x00 }, rx[2] = {0};
+    spi_transaction_t t = {};
+    t.user = this;
+    t.length = 16;
+    t.tx_buffer = tx;
+    t.rx_buffer = rx;
+    esp_err_t err = spi_device_transmit(dev_, &t);
+    if (err == ESP_OK) sr = rx[1];
+    return err;
+}
+
+esp_err_t FRAM::write_sr(uint8_t sr)
+{
+    // WRSR clears WEL by itself, no WRDI needed
+    DriverGuard bus;
+    ESP_RETURN_ON_ERROR(wren(true), TAG, "WREN");
+    uint8_t tx[2] = { FRAM_CMD_WRSR, sr };
+    spi_transaction_t t = {};
+    t.user = this;
+    t.length = 16;
+    t.tx_buffer = tx;
+    ESP_RETURN_ON_ERROR(spi_device_transmit(dev_, &t), TAG, "WRSR");
+    sr_ = sr;
+    return ESP_OK;
+}
+
+esp_err_t FRAM::set_sr(uint8_t sr)
+{
+    if (!mirror_) return write_sr(sr);
+    return both_sides([&](FRAM &f) { return f.write_sr(sr); });
+}
+
+esp_err_t FRAM::check_sr(uint8_t sr)
+{
+    // read back once: WPEN with /WP low keeps the old value
+    esp_err_t err = ESP_OK;
+    for (uint8_t s = 0; err == ESP_OK && s <= (mirror_ ? 1 : 0); ++s) {
+        if (s == stale_) continue;
+        uint8_t now = 0;
+        err = side(s).read_sr(now);
+        if (err == ESP_OK && (now & FRAM_SR_WRITABLE) != sr) {
+            side(s).sr_ = now & FRAM_SR_WRITABLE;
+            ESP_LOGE(TAG, "side %u: SR=0x%02X, expected 0x%02X (WPEN and /WP low?)", s, now, sr);
+            err = ESP_ERR_INVALID_STATE;
+        }
+    }
+    return err;
+}
+
+esp_err_t FRAM::check_writable(addr_t addr, size_t len) const
+{
+    const auto locked = static_cast<Protect>((sr_ & FRAM_SR_BP_MASK) >> FRAM_SR_BP_SHIFT);
+    // the chip would drop the data without an error, report it instead
+    ESP_RETURN_ON_FALSE((uint32_t)addr + len <= protect_start(locked), ESP_ERR_INVALID_STATE, TAG,
+                        "0x%04X+%u is write-protected, open a WriteWindow", (unsigned)addr, (unsigned)len);
+    return ESP_OK;
+}
+
+esp_err_t FRAM::protect_from(size_t from, bool wpen)
+{
+    ESP_RETURN_ON_FALSE(from <= FRAM_SIZE_BYTES, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    ESP_RETURN_ON_FALSE(sr_lock_, ESP_ERR_INVALID_STATE, TAG, "not initialized");
+    // smallest window that still covers [from, end)
+    Protect bp = Protect::ALL;
+    for (Protect p : { Protect::NONE, Protect::UPPER_QUARTER, Protect::UPPER_HALF }) {
+        if (from >= protect_start(p)) {
+            bp = p;
+            break;
+        }
+    }
+
+    xSemaphoreTake(sr_lock_, portMAX_DELAY);
+    // inside an open window the BP bits stay clear until the last lock()
+    const uint8_t bits = unlocked_ ? 0 : static_cast<uint8_t>(bp) << FRAM_SR_BP_SHIFT;
+    const uint8_t sr = (wpen ? FRAM_SR_WPEN : 0) | bits;
+    esp_err_t err = set_sr(sr);
+    if (err == ESP_OK) err = check_sr(sr);
+    if (err == ESP_OK) bp_ = bp;
+    xSemaphoreGive(sr_lock_);
+    ESP_RETURN_ON_ERROR(err, TAG, "protect_from 0x%04X", (unsigned)from);
+    if (bp == Protect::NONE) {
+        ESP_LOGI(TAG, "write protection off%s", wpen ? ", WPEN" : "");
+    } else {
+        ESP_LOGI(TAG, "write protection: 0x%04X..0x%04X%s", (unsigned)protect_start(bp),
+                 (unsigned)FRAM_SIZE_BYTES - 1, wpen ? ", WPEN" : "");
+    }
+    return ESP_OK;
+}
+
+esp_err_t FRAM::unlock()
+{
+    ESP_RETURN_ON_FALSE(sr_lock_, ESP_ERR_INVALID_STATE, TAG, "not initialized");
+    xSemaphoreTake(sr_lock_, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (unlocked_ == 0 && (sr_ & FRAM_SR_BP_MASK)) {
+        const uint8_t sr = sr_ & ~FRAM_SR_BP_MASK;
+        err = set_sr(sr);
+        if (err == ESP_OK) err = check_sr(sr);
+    }
+    if (err == ESP_OK) ++unlocked_;
+    xSemaphoreGive(sr_lock_);
+    return err;
+}
+
+esp_err_t FRAM::lock()
+{
+    ESP_RETURN_ON_FALSE(sr_lock_, ESP_ERR_INVALID_STATE, TAG, "not initialized");
+    xSemaphoreTake(sr_lock_, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    if (unlocked_ == 0) {
+        err = ESP_ERR_INVALID_STATE;
+    } else if (--unlocked_ == 0 && bp_ != Protect::NONE) {
+        const uint8_t sr = (sr_ & ~FRAM_SR_BP_MASK) | (static_cast<uint8_t>(bp_) << FRAM_SR_BP_SHIFT);
+        err = set_sr(sr);
+        if (err == ESP_OK) err = check_sr(sr);
+    }
+    xSemaphoreGive(sr_lock_);
+    ESP_RETURN_ON_ERROR(err, TAG, "lock");
+    return ESP_OK;
+}
@@ -9,6 +9,7 @@
  */
 
 #pragma once
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
 #include <vector>
@@ -17,6 +18,8 @@
 #include "esp_err.h"
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 class FRAM {
 public:
@@ -26,6 +29,9 @@ public:
     /// Total device size in bytes (used for bounds checking)
     static constexpr size_t FRAM_SIZE_BYTES = 8 * 1024;
 
+    /// Highest SCK frequency of the MB85RS64
+    static constexpr int FRAM_MAX_CLOCK_HZ = 20 * 1000 * 1000;
+
     /**
      * @brief Construct a FRAM driver instance.
      * @param host SPI host (e.g. HSPI_HOST / VSPI_HOST)
@@ -45,20 +51,37 @@ public:
          gpio_num_t miso,
          int freq_hz = 1 * 1000 * 1000);
 
+    /**
+     * @brief Construct a FRAM driver for a bus shared with other devices.
+     * @param host SPI host, already set up with spi_bus_initialize() by its owner
+     * @param cs   GPIO pin used for chip-select
+     * @param freq_hz SPI clock frequency in Hz (default 1MHz)
+     *
+     * @note init() only adds the device to the host and the destructor only
+     *       removes it; the bus stays with its owner. Transfers are bounded
+     *       to SHARED_MAX_HOLD_US from the start (set_max_hold_us()).
+     */
+    FRAM(spi_host_device_t host, gpio_num_t cs, int freq_hz = 1 * 1000 * 1000);
+
     /**
      * @brief Destructor.
-     * @details Detaches the SPI device and attempts to free the SPI bus.
-     *          Destructor ignores errors from bus free operations.
+     * @details Detaches the SPI device and attempts to free the SPI bus
+     *          (not on a shared bus). Destructor ignores errors from bus
+     *          free operations.
      */
     ~FRAM();
 
     /**
      * @brief Initialize SPI bus and attach FRAM device.
-     * @return ESP_OK on success, otherwise an esp_err_t error code.
+     * @return ESP_OK on success, otherwise an esp_err_t error code
+     *         (ESP_ERR_INVALID_STATE on a shared bus that is not initialized).
      * @note This must be called before any read/write/rdid calls.
      */
     esp_err_t init();
 
+    /// true if the bus belongs to someone else (attach constructor).
+    bool shared() const { return shared_; }
+
     /* ---------------------------------------------------------------------
      * Low-level C-style operations
      * ------------------------------------------------------------------*/
@@ -162,6 +185,334 @@ public:
         return write(addr, reinterpret_cast<const void*>(s.data()), s.size());
     }
 
+    /* ---------------------------------------------------------------------
+     * Bulk operations (in-device, fixed bounce buffers, queued transfers)
+     * ------------------------------------------------------------------- */
+
+    /**
+     * @brief Set @p len bytes starting at @p addr to @p value.
+     * @return ESP_OK on success, ESP_ERR_INVALID_ARG for bad args.
+     *
+     * @note One WRITE with CS held across queued transfers of a single
+     *       pattern buffer, so the chip sees one continuous stream.
+     */
+    esp_err_t fill(addr_t addr, uint8_t value, size_t len);
+
+    /**
+     * @brief Copy @p len bytes inside the chip.
+     * @return ESP_OK on success, ESP_ERR_INVALID_ARG if the ranges overlap
+     *         (use move()) or are out of range.
+     *
+     * @note Reads the next chunk while the previous one is written, through
+     *       two fixed bounce buffers.
+     */
+    esp_err_t copy(addr_t dst, addr_t src, size_t len);
+
+    /**
+     * @brief Like copy(), but the ranges may overlap (memmove semantics).
+     * @return ESP_OK on success, ESP_ERR_INVALID_ARG for bad args.
+     */
+    esp_err_t move(addr_t dst, addr_t src, size_t len);
+
+    /// One buffer of a scatter/gather transfer.
+    struct IoVec {
+        void *base;
+        size_t len;
+    };
+
+    /**
+     * @brief Read consecutive bytes from @p addr into several buffers, in order.
+     * @param iov Buffers; zero-length entries are skipped.
+     * @return ESP_OK on success, ESP_ERR_INVALID_ARG for bad args or out-of-range.
+     *
+     * @note One READ with CS held across queued transfers straight into the
+     *       buffers: a single command/address phase and no bounce copy.
+     *       On a mirror the whole stream comes from one side.
+     */
+    esp_err_t readv(addr_t addr, const IoVec *iov, size_t n);
+
+    /// Write several buffers back to back from @p addr as one WRITE (see readv()).
+    esp_err_t writev(addr_t addr, const IoVec *iov, size_t n);
+
+    /// One range of a write_batch().
+    struct Segment {
+        addr_t addr;
+        const void *buf;
+        size_t len;
+    };
+
+    /**
+     * @brief Write several unrelated ranges, in order, under one bus acquisition.
+     * @return ESP_OK on success, ESP_ERR_INVALID_ARG for bad args,
+     *         ESP_ERR_INVALID_STATE if a range is write-protected (nothing is written).
+     *
+     * @note Every range is a WREN + WRITE pair queued back to back straight
+     *       from its buffer, and the batch ends with a single WRDI: no task
+     *       switch between the writes. The chip executes them in order, so a
+     *       range is written only after all ranges before it.
+     */
+    esp_err_t write_batch(const Segment *segs, size_t n);
+
+    /**
+     * @brief Write using direct register polling of the SPI host (IRAM).
+     * @param[in] addr Address to start writing to.
+     * @param[in] buf  Source buffer (must be in internal RAM).
+     * @param[in] len  Number of bytes to write.
+     * @param[in] panic_clock true: clock at set_panic_write_hz() instead of
+     *                        the device clock.
+     * @return ESP_OK on success, ESP_ERR_INVALID_ARG for bad args,
+     *         ESP_ERR_TIMEOUT if the SPI host does not complete.
+     *
+     * @note Works with interrupts disabled and the flash cache off (panic
+     *       handler, cache-disabled sections). It bypasses the SPI master
+     *       driver and its locking (the panic handler path); elsewhere use
+     *       write_fast(). Writes the mirror too when one is attached. Write
+     *       protection is not lifted here: the chip drops writes into a
+     *       locked window.
+     */
+    esp_err_t write_polled(addr_t addr, const void *buf, size_t len, bool panic_clock = false);
+
+    /**
+     * @brief SCK of write_polled(..., true), the panic-time write.
+     * @param hz SCK frequency, capped at FRAM_MAX_CLOCK_HZ; 0 or anything up to
+     *           the device clock keeps the device clock.
+     * @return ESP_OK, ESP_ERR_INVALID_STATE before init().
+     *
+     * @note Writes clock nothing in on MISO, so they are not bound by the
+     *       input timing that limits the device clock; the wiring still has
+     *       to carry @p hz. Every other polled write (write_fast(), direct
+     *       writes) keeps the device clock. The mirror, if attached, gets
+     *       the same setting. Call from a task.
+     */
+    esp_err_t set_panic_write_hz(int hz);
+
+    /* ---------------------------------------------------------------------
+     * Fast path (IRAM, keeps working while the flash cache is disabled)
+     * ------------------------------------------------------------------*/
+
+    /**
+     * @brief Read through direct register polling of the SPI host (IRAM).
+     * @param[out] buf Destination buffer (must be in internal RAM).
+     * @return ESP_OK on success, ESP_ERR_INVALID_ARG for bad args,
+     *         ESP_ERR_NOT_FINISHED if another FRAM call holds the bus (retry later),
+     *         ESP_ERR_NOT_SUPPORTED on a shared bus,
+     *         ESP_ERR_TIMEOUT if the SPI host does not complete.
+     *
+     * @note Safe from IRAM interrupt handlers and while NVS, OTA or SPIFFS
+     *       write flash with the cache off: no SPI master driver, RTOS or
+     *       flash-resident code. Runs in pieces of 61 data bytes through the
+     *       64-byte W0..W15 buffer, without DMA. Every other FRAM call holds
+     *       the bus for its whole duration; a fast call that finds it held
+     *       fails at once instead of waiting. Interrupts stay masked on
+     *       the calling core for the whole call, so keep it short. On a
+     *       mirror, reads the side that is in sync. Not available on a shared bus
+     *       (ESP_ERR_NOT_SUPPORTED): transactions of the other devices are
+     *       started by the driver interrupt, which the gate does not hold off.
+     */
+    esp_err_t read_fast(addr_t addr, void *buf, size_t len);
+
+    /**
+     * @brief Write counterpart of read_fast(); writes both chips of a mirror.
+     * @return As read_fast(), plus ESP_ERR_INVALID_STATE if the range is write-protected.
+     */
+    esp_err_t write_fast(addr_t addr, const void *buf, size_t len);
+
+    /* ---------------------------------------------------------------------
+     * Direct backend for small transfers
+     * ------------------------------------------------------------------*/
+
+    /// largest data length that set_direct() routes around the driver
+    static constexpr size_t DIRECT_MAX = 16;
+
+    /**
+     * @brief Route small transfers around the SPI master driver.
+     * @param on true: read() and write() of up to DIRECT_MAX bytes and the
+     *           RDSR drive the SPI host registers directly (polled, W0..W15
+     *           buffer, no DMA, queue or semaphore); false: all through spi_master.
+     *
+     * @note CS is the device's hardware CS, asserted by the host for each
+     *       command. The clock, mode and CS registers of this device are
+     *       captured after the RDID in init() and swapped in around every
+     *       direct op, so other devices on the host keep their settings.
+     *       A direct op runs with preemption off on the calling core. When a
+     *       driver call or a fast op holds the bus, the call takes the driver
+     *       path instead. Not used on a mirror. Call before init() to have
+     *       the RDSR in init() go direct too. On a shared bus each direct op
+     *       first acquires the bus from the driver, which costs a little of
+     *       the gain but keeps the other devices' transactions out.
+     */
+    void set_direct(bool on) { direct_ = on; }
+
+    /// true if small transfers bypass the driver (set_direct()).
+    bool direct() const { return direct_; }
+
+    /* ---------------------------------------------------------------------
+     * Bus sharing: bounded holds and bus-time accounting
+     * ------------------------------------------------------------------*/
+
+    /// hold limit set by the attach constructor, in microseconds
+    static constexpr uint32_t SHARED_MAX_HOLD_US = 100;
+
+    /**
+     * @brief Bound the time a single transfer keeps other devices off the bus.
+     * @param us Hold limit in microseconds, 0 for none (the default on an own bus).
+     *
+     * @note read(), write(), fill(), move(), readv(), writev(), write_batch()
+     *       and resync() longer than what the clock moves in @p us are split
+     *       into pieces, each one a command of its own with CS released in
+     *       between. Transactions queued by other devices on the host run
+     *       between the pieces, so an ADC or a display waits at most about
+     *       one piece for the bus. A piece is still atomic against the other
+     *       devices; readv()/writev() are then one command per piece.
+     *       move() reads a piece and writes it back in one hold, so its
+     *       pieces are half as long. On a shared bus the length is also capped at the host's
+     *       max_transfer_sz.
+     */
+    void set_max_hold_us(uint32_t us);
+
+    /// Hold limit set by set_max_hold_us(), 0 if unbounded.
+    uint32_t max_hold_us() const { return max_hold_us_; }
+
+    /// Bus time used by this device, for checking the budget of a shared bus.
+    struct BusStats {
+        uint32_t transactions;      ///< transfers on the wire (driver and direct backend)
+        uint64_t busy_us;           ///< time on the wire
+        uint32_t longest_hold_us;   ///< longest time the bus was held: a transaction or a CS-held session
+    };
+
+    /// Counters since init() or the last reset_bus_stats().
+    BusStats bus_stats() const;
+    void reset_bus_stats();
+
+    /* ---------------------------------------------------------------------
+     * Write protection (status register BP0/BP1, WPEN)
+     * ------------------------------------------------------------------*/
+
+    /// Hardware protection windows of the BP1:BP0 bits, always the top of the array.
+    enum class Protect : uint8_t {
+        NONE = 0,           ///< nothing protected
+        UPPER_QUARTER = 1,  ///< 0x1800..0x1FFF
+        UPPER_HALF = 2,     ///< 0x1000..0x1FFF
+        ALL = 3,            ///< 0x0000..0x1FFF
+    };
+
+    /**
+     * @brief Protect [@p from, end of chip) with the status register bits.
+     * @param from First address to protect; rounded down to the smallest BP
+     *             window that covers it. FRAM_SIZE_BYTES removes protection.
+     * @param wpen Also set WPEN: with the /WP pin held low the status
+     *             register itself becomes read-only.
+     * @return ESP_OK on success, ESP_ERR_INVALID_STATE if the chip did not
+     *         take the new value (WPEN set and /WP low).
+     *
+     * @note The setting is non-volatile and survives power cycles. It is read
+     *       back at init(), so protection applies from boot on.
+     */
+    esp_err_t protect_from(size_t from, bool wpen = false);
+
+    /// Window selected by protect_from().
+    Protect protection() const { return bp_; }
+
+    /// First protected address of a window (FRAM_SIZE_BYTES for NONE).
+    static constexpr size_t protect_start(Protect p) {
+        return p == Protect::NONE ? FRAM_SIZE_BYTES
+             : p == Protect::UPPER_QUARTER ? FRAM_SIZE_BYTES - FRAM_SIZE_BYTES / 4
+             : p == Protect::UPPER_HALF ? FRAM_SIZE_BYTES / 2 : 0;
+    }
+
+    /**
+     * @brief Open a write window: clear the BP bits until the matching lock().
+     * @return ESP_OK on success, ESP_ERR_INVALID_STATE if the status register
+     *         read back unchanged (WPEN set and /WP low), otherwise an
+     *         esp_err_t from WRSR/RDSR.
+     *
+     * @note Windows nest; only the outermost unlock()/lock() pair writes the
+     *       status register, so a commit of many writes costs two WRSR and
+     *       two RDSR in total. The window is global to the chip, not per
+     *       task. Prefer the WriteWindow guard.
+     * @note Persistent, KvStore, AppendJournal, Superblock and Snapshot open
+     *       a window around their own commits. Every other writer (the
+     *       write_fast()/store_fast() paths, the hash, B-tree, blob and
+     *       vector stores, the LittleFS backend, raw write()) must be
+     *       inside a window opened by the caller when its region is
+     *       protected; otherwise the write fails with ESP_ERR_INVALID_STATE.
+     */
+    esp_err_t unlock();
+
+    /// Close a write window opened by unlock(); restores the BP bits on the outermost one.
+    esp_err_t lock();
+
+    /// Cached status register (no SPI transfer).
+    uint8_t status() const { return sr_; }
+
+    /// RAII write window around a commit: unlock() in the constructor, lock() in the destructor.
+    class WriteWindow {
+    public:
+        explicit WriteWindow(FRAM &fram) : fram_(fram), err_(fram.unlock()) {}
+        ~WriteWindow() { if (err_ == ESP_OK) fram_.lock(); }
+        /// ESP_OK if the window is open.
+        esp_err_t status() const { return err_; }
+        WriteWindow(const WriteWindow&) = delete;
+        WriteWindow& operator=(const WriteWindow&) = delete;
+    private:
+        FRAM &fram_;
+        esp_err_t err_;
+    };
+
+    /* ---------------------------------------------------------------------
+     * Mirroring (RAID-1 over two chips)
+     * ------------------------------------------------------------------*/
+
+    /// Mirror counters.
+    struct MirrorStats {
+        uint32_t reads[2];      ///< single-side reads per side
+        uint32_t split_reads;   ///< reads served half from each side
+        uint32_t failovers;     ///< side errors answered by the other side
+    };
+
+    /**
+     * @brief Mirror this device (side 0) onto a second chip (side 1).
+     * @param mirror Initialized FRAM on its own host or chip-select, nullptr to stop mirroring.
+     * @return ESP_OK on success, otherwise an esp_err_t error code.
+     *
+     * @note write() then goes to both chips, queued on both devices at once so
+     *       that the transfers overlap when the chips sit on separate hosts.
+     *       read() alternates between the sides and splits large reads across
+     *       both; a split read is ordered against mirrored writes, so it never
+     *       returns half old and half new data. A side that fails a transfer
+     *       is marked stale and skipped until resync().
+     */
+    esp_err_t set_mirror(FRAM *mirror);
+
+    /// true if a mirror is attached.
+    bool mirrored() const { return mirror_ != nullptr; }
+
+    /**
+     * @brief Read from one side only (e.g. to retry after a CRC mismatch).
+     * @param side 0 = this chip, 1 = mirror.
+     * @return ESP_ERR_INVALID_STATE if the side is absent or stale, otherwise as read().
+     */
+    esp_err_t read_side(uint8_t side, addr_t addr, void *buf, size_t len);
+
+    /// Exclude a side from reads (e.g. after replacing the chip) until resync().
+    void mark_stale(uint8_t side);
+
+    /// Stale side, or -1 when both sides are in sync.
+    int stale_side() const { return stale_; }
+
+    /**
+     * @brief Copy the whole device from the good side onto the stale one.
+     * @param chunk Bytes per bulk transfer.
+     * @return ESP_OK on success, ESP_ERR_INVALID_STATE if no mirror is attached.
+     *
+     * @note Runs online: writes issued meanwhile go to both sides and each
+     *       chunk copy is atomic with respect to them. Reads keep using the
+     *       good side until the copy completes.
+     */
+    esp_err_t resync(size_t chunk = 512);
+
+    MirrorStats mirror_stats() const { return mirror_stats_; }
+
     // non-copyable
     FRAM(const FRAM&) = delete;
     FRAM& operator=(const FRAM&) = delete;
@@ -183,8 +534,121 @@ private:
      */
     esp_err_t wren(bool en);
 
+    /// one queued SPI transaction with its buffers
+    struct Xfer {
+        std::vector<uint8_t> tx, rx;
+        spi_transaction_t t{};
+        size_t len{0};
+    };
+
+    esp_err_t read_raw(addr_t addr, void *buf, size_t len);
+    esp_err_t write_raw(addr_t addr, const void *buf, size_t len);
+    esp_err_t start_read(addr_t addr, size_t len, Xfer &x);
+    esp_err_t start_write(addr_t addr, const void *buf, size_t len, Xfer &x);
+    esp_err_t finish(Xfer &x);
+    FRAM &side(uint8_t s) { return s ? *mirror_ : *this; }
+    esp_err_t read_mirrored(addr_t addr, void *buf, size_t len);
+    esp_err_t write_mirrored(addr_t addr, const void *buf, size_t len);
+    /// result of a write applied to both sides: degrade to one side if the other failed
+    esp_err_t mirror_outcome(esp_err_t ea, esp_err_t eb);
+    template <typename Op> esp_err_t both_sides(Op op);
+
+    esp_err_t fill_raw(addr_t addr, uint8_t value, size_t len);
+    esp_err_t transfer_raw(addr_t dst, addr_t src, size_t len, bool backward);
+    esp_err_t stream_raw(addr_t addr, const IoVec *iov, size_t n, bool write);
+    esp_err_t batch_raw(const Segment *segs, size_t n);
+    esp_err_t wait_queued(size_t n);
+    esp_err_t readv_piece(addr_t addr, const IoVec *iov, size_t n);
+    esp_err_t writev_piece(addr_t addr, const IoVec *iov, size_t n);
+    esp_err_t batch_piece(const Segment *segs, size_t n);
+
+    // bounded holds: op(off, n) for consecutive pieces of at most piece bytes
+    // (slice_ when 0; all of len at once when unbounded), from the end when backward
+    template <typename Op> esp_err_t sliced(size_t len, bool backward, Op op, size_t piece = 0);
+    void update_slice();
+
+    // CS-held sessions; the time between them counts as one bus hold
+    esp_err_t acquire_bus();
+    void release_bus();
+    // driver callbacks (ISR): time on the wire of every transaction with user = this
+    static void on_trans_start(spi_transaction_t *t);
+    static void on_trans_done(spi_transaction_t *t);
+    // one transaction of wire_us on the wire (none if negative); hold_us: a bus hold that ended
+    void account(int64_t wire_us, int64_t hold_us);
+
+    /*
+      Bus gate between the driver calls and the fast path (fram_polled.cpp),
+      shared by all instances: a public call that talks to a chip holds a
+      DriverGuard until it returns, waiting while a fast op is on the wire;
+      a fast op claims the bus only when no driver call is in progress, so
+      WREN/WRITE pairs and CS-held sessions are never split.
+    */
+    class DriverGuard {
+    public:
+        DriverGuard();
+        ~DriverGuard();
+        DriverGuard(const DriverGuard&) = delete;
+        DriverGuard& operator=(const DriverGuard&) = delete;
+    };
+    static bool fast_claim();
+    static void fast_release();
+    esp_err_t read_polled(addr_t addr, void *buf, size_t len);
+    // full-duplex command of n bytes, the received bytes replace io
+    esp_err_t xfer_polled(uint8_t *io, size_t n);
+
+    // direct backend: the gate is claimed with preemption off (after acquiring
+    // a shared bus); ESP_ERR_NOT_FINISHED when the bus is busy (or the
+    // registers are not captured yet). t0 is the start of the bus hold
+    bool direct_begin(int64_t &t0);
+    void direct_end(int64_t t0);
+    esp_err_t direct_read(addr_t addr, void *buf, size_t len);
+    esp_err_t direct_write(addr_t addr, const void *buf, size_t len);
+    esp_err_t direct_xfer(uint8_t *io, size_t n);
+
+    /// host registers that the driver loads when it switches to a device
+    struct HostRegs {
+        uint32_t clock, pin, user, ctrl, ctrl2;
+    };
+    void capture_regs();
+    // waits for the host, saves its registers and loads this device's ones
+    bool load_regs(HostRegs &saved);
+    void restore_regs(const HostRegs &saved);
+
+    /// ESP_ERR_INVALID_STATE if [addr, addr + len) touches the locked window (cached SR, no SPI)
+    esp_err_t check_writable(addr_t addr, size_t len) const;
+    esp_err_t read_sr(uint8_t &sr);
+    esp_err_t write_sr(uint8_t sr);
+    esp_err_t set_sr(uint8_t sr);
+    /// RDSR on each live side after set_sr(); ESP_ERR_INVALID_STATE and the cache corrected if @p sr did not stick
+    esp_err_t check_sr(uint8_t sr);
+
     spi_host_device_t host_;
     gpio_num_t cs_, sclk_, mosi_, miso_;
     int freq_hz_;
     spi_device_handle_t dev_{nullptr};
+    bool shared_{false};                       ///< bus owned by someone else
+
+    uint32_t max_hold_us_{0};
+    size_t max_len_{0};                        ///< longest transaction the host takes
+    size_t slice_{0};                          ///< data bytes per bus hold, 0 = unbounded
+    mutable portMUX_TYPE stats_lock_ = portMUX_INITIALIZER_UNLOCKED;
+    BusStats bus_stats_{};
+    volatile int64_t wire_t0_{0};              ///< start of the transaction on the wire
+    int64_t session_t0_{0};                    ///< start of the CS-held session, 0 outside
+
+    FRAM *mirror_{nullptr};
+    SemaphoreHandle_t mirror_lock_{nullptr};   ///< orders mirrored writes against resync chunks and split reads
+    std::atomic<int> stale_{-1};
+    uint8_t next_side_{0};
+    MirrorStats mirror_stats_{};
+
+    uint8_t sr_{0};                            ///< cached status register (WPEN, BP1, BP0)
+    Protect bp_{Protect::NONE};                ///< window restored by lock()
+    int unlocked_{0};                          ///< open write windows
+    SemaphoreHandle_t sr_lock_{nullptr};
+
+    bool direct_{false};                       ///< small transfers bypass the driver
+    HostRegs regs_{};                          ///< this device's host setup, for the polled paths
+    bool regs_valid_{false};
+    uint32_t panic_clock_{0};                  ///< clock register for panic-time writes, 0 = regs_.clock
 };
\ No newline at end of file
@@ -0,0 +1,349 @@
+/**
+ * @file fram_bench.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_bench.h"
+#include "fram_nvs.h"
+#include "fram_store.h"
+#include "fram_group.h"
+#include <inttypes.h>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include <unistd.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "esp_private/cache_utils.h"
+#include "nvs_flash.h"
+#include "esp_spiffs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+static const char *TAG = "FRAM_BENCH";
+
+namespace fram_bench {
+
+void log_stats(const char *name, const LatencyStats &s)
+{
+    ESP_LOGI(TAG, "%-24s n=%" PRIu32 " min=%" PRId64 "us avg=%" PRId64 "us max=%" PRId64 "us",
+             name, s.count, s.count ? s.min_us : 0, s.avg_us(), s.max_us);
+}
+
+esp_err_t nvs_commit_latency(size_t iterations)
+{
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_RETURN_ON_ERROR(nvs_flash_erase(), TAG, "nvs_flash_erase");
+        err = nvs_flash_init();
+    }
+    ESP_RETURN_ON_ERROR(err, TAG, "nvs_flash_init");
+
+    LatencyStats flash, fram;
+    nvs_handle_t h;
+
+    ESP_RETURN_ON_ERROR(nvs_open("bench", NVS_READWRITE, &h), TAG, "nvs_open");
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t t0 = esp_timer_get_time();
+        err = nvs_set_u32(h, "cnt", static_cast<uint32_t>(i));
+        if (err == ESP_OK) err = nvs_commit(h);
+        flash.add(esp_timer_get_time() - t0);
+        if (err != ESP_OK) break;
+    }
+    nvs_close(h);
+    ESP_RETURN_ON_ERROR(err, TAG, "flash nvs");
+
+    ESP_RETURN_ON_ERROR(fram_nvs_open("bench", NVS_READWRITE, &h), TAG, "fram_nvs_open");
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t t0 = esp_timer_get_time();
+        err = fram_nvs_set_u32(h, "cnt", static_cast<uint32_t>(i));
+        if (err == ESP_OK) err = fram_nvs_commit(h);
+        fram.add(esp_timer_get_time() - t0);
+        if (err != ESP_OK) break;
+    }
+    fram_nvs_close(h);
+    ESP_RETURN_ON_ERROR(err, TAG, "fram nvs");
+
+    log_stats("flash nvs set+commit", flash);
+    log_stats("fram nvs set+commit", fram);
+    return ESP_OK;
+}
+
+esp_err_t mount_spiffs(const char *base_path, const char *label)
+{
+    if (esp_spiffs_mounted(label)) return ESP_OK;
+    esp_vfs_spiffs_conf_t conf = {};
+    conf.base_path = base_path;
+    conf.partition_label = label;
+    conf.max_files = 4;
+    conf.format_if_mount_failed = true;
+    return esp_vfs_spiffs_register(&conf);
+}
+
+esp_err_t journal_append_latency(fram_store::AppendJournal &journal, uint8_t id,
+                                 const char *direct_path, size_t iterations, size_t len)
+{
+    ESP_RETURN_ON_FALSE(direct_path && len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    std::vector<uint8_t> line(len, 'x');
+    LatencyStats direct, journaled, drain;
+
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t t0 = esp_timer_get_time();
+        FILE *f = fopen(direct_path, "ab");
+        ESP_RETURN_ON_FALSE(f, ESP_FAIL, TAG, "open %s", direct_path);
+        size_t n = fwrite(line.data(), 1, len, f);
+        fclose(f);
+        direct.add(esp_timer_get_time() - t0);
+        ESP_RETURN_ON_FALSE(n == len, ESP_FAIL, TAG, "fwrite");
+    }
+
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t t0 = esp_timer_get_time();
+        esp_err_t err = journal.append(id, line.data(), len);
+        journaled.add(esp_timer_get_time() - t0);
+        ESP_RETURN_ON_ERROR(err, TAG, "journal append");
+    }
+
+    int64_t t0 = esp_timer_get_time();
+    ESP_RETURN_ON_ERROR(journal.drain(), TAG, "drain");
+    drain.add(esp_timer_get_time() - t0);
+
+    log_stats("direct fwrite append", direct);
+    log_stats("journal append", journaled);
+    log_stats("journal final drain", drain);
+    return ESP_OK;
+}
+
+esp_err_t file_ops_rate(const char *dir, size_t iterations, size_t len)
+{
+    ESP_RETURN_ON_FALSE(dir && iterations && len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    std::vector<uint8_t> buf(len, 0x5A), rd(len);
+    char path[64];
+    LatencyStats create, readback, remove;
+
+    for (size_t i = 0; i < iterations; ++i) {
+        snprintf(path, sizeof path, "%s/b%u.bin", dir, (unsigned)(i % 8));
+
+        int64_t t0 = esp_timer_get_time();
+        FILE *f = fopen(path, "wb");
+        ESP_RETURN_ON_FALSE(f, ESP_FAIL, TAG, "create %s", path);
+        size_t n = fwrite(buf.data(), 1, len, f);
+        fclose(f);
+        create.add(esp_timer_get_time() - t0);
+        ESP_RETURN_ON_FALSE(n == len, ESP_FAIL, TAG, "fwrite");
+
+        t0 = esp_timer_get_time();
+        f = fopen(path, "rb");
+        ESP_RETURN_ON_FALSE(f, ESP_FAIL, TAG, "open %s", path);
+        n = fread(rd.data(), 1, len, f);
+        fclose(f);
+        readback.add(esp_timer_get_time() - t0);
+        ESP_RETURN_ON_FALSE(n == len, ESP_FAIL, TAG, "fread");
+
+        t0 = esp_timer_get_time();
+        unlink(path);
+        remove.add(esp_timer_get_time() - t0);
+    }
+
+    int64_t total = create.total_us + readback.total_us + remove.total_us;
+    ESP_LOGI(TAG, "%s: %" PRId64 " file ops/s", dir, total ? (int64_t)(3 * iterations) * 1000000 / total : 0);
+    log_stats("create+write+close", create);
+    log_stats("open+read+close", readback);
+    log_stats("unlink", remove);
+    return ESP_OK;
+}
+
+namespace {
+
+struct CommitJob {
+    fram_store::Persistent<uint32_t> *store;
+    size_t commits;
+    SemaphoreHandle_t done;
+    esp_err_t err;
+};
+
+void commit_task(void *arg)
+{
+    auto *job = static_cast<CommitJob *>(arg);
+    for (size_t i = 0; i < job->commits && job->err == ESP_OK; ++i) {
+        job->err = job->store->store_immediate(static_cast<uint32_t>(i));
+    }
+    xSemaphoreGive(job->done);
+    vTaskDelete(nullptr);
+}
+
+} // namespace
+
+esp_err_t group_commit_rate(FRAM &fram, FRAM::addr_t base, size_t size, size_t tasks, size_t commits)
+{
+    using Store = fram_store::Persistent<uint32_t>;
+    const size_t stride = 2 * (sizeof(fram_store::Header) + Store::PAYLOAD_SIZE);
+    ESP_RETURN_ON_FALSE(tasks && commits && tasks * stride <= size, ESP_ERR_INVALID_SIZE, TAG, "region too small");
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(tasks, 0);
+    ESP_RETURN_ON_FALSE(done, ESP_ERR_NO_MEM, TAG, "semaphore");
+
+    fram_store::GroupCommit group(fram);
+    esp_err_t err = ESP_OK;
+    for (int grouped = 0; grouped < 2 && err == ESP_OK; ++grouped) {
+        std::vector<std::unique_ptr<Store>> stores;
+        std::vector<CommitJob> jobs(tasks);
+        for (size_t i = 0; i < tasks; ++i) {
+            stores.push_back(std::make_unique<Store>(fram, static_cast<FRAM::addr_t>(base + i * stride), 2));
+            if (grouped) stores[i]->set_group(&group);
+            jobs[i] = CommitJob{stores[i].get(), commits, done, ESP_OK};
+        }
+
+        // same priority as the caller: a task blocked on the bus lets the others queue up
+        const int64_t t0 = esp_timer_get_time();
+        size_t started = 0;
+        for (; started < tasks; ++started) {
+            if (xTaskCreate(commit_task, "bench_commit", 3072, &jobs[started], uxTaskPriorityGet(nullptr),
+                            nullptr) != pdPASS) {
+                err = ESP_ERR_NO_MEM;
+                break;
+            }
+        }
+        for (size_t i = 0; i < started; ++i) xSemaphoreTake(done, portMAX_DELAY);
+        const int64_t us = esp_timer_get_time() - t0;
+        for (const CommitJob &j : jobs) {
+            if (err == ESP_OK) err = j.err;
+        }
+        if (err == ESP_OK) {
+            ESP_LOGI(TAG, "%-24s tasks=%u %" PRId64 " commits/s", grouped ? "group commit" : "store_immediate",
+                     (unsigned)tasks, us ? static_cast<int64_t>(tasks * commits) * 1000000 / us : 0);
+        }
+    }
+    const auto st = group.stats();
+    if (err == ESP_OK && st.batches) {
+        ESP_LOGI(TAG, "group commit: %" PRIu32 " batches, avg %.1f max %" PRIu32 " commits per batch", st.batches,
+                 static_cast<double>(st.commits) / st.batches, st.max_batch);
+    }
+    vSemaphoreDelete(done);
+    return err;
+}
+
+namespace {
+
+// what a control loop commits every period
+struct ControlRecord {
+    uint32_t tick;
+    int32_t setpoint;
+    int32_t output[6];
+};
+
+using ControlStore = fram_store::Persistent<ControlRecord>;
+
+// commits with the cache off and the other CPU parked, as during a flash write
+IRAM_ATTR void store_fast_cache_off(ControlStore &store, uint32_t first, uint32_t *cycles, size_t n, esp_err_t &err)
+{
+    ControlRecord rec{};
+    spi_flash_disable_interrupts_caches_and_other_cpu();
+    for (size_t i = 0; i < n; ++i) {
+        rec.tick = first + i;
+        const uint32_t t0 = esp_cpu_get_cycle_count();
+        const esp_err_t e = store.store_fast(rec);
+        cycles[i] = esp_cpu_get_cycle_count() - t0;
+        if (err == ESP_OK) err = e;
+    }
+    spi_flash_enable_interrupts_caches_and_other_cpu();
+}
+
+} // namespace
+
+esp_err_t fast_path_latency(FRAM &fram, FRAM::addr_t base, size_t size, size_t iterations)
+{
+    ESP_RETURN_ON_FALSE(iterations && 2 * (sizeof(fram_store::Header) + ControlStore::PAYLOAD_SIZE) <= size,
+                        ESP_ERR_INVALID_SIZE, TAG, "region too small");
+    ControlStore store(fram, base, 2);
+    ControlRecord rec{};
+    // the first commit finds the slot, store_fast() needs it
+    ESP_RETURN_ON_ERROR(store.store_immediate(rec), TAG, "store");
+
+    LatencyStats driver, fast, cache_off;
+    for (size_t i = 0; i < iterations; ++i) {
+        rec.tick = i;
+        int64_t t0 = esp_timer_get_time();
+        ESP_RETURN_ON_ERROR(store.store_immediate(rec), TAG, "store_immediate");
+        driver.add(esp_timer_get_time() - t0);
+        t0 = esp_timer_get_time();
+        ESP_RETURN_ON_ERROR(store.store_fast(rec), TAG, "store_fast");
+        fast.add(esp_timer_get_time() - t0);
+    }
+
+    // both CPUs stall while the cache is off: short bursts, a tick in between
+    static constexpr size_t BURST = 16;
+    std::vector<uint32_t> cycles(BURST);
+    const uint32_t per_us = esp_rom_get_cpu_ticks_per_us();
+    esp_err_t err = ESP_OK;
+    for (size_t done = 0; done < iterations && err == ESP_OK; done += BURST) {
+        const size_t n = std::min(BURST, iterations - done);
+        store_fast_cache_off(store, done, cycles.data(), n, err);
+        for (size_t i = 0; i < n; ++i) cache_off.add(cycles[i] / per_us);
+        vTaskDelay(1);
+    }
+    ESP_RETURN_ON_ERROR(err, TAG, "store_fast with the cache off");
+
+    ControlRecord back{};
+    ESP_RETURN_ON_ERROR(store.load(back), TAG, "load");
+    ESP_RETURN_ON_FALSE(back.tick == iterations - 1, ESP_ERR_INVALID_CRC, TAG, "read back tick %" PRIu32, back.tick);
+
+    log_stats("store_immediate", driver);
+    log_stats("store_fast", fast);
+    log_stats("store_fast, cache off", cache_off);
+    ESP_LOGI(TAG, "fast path worst case: %" PRId64 " us with the flash cache off", cache_off.max_us);
+    return ESP_OK;
+}
+
+esp_err_t direct_latency(FRAM &fram, FRAM::addr_t base, size_t iterations)
+{
+    ESP_RETURN_ON_FALSE(iterations, ESP_ERR_INVALID_ARG, TAG, "no iterations");
+    ESP_RETURN_ON_FALSE(!fram.mirrored(), ESP_ERR_INVALID_ARG, TAG, "direct backend is not used on a mirror");
+    const bool was_direct = fram.direct();
+
+    static constexpr size_t SIZES[] = {1, 4, FRAM::DIRECT_MAX};
+    uint8_t out[FRAM::DIRECT_MAX], in[FRAM::DIRECT_MAX];
+    esp_err_t err = ESP_OK;
+    for (size_t len : SIZES) {
+        LatencyStats wr[2], rd[2];
+        for (size_t i = 0; i < iterations && err == ESP_OK; ++i) {
+            for (int d = 0; d < 2 && err == ESP_OK; ++d) {
+                fram.set_direct(d);
+                memset(out, static_cast<uint8_t>(i + d), len);
+                int64_t t0 = esp_timer_get_time();
+                err = fram.write(base, out, len);
+                wr[d].add(esp_timer_get_time() - t0);
+                t0 = esp_timer_get_time();
+                if (err == ESP_OK) err = fram.read(base, in, len);
+                rd[d].add(esp_timer_get_time() - t0);
+                if (err == ESP_OK && memcmp(in, out, len) != 0) err = ESP_ERR_INVALID_CRC;
+            }
+        }
+        if (err != ESP_OK) break;
+
+        char name[32];
+        snprintf(name, sizeof name, "write %u B, driver", (unsigned)len);
+        log_stats(name, wr[0]);
+        snprintf(name, sizeof name, "write %u B, direct", (unsigned)len);
+        log_stats(name, wr[1]);
+        snprintf(name, sizeof name, "read %u B, driver", (unsigned)len);
+        log_stats(name, rd[0]);
+        snprintf(name, sizeof name, "read %u B, direct", (unsigned)len);
+        log_stats(name, rd[1]);
+    }
+    fram.set_direct(was_direct);
+    ESP_RETURN_ON_ERROR(err, TAG, "direct/driver transfer");
+    return ESP_OK;
+}
+
+} // namespace fram_bench
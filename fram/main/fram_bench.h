@@ -0,0 +1,109 @@
+/**
+ * @file fram_bench.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief On-target benchmarks comparing FRAM based storage with flash.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  Results are printed with ESP_LOGI. All functions return esp_err_t values.
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "esp_err.h"
+#include "fram.h"
+#include "fram_journal.h"
+
+namespace fram_bench {
+
+/// min/avg/max accumulator for per-operation latencies (microseconds)
+struct LatencyStats {
+    uint32_t count{0};
+    int64_t min_us{INT64_MAX};
+    int64_t max_us{0};
+    int64_t total_us{0};
+
+    void add(int64_t us) {
+        ++count;
+        total_us += us;
+        if (us < min_us) min_us = us;
+        if (us > max_us) max_us = us;
+    }
+    int64_t avg_us() const { return count ? total_us / count : 0; }
+};
+
+/// Print one result line: name, count, min/avg/max.
+void log_stats(const char *name, const LatencyStats &s);
+
+/**
+ * @brief Compare set_u32 + commit latency of flash NVS and fram_nvs.
+ * @param iterations Number of commits per backend.
+ * @return ESP_OK on success. fram_nvs_init() must have been called.
+ * @note Initializes flash NVS (nvs_flash_init) and writes to namespace "bench".
+ */
+esp_err_t nvs_commit_latency(size_t iterations);
+
+/**
+ * @brief Mount the SPIFFS partition used by the file benchmarks.
+ * @param base_path VFS mount point.
+ * @param label     Partition label.
+ * @return ESP_OK if mounted (or already mounted).
+ */
+esp_err_t mount_spiffs(const char *base_path = "/spiffs", const char *label = "spiffs");
+
+/**
+ * @brief Compare small-append latency: fopen/fwrite/fclose vs AppendJournal::append.
+ * @param journal     Mounted journal with file id @p id registered.
+ * @param id          Journal file id.
+ * @param direct_path File appended to directly (should differ from the journal file).
+ * @param iterations  Number of appends per variant.
+ * @param len         Bytes per append.
+ * @return ESP_OK on success.
+ */
+esp_err_t journal_append_latency(fram_store::AppendJournal &journal, uint8_t id,
+                                 const char *direct_path, size_t iterations, size_t len = 32);
+
+/**
+ * @brief File operations per second on a VFS mount point.
+ * @param dir        Directory on a mounted filesystem, e.g. "/fram" or "/spiffs".
+ * @param iterations Create/write/close + open/read/close + unlink cycles.
+ * @param len        File size in bytes.
+ * @return ESP_OK on success.
+ * @note Run once for the FRAM LittleFS mount and once for a flash mount to compare.
+ */
+esp_err_t file_ops_rate(const char *dir, size_t iterations, size_t len = 64);
+
+/**
+ * @brief Aggregate store_immediate() throughput of concurrent committers, direct vs GroupCommit.
+ * @param base    Scratch region: one Persistent<uint32_t> (2 slots) per task, overwritten.
+ * @param size    Region size in bytes.
+ * @param tasks   Committing tasks, each on its own store.
+ * @param commits Commits per task and variant.
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the region is too small.
+ * @note Run with 1, 2, 4, 8 tasks to see how the grouped rate scales.
+ */
+esp_err_t group_commit_rate(FRAM &fram, FRAM::addr_t base, size_t size, size_t tasks, size_t commits);
+
+/**
+ * @brief Commit latency of the IRAM fast path (Persistent::store_fast) against store_immediate().
+ * @param base       Scratch region for one Persistent with two slots of a 32-byte record, overwritten.
+ * @param size       Region size in bytes.
+ * @param iterations Commits per variant.
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the region is too small.
+ * @note The last pass runs store_fast() in short bursts with the flash cache
+ *       disabled and the other CPU stalled, the state a flash write by NVS,
+ *       OTA or SPIFFS puts the chip in; its max is the worst-case latency.
+ */
+esp_err_t fast_path_latency(FRAM &fram, FRAM::addr_t base, size_t size, size_t iterations);
+
+/**
+ * @brief Small-transfer latency, spi_master driver vs the direct register backend (FRAM::set_direct()).
+ * @param base       Scratch area of FRAM::DIRECT_MAX bytes, overwritten.
+ * @param iterations Write + read-back pairs per size and backend.
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG on a mirrored FRAM.
+ * @note Runs 1, 4 and DIRECT_MAX bytes; the direct() setting is restored afterwards.
+ */
+esp_err_t direct_latency(FRAM &fram, FRAM::addr_t base, size_t iterations);
+
+} // namespace fram_bench
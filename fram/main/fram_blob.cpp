@@ -0,0 +1,378 @@
+/**
+ * @file fram_blob.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_blob.h"
+#include "fram_store.h"
+#include <algorithm>
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_BLOB";
+
+namespace fram_store {
+
+#pragma pack(push,1)
+struct BlobHeader {
+    uint32_t magic;
+    uint16_t max_ids;
+    uint16_t pages;
+    uint32_t reserved;
+    uint32_t crc;       // crc32 over the preceding fields
+};
+#pragma pack(pop)
+
+static constexpr uint32_t BLOB_MAGIC = 0x46424C42; // 'FBLB'
+static constexpr size_t NO_PAGE = SIZE_MAX;
+
+BlobStore::BlobStore(FRAM &fram, FRAM::addr_t base, size_t size, uint16_t max_ids)
+    : fram_(fram), base_(base), size_(size), max_ids_(max_ids)
+{
+    size_t dir_bytes = size_t(max_ids) * 2 * sizeof(DirEntry);
+    size_t fixed = sizeof(BlobHeader) + dir_bytes;
+    pages_count_ = size > fixed ? (size - fixed) / (PAGE_SIZE + sizeof(PageEntry)) : 0;
+    dir_base_  = static_cast<FRAM::addr_t>(base + sizeof(BlobHeader));
+    ptab_base_ = static_cast<FRAM::addr_t>(dir_base_ + dir_bytes);
+    heap_base_ = static_cast<FRAM::addr_t>(ptab_base_ + pages_count_ * sizeof(PageEntry));
+}
+
+uint16_t BlobStore::entry_crc(const DirEntry &e)
+{
+    return static_cast<uint16_t>(crc32(&e, offsetof(DirEntry, crc)));
+}
+
+uint8_t BlobStore::class_for(size_t len)
+{
+    uint8_t cls = 1;
+    while (cls < NUM_CLASSES && class_size(cls) < len) ++cls;
+    return cls;
+}
+
+FRAM::addr_t BlobStore::dir_addr(uint16_t id, uint8_t copy) const
+{
+    return static_cast<FRAM::addr_t>(dir_base_ + (size_t(id) * 2 + copy) * sizeof(DirEntry));
+}
+
+FRAM::addr_t BlobStore::page_entry_addr(size_t page) const
+{
+    return static_cast<FRAM::addr_t>(ptab_base_ + page * sizeof(PageEntry));
+}
+
+FRAM::addr_t BlobStore::chunk_addr(size_t page, size_t chunk) const
+{
+    return static_cast<FRAM::addr_t>(heap_base_ + page * PAGE_SIZE + chunk * class_size(pages_[page].cls));
+}
+
+bool BlobStore::locate(uint16_t off, size_t &page, size_t &chunk) const
+{
+    if (off < heap_base_ || off >= heap_base_ + pages_count_ * PAGE_SIZE) return false;
+    page = (off - heap_base_) / PAGE_SIZE;
+    uint8_t cls = pages_[page].cls;
+    if (cls == 0 || cls > NUM_CLASSES) return false;
+    size_t rel = (off - heap_base_) % PAGE_SIZE;
+    if (rel % class_size(cls)) return false;
+    chunk = rel / class_size(cls);
+    return true;
+}
+
+esp_err_t BlobStore::format()
+{
+    ESP_LOGI(TAG, "formatting region 0x%04X: %u ids, %u pages", base_, max_ids_, (unsigned)pages_count_);
+    ESP_RETURN_ON_ERROR(fram_.fill(dir_base_, 0, ptab_base_ - dir_base_ + pages_count_ * sizeof(PageEntry)),
+                        TAG, "clear tables");
+
+    BlobHeader h;
+    h.magic = BLOB_MAGIC;
+    h.max_ids = max_ids_;
+    h.pages = static_cast<uint16_t>(pages_count_);
+    h.reserved = 0;
+    h.crc = crc32(&h, offsetof(BlobHeader, crc));
+    ESP_RETURN_ON_ERROR(fram_.write(base_, &h, sizeof(h)), TAG, "header");
+
+    dir_.assign(max_ids_, DirEntry{0, 0, 0, 0});
+    active_.assign(max_ids_, 0);
+    pages_.assign(pages_count_, PageEntry{0, 0, 0});
+    return ESP_OK;
+}
+
+esp_err_t BlobStore::mount()
+{
+    ESP_RETURN_ON_FALSE(max_ids_ > 0 && pages_count_ > 0 &&
+                        (uint32_t)heap_base_ + pages_count_ * PAGE_SIZE <= FRAM::FRAM_SIZE_BYTES,
+                        ESP_ERR_INVALID_SIZE, TAG, "bad region");
+
+    BlobHeader h;
+    ESP_RETURN_ON_ERROR(fram_.read(base_, &h, sizeof(h)), TAG, "read header");
+    if (h.magic != BLOB_MAGIC || h.crc != crc32(&h, offsetof(BlobHeader, crc)) ||
+        h.max_ids != max_ids_ || h.pages != pages_count_) {
+        ESP_RETURN_ON_ERROR(format(), TAG, "format");
+        mounted_ = true;
+        return ESP_OK;
+    }
+
+    // both directory copies and the page table in two bulk reads
+    std::vector<DirEntry> raw(size_t(max_ids_) * 2);
+    ESP_RETURN_ON_ERROR(fram_.read(dir_base_, raw.data(), raw.size() * sizeof(DirEntry)), TAG, "read dir");
+    pages_.resize(pages_count_);
+    ESP_RETURN_ON_ERROR(fram_.read(ptab_base_, pages_.data(), pages_count_ * sizeof(PageEntry)), TAG, "read pages");
+
+    dir_.assign(max_ids_, DirEntry{0, 0, 0, 0});
+    active_.assign(max_ids_, 0);
+    for (uint16_t id = 0; id < max_ids_; ++id) {
+        const DirEntry &a = raw[id * 2], &b = raw[id * 2 + 1];
+        bool va = entry_crc(a) == a.crc, vb = entry_crc(b) == b.crc;
+        if (va && (!vb || static_cast<int16_t>(a.seq - b.seq) > 0)) {
+            dir_[id] = a;
+            active_[id] = 0;
+        } else if (vb) {
+            dir_[id] = b;
+            active_[id] = 1;
+        }
+    }
+
+    // the directory is authoritative: rebuild the bitmaps from it
+    std::vector<PageEntry> want(pages_count_, PageEntry{0, 0, 0});
+    for (uint16_t id = 0; id < max_ids_; ++id) {
+        DirEntry &e = dir_[id];
+        if (e.off == 0) continue;
+        // a blob always lives in the class chosen by its length, which also
+        // recovers the class of a torn page entry
+        size_t page = (e.off >= heap_base_) ? (e.off - heap_base_) / PAGE_SIZE : NO_PAGE;
+        if (page < pages_count_ && e.len <= MAX_BLOB) pages_[page].cls = class_for(e.len);
+        size_t chunk;
+        if (page >= pages_count_ || e.len > MAX_BLOB || !locate(e.off, page, chunk) ||
+            (want[page].cls && want[page].cls != pages_[page].cls)) {
+            ESP_LOGW(TAG, "blob %u: invalid location, dropped", id);
+            e = DirEntry{0, 0, e.seq, 0};
+            continue;
+        }
+        want[page].cls = pages_[page].cls;
+        want[page].used |= static_cast<uint16_t>(1u << chunk);
+    }
+    for (size_t p = 0; p < pages_count_; ++p) {
+        if (pages_[p].cls == want[p].cls && pages_[p].used == want[p].used) continue;
+        repaired_ += __builtin_popcount(pages_[p].used & ~want[p].used);
+        pages_[p] = want[p];
+        ESP_RETURN_ON_ERROR(write_page(p), TAG, "repair page");
+    }
+    if (repaired_) ESP_LOGW(TAG, "released %u leaked chunks", (unsigned)repaired_);
+
+    mounted_ = true;
+    return ESP_OK;
+}
+
+esp_err_t BlobStore::write_page(size_t page)
+{
+    return fram_.write(page_entry_addr(page), &pages_[page], sizeof(PageEntry));
+}
+
+esp_err_t BlobStore::write_dir(uint16_t id, uint16_t off, uint16_t len)
+{
+    uint8_t copy = active_[id] ^ 1;
+    DirEntry e{off, len, static_cast<uint16_t>(dir_[id].seq + 1), 0};
+    e.crc = entry_crc(e);
+    ESP_RETURN_ON_ERROR(fram_.write(dir_addr(id, copy), &e, sizeof(e)), TAG, "dir");
+    dir_[id] = e;
+    active_[id] = copy;
+    return ESP_OK;
+}
+
+esp_err_t BlobStore::alloc(uint8_t cls, size_t exclude_page, size_t &page, size_t &chunk, bool allow_new_page)
+{
+    const uint16_t full = static_cast<uint16_t>((1u << chunks_per_page(cls)) - 1);
+    size_t best = NO_PAGE, free_page = NO_PAGE;
+    int best_used = -1;
+
+    // fullest non-full page of the class first, keeps other pages emptying out
+    for (size_t p = 0; p < pages_count_; ++p) {
+        if (p == exclude_page) continue;
+        const PageEntry &pe = pages_[p];
+        if (pe.cls == cls && pe.used != full) {
+            int used = __builtin_popcount(pe.used);
+            if (used > best_used) {
+                best = p;
+                best_used = used;
+            }
+        } else if (pe.cls == 0 && free_page == NO_PAGE) {
+            free_page = p;
+        }
+    }
+    if (best == NO_PAGE) {
+        if (!allow_new_page || free_page == NO_PAGE) return ESP_ERR_NO_MEM;
+        best = free_page;
+        pages_[best].cls = cls;
+        pages_[best].used = 0;
+    }
+
+    PageEntry &pe = pages_[best];
+    size_t c = 0;
+    while (pe.used & (1u << c)) ++c;
+    pe.used |= static_cast<uint16_t>(1u << c);
+    esp_err_t err = write_page(best);
+    if (err != ESP_OK) {
+        pe.used &= static_cast<uint16_t>(~(1u << c));
+        if (!pe.used) pe.cls = 0;
+        return err;
+    }
+    page = best;
+    chunk = c;
+    return ESP_OK;
+}
+
+esp_err_t BlobStore::release(uint16_t off)
+{
+    size_t page, chunk;
+    ESP_RETURN_ON_FALSE(locate(off, page, chunk), ESP_ERR_INVALID_STATE, TAG, "bad chunk 0x%04X", off);
+    PageEntry &pe = pages_[page];
+    pe.used &= static_cast<uint16_t>(~(1u << chunk));
+    if (!pe.used) pe.cls = 0;
+    return write_page(page);
+}
+
+esp_err_t BlobStore::commit(uint16_t id, const void *data, size_t len, uint8_t cls, size_t exclude_page, bool allow_new_page)
+{
+    size_t page, chunk;
+    ESP_RETURN_ON_ERROR(alloc(cls, exclude_page, page, chunk, allow_new_page), TAG, "no free %u-byte chunk", (unsigned)class_size(cls));
+    FRAM::addr_t addr = chunk_addr(page, chunk);
+
+    esp_err_t err = len ? fram_.write(addr, data, len) : ESP_OK;
+    if (err == ESP_OK) err = write_dir(id, addr, static_cast<uint16_t>(len));
+    if (err != ESP_OK) {
+        release(addr);
+        return err;
+    }
+    // new copy is live; a crash from here on only leaks the old chunk
+    return ESP_OK;
+}
+
+esp_err_t BlobStore::put(uint16_t id, const void *data, size_t len)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(id < max_ids_ && (data || len == 0), ESP_ERR_INVALID_ARG, TAG, "bad args");
+    ESP_RETURN_ON_FALSE(len <= MAX_BLOB, ESP_ERR_INVALID_SIZE, TAG, "blob too large");
+
+    uint16_t old = dir_[id].off;
+    ESP_RETURN_ON_ERROR(commit(id, data, len, class_for(len), NO_PAGE, true), TAG, "commit");
+    if (old) ESP_RETURN_ON_ERROR(release(old), TAG, "release");
+    return ESP_OK;
+}
+
+esp_err_t BlobStore::get(uint16_t id, void *out, size_t *len)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(id < max_ids_ && len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    const DirEntry &e = dir_[id];
+    if (e.off == 0) return ESP_ERR_NOT_FOUND;
+    if (!out) {
+        *len = e.len;
+        return ESP_OK;
+    }
+    if (*len < e.len) {
+        *len = e.len;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *len = e.len;
+    return e.len ? fram_.read(e.off, out, e.len) : ESP_OK;
+}
+
+esp_err_t BlobStore::get(uint16_t id, std::string &out)
+{
+    size_t len = 0;
+    ESP_RETURN_ON_ERROR(get(id, nullptr, &len), TAG, "get");
+    out.resize(len);
+    return get(id, out.data(), &len);
+}
+
+esp_err_t BlobStore::remove(uint16_t id)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(id < max_ids_, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    uint16_t old = dir_[id].off;
+    if (old == 0) return ESP_ERR_NOT_FOUND;
+    ESP_RETURN_ON_ERROR(write_dir(id, 0, 0), TAG, "dir");
+    return release(old);
+}
+
+esp_err_t BlobStore::defrag_step(size_t max_bytes, bool *done)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    if (done) *done = false;
+
+    // find a class whose chunks fit into fewer pages than it occupies
+    uint8_t cls = 0;
+    size_t src = NO_PAGE;
+    for (uint8_t c = 1; c <= NUM_CLASSES && src == NO_PAGE; ++c) {
+        size_t cpp = chunks_per_page(c), npages = 0, used = 0, emptiest = NO_PAGE;
+        int min_used = INT32_MAX;
+        for (size_t p = 0; p < pages_count_; ++p) {
+            if (pages_[p].cls != c) continue;
+            int u = __builtin_popcount(pages_[p].used);
+            ++npages;
+            used += u;
+            if (u < min_used) {
+                min_used = u;
+                emptiest = p;
+            }
+        }
+        if (npages > (used + cpp - 1) / cpp) {
+            cls = c;
+            src = emptiest;
+        }
+    }
+    if (src == NO_PAGE) {
+        if (done) *done = true;
+        return ESP_OK;
+    }
+
+    std::vector<uint8_t> buf;
+    size_t moved = 0;
+    while (moved < max_bytes && pages_[src].cls == cls && pages_[src].used) {
+        size_t chunk = __builtin_ctz(pages_[src].used);
+        FRAM::addr_t addr = chunk_addr(src, chunk);
+        uint16_t id = 0;
+        while (id < max_ids_ && dir_[id].off != addr) ++id;
+        if (id == max_ids_) {
+            // unreferenced chunk, just drop it
+            ESP_RETURN_ON_ERROR(release(addr), TAG, "release");
+            continue;
+        }
+
+        size_t len = dir_[id].len;
+        buf.resize(len);
+        if (len) ESP_RETURN_ON_ERROR(fram_.read(addr, buf.data(), len), TAG, "read");
+        ESP_RETURN_ON_ERROR(commit(id, buf.data(), len, cls, src, false), TAG, "move");
+        ESP_RETURN_ON_ERROR(release(addr), TAG, "release");
+        moved += std::max<size_t>(len, 1);
+        moved_bytes_ += len;
+    }
+    ESP_LOGD(TAG, "defrag: class %u page %u, moved %u bytes", cls, (unsigned)src, (unsigned)moved);
+    return ESP_OK;
+}
+
+BlobStore::Stats BlobStore::stats() const
+{
+    Stats s{};
+    s.pages = pages_count_;
+    for (const auto &pe : pages_) {
+        if (pe.cls == 0) {
+            ++s.free_pages;
+            continue;
+        }
+        s.slack_bytes += __builtin_popcount(pe.used) * class_size(pe.cls);
+    }
+    for (const auto &e : dir_) {
+        if (e.off) s.used_bytes += e.len;
+    }
+    s.slack_bytes -= s.used_bytes;
+    s.moved_bytes = moved_bytes_;
+    s.repaired = repaired_;
+    return s;
+}
+
+} // namespace fram_store
@@ -0,0 +1,146 @@
+/**
+ * @file fram_blob.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Variable-length blob store with slab allocation and defragmentation.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "fram.h"
+#include "esp_err.h"
+
+namespace fram_store {
+
+/*
+  BlobStore
+  - region layout: [StoreHeader][directory][page table][pages]
+  - directory: two copies of a DirEntry {off, len, seq, crc} per blob id;
+    the valid copy with the newer seq is current
+  - pages of PAGE_SIZE bytes are assigned to one size class on demand
+    (16..256 bytes); the page table holds class + used-chunk bitmap and is
+    the persistent free-list
+  - put() is replace-by-copy: write data into a free chunk, mark it used,
+    commit by writing the inactive directory copy, then free the old chunk;
+    a crash at any point leaves the old or the new blob, never a mix
+  - chunks leaked by an interrupted commit are released by mount()
+  - defrag_step() migrates a bounded number of bytes per call out of the
+    emptiest page of a class so that whole pages return to the free pool
+*/
+class BlobStore {
+public:
+    static constexpr size_t PAGE_SIZE = 256;
+    static constexpr size_t MAX_BLOB = PAGE_SIZE;
+    static constexpr size_t NUM_CLASSES = 5;   ///< 16, 32, 64, 128, 256 bytes
+
+    struct Stats {
+        size_t pages;
+        size_t free_pages;
+        size_t used_bytes;     ///< sum of blob lengths
+        size_t slack_bytes;    ///< allocated chunk bytes not used by blobs
+        uint32_t moved_bytes;  ///< bytes relocated by the defragmenter
+        uint32_t repaired;     ///< leaked chunks released at mount
+    };
+
+    /**
+     * @brief Construct a blob store over a FRAM region.
+     * @param fram    FRAM driver (initialized).
+     * @param base    First byte of the region.
+     * @param size    Region size in bytes.
+     * @param max_ids Number of blob ids (0 .. max_ids-1).
+     */
+    BlobStore(FRAM &fram, FRAM::addr_t base, size_t size, uint16_t max_ids = 32);
+
+    /**
+     * @brief Load directory and page table, release leaked chunks.
+     * @return ESP_OK on success. A region with a different geometry is formatted.
+     */
+    esp_err_t mount();
+
+    /// Erase all blobs.
+    esp_err_t format();
+
+    /**
+     * @brief Atomically replace blob @p id.
+     * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_INVALID_SIZE if len > MAX_BLOB,
+     *         ESP_ERR_NO_MEM if no chunk of the needed class is free.
+     */
+    esp_err_t put(uint16_t id, const void *data, size_t len);
+    esp_err_t put(uint16_t id, std::string_view s) { return put(id, s.data(), s.size()); }
+
+    /**
+     * @brief Read blob @p id.
+     * @param[out]   out Destination, may be nullptr to query the length.
+     * @param[inout] len In: buffer size. Out: blob length.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND, ESP_ERR_INVALID_SIZE if the buffer is too small.
+     */
+    esp_err_t get(uint16_t id, void *out, size_t *len);
+    esp_err_t get(uint16_t id, std::string &out);
+
+    /// Delete blob @p id. ESP_ERR_NOT_FOUND if absent.
+    esp_err_t remove(uint16_t id);
+
+    bool exists(uint16_t id) const { return id < max_ids_ && dir_[id].off != 0; }
+
+    /**
+     * @brief Run one bounded defragmentation step.
+     * @param max_bytes Upper bound of payload bytes moved by this call.
+     * @param[out] done Set to true when no page can be freed by compaction.
+     * @return ESP_OK on success, otherwise an esp_err_t error code.
+     */
+    esp_err_t defrag_step(size_t max_bytes, bool *done = nullptr);
+
+    Stats stats() const;
+
+private:
+    struct DirEntry {
+        uint16_t off;   ///< chunk address, 0 = absent
+        uint16_t len;
+        uint16_t seq;
+        uint16_t crc;
+    };
+    struct PageEntry {
+        uint8_t cls;    ///< 0 = free page, 1..NUM_CLASSES
+        uint8_t reserved;
+        uint16_t used;  ///< bitmap of used chunks
+    };
+
+    static uint16_t entry_crc(const DirEntry &e);
+    static size_t class_size(uint8_t cls) { return size_t(16) << (cls - 1); }
+    static uint8_t class_for(size_t len);
+    static size_t chunks_per_page(uint8_t cls) { return PAGE_SIZE / class_size(cls); }
+
+    FRAM::addr_t dir_addr(uint16_t id, uint8_t copy) const;
+    FRAM::addr_t page_entry_addr(size_t page) const;
+    FRAM::addr_t chunk_addr(size_t page, size_t chunk) const;
+    bool locate(uint16_t off, size_t &page, size_t &chunk) const;
+
+    esp_err_t write_page(size_t page);
+    esp_err_t write_dir(uint16_t id, uint16_t off, uint16_t len);
+    esp_err_t alloc(uint8_t cls, size_t exclude_page, size_t &page, size_t &chunk, bool allow_new_page);
+    esp_err_t release(uint16_t off);
+    esp_err_t commit(uint16_t id, const void *data, size_t len, uint8_t cls, size_t exclude_page, bool allow_new_page);
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    size_t size_;
+    uint16_t max_ids_;
+    size_t pages_count_{0};
+    FRAM::addr_t dir_base_{0}, ptab_base_{0}, heap_base_{0};
+
+    std::vector<DirEntry> dir_;
+    std::vector<uint8_t> active_;      ///< which directory copy is current per id
+    std::vector<PageEntry> pages_;
+    bool mounted_{false};
+    uint32_t moved_bytes_{0};
+    uint32_t repaired_{0};
+};
+
+} // namespace fram_store
@@ -0,0 +1,557 @@
+/**
+ * @file fram_btree.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_btree.h"
+#include <algorithm>
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_BTREE";
+
+namespace fram_store {
+
+#pragma pack(push,1)
+struct NodeHeader {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t count;     // leaf: records, inner: children
+    uint32_t crc;       // crc32 over the rest of the node
+};
+#pragma pack(pop)
+
+static constexpr size_t HDR = sizeof(NodeHeader);
+static constexpr size_t ROOT_SLOTS = 2;
+
+BTree::BTree(FRAM &fram, FRAM::addr_t base, size_t size, uint8_t val_size,
+             size_t node_size, size_t cache_nodes)
+    : fram_(fram), root_store_(fram, base, ROOT_SLOTS), val_size_(val_size),
+      node_size_(node_size), cache_nodes_(cache_nodes)
+{
+    size_t roots = ROOT_SLOTS * (sizeof(Header) + sizeof(Root));
+    nodes_base_ = static_cast<FRAM::addr_t>(base + roots);
+    node_count_ = (size > roots && node_size) ? std::min<size_t>((size - roots) / node_size, NO_NODE) : 0;
+    leaf_cap_ = node_size > HDR ? (node_size - HDR) / (4 + val_size) : 0;
+    inner_cap_ = node_size > HDR ? (node_size - HDR + 4) / 6 : 0;
+}
+
+// ---- node layout -----------------------------------------------------------
+
+uint16_t BTree::count(const Node &n) const
+{
+    uint16_t c;
+    memcpy(&c, &n[offsetof(NodeHeader, count)], sizeof(c));
+    return c;
+}
+
+void BTree::set_header(Node &n, uint8_t type, uint16_t count) const
+{
+    n[0] = type;
+    n[1] = 0;
+    memcpy(&n[offsetof(NodeHeader, count)], &count, sizeof(count));
+}
+
+uint32_t BTree::leaf_key(const Node &n, size_t i) const
+{
+    uint32_t k;
+    memcpy(&k, &n[HDR + i * (4 + val_size_)], sizeof(k));
+    return k;
+}
+
+uint8_t *BTree::leaf_value(Node &n, size_t i) const
+{
+    return &n[HDR + i * (4 + val_size_) + 4];
+}
+
+uint32_t BTree::inner_key(const Node &n, size_t i) const
+{
+    uint32_t k;
+    memcpy(&k, &n[HDR + i * 4], sizeof(k));
+    return k;
+}
+
+uint16_t BTree::child(const Node &n, size_t i) const
+{
+    uint16_t c;
+    memcpy(&c, &n[HDR + (inner_cap_ - 1) * 4 + i * 2], sizeof(c));
+    return c;
+}
+
+void BTree::set_inner_key(Node &n, size_t i, uint32_t key) const
+{
+    memcpy(&n[HDR + i * 4], &key, sizeof(key));
+}
+
+void BTree::set_child(Node &n, size_t i, uint16_t idx) const
+{
+    memcpy(&n[HDR + (inner_cap_ - 1) * 4 + i * 2], &idx, sizeof(idx));
+}
+
+size_t BTree::leaf_lower_bound(const Node &n, uint32_t key) const
+{
+    size_t lo = 0, hi = count(n);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (leaf_key(n, mid) < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+size_t BTree::inner_child_for(const Node &n, uint32_t key) const
+{
+    // child i holds keys in [key(i-1), key(i))
+    size_t lo = 0, hi = count(n) - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (inner_key(n, mid) <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// ---- node storage ----------------------------------------------------------
+
+FRAM::addr_t BTree::node_addr(uint16_t idx) const
+{
+    return static_cast<FRAM::addr_t>(nodes_base_ + size_t(idx) * node_size_);
+}
+
+void BTree::cache_put(uint16_t idx, const Node &n, uint8_t rank, bool written)
+{
+    if (type(n) != INNER || cache_nodes_ == 0) return;
+    if (cache_.size() >= cache_nodes_) {
+        // full: the root and the levels under it are on every path, so a node
+        // only displaces one of a lower rank; a written node also wins a tie,
+        // the copy it replaces is freed by the commit
+        auto low = cache_.begin();
+        for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+            if (it->second.rank < low->second.rank) low = it;
+        }
+        if (low->second.rank > rank || (low->second.rank == rank && !written)) return;
+        cache_.erase(low);
+    }
+    cache_[idx] = CachedNode{n, rank};
+}
+
+esp_err_t BTree::read_node(uint16_t idx, uint8_t rank, Node &n)
+{
+    ESP_RETURN_ON_FALSE(idx < node_count_, ESP_ERR_INVALID_CRC, TAG, "bad node index %u", idx);
+    auto it = cache_.find(idx);
+    if (it != cache_.end()) {
+        n = it->second.node;
+        ++cache_hits_;
+        return ESP_OK;
+    }
+
+    n.resize(node_size_);
+    ESP_RETURN_ON_ERROR(fram_.read(node_addr(idx), n.data(), node_size_), TAG, "read node %u", idx);
+    ++node_reads_;
+    NodeHeader h;
+    memcpy(&h, n.data(), sizeof(h));
+    size_t cap = h.type == LEAF ? leaf_cap_ : inner_cap_;
+    ESP_RETURN_ON_FALSE((h.type == LEAF || h.type == INNER) && h.count <= cap &&
+                        h.crc == crc32(n.data() + HDR, node_size_ - HDR),
+                        ESP_ERR_INVALID_CRC, TAG, "node %u damaged", idx);
+    cache_put(idx, n, rank, false);
+    return ESP_OK;
+}
+
+uint16_t BTree::alloc_node()
+{
+    for (size_t i = 0; i < node_count_; ++i) {
+        if (!used_[i]) {
+            used_[i] = true;
+            ++used_count_;
+            return static_cast<uint16_t>(i);
+        }
+    }
+    return NO_NODE;
+}
+
+void BTree::free_node(uint16_t idx)
+{
+    if (idx >= node_count_ || !used_[idx]) return;
+    used_[idx] = false;
+    --used_count_;
+    cache_.erase(idx);
+}
+
+esp_err_t BTree::write_node(Node &n, uint8_t rank, uint16_t &idx)
+{
+    idx = alloc_node();
+    ESP_RETURN_ON_FALSE(idx != NO_NODE, ESP_ERR_NO_MEM, TAG, "out of nodes");
+    uint32_t crc = crc32(n.data() + HDR, node_size_ - HDR);
+    memcpy(&n[offsetof(NodeHeader, crc)], &crc, sizeof(crc));
+    esp_err_t err = fram_.write(node_addr(idx), n.data(), node_size_);
+    if (err != ESP_OK) {
+        free_node(idx);
+        return err;
+    }
+    ++node_writes_;
+    cache_put(idx, n, rank, true);
+    return ESP_OK;
+}
+
+esp_err_t BTree::commit(const Root &r, const std::vector<uint16_t> &old_nodes, std::vector<uint16_t> &new_nodes)
+{
+    esp_err_t err = root_store_.store_immediate(r);
+    if (err != ESP_OK) {
+        for (uint16_t idx : new_nodes) free_node(idx);
+        return err;
+    }
+    root_ = r;
+    // the previous tree is unreachable from now on
+    for (uint16_t idx : old_nodes) free_node(idx);
+    return ESP_OK;
+}
+
+// ---- mount -----------------------------------------------------------------
+
+esp_err_t BTree::mark(uint16_t idx, uint8_t level, uint32_t &records)
+{
+    ESP_RETURN_ON_FALSE(idx < node_count_ && !used_[idx], ESP_ERR_INVALID_CRC, TAG, "node %u linked twice", idx);
+    Node n;
+    ESP_RETURN_ON_ERROR(read_node(idx, root_.height - 1 - level, n), TAG, "walk");
+    bool leaf_level = level + 1 == root_.height;
+    ESP_RETURN_ON_FALSE(type(n) == (leaf_level ? LEAF : INNER) && count(n) > 0,
+                        ESP_ERR_INVALID_CRC, TAG, "node %u: bad type at level %u", idx, level);
+    used_[idx] = true;
+    ++used_count_;
+    if (leaf_level) {
+        records += count(n);
+        return ESP_OK;
+    }
+    for (size_t i = 0; i < count(n); ++i) {
+        ESP_RETURN_ON_ERROR(mark(child(n, i), level + 1, records), TAG, "walk");
+    }
+    return ESP_OK;
+}
+
+esp_err_t BTree::mount()
+{
+    ESP_RETURN_ON_FALSE(val_size_ <= MAX_VALUE && node_size_ >= 64 && node_size_ <= 512 &&
+                        leaf_cap_ >= 2 && inner_cap_ >= 3,
+                        ESP_ERR_INVALID_ARG, TAG, "bad node geometry");
+    ESP_RETURN_ON_FALSE(node_count_ >= 2 && (uint32_t)node_addr(0) + node_count_ * node_size_ <= FRAM::FRAM_SIZE_BYTES,
+                        ESP_ERR_INVALID_SIZE, TAG, "bad region");
+
+    esp_err_t err = root_store_.load(root_);
+    if (err == ESP_ERR_NOT_FOUND) {
+        root_ = Root{NO_NODE, 0, 0, 0};
+    } else {
+        ESP_RETURN_ON_ERROR(err, TAG, "load root");
+    }
+
+    used_.assign(node_count_, false);
+    used_count_ = 0;
+    cache_.clear();
+    if (root_.node != NO_NODE) {
+        ESP_RETURN_ON_FALSE(root_.height > 0 && root_.height <= MAX_HEIGHT, ESP_ERR_INVALID_CRC, TAG, "bad height");
+        uint32_t records = 0;
+        ESP_RETURN_ON_ERROR(mark(root_.node, 0, records), TAG, "tree damaged");
+        if (records != root_.count) {
+            ESP_LOGW(TAG, "record count %u, root says %u", (unsigned)records, (unsigned)root_.count);
+            root_.count = records;
+        }
+    }
+    ESP_LOGI(TAG, "mounted: %u records, height %u, %u/%u nodes",
+             (unsigned)root_.count, root_.height, (unsigned)used_count_, (unsigned)node_count_);
+    mounted_ = true;
+    return ESP_OK;
+}
+
+esp_err_t BTree::clear()
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_ERROR(root_store_.store_immediate(Root{NO_NODE, 0, 0, 0}), TAG, "root");
+    root_ = Root{NO_NODE, 0, 0, 0};
+    used_.assign(node_count_, false);
+    used_count_ = 0;
+    cache_.clear();
+    return ESP_OK;
+}
+
+// ---- operations ------------------------------------------------------------
+
+esp_err_t BTree::get(uint32_t key, void *value)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    if (root_.node == NO_NODE) return ESP_ERR_NOT_FOUND;
+
+    Node n;
+    uint16_t idx = root_.node;
+    for (uint8_t level = 0; level < root_.height; ++level) {
+        ESP_RETURN_ON_ERROR(read_node(idx, root_.height - 1 - level, n), TAG, "descend");
+        if (level + 1 < root_.height) idx = child(n, inner_child_for(n, key));
+    }
+    size_t i = leaf_lower_bound(n, key);
+    if (i >= count(n) || leaf_key(n, i) != key) return ESP_ERR_NOT_FOUND;
+    if (value && val_size_) memcpy(value, leaf_value(n, i), val_size_);
+    return ESP_OK;
+}
+
+esp_err_t BTree::insert(uint32_t key, const void *value)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(value || val_size_ == 0, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    const size_t es = 4 + val_size_;
+    std::vector<uint16_t> old_nodes, new_nodes;
+
+    if (root_.node == NO_NODE) {
+        Node leaf(node_size_, 0);
+        set_header(leaf, LEAF, 1);
+        memcpy(&leaf[HDR], &key, 4);
+        if (val_size_) memcpy(leaf_value(leaf, 0), value, val_size_);
+        uint16_t idx;
+        ESP_RETURN_ON_ERROR(write_node(leaf, 0, idx), TAG, "leaf");
+        new_nodes.push_back(idx);
+        return commit(Root{idx, 1, 0, 1}, old_nodes, new_nodes);
+    }
+
+    // a split of every level plus a new root in the worst case
+    ESP_RETURN_ON_FALSE(root_.height < MAX_HEIGHT && node_count_ - used_count_ >= 2u * root_.height + 1,
+                        ESP_ERR_NO_MEM, TAG, "out of nodes");
+
+    const uint8_t h = root_.height;
+    Node path[MAX_HEIGHT];
+    size_t pos[MAX_HEIGHT] = {};
+    uint16_t idx = root_.node;
+    for (uint8_t level = 0; level < h; ++level) {
+        ESP_RETURN_ON_ERROR(read_node(idx, h - 1 - level, path[level]), TAG, "descend");
+        old_nodes.push_back(idx);
+        if (level + 1 < h) {
+            pos[level] = inner_child_for(path[level], key);
+            idx = child(path[level], pos[level]);
+        }
+    }
+
+    auto fail = [&](esp_err_t err) {
+        for (uint16_t n : new_nodes) free_node(n);
+        return err;
+    };
+    auto store = [&](Node &n, uint8_t rank, uint16_t &out) {
+        esp_err_t err = write_node(n, rank, out);
+        if (err == ESP_OK) new_nodes.push_back(out);
+        return err;
+    };
+
+    // leaf
+    Node &leaf = path[h - 1];
+    const size_t cnt = count(leaf);
+    size_t i = leaf_lower_bound(leaf, key);
+    const bool replace = i < cnt && leaf_key(leaf, i) == key;
+    uint16_t left = NO_NODE, right = NO_NODE;
+    uint32_t sep = 0;
+    esp_err_t err;
+
+    if (replace) {
+        if (val_size_ && memcmp(leaf_value(leaf, i), value, val_size_) == 0) return ESP_OK;
+        if (val_size_) memcpy(leaf_value(leaf, i), value, val_size_);
+        if ((err = store(leaf, 0, left)) != ESP_OK) return fail(err);
+    } else {
+        // all entries including the new one, in order
+        std::vector<uint8_t> all((cnt + 1) * es);
+        memcpy(all.data(), &leaf[HDR], i * es);
+        memcpy(&all[i * es], &key, 4);
+        if (val_size_) memcpy(&all[i * es + 4], value, val_size_);
+        memcpy(&all[(i + 1) * es], &leaf[HDR + i * es], (cnt - i) * es);
+
+        if (cnt + 1 <= leaf_cap_) {
+            set_header(leaf, LEAF, static_cast<uint16_t>(cnt + 1));
+            memcpy(&leaf[HDR], all.data(), all.size());
+            if ((err = store(leaf, 0, left)) != ESP_OK) return fail(err);
+        } else {
+            size_t nl = (cnt + 1) / 2, nr = cnt + 1 - nl;
+            Node l(node_size_, 0), r(node_size_, 0);
+            set_header(l, LEAF, static_cast<uint16_t>(nl));
+            set_header(r, LEAF, static_cast<uint16_t>(nr));
+            memcpy(&l[HDR], all.data(), nl * es);
+            memcpy(&r[HDR], &all[nl * es], nr * es);
+            sep = leaf_key(r, 0);
+            if ((err = store(l, 0, left)) != ESP_OK || (err = store(r, 0, right)) != ESP_OK) return fail(err);
+        }
+    }
+
+    // copy the path up to the root
+    for (int level = h - 2; level >= 0; --level) {
+        Node &n = path[level];
+        const size_t c = count(n), p = pos[level];
+        std::vector<uint32_t> keys(c - 1);
+        std::vector<uint16_t> kids(c);
+        for (size_t k = 0; k + 1 < c; ++k) keys[k] = inner_key(n, k);
+        for (size_t k = 0; k < c; ++k) kids[k] = child(n, k);
+        kids[p] = left;
+        if (right != NO_NODE) {
+            keys.insert(keys.begin() + p, sep);
+            kids.insert(kids.begin() + p + 1, right);
+        }
+        right = NO_NODE;
+
+        auto encode = [&](Node &out, size_t k0, size_t nk) {
+            std::fill(out.begin(), out.end(), 0);
+            set_header(out, INNER, static_cast<uint16_t>(nk));
+            for (size_t k = 0; k < nk; ++k) set_child(out, k, kids[k0 + k]);
+            for (size_t k = 0; k + 1 < nk; ++k) set_inner_key(out, k, keys[k0 + k]);
+        };
+        if (kids.size() <= inner_cap_) {
+            encode(n, 0, kids.size());
+            if ((err = store(n, h - 1 - level, left)) != ESP_OK) return fail(err);
+        } else {
+            size_t nl = kids.size() / 2;
+            Node l(node_size_), r(node_size_);
+            encode(l, 0, nl);
+            encode(r, nl, kids.size() - nl);
+            sep = keys[nl - 1];   // promoted, not kept in either half
+            const uint8_t rank = h - 1 - level;
+            if ((err = store(l, rank, left)) != ESP_OK || (err = store(r, rank, right)) != ESP_OK) return fail(err);
+        }
+    }
+
+    Root r{left, h, 0, root_.count + (replace ? 0u : 1u)};
+    if (right != NO_NODE) {
+        Node top(node_size_, 0);
+        set_header(top, INNER, 2);
+        set_child(top, 0, left);
+        set_child(top, 1, right);
+        set_inner_key(top, 0, sep);
+        if ((err = store(top, h, r.node)) != ESP_OK) return fail(err);
+        r.height = h + 1;
+    }
+    return commit(r, old_nodes, new_nodes);
+}
+
+esp_err_t BTree::remove(uint32_t key)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    if (root_.node == NO_NODE) return ESP_ERR_NOT_FOUND;
+    const size_t es = 4 + val_size_;
+    const uint8_t h = root_.height;
+    std::vector<uint16_t> old_nodes, new_nodes;
+
+    Node path[MAX_HEIGHT];
+    size_t pos[MAX_HEIGHT] = {};
+    uint16_t idx = root_.node;
+    for (uint8_t level = 0; level < h; ++level) {
+        ESP_RETURN_ON_ERROR(read_node(idx, h - 1 - level, path[level]), TAG, "descend");
+        old_nodes.push_back(idx);
+        if (level + 1 < h) {
+            pos[level] = inner_child_for(path[level], key);
+            idx = child(path[level], pos[level]);
+        }
+    }
+    Node &leaf = path[h - 1];
+    const size_t cnt = count(leaf);
+    size_t i = leaf_lower_bound(leaf, key);
+    if (i >= cnt || leaf_key(leaf, i) != key) return ESP_ERR_NOT_FOUND;
+    ESP_RETURN_ON_FALSE(node_count_ - used_count_ >= h, ESP_ERR_NO_MEM, TAG, "out of nodes");
+
+    auto fail = [&](esp_err_t err) {
+        for (uint16_t n : new_nodes) free_node(n);
+        return err;
+    };
+    auto store = [&](Node &n, uint8_t rank, uint16_t &out) {
+        esp_err_t err = write_node(n, rank, out);
+        if (err == ESP_OK) new_nodes.push_back(out);
+        return err;
+    };
+
+    esp_err_t err;
+    uint16_t cur = NO_NODE;
+    bool drop = cnt == 1;
+    if (!drop) {
+        memmove(&leaf[HDR + i * es], &leaf[HDR + (i + 1) * es], (cnt - i - 1) * es);
+        memset(&leaf[HDR + (cnt - 1) * es], 0, es);
+        set_header(leaf, LEAF, static_cast<uint16_t>(cnt - 1));
+        if ((err = store(leaf, 0, cur)) != ESP_OK) return fail(err);
+    }
+
+    uint8_t height = h;
+    for (int level = h - 2; level >= 0; --level) {
+        Node &n = path[level];
+        const size_t c = count(n), p = pos[level];
+        std::vector<uint32_t> keys(c - 1);
+        std::vector<uint16_t> kids(c);
+        for (size_t k = 0; k + 1 < c; ++k) keys[k] = inner_key(n, k);
+        for (size_t k = 0; k < c; ++k) kids[k] = child(n, k);
+        if (drop) {
+            kids.erase(kids.begin() + p);
+            if (!keys.empty()) keys.erase(keys.begin() + (p > 0 ? p - 1 : 0));
+            drop = kids.empty();
+            if (drop) continue;
+        } else {
+            kids[p] = cur;
+        }
+        if (level == 0 && kids.size() == 1) {
+            // the root lost all but one child: the tree gets shorter
+            cur = kids[0];
+            --height;
+            continue;
+        }
+        std::fill(n.begin(), n.end(), 0);
+        set_header(n, INNER, static_cast<uint16_t>(kids.size()));
+        for (size_t k = 0; k < kids.size(); ++k) set_child(n, k, kids[k]);
+        for (size_t k = 0; k < keys.size(); ++k) set_inner_key(n, k, keys[k]);
+        if ((err = store(n, h - 1 - level, cur)) != ESP_OK) return fail(err);
+    }
+
+    Root r{drop ? NO_NODE : cur, static_cast<uint8_t>(drop ? 0 : height), 0, root_.count - 1};
+    // single-child inner nodes below a collapsed root are skipped as well
+    while (r.node != NO_NODE && r.height > 1) {
+        Node n;
+        if ((err = read_node(r.node, r.height - 1, n)) != ESP_OK) return fail(err);
+        if (count(n) != 1) break;
+        old_nodes.push_back(r.node);
+        r.node = child(n, 0);
+        --r.height;
+    }
+    return commit(r, old_nodes, new_nodes);
+}
+
+esp_err_t BTree::scan(uint16_t idx, uint8_t level, uint32_t from, uint32_t to, const Visitor &fn, bool &stop)
+{
+    Node n;
+    ESP_RETURN_ON_ERROR(read_node(idx, root_.height - 1 - level, n), TAG, "scan");
+    const size_t c = count(n);
+    if (level + 1 == root_.height) {
+        for (size_t i = leaf_lower_bound(n, from); i < c && !stop; ++i) {
+            uint32_t k = leaf_key(n, i);
+            if (k > to) {
+                stop = true;
+                break;
+            }
+            if (!fn(k, leaf_value(n, i))) stop = true;
+        }
+        return ESP_OK;
+    }
+    for (size_t i = inner_child_for(n, from); i < c && !stop; ++i) {
+        if (i > 0 && inner_key(n, i - 1) > to) {
+            stop = true;
+            break;
+        }
+        ESP_RETURN_ON_ERROR(scan(child(n, i), level + 1, from, to, fn, stop), TAG, "scan");
+    }
+    return ESP_OK;
+}
+
+esp_err_t BTree::range(uint32_t from, uint32_t to, const Visitor &fn)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(fn, ESP_ERR_INVALID_ARG, TAG, "no visitor");
+    if (root_.node == NO_NODE || from > to) return ESP_OK;
+    bool stop = false;
+    return scan(root_.node, 0, from, to, fn, stop);
+}
+
+BTree::Stats BTree::stats() const
+{
+    return Stats{root_.count, root_.height, used_count_, node_count_, node_reads_, node_writes_, cache_hits_};
+}
+
+} // namespace fram_store
@@ -0,0 +1,159 @@
+/**
+ * @file fram_btree.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Copy-on-write B+tree index for ordered records in FRAM.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "fram.h"
+#include "fram_store.h"
+#include "esp_err.h"
+
+namespace fram_store {
+
+/*
+  BTree
+  - region layout: [Persistent<Root> x2 slots][nodes]
+  - fixed-size nodes of node_size bytes (the SPI transfer unit), each one
+    [NodeHeader{type, count, crc}][entries]
+  - leaf entry: [u32 key][value val_size]; inner node: separator keys
+    followed by child node indices
+  - copy-on-write: insert/remove write the changed leaf-to-root path into
+    free nodes, then commit the new root through Persistent<Root>; the old
+    path is released only after the commit, so a crash leaves the old tree
+  - the free-node bitmap lives in RAM and is rebuilt by walking the tree
+    at mount(), which also reclaims nodes of an interrupted update
+  - inner nodes can be cached in RAM (cache_nodes), the root and upper
+    levels first: a full cache only takes a node in place of one of a lower
+    level, or of the same level for a node just written; leaves are always
+    read from FRAM, one bulk transfer per node
+  - underfull nodes are not merged, empty ones are dropped from the parent
+*/
+class BTree {
+public:
+    static constexpr size_t MAX_HEIGHT = 8;
+    static constexpr size_t MAX_VALUE = 64;
+
+    struct Stats {
+        uint32_t count;          ///< records
+        uint8_t height;
+        size_t nodes_used;
+        size_t nodes_total;
+        uint32_t node_reads;     ///< node transfers from FRAM
+        uint32_t node_writes;
+        uint32_t cache_hits;
+    };
+
+    /// return false to stop a range scan
+    using Visitor = std::function<bool(uint32_t key, const void *value)>;
+
+    /**
+     * @brief Construct a B+tree over a FRAM region.
+     * @param fram        FRAM driver (initialized).
+     * @param base        First byte of the region.
+     * @param size        Region size in bytes.
+     * @param val_size    Fixed value length stored with every key.
+     * @param node_size   Node size in bytes (64..512).
+     * @param cache_nodes Number of inner nodes kept in RAM, 0 disables the cache.
+     */
+    BTree(FRAM &fram, FRAM::addr_t base, size_t size, uint8_t val_size,
+          size_t node_size = 128, size_t cache_nodes = 0);
+
+    /**
+     * @brief Load the root and rebuild the free-node map.
+     * @return ESP_OK, ESP_ERR_INVALID_CRC if a reachable node is damaged.
+     */
+    esp_err_t mount();
+
+    /// Drop all records.
+    esp_err_t clear();
+
+    /**
+     * @brief Insert a record or replace the value of an existing key.
+     * @return ESP_OK, ESP_ERR_NO_MEM if there are not enough free nodes.
+     */
+    esp_err_t insert(uint32_t key, const void *value);
+
+    /// Read the value of @p key. ESP_ERR_NOT_FOUND if absent.
+    esp_err_t get(uint32_t key, void *value);
+
+    /// Delete @p key. ESP_ERR_NOT_FOUND if absent.
+    esp_err_t remove(uint32_t key);
+
+    /**
+     * @brief Visit all records with from <= key <= to in ascending order.
+     * @return ESP_OK on success, otherwise an esp_err_t error code.
+     */
+    esp_err_t range(uint32_t from, uint32_t to, const Visitor &fn);
+
+    Stats stats() const;
+    size_t leaf_capacity() const { return leaf_cap_; }
+    size_t inner_capacity() const { return inner_cap_; }
+
+private:
+    struct Root {
+        uint16_t node;      ///< NO_NODE for an empty tree
+        uint8_t height;     ///< levels including the leaves
+        uint8_t reserved;
+        uint32_t count;
+    };
+    enum : uint8_t { LEAF = 1, INNER = 2 };
+    static constexpr uint16_t NO_NODE = 0xFFFF;
+
+    using Node = std::vector<uint8_t>;
+
+    // node field access
+    uint8_t type(const Node &n) const { return n[0]; }
+    uint16_t count(const Node &n) const;
+    void set_header(Node &n, uint8_t type, uint16_t count) const;
+    uint32_t leaf_key(const Node &n, size_t i) const;
+    uint8_t *leaf_value(Node &n, size_t i) const;
+    uint32_t inner_key(const Node &n, size_t i) const;
+    uint16_t child(const Node &n, size_t i) const;
+    void set_inner_key(Node &n, size_t i, uint32_t key) const;
+    void set_child(Node &n, size_t i, uint16_t idx) const;
+    size_t leaf_lower_bound(const Node &n, uint32_t key) const;
+    size_t inner_child_for(const Node &n, uint32_t key) const;
+
+    FRAM::addr_t node_addr(uint16_t idx) const;
+    // rank: levels above the leaves (0 = leaf); fixed for a node's lifetime, unlike its depth
+    esp_err_t read_node(uint16_t idx, uint8_t rank, Node &n);
+    esp_err_t write_node(Node &n, uint8_t rank, uint16_t &idx);
+    void cache_put(uint16_t idx, const Node &n, uint8_t rank, bool written);
+    uint16_t alloc_node();
+    void free_node(uint16_t idx);
+    esp_err_t mark(uint16_t idx, uint8_t level, uint32_t &records);
+    esp_err_t commit(const Root &r, const std::vector<uint16_t> &old_nodes, std::vector<uint16_t> &new_nodes);
+    esp_err_t scan(uint16_t idx, uint8_t level, uint32_t from, uint32_t to, const Visitor &fn, bool &stop);
+
+    FRAM &fram_;
+    Persistent<Root> root_store_;
+    uint8_t val_size_;
+    size_t node_size_;
+    size_t cache_nodes_;
+    FRAM::addr_t nodes_base_;
+    size_t node_count_;
+    size_t leaf_cap_, inner_cap_;
+
+    Root root_{NO_NODE, 0, 0, 0};
+    std::vector<bool> used_;
+    size_t used_count_{0};
+    bool mounted_{false};
+    struct CachedNode {
+        Node node;
+        uint8_t rank;
+    };
+    std::unordered_map<uint16_t, CachedNode> cache_;
+    uint32_t node_reads_{0}, node_writes_{0}, cache_hits_{0};
+};
+
+} // namespace fram_store
@@ -0,0 +1,248 @@
+/**
+ * @file fram_crash.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_crash.h"
+#include "fram_store.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "esp_rom_sys.h"
+#include "esp_memory_utils.h"
+#include "esp_debug_helpers.h"
+#include "esp_private/panic_internal.h"
+#include "freertos/FreeRTOS.h"
+#if CONFIG_IDF_TARGET_ARCH_XTENSA
+#include "xtensa_context.h"
+#endif
+
+static const char *TAG = "FRAM_CRASH";
+
+namespace fram_store {
+
+static constexpr uint32_t CLEARED = 0;
+
+// panic-time state: plain DRAM, no constructors that could run late
+static FRAM *s_fram = nullptr;
+static FRAM::addr_t s_base = 0;
+static uint32_t s_seq = 0;
+static bool s_captured = false;
+static CrashLog::Record s_rec;
+
+static char s_tail[CrashLog::LOG_TAIL];
+static size_t s_tail_pos = 0;
+static bool s_tail_full = false;
+static portMUX_TYPE s_tail_mux = portMUX_INITIALIZER_UNLOCKED;
+static vprintf_like_t s_prev_vprintf = nullptr;
+
+#if CONFIG_IDF_TARGET_ARCH_XTENSA
+// return address -> call site, as esp_cpu_process_stack_pc() does
+FORCE_INLINE_ATTR uint32_t stack_pc(uint32_t pc)
+{
+    if (pc & 0x80000000) pc = (pc & 0x3FFFFFFF) | 0x40000000;
+    return pc - 3;
+}
+#endif
+
+int CrashLog::log_vprintf(const char *fmt, va_list ap)
+{
+    char line[96];
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(line, sizeof(line), fmt, copy);
+    va_end(copy);
+
+    if (n > 0) {
+        size_t len = std::min(static_cast<size_t>(n), sizeof(line) - 1);
+        portENTER_CRITICAL(&s_tail_mux);
+        for (size_t i = 0; i < len; ++i) {
+            s_tail[s_tail_pos] = line[i];
+            if (++s_tail_pos == LOG_TAIL) {
+                s_tail_pos = 0;
+                s_tail_full = true;
+            }
+        }
+        portEXIT_CRITICAL(&s_tail_mux);
+    }
+    return s_prev_vprintf ? s_prev_vprintf(fmt, ap) : vprintf(fmt, ap);
+}
+
+esp_err_t CrashLog::install(FRAM &fram, FRAM::addr_t base, int write_hz)
+{
+    ESP_RETURN_ON_FALSE((uint32_t)base + REGION_SIZE <= FRAM::FRAM_SIZE_BYTES, ESP_ERR_INVALID_ARG, TAG, "region out of range");
+    ESP_RETURN_ON_ERROR(fram.set_panic_write_hz(write_hz), TAG, "write clock");
+
+    // continue the sequence of the previous record, consumed or not
+    Record hdr{};
+    ESP_RETURN_ON_ERROR(fram.read(base, &hdr, BODY_OFFSET), TAG, "read header");
+    const bool known = (hdr.magic == MAGIC || hdr.magic == CLEARED) && hdr.version == VERSION;
+    s_seq = known ? hdr.seq : 0;
+
+    s_base = base;
+    s_fram = &fram;
+    if (!s_prev_vprintf) s_prev_vprintf = esp_log_set_vprintf(&CrashLog::log_vprintf);
+    return ESP_OK;
+}
+
+IRAM_ATTR void CrashLog::capture(const void *panic_info)
+{
+    // a fault inside the capture itself re-enters the panic handler
+    if (!s_fram || s_captured) return;
+    s_captured = true;
+
+    const panic_info_t *info = static_cast<const panic_info_t *>(panic_info);
+    Record &r = s_rec;
+    memset(&r, 0, sizeof(r));
+    r.magic = MAGIC;
+    r.version = VERSION;
+    r.len = sizeof(Record);
+    r.seq = s_seq + 1;
+    r.uptime_ms = static_cast<uint32_t>(esp_timer_get_time() / 1000);
+    r.core = static_cast<uint8_t>(info->core);
+    r.kind = static_cast<uint8_t>(info->exception);
+
+#if CONFIG_IDF_TARGET_ARCH_XTENSA
+    const XtExcFrame *f = static_cast<const XtExcFrame *>(info->frame);
+    if (f) {
+        const uint32_t regs[REG_COUNT] = {
+            (uint32_t)f->pc, (uint32_t)f->ps,
+            (uint32_t)f->a0, (uint32_t)f->a1, (uint32_t)f->a2, (uint32_t)f->a3,
+            (uint32_t)f->a4, (uint32_t)f->a5, (uint32_t)f->a6, (uint32_t)f->a7,
+            (uint32_t)f->a8, (uint32_t)f->a9, (uint32_t)f->a10, (uint32_t)f->a11,
+            (uint32_t)f->a12, (uint32_t)f->a13, (uint32_t)f->a14, (uint32_t)f->a15,
+            (uint32_t)f->sar, (uint32_t)f->lbeg, (uint32_t)f->lend, (uint32_t)f->lcount,
+        };
+        memcpy(r.regs, regs, sizeof(regs));
+        r.exccause = f->exccause;
+        r.excvaddr = f->excvaddr;
+
+        esp_backtrace_frame_t bt = { (uint32_t)f->pc, (uint32_t)f->a1, (uint32_t)f->a0, f };
+        r.backtrace[0][0] = stack_pc(bt.pc);
+        r.backtrace[0][1] = bt.sp;
+        r.frames = 1;
+        while (r.frames < MAX_FRAMES && bt.next_pc != 0 && esp_backtrace_get_next_frame(&bt)) {
+            r.backtrace[r.frames][0] = stack_pc(bt.pc);
+            r.backtrace[r.frames][1] = bt.sp;
+            ++r.frames;
+        }
+    }
+#endif
+
+    // reason strings in flash may be unreachable with the cache off; abort() messages live in DRAM
+    if (info->reason && esp_ptr_internal(info->reason)) {
+        for (size_t i = 0; i < REASON_LEN - 1 && info->reason[i]; ++i) r.reason[i] = info->reason[i];
+    }
+
+    // the other core is stalled, the ring is read without its lock
+    size_t n = 0;
+    if (s_tail_full) {
+        for (size_t i = s_tail_pos; i < LOG_TAIL; ++i) r.log[n++] = s_tail[i];
+    }
+    for (size_t i = 0; i < s_tail_pos; ++i) r.log[n++] = s_tail[i];
+    r.log_len = static_cast<uint8_t>(n);
+
+    const uint8_t *raw = reinterpret_cast<const uint8_t *>(&r);
+    r.crc = esp_rom_crc32_le(0, raw + BODY_OFFSET, sizeof(Record) - BODY_OFFSET);
+
+    // body first, header last: the magic appears only over a complete record
+    const int64_t t0 = esp_timer_get_time();
+    if (s_fram->write_polled(s_base + BODY_OFFSET, raw + BODY_OFFSET, sizeof(Record) - BODY_OFFSET, true) != ESP_OK) return;
+    if (s_fram->write_polled(s_base, raw, BODY_OFFSET, true) != ESP_OK) return;
+    esp_rom_printf("FRAM crash record: %u bytes in %u us\n", (unsigned)sizeof(Record),
+                   (unsigned)(esp_timer_get_time() - t0));
+}
+
+esp_err_t CrashLog::load(FRAM &fram, FRAM::addr_t base, Record &out)
+{
+    ESP_RETURN_ON_ERROR(fram.read(base, &out, sizeof(Record)), TAG, "read record");
+    if (out.magic != MAGIC) return ESP_ERR_NOT_FOUND;
+    if (out.version != VERSION || out.len != sizeof(Record)) return ESP_ERR_INVALID_VERSION;
+    const uint8_t *raw = reinterpret_cast<const uint8_t *>(&out);
+    if (crc32(raw + BODY_OFFSET, sizeof(Record) - BODY_OFFSET) != out.crc) return ESP_ERR_INVALID_CRC;
+    out.frames = std::min<uint8_t>(out.frames, MAX_FRAMES);
+    out.log_len = std::min<uint8_t>(out.log_len, LOG_TAIL);
+    out.reason[REASON_LEN - 1] = '\0';
+    return ESP_OK;
+}
+
+esp_err_t CrashLog::clear(FRAM &fram, FRAM::addr_t base)
+{
+    const uint32_t magic = CLEARED;
+    return fram.write(base, &magic, sizeof(magic));
+}
+
+static const char *kind_name(uint8_t kind)
+{
+    static const char *const names[] = { "Debug", "Interrupt wdt", "Task wdt", "Abort", "Fault", "Cache error" };
+    return kind < sizeof(names) / sizeof(names[0]) ? names[kind] : "Unknown";
+}
+
+static const char *cause_name(uint32_t cause)
+{
+    switch (cause) {
+    case 0:  return "IllegalInstruction";
+    case 2:  return "InstructionFetchError";
+    case 3:  return "LoadStoreError";
+    case 6:  return "IntegerDivideByZero";
+    case 9:  return "LoadStoreAlignment";
+    case 20: return "InstFetchProhibited";
+    case 28: return "LoadProhibited";
+    case 29: return "StoreProhibited";
+    default: return "Exception";
+    }
+}
+
+void CrashLog::print(const Record &r)
+{
+    static const char *const reg_names[REG_COUNT] = {
+        "PC", "PS", "A0", "A1", "A2", "A3", "A4", "A5", "A6", "A7", "A8", "A9",
+        "A10", "A11", "A12", "A13", "A14", "A15", "SAR", "LBEG", "LEND", "LCOUNT",
+    };
+
+    ESP_LOGE(TAG, "Crash #%" PRIu32 " on core %u after %" PRIu32 " ms: %s (%s)",
+             r.seq, r.core, r.uptime_ms, kind_name(r.kind),
+             r.reason[0] ? r.reason : cause_name(r.exccause));
+    ESP_LOGE(TAG, "EXCCAUSE 0x%08" PRIx32 " EXCVADDR 0x%08" PRIx32, r.exccause, r.excvaddr);
+    for (size_t i = 0; i < REG_COUNT; i += 4) {
+        char line[96];
+        int n = 0;
+        for (size_t j = i; j < std::min(i + 4, REG_COUNT); ++j) {
+            n += snprintf(line + n, sizeof(line) - n, "%-7s: 0x%08" PRIx32 "  ", reg_names[j], r.regs[j]);
+        }
+        ESP_LOGE(TAG, "%s", line);
+    }
+
+    char bt[24 + MAX_FRAMES * 22];
+    int n = snprintf(bt, sizeof(bt), "Backtrace:");
+    for (size_t i = 0; i < r.frames; ++i) {
+        n += snprintf(bt + n, sizeof(bt) - n, " 0x%08" PRIx32 ":0x%08" PRIx32, r.backtrace[i][0], r.backtrace[i][1]);
+    }
+    ESP_LOGE(TAG, "%s", bt);
+
+    if (r.log_len) {
+        ESP_LOGE(TAG, "Log tail:\n%.*s", r.log_len, r.log);
+    }
+}
+
+} // namespace fram_store
+
+// link with -Wl,--wrap=esp_panic_handler: the record is written before IDF prints and reboots
+extern "C" void __real_esp_panic_handler(panic_info_t *info);
+
+extern "C" IRAM_ATTR void __wrap_esp_panic_handler(panic_info_t *info)
+{
+    fram_store::CrashLog::capture(info);
+    __real_esp_panic_handler(info);
+}
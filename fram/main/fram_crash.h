@@ -0,0 +1,100 @@
+/**
+ * @file fram_crash.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Crash record written to FRAM from the panic handler.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstdarg>
+#include "fram.h"
+#include "esp_err.h"
+
+namespace fram_store {
+
+/*
+  CrashLog
+  - one fixed record at base: [Record header{magic, version, len, seq, crc}][body]
+  - body: panic kind, exception cause, core, uptime, the exception frame
+    registers, up to MAX_FRAMES backtrace pc:sp pairs, the panic reason and
+    the last LOG_TAIL bytes of the app log
+  - capture() runs inside the panic handler (esp_panic_handler is wrapped at
+    link time): it only touches IRAM code, ROM functions and DRAM data and
+    writes through FRAM::write_polled(), body first and header last, so a
+    record is either complete or absent
+  - the record is written at write_hz (FRAM::set_panic_write_hz()), not at
+    the device clock; capture() prints the time the write took on the panic
+    console
+  - the log tail is a DRAM ring fed by an esp_log vprintf hook that forwards
+    to the previous sink
+  - at the next boot load() validates the record, print() decodes it in the
+    format idf.py monitor understands and clear() consumes it
+  - one record only: a new crash overwrites an unread one
+*/
+class CrashLog {
+public:
+    static constexpr size_t MAX_FRAMES = 16;
+    static constexpr size_t LOG_TAIL = 208;
+    static constexpr size_t REASON_LEN = 48;
+    static constexpr size_t REG_COUNT = 22;   ///< pc, ps, a0..a15, sar, lbeg, lend, lcount
+
+    struct Record {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t len;
+        uint32_t seq;
+        uint32_t crc;                     ///< crc32 of the bytes after this field
+        uint32_t uptime_ms;
+        uint8_t core;
+        uint8_t kind;                     ///< panic_exception_t
+        uint8_t frames;                   ///< valid backtrace entries
+        uint8_t log_len;
+        uint32_t exccause;
+        uint32_t excvaddr;
+        uint32_t regs[REG_COUNT];
+        uint32_t backtrace[MAX_FRAMES][2];  ///< pc, sp
+        char reason[REASON_LEN];
+        char log[LOG_TAIL];               ///< oldest byte first
+    };
+
+    static constexpr size_t REGION_SIZE = sizeof(Record);
+
+    /**
+     * @brief Arm the panic hook and start collecting the log tail.
+     * @param fram FRAM driver (initialized, must outlive the application).
+     * @param base First byte of the REGION_SIZE bytes reserved for the record.
+     * @param write_hz SCK of the record write (FRAM::set_panic_write_hz());
+     *                 lower it when the wiring does not carry 20 MHz.
+     */
+    static esp_err_t install(FRAM &fram, FRAM::addr_t base, int write_hz = FRAM::FRAM_MAX_CLOCK_HZ);
+
+    /**
+     * @brief Read the record left by the last crash.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if there is none,
+     *         ESP_ERR_INVALID_CRC if it is damaged.
+     */
+    static esp_err_t load(FRAM &fram, FRAM::addr_t base, Record &out);
+
+    /// Log a decoded record (registers, backtrace line, log tail).
+    static void print(const Record &r);
+
+    /// Mark the record as consumed.
+    static esp_err_t clear(FRAM &fram, FRAM::addr_t base);
+
+    /// Panic handler entry (IRAM), @p panic_info is the panic_info_t of the crash.
+    static void capture(const void *panic_info);
+
+private:
+    static constexpr uint32_t MAGIC = 0x48535243;   // 'CRSH'
+    static constexpr uint16_t VERSION = 1;
+    static constexpr size_t BODY_OFFSET = offsetof(Record, uptime_ms);
+
+    static int log_vprintf(const char *fmt, va_list ap);
+};
+
+} // namespace fram_store
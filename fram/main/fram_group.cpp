@@ -0,0 +1,91 @@
+/**
+ * @file fram_group.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_group.h"
+#include <algorithm>
+#include <vector>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_GROUP";
+
+namespace fram_store {
+
+GroupCommit::GroupCommit(FRAM &fram, TickType_t window, size_t max_batch)
+    : fram_(fram), window_(window), max_batch_(max_batch ? max_batch : 1)
+{
+    lock_ = xSemaphoreCreateMutex();
+}
+
+GroupCommit::~GroupCommit()
+{
+    if (lock_) vSemaphoreDelete(lock_);
+}
+
+esp_err_t GroupCommit::commit(const FRAM::Segment *writes, size_t n)
+{
+    ESP_RETURN_ON_FALSE(writes && n && n <= MAX_WRITES, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    ESP_RETURN_ON_FALSE(lock_, ESP_ERR_NO_MEM, TAG, "mutex");
+    Waiter me{writes, n, xTaskGetCurrentTaskHandle(), ESP_OK, false, false};
+
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    queue_.push_back(&me);
+    me.lead = !busy_;
+    busy_ = true;
+    xSemaphoreGive(lock_);
+
+    // followers sleep until their batch is written or they are handed the next one
+    while (!me.done && !me.lead) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (me.done) return me.err;
+    return lead(me);
+}
+
+esp_err_t GroupCommit::lead(Waiter &me)
+{
+    if (window_) vTaskDelay(window_);
+
+    // the leader is always at the front, so it is part of its own batch
+    std::vector<Waiter *> batch;
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    const size_t k = std::min(max_batch_, queue_.size());
+    batch.assign(queue_.begin(), queue_.begin() + k);
+    queue_.erase(queue_.begin(), queue_.begin() + k);
+    xSemaphoreGive(lock_);
+
+    std::vector<FRAM::Segment> segs;
+    segs.reserve(k * MAX_WRITES);
+    for (const Waiter *w : batch) segs.insert(segs.end(), w->writes, w->writes + w->n);
+    const esp_err_t err = fram_.write_batch(segs.data(), segs.size());
+    if (err != ESP_OK) ESP_LOGW(TAG, "batch of %u commits: %s", (unsigned)k, esp_err_to_name(err));
+
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    ++stats_.batches;
+    stats_.commits += k;
+    stats_.max_batch = std::max<uint32_t>(stats_.max_batch, k);
+    Waiter *next = queue_.empty() ? nullptr : queue_.front();
+    if (!next) busy_ = false;
+    xSemaphoreGive(lock_);
+
+    for (Waiter *w : batch) {
+        if (w == &me) continue;
+        // the waiter may return as soon as done is set
+        TaskHandle_t task = w->task;
+        w->err = err;
+        w->done = true;
+        xTaskNotifyGive(task);
+    }
+    if (next) {
+        TaskHandle_t task = next->task;
+        next->lead = true;
+        xTaskNotifyGive(task);
+    }
+    return err;
+}
+
+} // namespace fram_store
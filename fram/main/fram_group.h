@@ -0,0 +1,94 @@
+/**
+ * @file fram_group.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Group commit of concurrent store commits into one FRAM batch.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include "fram.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+namespace fram_store {
+
+/*
+  GroupCommit
+  - shared by the stores on one FRAM; a Persistent attached with
+    set_group() hands its commit (the whole slot, one write) to commit()
+    instead of writing it itself
+  - the first committer becomes the leader: it waits `window` ticks for
+    others to join, takes up to max_batch queued commits and writes all of
+    them with one FRAM::write_batch() (one bus acquisition, WREN + WRITE
+    pairs queued back to back, one WRDI), then wakes every waiter with the
+    result of the batch
+  - commits that arrive while a batch is on the wire queue up and the first
+    of them leads the next batch, so batches grow with the number of
+    concurrent committers even with window 0
+  - commits keep their arrival order in a batch and the writes of one
+    commit keep theirs, so an ordered commit (e.g. data, then the record
+    that validates it) stays ordered
+  - waiters sleep on their task notification (ulTaskNotifyTake): do not
+    commit from a task that uses it for something else
+*/
+class GroupCommit {
+public:
+    /// writes per commit
+    static constexpr size_t MAX_WRITES = 4;
+
+    struct Stats {
+        uint32_t commits;       ///< commits written
+        uint32_t batches;       ///< write_batch() calls
+        uint32_t max_batch;     ///< most commits in one batch
+    };
+
+    /**
+     * @param window    Ticks the leader waits for more commits (0 = batch only
+     *                  what queued up during the previous batch).
+     * @param max_batch Commits per batch.
+     */
+    explicit GroupCommit(FRAM &fram, TickType_t window = 0, size_t max_batch = 8);
+    ~GroupCommit();
+
+    /**
+     * @brief Write @p n ranges, in order, as part of the next batch.
+     * @return ESP_OK once the ranges are in FRAM, otherwise the error of the batch.
+     * @note The ranges must stay valid until the call returns.
+     */
+    esp_err_t commit(const FRAM::Segment *writes, size_t n);
+
+    Stats stats() const { return stats_; }
+
+    GroupCommit(const GroupCommit&) = delete;
+    GroupCommit& operator=(const GroupCommit&) = delete;
+
+private:
+    struct Waiter {
+        const FRAM::Segment *writes;
+        size_t n;
+        TaskHandle_t task;
+        esp_err_t err;
+        volatile bool done;
+        volatile bool lead;
+    };
+
+    esp_err_t lead(Waiter &me);
+
+    FRAM &fram_;
+    TickType_t window_;
+    size_t max_batch_;
+    SemaphoreHandle_t lock_{nullptr};
+    std::deque<Waiter *> queue_;        ///< commits not yet taken by a leader
+    bool busy_{false};                  ///< a leader is active
+    Stats stats_{};
+};
+
+} // namespace fram_store
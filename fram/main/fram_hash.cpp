@@ -0,0 +1,407 @@
+/**
+ * @file fram_hash.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_hash.h"
+#include "fram_store.h"
+#include <algorithm>
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_HASH";
+
+namespace fram_store {
+
+#pragma pack(push,1)
+struct TableHeader {
+    uint32_t magic;
+    uint16_t capacity;
+    uint8_t key_size;
+    uint8_t val_size;
+    uint32_t reserved;
+    uint32_t crc;       // crc32 over the preceding fields
+};
+
+struct IntentHeader {
+    uint16_t magic;     // INTENT_MAGIC while the intent is pending
+    uint16_t reserved;
+    uint32_t crc;       // crc32 over dst, src and the entry image
+    uint16_t dst;
+    uint16_t src;
+};
+#pragma pack(pop)
+
+static constexpr uint32_t TABLE_MAGIC = 0x46485431;  // 'FHT1'
+static constexpr uint16_t INTENT_MAGIC = 0x4849;     // 'HI'
+static constexpr size_t IMAGE_MAX = 4 + HashTable::MAX_KEY + HashTable::MAX_VALUE;
+static constexpr size_t SCAN_CHUNK = 256;
+
+HashTable::HashTable(FRAM &fram, FRAM::addr_t base, size_t size, uint8_t key_size, uint8_t val_size)
+    : fram_(fram), base_(base), size_(size), key_size_(key_size), val_size_(val_size)
+{
+    size_t fixed = sizeof(TableHeader) + sizeof(IntentHeader) + entry_size();
+    capacity_ = size > fixed ? std::min<size_t>((size - fixed) / entry_size(), NO_SLOT) : 0;
+    intent_addr_ = static_cast<FRAM::addr_t>(base + sizeof(TableHeader));
+    table_base_ = static_cast<FRAM::addr_t>(intent_addr_ + sizeof(IntentHeader) + entry_size());
+}
+
+FRAM::addr_t HashTable::slot_addr(size_t slot) const
+{
+    return static_cast<FRAM::addr_t>(table_base_ + slot * entry_size());
+}
+
+size_t HashTable::home(const uint8_t *key) const
+{
+    uint32_t h = 2166136261u;   // FNV-1a
+    for (size_t i = 0; i < key_size_; ++i) {
+        h ^= key[i];
+        h *= 16777619u;
+    }
+    return h % capacity_;
+}
+
+uint16_t HashTable::image_crc(const uint8_t *image) const
+{
+    return static_cast<uint16_t>(crc32(image + 4, key_size_ + val_size_));
+}
+
+esp_err_t HashTable::format()
+{
+    ESP_LOGI(TAG, "formatting region 0x%04X: %u buckets of %u bytes", base_, (unsigned)capacity_, (unsigned)entry_size());
+    ESP_RETURN_ON_ERROR(fram_.fill(intent_addr_, 0, slot_addr(capacity_) - intent_addr_), TAG, "clear");
+
+    TableHeader h;
+    h.magic = TABLE_MAGIC;
+    h.capacity = static_cast<uint16_t>(capacity_);
+    h.key_size = key_size_;
+    h.val_size = val_size_;
+    h.reserved = 0;
+    h.crc = crc32(&h, offsetof(TableHeader, crc));
+    ESP_RETURN_ON_ERROR(fram_.write(base_, &h, sizeof(h)), TAG, "header");
+
+    live_ = tombs_ = 0;
+    cursor_ = 0;
+    return ESP_OK;
+}
+
+esp_err_t HashTable::mount()
+{
+    ESP_RETURN_ON_FALSE(key_size_ > 0 && key_size_ <= MAX_KEY && val_size_ <= MAX_VALUE,
+                        ESP_ERR_INVALID_ARG, TAG, "bad entry geometry");
+    ESP_RETURN_ON_FALSE(capacity_ >= 2 && (uint32_t)slot_addr(capacity_) <= FRAM::FRAM_SIZE_BYTES &&
+                        (uint32_t)base_ + size_ <= FRAM::FRAM_SIZE_BYTES,
+                        ESP_ERR_INVALID_SIZE, TAG, "bad region");
+
+    TableHeader h;
+    ESP_RETURN_ON_ERROR(fram_.read(base_, &h, sizeof(h)), TAG, "read header");
+    if (h.magic != TABLE_MAGIC || h.crc != crc32(&h, offsetof(TableHeader, crc)) ||
+        h.capacity != capacity_ || h.key_size != key_size_ || h.val_size != val_size_) {
+        ESP_RETURN_ON_ERROR(format(), TAG, "format");
+        mounted_ = true;
+        return ESP_OK;
+    }
+
+    ESP_RETURN_ON_ERROR(replay_intent(), TAG, "replay intent");
+
+    // count live and dead buckets, a chunk of buckets per read
+    live_ = tombs_ = 0;
+    uint8_t buf[SCAN_CHUNK];
+    const size_t per_read = std::max<size_t>(1, SCAN_CHUNK / entry_size());
+    for (size_t s = 0; s < capacity_; s += per_read) {
+        size_t n = std::min(per_read, capacity_ - s);
+        ESP_RETURN_ON_ERROR(fram_.read(slot_addr(s), buf, n * entry_size()), TAG, "scan");
+        for (size_t i = 0; i < n; ++i) {
+            const uint8_t *e = buf + i * entry_size();
+            uint16_t crc;
+            memcpy(&crc, e + 2, sizeof(crc));
+            if (e[0] == VALID && crc == image_crc(e)) ++live_;
+            else if (e[0] != EMPTY) ++tombs_;
+        }
+    }
+    ESP_LOGI(TAG, "mounted: %u live, %u tombstones, %u buckets",
+             (unsigned)live_, (unsigned)tombs_, (unsigned)capacity_);
+    cursor_ = 0;
+    mounted_ = true;
+    return ESP_OK;
+}
+
+esp_err_t HashTable::read_slot(size_t slot, uint8_t *image, uint8_t &state)
+{
+    ESP_RETURN_ON_ERROR(fram_.read(slot_addr(slot), image, entry_size()), TAG, "read bucket %u", (unsigned)slot);
+    state = image[0];
+    if (state == VALID) {
+        uint16_t crc;
+        memcpy(&crc, image + 2, sizeof(crc));
+        if (crc != image_crc(image)) {
+            ++crc_errors_;
+            state = TOMBSTONE;
+        }
+    } else if (state != EMPTY) {
+        state = TOMBSTONE;
+    }
+    return ESP_OK;
+}
+
+esp_err_t HashTable::find(const uint8_t *key, size_t &slot, size_t &free, bool &free_empty, uint8_t *image)
+{
+    slot = free = NO_SLOT;
+    free_empty = false;
+    size_t s = home(key);
+    uint32_t probes = 0;
+    esp_err_t err = ESP_OK;
+    for (size_t n = 0; n < capacity_; ++n, s = (s + 1) % capacity_) {
+        uint8_t state;
+        ++probes;
+        if ((err = read_slot(s, image, state)) != ESP_OK) break;
+        if (state == EMPTY) {
+            if (free == NO_SLOT) {
+                free = s;
+                free_empty = true;
+            }
+            break;
+        }
+        if (state == VALID && memcmp(image + 4, key, key_size_) == 0) {
+            slot = s;
+            break;
+        }
+        if (state == TOMBSTONE && free == NO_SLOT) free = s;
+    }
+    ++lookups_;
+    probes_ += probes;
+    max_probe_ = std::max(max_probe_, probes);
+    return err;
+}
+
+esp_err_t HashTable::set_state(size_t slot, uint8_t state)
+{
+    return fram_.write(slot_addr(slot), &state, 1);
+}
+
+esp_err_t HashTable::apply_intent(size_t dst, size_t src, const uint8_t *image)
+{
+    uint8_t buf[sizeof(IntentHeader) + IMAGE_MAX];
+    IntentHeader ih{INTENT_MAGIC, 0, 0, static_cast<uint16_t>(dst), static_cast<uint16_t>(src)};
+    memcpy(buf, &ih, sizeof(ih));
+    memcpy(buf + sizeof(ih), image, entry_size());
+    ih.crc = crc32(buf + offsetof(IntentHeader, dst), 4 + entry_size());
+    memcpy(buf, &ih, sizeof(ih));
+
+    // redo record first, then the table, then retire the record. The body goes
+    // out before the magic: retiring clears only the magic, so a record whose
+    // magic landed without its body would pass the CRC with the old body
+    constexpr size_t body = offsetof(IntentHeader, reserved);
+    ESP_RETURN_ON_ERROR(fram_.write(static_cast<FRAM::addr_t>(intent_addr_ + body), buf + body,
+                                    sizeof(ih) + entry_size() - body), TAG, "intent");
+    ESP_RETURN_ON_ERROR(fram_.write(intent_addr_, buf, body), TAG, "intent magic");
+    ESP_RETURN_ON_ERROR(fram_.write(slot_addr(dst), image, entry_size()), TAG, "bucket");
+    if (src != NO_SLOT) ESP_RETURN_ON_ERROR(set_state(src, TOMBSTONE), TAG, "tombstone");
+    const uint16_t none = 0;
+    return fram_.write(intent_addr_, &none, sizeof(none));
+}
+
+esp_err_t HashTable::replay_intent()
+{
+    uint8_t buf[sizeof(IntentHeader) + IMAGE_MAX];
+    ESP_RETURN_ON_ERROR(fram_.read(intent_addr_, buf, sizeof(IntentHeader) + entry_size()), TAG, "read intent");
+    IntentHeader ih;
+    memcpy(&ih, buf, sizeof(ih));
+    if (ih.magic != INTENT_MAGIC) return ESP_OK;
+    if (ih.crc != crc32(buf + offsetof(IntentHeader, dst), 4 + entry_size()) ||
+        ih.dst >= capacity_ || (ih.src != NO_SLOT && ih.src >= capacity_)) {
+        // torn before the table was touched
+        const uint16_t none = 0;
+        return fram_.write(intent_addr_, &none, sizeof(none));
+    }
+    ESP_LOGW(TAG, "replaying interrupted update of bucket %u", ih.dst);
+    return apply_intent(ih.dst, ih.src, buf + sizeof(IntentHeader));
+}
+
+esp_err_t HashTable::pad_key(std::string_view key, uint8_t *out) const
+{
+    ESP_RETURN_ON_FALSE(key.size() <= key_size_, ESP_ERR_INVALID_SIZE, TAG, "key too long");
+    memset(out, 0, key_size_);
+    memcpy(out, key.data(), key.size());
+    return ESP_OK;
+}
+
+esp_err_t HashTable::put(const void *key, const void *value)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(key && (value || val_size_ == 0), ESP_ERR_INVALID_ARG, TAG, "bad args");
+
+    uint8_t image[IMAGE_MAX];
+    image[0] = VALID;
+    image[1] = 0;
+    memcpy(image + 4, key, key_size_);
+    if (val_size_) memcpy(image + 4 + key_size_, value, val_size_);
+    uint16_t crc = image_crc(image);
+    memcpy(image + 2, &crc, sizeof(crc));
+
+    uint8_t cur[IMAGE_MAX];
+    size_t slot, free;
+    bool free_empty;
+    ESP_RETURN_ON_ERROR(find(image + 4, slot, free, free_empty, cur), TAG, "probe");
+
+    if (slot != NO_SLOT) {
+        if (memcmp(cur, image, entry_size()) == 0) return ESP_OK;
+        return apply_intent(slot, NO_SLOT, image);
+    }
+
+    // keep 1/8 of the buckets and at least one EMPTY so that misses terminate
+    ESP_RETURN_ON_FALSE(free != NO_SLOT && live_ < capacity_ - capacity_ / 8 &&
+                        (!free_empty || live_ + tombs_ + 1 < capacity_),
+                        ESP_ERR_NO_MEM, TAG, "table full (%u live, %u tombstones)", (unsigned)live_, (unsigned)tombs_);
+
+    // body first, the state byte commits the entry
+    ESP_RETURN_ON_ERROR(fram_.write(static_cast<FRAM::addr_t>(slot_addr(free) + 1), image + 1, entry_size() - 1), TAG, "bucket");
+    ESP_RETURN_ON_ERROR(set_state(free, VALID), TAG, "commit");
+    ++live_;
+    if (!free_empty) --tombs_;
+    return ESP_OK;
+}
+
+esp_err_t HashTable::put(std::string_view key, const void *value)
+{
+    uint8_t k[MAX_KEY];
+    ESP_RETURN_ON_ERROR(pad_key(key, k), TAG, "key");
+    return put(k, value);
+}
+
+esp_err_t HashTable::get(const void *key, void *value)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(key, ESP_ERR_INVALID_ARG, TAG, "bad args");
+
+    uint8_t image[IMAGE_MAX];
+    size_t slot, free;
+    bool free_empty;
+    ESP_RETURN_ON_ERROR(find(static_cast<const uint8_t *>(key), slot, free, free_empty, image), TAG, "probe");
+    if (slot == NO_SLOT) return ESP_ERR_NOT_FOUND;
+    if (value && val_size_) memcpy(value, image + 4 + key_size_, val_size_);
+    return ESP_OK;
+}
+
+esp_err_t HashTable::get(std::string_view key, void *value)
+{
+    uint8_t k[MAX_KEY];
+    ESP_RETURN_ON_ERROR(pad_key(key, k), TAG, "key");
+    return get(k, value);
+}
+
+esp_err_t HashTable::remove(const void *key)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(key, ESP_ERR_INVALID_ARG, TAG, "bad args");
+
+    uint8_t image[IMAGE_MAX];
+    size_t slot, free;
+    bool free_empty;
+    ESP_RETURN_ON_ERROR(find(static_cast<const uint8_t *>(key), slot, free, free_empty, image), TAG, "probe");
+    if (slot == NO_SLOT) return ESP_ERR_NOT_FOUND;
+    ESP_RETURN_ON_ERROR(set_state(slot, TOMBSTONE), TAG, "tombstone");
+    --live_;
+    ++tombs_;
+    return ESP_OK;
+}
+
+esp_err_t HashTable::remove(std::string_view key)
+{
+    uint8_t k[MAX_KEY];
+    ESP_RETURN_ON_ERROR(pad_key(key, k), TAG, "key");
+    return remove(k);
+}
+
+esp_err_t HashTable::chain_needs(size_t slot, bool &needed)
+{
+    uint8_t image[IMAGE_MAX];
+    needed = false;
+    for (size_t p = (slot + 1) % capacity_; p != slot; p = (p + 1) % capacity_) {
+        uint8_t state;
+        ESP_RETURN_ON_ERROR(read_slot(p, image, state), TAG, "scan cluster");
+        if (state == EMPTY) return ESP_OK;
+        if (state != VALID) continue;
+        size_t h = home(image + 4);
+        // slot lies on the probe path [h, p) of this entry
+        if ((slot + capacity_ - h) % capacity_ < (p + capacity_ - h) % capacity_) {
+            needed = true;
+            return ESP_OK;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t HashTable::rehash_step(size_t max_buckets, bool *done)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    if (done) *done = false;
+
+    uint8_t image[IMAGE_MAX], probe[IMAGE_MAX];
+    for (size_t n = 0; n < max_buckets; ++n) {
+        size_t s = cursor_;
+        uint8_t state;
+        ESP_RETURN_ON_ERROR(read_slot(s, image, state), TAG, "rehash read");
+
+        if (state == VALID) {
+            // move the entry to the first reusable bucket of its probe path
+            for (size_t j = home(image + 4); j != s; j = (j + 1) % capacity_) {
+                uint8_t js;
+                ESP_RETURN_ON_ERROR(read_slot(j, probe, js), TAG, "rehash probe");
+                if (js == VALID) continue;
+                ESP_RETURN_ON_ERROR(apply_intent(j, s, image), TAG, "move");
+                if (js == EMPTY) ++tombs_;
+                ++moved_;
+                pass_changed_ = true;
+                break;
+            }
+        } else if (state == TOMBSTONE) {
+            bool needed;
+            ESP_RETURN_ON_ERROR(chain_needs(s, needed), TAG, "chain");
+            if (!needed) {
+                ESP_RETURN_ON_ERROR(set_state(s, EMPTY), TAG, "clear tombstone");
+                --tombs_;
+                pass_changed_ = true;
+            }
+        }
+
+        cursor_ = (s + 1) % capacity_;
+        if (cursor_ == 0) {
+            if (!pass_changed_) {
+                if (done) *done = true;
+                return ESP_OK;
+            }
+            pass_changed_ = false;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t HashTable::probe_stats(ProbeStats &out)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    out = ProbeStats{};
+    uint8_t image[IMAGE_MAX];
+    for (size_t s = 0; s < capacity_; ++s) {
+        uint8_t state;
+        ESP_RETURN_ON_ERROR(read_slot(s, image, state), TAG, "scan");
+        if (state != VALID) continue;
+        size_t len = (s + capacity_ - home(image + 4)) % capacity_ + 1;
+        ++out.live;
+        out.total += len;
+        out.max = static_cast<uint16_t>(std::max<size_t>(out.max, len));
+        ++out.hist[std::min(len, PROBE_HIST) - 1];
+    }
+    return ESP_OK;
+}
+
+HashTable::Stats HashTable::stats() const
+{
+    return Stats{capacity_, live_, tombs_, lookups_, probes_, max_probe_, crc_errors_, moved_};
+}
+
+} // namespace fram_store
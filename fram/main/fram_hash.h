@@ -0,0 +1,147 @@
+/**
+ * @file fram_hash.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Open-addressing hash table stored entirely in FRAM.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+#include "fram.h"
+#include "esp_err.h"
+
+namespace fram_store {
+
+/*
+  HashTable
+  - region layout: [TableHeader][Intent + entry image][buckets]
+  - bucket: [state u8][reserved u8][crc16][key key_size][value val_size],
+    linear probing from fnv1a(key) % capacity
+  - nothing but a few counters is kept in RAM; a hit at the home bucket
+    costs one SPI read
+  - insert writes key/value/crc first and flips the state byte to VALID last;
+    remove flips it to TOMBSTONE (single-byte writes are atomic on FRAM)
+  - an update in place and a rehash move go through the intent record
+    (redo log), which mount() replays after a crash
+  - rehash_step() migrates entries towards their home bucket in bounded
+    steps and turns tombstones no probe chain needs back into EMPTY
+*/
+class HashTable {
+public:
+    static constexpr size_t MAX_KEY = 32;
+    static constexpr size_t MAX_VALUE = 64;
+    static constexpr size_t PROBE_HIST = 8;   ///< last histogram bucket is ">= PROBE_HIST"
+
+    struct Stats {
+        size_t capacity;
+        size_t live;
+        size_t tombstones;
+        uint32_t lookups;
+        uint32_t probes;       ///< buckets read by lookups
+        uint32_t max_probe;    ///< longest lookup seen
+        uint32_t crc_errors;   ///< VALID buckets that failed the CRC check
+        uint32_t moved;        ///< entries relocated by rehash_step()
+    };
+
+    struct ProbeStats {
+        size_t live;
+        size_t total;          ///< sum of probe lengths of all live entries
+        uint16_t max;
+        uint16_t hist[PROBE_HIST];   ///< hist[n-1] = entries found after n probes
+    };
+
+    /**
+     * @brief Construct a hash table over a FRAM region.
+     * @param fram     FRAM driver (initialized).
+     * @param base     First byte of the region.
+     * @param size     Region size in bytes.
+     * @param key_size Fixed key length (shorter string keys are zero-padded).
+     * @param val_size Fixed value length.
+     */
+    HashTable(FRAM &fram, FRAM::addr_t base, size_t size, uint8_t key_size, uint8_t val_size);
+
+    /**
+     * @brief Check the header, replay a pending intent and count the buckets.
+     * @return ESP_OK on success. A region with a different geometry is formatted.
+     */
+    esp_err_t mount();
+
+    /// Empty the table.
+    esp_err_t format();
+
+    /**
+     * @brief Insert or replace an entry.
+     * @param key   key_size bytes.
+     * @param value val_size bytes.
+     * @return ESP_OK, ESP_ERR_NO_MEM if the table is at its load limit.
+     */
+    esp_err_t put(const void *key, const void *value);
+    esp_err_t put(std::string_view key, const void *value);
+
+    /**
+     * @brief Look up an entry.
+     * @param[out] value val_size bytes, may be nullptr to test presence.
+     * @return ESP_OK or ESP_ERR_NOT_FOUND.
+     */
+    esp_err_t get(const void *key, void *value);
+    esp_err_t get(std::string_view key, void *value);
+
+    /// Delete an entry. ESP_ERR_NOT_FOUND if absent.
+    esp_err_t remove(const void *key);
+    esp_err_t remove(std::string_view key);
+
+    /**
+     * @brief Run one bounded rehash step.
+     * @param max_buckets Number of buckets visited by this call.
+     * @param[out] done   Set to true after a full pass that changed nothing.
+     * @return ESP_OK on success, otherwise an esp_err_t error code.
+     */
+    esp_err_t rehash_step(size_t max_buckets, bool *done = nullptr);
+
+    /// Probe-length distribution of the live entries (scans the table).
+    esp_err_t probe_stats(ProbeStats &out);
+
+    Stats stats() const;
+    size_t capacity() const { return capacity_; }
+
+private:
+    enum : uint8_t { EMPTY = 0x00, VALID = 0xA5, TOMBSTONE = 0x5A };
+    static constexpr uint16_t NO_SLOT = 0xFFFF;
+
+    size_t entry_size() const { return 4 + key_size_ + val_size_; }
+    FRAM::addr_t slot_addr(size_t slot) const;
+    size_t home(const uint8_t *key) const;
+    uint16_t image_crc(const uint8_t *image) const;
+
+    /// reads a bucket; returns its effective state (a VALID bucket with a bad crc reads as TOMBSTONE)
+    esp_err_t read_slot(size_t slot, uint8_t *image, uint8_t &state);
+    /// finds key; slot = bucket of the key or NO_SLOT, free = first reusable bucket on the way
+    esp_err_t find(const uint8_t *key, size_t &slot, size_t &free, bool &free_empty, uint8_t *image);
+    esp_err_t set_state(size_t slot, uint8_t state);
+    /// atomically writes image to dst and, if src != NO_SLOT, tombstones src
+    esp_err_t apply_intent(size_t dst, size_t src, const uint8_t *image);
+    esp_err_t replay_intent();
+    /// true if a live entry further along the cluster probes through slot
+    esp_err_t chain_needs(size_t slot, bool &needed);
+    esp_err_t pad_key(std::string_view key, uint8_t *out) const;
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    size_t size_;
+    uint8_t key_size_, val_size_;
+    size_t capacity_{0};
+    FRAM::addr_t intent_addr_{0}, table_base_{0};
+
+    bool mounted_{false};
+    size_t live_{0}, tombs_{0};
+    size_t cursor_{0};
+    bool pass_changed_{false};
+    uint32_t lookups_{0}, probes_{0}, max_probe_{0}, crc_errors_{0}, moved_{0};
+};
+
+} // namespace fram_store
@@ -0,0 +1,85 @@
+/**
+ * @file fram_id.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_id.h"
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_ID";
+
+namespace fram_store {
+
+IdAllocator::IdAllocator(FRAM &fram, FRAM::addr_t base, uint32_t lease_size, uint32_t first)
+    : store_(fram, base, 2), lease_size_(lease_size ? lease_size : 1), first_(first)
+{
+    lock_ = xSemaphoreCreateMutex();
+}
+
+IdAllocator::~IdAllocator()
+{
+    if (lock_) vSemaphoreDelete(lock_);
+}
+
+esp_err_t IdAllocator::mount()
+{
+    ESP_RETURN_ON_FALSE(lock_, ESP_ERR_NO_MEM, TAG, "mutex");
+    uint32_t end = 0;
+    esp_err_t err = store_.load(end);
+    if (err == ESP_ERR_NOT_FOUND) {
+        end = first_;
+    } else {
+        ESP_RETURN_ON_ERROR(err, TAG, "load lease");
+    }
+    // nothing is leased yet: the first next() commits [end, end + lease_size)
+    start_ = end;
+    next_.store(end, std::memory_order_relaxed);
+    limit_.store(end, std::memory_order_release);
+    mounted_ = true;
+    ESP_LOGI(TAG, "resuming at %u", (unsigned)end);
+    return ESP_OK;
+}
+
+esp_err_t IdAllocator::extend(uint32_t id)
+{
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    // another task may have extended the lease while we waited
+    while (err == ESP_OK && id >= limit_.load(std::memory_order_acquire)) {
+        uint32_t limit = limit_.load(std::memory_order_relaxed);
+        if (limit > UINT32_MAX - lease_size_) {
+            err = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        uint32_t end = limit + lease_size_;
+        err = store_.store_immediate(end);
+        if (err == ESP_OK) {
+            limit_.store(end, std::memory_order_release);
+            ++commits_;
+        }
+    }
+    xSemaphoreGive(lock_);
+    return err;
+}
+
+esp_err_t IdAllocator::next(uint32_t &id)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    uint32_t v = next_.fetch_add(1, std::memory_order_relaxed);
+    if (v < limit_.load(std::memory_order_acquire) && v >= start_) {
+        id = v;
+        return ESP_OK;
+    }
+    // v is ours alone; it is only returned once a commit covers it
+    ESP_RETURN_ON_FALSE(v >= start_, ESP_ERR_INVALID_STATE, TAG, "ID space exhausted");
+    ESP_RETURN_ON_ERROR(extend(v), TAG, "lease commit");
+    id = v;
+    return ESP_OK;
+}
+
+} // namespace fram_store
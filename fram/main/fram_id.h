@@ -0,0 +1,84 @@
+/**
+ * @file fram_id.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Monotonic ID allocator persisted in leased blocks.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include "fram.h"
+#include "fram_store.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+namespace fram_store {
+
+/*
+  IdAllocator
+  - region layout: [Persistent<Lease> x2 slots]
+  - the persisted value is the end of the current lease: every ID below it
+    may have been handed out already
+  - next() is an atomic increment of a RAM counter; only the call that
+    crosses the lease end commits a new end (one small FRAM write per
+    lease_size IDs)
+  - mount() resumes at the persisted end, so the unused rest of the lease
+    that was active at reset is skipped and IDs never repeat
+*/
+class IdAllocator {
+public:
+    /// bytes occupied in FRAM
+    static constexpr size_t REGION_SIZE = 2 * (sizeof(Header) + sizeof(uint32_t));
+
+    /**
+     * @brief Construct an allocator.
+     * @param fram       FRAM driver (initialized).
+     * @param base       First byte of the region (REGION_SIZE bytes).
+     * @param lease_size IDs covered by one commit.
+     * @param first      First ID issued on a blank region.
+     */
+    IdAllocator(FRAM &fram, FRAM::addr_t base, uint32_t lease_size = 64, uint32_t first = 1);
+    ~IdAllocator();
+
+    /**
+     * @brief Load the lease end; allocation resumes there.
+     * @return ESP_OK on success, otherwise an esp_err_t error code.
+     */
+    esp_err_t mount();
+
+    /**
+     * @brief Allocate the next ID. Safe to call from several tasks.
+     * @return ESP_OK, ESP_ERR_INVALID_STATE when the 32-bit ID space is exhausted,
+     *         or the FRAM error of a failed lease commit (that ID is never reused).
+     */
+    esp_err_t next(uint32_t &id);
+
+    /// End of the current lease (first ID not yet covered by a commit).
+    uint32_t lease_end() const { return limit_.load(std::memory_order_acquire); }
+    /// Lease commits since mount().
+    uint32_t commits() const { return commits_; }
+
+    IdAllocator(const IdAllocator&) = delete;
+    IdAllocator& operator=(const IdAllocator&) = delete;
+
+private:
+    esp_err_t extend(uint32_t id);
+
+    Persistent<uint32_t> store_;
+    uint32_t lease_size_;
+    uint32_t first_;
+    uint32_t start_{0};                 ///< first ID of this boot, a smaller value means wrap-around
+    std::atomic<uint32_t> next_{0};
+    std::atomic<uint32_t> limit_{0};
+    uint32_t commits_{0};
+    bool mounted_{false};
+    SemaphoreHandle_t lock_{nullptr};   ///< serializes lease commits only
+};
+
+} // namespace fram_store
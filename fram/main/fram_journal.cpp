@@ -0,0 +1,363 @@
+/**
+ * @file fram_journal.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_journal.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_JOURNAL";
+
+namespace fram_store {
+
+#pragma pack(push,1)
+struct JournalRec {
+    uint16_t magic;
+    uint8_t  file;
+    uint8_t  reserved;
+    uint16_t len;
+    uint16_t reserved2;
+    uint32_t seq;
+    uint32_t foff;      // target offset in the file
+    uint32_t crc;       // crc32 over header (crc=0) and data
+};
+#pragma pack(pop)
+
+static constexpr uint16_t JOURNAL_REC_MAGIC = 0x4A52; // 'JR'
+static constexpr size_t CHECKPOINT_SLOTS = 2;
+
+AppendJournal::AppendJournal(FRAM &fram, FRAM::addr_t base, size_t size)
+    : fram_(fram),
+      checkpoint_(fram, base, CHECKPOINT_SLOTS, 1),
+      ring_base_(static_cast<FRAM::addr_t>(base + CHECKPOINT_SLOTS * (sizeof(Header) + sizeof(Checkpoint)))),
+      ring_size_(size - CHECKPOINT_SLOTS * (sizeof(Header) + sizeof(Checkpoint)))
+{}
+
+AppendJournal::~AppendJournal()
+{
+    stop();
+    if (space_) vSemaphoreDelete(space_);
+    if (drain_lock_) vSemaphoreDelete(drain_lock_);
+    if (lock_) vSemaphoreDelete(lock_);
+}
+
+esp_err_t AppendJournal::add_file(uint8_t id, const char *path)
+{
+    ESP_RETURN_ON_FALSE(!mounted_, ESP_ERR_INVALID_STATE, TAG, "already mounted");
+    ESP_RETURN_ON_FALSE(id < MAX_FILES && path && *path, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    files_[id].path = path;
+    return ESP_OK;
+}
+
+esp_err_t AppendJournal::ring_read(uint32_t off, void *buf, size_t len)
+{
+    uint8_t *p = static_cast<uint8_t *>(buf);
+    size_t first = std::min(len, ring_size_ - off);
+    FRAM::WriteWindow window(fram_);
+    ESP_RETURN_ON_ERROR(window.status(), TAG, "write window");
+    ESP_RETURN_ON_ERROR(fram_.read(ring_base_ + off, p, first), TAG, "ring read");
+    if (first < len) ESP_RETURN_ON_ERROR(fram_.read(ring_base_, p + first, len - first), TAG, "ring read");
+    return ESP_OK;
+}
+
+esp_err_t AppendJournal::ring_write(uint32_t off, const void *buf, size_t len)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(buf);
+    size_t first = std::min(len, ring_size_ - off);
+    ESP_RETURN_ON_ERROR(fram_.write(ring_base_ + off, p, first), TAG, "ring write");
+    if (first < len) ESP_RETURN_ON_ERROR(fram_.write(ring_base_, p + first, len - first), TAG, "ring write");
+    return ESP_OK;
+}
+
+esp_err_t AppendJournal::read_record(uint32_t off, uint32_t seq, uint8_t &id, uint32_t &foff,
+                                     std::string &data, size_t &rec_len)
+{
+    JournalRec h;
+    ESP_RETURN_ON_ERROR(ring_read(off, &h, sizeof(h)), TAG, "read rec");
+    if (h.magic != JOURNAL_REC_MAGIC || h.seq != seq || h.file >= MAX_FILES ||
+        h.len == 0 || h.len > ring_size_ / 2) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    data.resize(h.len);
+    ESP_RETURN_ON_ERROR(ring_read((off + sizeof(h)) % ring_size_, data.data(), h.len), TAG, "read data");
+
+    uint32_t crc = h.crc;
+    h.crc = 0;
+    std::vector<uint8_t> tmp(sizeof(h) + h.len);
+    memcpy(tmp.data(), &h, sizeof(h));
+    memcpy(tmp.data() + sizeof(h), data.data(), h.len);
+    if (crc32(tmp.data(), tmp.size()) != crc) return ESP_ERR_NOT_FOUND;
+
+    id = h.file;
+    foff = h.foff;
+    rec_len = sizeof(h) + h.len;
+    return ESP_OK;
+}
+
+esp_err_t AppendJournal::mount()
+{
+    ESP_RETURN_ON_FALSE(!mounted_, ESP_ERR_INVALID_STATE, TAG, "already mounted");
+    ESP_RETURN_ON_FALSE(ring_size_ > 2 * sizeof(JournalRec) && ring_size_ < FRAM::FRAM_SIZE_BYTES &&
+                        (uint32_t)ring_base_ + ring_size_ <= FRAM::FRAM_SIZE_BYTES,
+                        ESP_ERR_INVALID_SIZE, TAG, "bad region");
+
+    if (!lock_) lock_ = xSemaphoreCreateMutex();
+    if (!drain_lock_) drain_lock_ = xSemaphoreCreateMutex();
+    if (!space_) space_ = xSemaphoreCreateCounting(UINT16_MAX, 0);
+    ESP_RETURN_ON_FALSE(lock_ && drain_lock_ && space_, ESP_ERR_NO_MEM, TAG, "semaphores");
+
+    Checkpoint cp;
+    if (checkpoint_.load(cp) != ESP_OK || cp.tail >= ring_size_) {
+        ESP_LOGI(TAG, "no checkpoint, starting empty journal");
+        cp = Checkpoint{0, 1};
+        ESP_RETURN_ON_ERROR(checkpoint_.store_immediate(cp), TAG, "checkpoint");
+    }
+    tail_ = cp.tail;
+    tail_seq_ = cp.seq;
+
+    for (auto &f : files_) {
+        struct stat st;
+        if (!f.path.empty() && stat(f.path.c_str(), &st) == 0) f.size = static_cast<uint32_t>(st.st_size);
+    }
+
+    // find the head and the logical file sizes
+    uint32_t off = tail_, seq = tail_seq_;
+    size_t used = 0;
+    std::string data;
+    for (;;) {
+        uint8_t id;
+        uint32_t foff;
+        size_t rec_len;
+        if (read_record(off, seq, id, foff, data, rec_len) != ESP_OK) break;
+        if (used + rec_len > ring_size_) break;
+        if (files_[id].path.empty()) {
+            ESP_LOGW(TAG, "record for unregistered file %u, stopping replay", id);
+            break;
+        }
+        files_[id].size = std::max<uint32_t>(files_[id].size, foff + data.size());
+        used += rec_len;
+        off = (off + rec_len) % ring_size_;
+        ++seq;
+    }
+    head_ = off;
+    head_seq_ = seq;
+    used_ = used;
+    mounted_ = true;
+
+    stats_.replayed = head_seq_ - tail_seq_;
+    if (stats_.replayed) {
+        ESP_LOGI(TAG, "replaying %u records (%u bytes)", (unsigned)stats_.replayed, (unsigned)used_);
+        ESP_RETURN_ON_ERROR(drain(), TAG, "replay");
+    }
+    return ESP_OK;
+}
+
+esp_err_t AppendJournal::append(uint8_t id, const void *data, size_t len, TickType_t wait)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(id < MAX_FILES && !files_[id].path.empty() && data && len &&
+                        len <= ring_size_ / 2 && len <= UINT16_MAX,
+                        ESP_ERR_INVALID_ARG, TAG, "bad args");
+    const size_t rec_len = sizeof(JournalRec) + len;
+
+    for (;;) {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        if (used_ + rec_len <= ring_size_) break;
+        ++stats_.full_waits;
+        if (!task_) {
+            xSemaphoreGive(lock_);
+            ESP_RETURN_ON_ERROR(drain(), TAG, "inline drain");
+            continue;
+        }
+        // counted while still under lock_, so the next drain() hands this writer a token
+        ++waiters_;
+        xSemaphoreGive(lock_);
+        xTaskNotifyGive(task_);
+        if (xSemaphoreTake(space_, wait) != pdTRUE) {
+            // still counted, or a drain() gave our token in the meantime: take back whichever
+            xSemaphoreTake(lock_, portMAX_DELAY);
+            if (waiters_) {
+                --waiters_;
+            } else {
+                (void)xSemaphoreTake(space_, 0);
+            }
+            xSemaphoreGive(lock_);
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+
+    std::vector<uint8_t> rec(rec_len);
+    JournalRec h;
+    h.magic = JOURNAL_REC_MAGIC;
+    h.file = id;
+    h.reserved = 0;
+    h.len = static_cast<uint16_t>(len);
+    h.reserved2 = 0;
+    h.seq = head_seq_;
+    h.foff = files_[id].size;
+    h.crc = 0;
+    memcpy(rec.data(), &h, sizeof(h));
+    memcpy(rec.data() + sizeof(h), data, len);
+    h.crc = crc32(rec.data(), rec_len);
+    memcpy(rec.data() + offsetof(JournalRec, crc), &h.crc, sizeof(h.crc));
+
+    esp_err_t err = ring_write(head_, rec.data(), rec_len);
+    if (err == ESP_OK) {
+        head_ = (head_ + rec_len) % ring_size_;
+        ++head_seq_;
+        used_ += rec_len;
+        files_[id].size += len;
+        ++stats_.appends;
+    }
+    bool kick = used_ > ring_size_ / 2;
+    xSemaphoreGive(lock_);
+
+    if (kick && task_) xTaskNotifyGive(task_);
+    return err;
+}
+
+esp_err_t AppendJournal::apply(uint32_t from, uint32_t from_seq, uint32_t to_seq,
+                               uint32_t &end, uint32_t &bytes, uint32_t &count)
+{
+    std::array<FILE *, MAX_FILES> fp{};
+    int run_id = -1;
+    uint32_t run_off = 0;
+    std::string run, data;
+    esp_err_t err = ESP_OK;
+
+    auto write_run = [&]() -> esp_err_t {
+        if (run_id < 0 || run.empty()) return ESP_OK;
+        FILE *&f = fp[run_id];
+        if (!f) f = fopen(files_[run_id].path.c_str(), "r+b");
+        if (!f) f = fopen(files_[run_id].path.c_str(), "w+b");
+        ESP_RETURN_ON_FALSE(f, ESP_FAIL, TAG, "open %s", files_[run_id].path.c_str());
+
+        // a file shorter than the record offset (deleted or truncated) is padded
+        ESP_RETURN_ON_FALSE(fseek(f, 0, SEEK_END) == 0, ESP_FAIL, TAG, "seek");
+        long cur = ftell(f);
+        for (; cur >= 0 && static_cast<uint32_t>(cur) < run_off; ++cur) fputc(0, f);
+        ESP_RETURN_ON_FALSE(fseek(f, run_off, SEEK_SET) == 0, ESP_FAIL, TAG, "seek");
+        ESP_RETURN_ON_FALSE(fwrite(run.data(), 1, run.size(), f) == run.size(), ESP_FAIL, TAG, "fwrite");
+        ++stats_.file_writes;
+        run.clear();
+        run_id = -1;
+        return ESP_OK;
+    };
+
+    uint32_t off = from, seq = from_seq;
+    bytes = 0;
+    count = 0;
+    while (seq != to_seq) {
+        uint8_t id;
+        uint32_t foff;
+        size_t rec_len;
+        err = read_record(off, seq, id, foff, data, rec_len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "journal record %u unreadable", (unsigned)seq);
+            err = ESP_ERR_INVALID_CRC;
+            break;
+        }
+        bool contiguous = (id == run_id) && (foff == run_off + run.size()) && (run.size() + data.size() <= COALESCE_MAX);
+        if (!contiguous) {
+            if ((err = write_run()) != ESP_OK) break;
+            run_id = id;
+            run_off = foff;
+        }
+        run.append(data);
+        off = (off + rec_len) % ring_size_;
+        bytes += rec_len;
+        ++seq;
+        ++count;
+    }
+    if (err == ESP_OK) err = write_run();
+
+    // fclose commits the data to flash; the checkpoint may only move after that
+    for (FILE *f : fp) {
+        if (f && fclose(f) != 0 && err == ESP_OK) err = ESP_FAIL;
+    }
+    end = off;
+    return err;
+}
+
+esp_err_t AppendJournal::drain()
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    xSemaphoreTake(drain_lock_, portMAX_DELAY);
+
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    uint32_t from = tail_, from_seq = tail_seq_, to_seq = head_seq_;
+    xSemaphoreGive(lock_);
+
+    esp_err_t err = ESP_OK;
+    if (from_seq != to_seq) {
+        uint32_t end = 0, bytes = 0, count = 0;
+        err = apply(from, from_seq, to_seq, end, bytes, count);
+        if (err == ESP_OK) err = checkpoint_.store_immediate(Checkpoint{end, to_seq});
+        if (err == ESP_OK) {
+            xSemaphoreTake(lock_, portMAX_DELAY);
+            tail_ = end;
+            tail_seq_ = to_seq;
+            used_ -= bytes;
+            ++stats_.drains;
+            xSemaphoreGive(lock_);
+            ESP_LOGD(TAG, "drained %u records, %u bytes", (unsigned)count, (unsigned)bytes);
+        }
+    }
+
+    // one token per waiting writer, none when nobody waits: a stale token
+    // would let a later writer skip its wait
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    const uint32_t waiters = waiters_;
+    waiters_ = 0;
+    xSemaphoreGive(lock_);
+    xSemaphoreGive(drain_lock_);
+    for (uint32_t i = 0; i < waiters; ++i) xSemaphoreGive(space_);
+    return err;
+}
+
+void AppendJournal::task_entry(void *arg)
+{
+    auto *self = static_cast<AppendJournal *>(arg);
+    while (self->running_) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(self->period_ms_));
+        if (!self->running_) break;
+        esp_err_t err = self->drain();
+        if (err != ESP_OK) ESP_LOGW(TAG, "drain failed: %s", esp_err_to_name(err));
+    }
+    self->task_ = nullptr;
+    vTaskDelete(nullptr);
+}
+
+esp_err_t AppendJournal::start(uint32_t period_ms, UBaseType_t prio, BaseType_t core)
+{
+    ESP_RETURN_ON_FALSE(mounted_ && !task_, ESP_ERR_INVALID_STATE, TAG, "bad state");
+    period_ms_ = period_ms;
+    running_ = true;
+    BaseType_t ok = xTaskCreatePinnedToCore(task_entry, "fram_journal", 4096, this, prio, &task_, core);
+    if (ok != pdPASS) {
+        running_ = false;
+        task_ = nullptr;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void AppendJournal::stop()
+{
+    if (!task_) return;
+    running_ = false;
+    xTaskNotifyGive(task_);
+    while (task_) vTaskDelay(1);
+}
+
+} // namespace fram_store
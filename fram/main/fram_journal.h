@@ -0,0 +1,142 @@
+/**
+ * @file fram_journal.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief FRAM write-ahead journal for small appends to flash files.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <string>
+#include "fram.h"
+#include "fram_store.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+namespace fram_store {
+
+/*
+  AppendJournal
+  - region layout: [Persistent<Checkpoint> x2 slots][ring]
+  - append() writes one record [JournalRec][data] into the ring and returns;
+    the data is durable once the FRAM write completes
+  - each record carries the target file offset, so applying it is idempotent
+    (fseek + fwrite); replay after a crash simply applies everything after the
+    checkpoint again
+  - drain() coalesces contiguous records of a file into large fwrite calls,
+    closes the files and then advances the checkpoint
+  - start() runs drain() in a background task, woken periodically or when the
+    ring is half full
+*/
+class AppendJournal {
+public:
+    static constexpr size_t MAX_FILES = 4;
+    /// largest single fwrite issued while draining
+    static constexpr size_t COALESCE_MAX = 4096;
+
+    struct Stats {
+        uint32_t appends;
+        uint32_t drains;
+        uint32_t file_writes;    ///< fwrite calls issued to flash
+        uint32_t replayed;       ///< records re-applied at mount
+        uint32_t full_waits;     ///< appends that had to wait for space
+    };
+
+    /**
+     * @brief Construct a journal over a FRAM region.
+     * @param fram FRAM driver (initialized).
+     * @param base First byte of the region.
+     * @param size Region size in bytes (checkpoint + ring).
+     */
+    AppendJournal(FRAM &fram, FRAM::addr_t base, size_t size);
+    ~AppendJournal();
+
+    /**
+     * @brief Bind a file id to a path on a mounted filesystem.
+     * @note Must be called for every id before mount(). The file is only
+     *       written through the journal afterwards.
+     */
+    esp_err_t add_file(uint8_t id, const char *path);
+
+    /**
+     * @brief Load the checkpoint and replay records not yet applied to the files.
+     * @return ESP_OK on success, otherwise an esp_err_t error code.
+     */
+    esp_err_t mount();
+
+    /**
+     * @brief Durably append data to a file (FRAM only, no flash access).
+     * @param id   File id registered with add_file().
+     * @param data Bytes to append.
+     * @param len  Number of bytes, at most ring capacity / 2.
+     * @param wait How long to wait for space when the ring is full.
+     * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_TIMEOUT if the ring stayed full.
+     */
+    esp_err_t append(uint8_t id, const void *data, size_t len, TickType_t wait = portMAX_DELAY);
+
+    /// Apply all journaled records to the files and advance the checkpoint.
+    esp_err_t drain();
+
+    /**
+     * @brief Start the background drain task.
+     * @param period_ms Drain at least this often even if the ring is not half full.
+     */
+    esp_err_t start(uint32_t period_ms = 1000, UBaseType_t prio = 2, BaseType_t core = tskNO_AFFINITY);
+
+    /// Stop the background task (pending records stay journaled).
+    void stop();
+
+    size_t pending_bytes() const { return used_; }
+    size_t capacity() const { return ring_size_; }
+    Stats stats() const { return stats_; }
+
+    AppendJournal(const AppendJournal&) = delete;
+    AppendJournal& operator=(const AppendJournal&) = delete;
+
+private:
+    struct Checkpoint {
+        uint32_t tail;      ///< ring offset of the oldest unapplied record
+        uint32_t seq;       ///< its sequence number
+    };
+
+    struct FileSlot {
+        std::string path;
+        uint32_t size{0};   ///< logical size including journaled data
+    };
+
+    esp_err_t ring_read(uint32_t off, void *buf, size_t len);
+    esp_err_t ring_write(uint32_t off, const void *buf, size_t len);
+    /// reads record at off; returns ESP_ERR_NOT_FOUND at the end of the log
+    esp_err_t read_record(uint32_t off, uint32_t seq, uint8_t &id, uint32_t &foff, std::string &data, size_t &rec_len);
+    esp_err_t apply(uint32_t from, uint32_t from_seq, uint32_t to_seq, uint32_t &end, uint32_t &bytes, uint32_t &count);
+    static void task_entry(void *arg);
+
+    FRAM &fram_;
+    Persistent<Checkpoint> checkpoint_;
+    FRAM::addr_t ring_base_;
+    size_t ring_size_;
+
+    std::array<FileSlot, MAX_FILES> files_;
+    uint32_t tail_{0}, tail_seq_{1};
+    uint32_t head_{0}, head_seq_{1};
+    size_t used_{0};
+    bool mounted_{false};
+    Stats stats_{};
+
+    SemaphoreHandle_t lock_{nullptr};        ///< protects head/tail state and FRAM ring writes
+    SemaphoreHandle_t drain_lock_{nullptr};  ///< serializes drain()
+    SemaphoreHandle_t space_{nullptr};       ///< counting; one token per waiter after a drain
+    uint32_t waiters_{0};                    ///< writers blocked on space_ (under lock_)
+    TaskHandle_t task_{nullptr};
+    uint32_t period_ms_{1000};
+    volatile bool running_{false};
+};
+
+} // namespace fram_store
@@ -0,0 +1,322 @@
+/**
+ * @file fram_kv.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_kv.h"
+#include "fram_store.h"
+#include <vector>
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_KV";
+
+namespace fram_store {
+
+#pragma pack(push,1)
+struct BankHeader {
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t reserved;
+    uint32_t crc;       // crc32 over the preceding fields
+};
+
+struct RecHeader {
+    uint16_t magic;
+    uint8_t  type;
+    uint8_t  name_len;
+    uint16_t val_len;
+    uint16_t reserved;
+    uint32_t gen;       // must match the bank generation
+    uint32_t crc;       // crc32 over header (crc=0), name and value
+};
+#pragma pack(pop)
+
+static constexpr uint32_t KV_BANK_MAGIC = 0x464B5631; // 'FKV1'
+static constexpr uint16_t KV_REC_MAGIC  = 0x4B56;     // 'KV'
+
+KvStore::KvStore(FRAM &fram, FRAM::addr_t base, size_t size)
+    : fram_(fram), base_(base), bank_size_(size / 2)
+{}
+
+std::string KvStore::make_name(std::string_view ns, std::string_view key)
+{
+    std::string name;
+    name.reserve(ns.size() + 1 + key.size());
+    name.append(ns);
+    name.push_back('\0');
+    name.append(key);
+    return name;
+}
+
+FRAM::addr_t KvStore::bank_addr(uint8_t bank) const
+{
+    return static_cast<FRAM::addr_t>(base_ + bank * bank_size_);
+}
+
+esp_err_t KvStore::read_bank_gen(uint8_t bank, uint32_t &gen)
+{
+    BankHeader h;
+    ESP_RETURN_ON_ERROR(fram_.read(bank_addr(bank), &h, sizeof(h)), TAG, "read bank hdr");
+    if (h.magic != KV_BANK_MAGIC || crc32(&h, offsetof(BankHeader, crc)) != h.crc) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    gen = h.gen;
+    return ESP_OK;
+}
+
+esp_err_t KvStore::write_bank_header(uint8_t bank, uint32_t gen)
+{
+    BankHeader h;
+    h.magic = KV_BANK_MAGIC;
+    h.gen = gen;
+    h.reserved = 0;
+    h.crc = crc32(&h, offsetof(BankHeader, crc));
+    FRAM::WriteWindow window(fram_);
+    ESP_RETURN_ON_ERROR(window.status(), TAG, "write window");
+    return fram_.write(bank_addr(bank), &h, sizeof(h));
+}
+
+esp_err_t KvStore::mount()
+{
+    ESP_RETURN_ON_FALSE(bank_size_ > sizeof(BankHeader) + sizeof(RecHeader), ESP_ERR_INVALID_SIZE, TAG, "region too small");
+    ESP_RETURN_ON_FALSE((uint32_t)base_ + 2 * bank_size_ <= FRAM::FRAM_SIZE_BYTES, ESP_ERR_INVALID_ARG, TAG, "region out of range");
+
+    uint32_t g0 = 0, g1 = 0;
+    bool v0 = read_bank_gen(0, g0) == ESP_OK;
+    bool v1 = read_bank_gen(1, g1) == ESP_OK;
+
+    if (!v0 && !v1) {
+        ESP_LOGI(TAG, "formatting region 0x%04X (%u bytes)", base_, (unsigned)(2 * bank_size_));
+        ESP_RETURN_ON_ERROR(write_bank_header(0, 1), TAG, "format");
+        bank_ = 0;
+        gen_ = 1;
+    } else if (v0 && (!v1 || g0 > g1)) {
+        bank_ = 0;
+        gen_ = g0;
+    } else {
+        bank_ = 1;
+        gen_ = g1;
+    }
+
+    ESP_RETURN_ON_ERROR(scan(), TAG, "scan");
+    mounted_ = true;
+    return ESP_OK;
+}
+
+esp_err_t KvStore::scan()
+{
+    index_.clear();
+    live_ = 0;
+    size_t off = sizeof(BankHeader);
+    std::vector<uint8_t> rec;
+
+    while (off + sizeof(RecHeader) <= bank_size_) {
+        RecHeader h;
+        ESP_RETURN_ON_ERROR(fram_.read(bank_addr(bank_) + off, &h, sizeof(h)), TAG, "read rec");
+        if (h.magic != KV_REC_MAGIC || h.gen != gen_ || h.name_len == 0) break;
+        size_t rec_len = sizeof(RecHeader) + h.name_len + h.val_len;
+        if (off + rec_len > bank_size_) break;
+
+        rec.resize(rec_len);
+        ESP_RETURN_ON_ERROR(fram_.read(bank_addr(bank_) + off, rec.data(), rec_len), TAG, "read rec");
+        uint32_t crc = h.crc;
+        reinterpret_cast<RecHeader *>(rec.data())->crc = 0;
+        if (crc32(rec.data(), rec_len) != crc) break;
+
+        std::string name(reinterpret_cast<const char *>(rec.data() + sizeof(RecHeader)), h.name_len);
+        auto it = index_.find(name);
+        if (it != index_.end()) {
+            live_ -= sizeof(RecHeader) + name.size() + it->second.len;
+            index_.erase(it);
+        }
+        if (static_cast<KvType>(h.type) != KvType::ERASED) {
+            index_[name] = Entry{static_cast<KvType>(h.type), h.val_len, static_cast<uint16_t>(off)};
+            live_ += rec_len;
+        }
+        off += rec_len;
+    }
+
+    tail_ = off;
+    ESP_LOGI(TAG, "mounted bank %u gen %u: %u keys, %u/%u bytes used",
+             bank_, (unsigned)gen_, (unsigned)index_.size(), (unsigned)tail_, (unsigned)bank_size_);
+    return ESP_OK;
+}
+
+esp_err_t KvStore::append(uint8_t bank, uint32_t gen, size_t &tail, const std::string &name,
+                          KvType type, const void *data, size_t len)
+{
+    size_t rec_len = sizeof(RecHeader) + name.size() + len;
+    if (tail + rec_len > bank_size_) return ESP_ERR_NO_MEM;
+
+    // whole record goes out in one transfer
+    std::vector<uint8_t> rec(rec_len);
+    RecHeader h;
+    h.magic = KV_REC_MAGIC;
+    h.type = static_cast<uint8_t>(type);
+    h.name_len = static_cast<uint8_t>(name.size());
+    h.val_len = static_cast<uint16_t>(len);
+    h.reserved = 0;
+    h.gen = gen;
+    h.crc = 0;
+    memcpy(rec.data(), &h, sizeof(h));
+    memcpy(rec.data() + sizeof(h), name.data(), name.size());
+    if (len) memcpy(rec.data() + sizeof(h) + name.size(), data, len);
+    h.crc = crc32(rec.data(), rec_len);
+    memcpy(rec.data() + offsetof(RecHeader, crc), &h.crc, sizeof(h.crc));
+
+    FRAM::WriteWindow window(fram_);
+    ESP_RETURN_ON_ERROR(window.status(), TAG, "write window");
+    ESP_RETURN_ON_ERROR(fram_.write(bank_addr(bank) + tail, rec.data(), rec_len), TAG, "write rec");
+    tail += rec_len;
+    return ESP_OK;
+}
+
+esp_err_t KvStore::set(std::string_view ns, std::string_view key, KvType type, const void *data, size_t len)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(!ns.empty() && !key.empty() && ns.size() + key.size() <= MAX_NAME_LEN,
+                        ESP_ERR_INVALID_ARG, TAG, "bad name");
+    ESP_RETURN_ON_FALSE(type != KvType::ERASED && (data || len == 0) && len <= UINT16_MAX,
+                        ESP_ERR_INVALID_ARG, TAG, "bad args");
+
+    std::string name = make_name(ns, key);
+    size_t rec_len = sizeof(RecHeader) + name.size() + len;
+    auto it = index_.find(name);
+    size_t old_len = (it != index_.end()) ? sizeof(RecHeader) + name.size() + it->second.len : 0;
+
+    if (tail_ + rec_len > bank_size_) {
+        if (live_ - old_len + rec_len + sizeof(BankHeader) > bank_size_) return ESP_ERR_NO_MEM;
+        ESP_RETURN_ON_ERROR(compact(), TAG, "compact");
+    }
+
+    size_t off = tail_;
+    ESP_RETURN_ON_ERROR(append(bank_, gen_, tail_, name, type, data, len), TAG, "append");
+    live_ = live_ - old_len + rec_len;
+    index_[name] = Entry{type, static_cast<uint16_t>(len), static_cast<uint16_t>(off)};
+    return ESP_OK;
+}
+
+esp_err_t KvStore::get(std::string_view ns, std::string_view key, KvType type, void *out, size_t *len)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+
+    auto it = index_.find(make_name(ns, key));
+    if (it == index_.end()) return ESP_ERR_NOT_FOUND;
+    const Entry &e = it->second;
+    if (e.type != type) return ESP_ERR_INVALID_STATE;
+
+    if (!out) {
+        *len = e.len;
+        return ESP_OK;
+    }
+    if (*len < e.len) {
+        *len = e.len;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *len = e.len;
+    if (e.len == 0) return ESP_OK;
+    size_t val_off = e.off + sizeof(RecHeader) + it->first.size();
+    return fram_.read(bank_addr(bank_) + val_off, out, e.len);
+}
+
+esp_err_t KvStore::erase(std::string_view ns, std::string_view key)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    std::string name = make_name(ns, key);
+    auto it = index_.find(name);
+    if (it == index_.end()) return ESP_ERR_NOT_FOUND;
+
+    size_t tomb_len = sizeof(RecHeader) + name.size();
+    if (tail_ + tomb_len > bank_size_) {
+        // dropping the key during compaction is enough, no tombstone needed
+        const Entry e = it->second;
+        const size_t live = live_;
+        live_ -= tomb_len + e.len;
+        index_.erase(it);
+        esp_err_t err = compact();
+        if (err != ESP_OK) {
+            // the old bank is still active and still holds the record
+            index_.emplace(std::move(name), e);
+            live_ = live;
+        }
+        return err;
+    }
+    ESP_RETURN_ON_ERROR(append(bank_, gen_, tail_, name, KvType::ERASED, nullptr, 0), TAG, "tombstone");
+    live_ -= tomb_len + it->second.len;
+    index_.erase(it);
+    return ESP_OK;
+}
+
+esp_err_t KvStore::erase_all(std::string_view ns)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    std::string prefix = make_name(ns, {});
+    std::vector<std::string> keys;
+    for (auto it = index_.lower_bound(prefix); it != index_.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        keys.push_back(it->first.substr(prefix.size()));
+    }
+    for (const auto &k : keys) {
+        ESP_RETURN_ON_ERROR(erase(ns, k), TAG, "erase");
+    }
+    return ESP_OK;
+}
+
+bool KvStore::has_namespace(std::string_view ns) const
+{
+    std::string prefix = make_name(ns, {});
+    auto it = index_.lower_bound(prefix);
+    return it != index_.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+}
+
+void KvStore::for_each(std::string_view ns,
+                       const std::function<void(std::string_view key, KvType type, size_t len)> &fn) const
+{
+    std::string prefix = make_name(ns, {});
+    for (auto it = index_.lower_bound(prefix); it != index_.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+        fn(std::string_view(it->first).substr(prefix.size()), it->second.type, it->second.len);
+    }
+}
+
+esp_err_t KvStore::compact()
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    uint8_t dst = bank_ ^ 1;
+    uint32_t dst_gen = gen_ + 1;
+    size_t dst_tail = sizeof(BankHeader);
+    std::map<std::string, Entry> moved;
+    std::vector<uint8_t> val;
+    // one window for the whole copy: the appends nest inside it
+    FRAM::WriteWindow window(fram_);
+    ESP_RETURN_ON_ERROR(window.status(), TAG, "write window");
+
+    // records first, bank header last: until the header lands the old bank stays active
+    for (const auto &[name, e] : index_) {
+        val.resize(e.len);
+        if (e.len) {
+            size_t val_off = e.off + sizeof(RecHeader) + name.size();
+            ESP_RETURN_ON_ERROR(fram_.read(bank_addr(bank_) + val_off, val.data(), e.len), TAG, "read val");
+        }
+        size_t off = dst_tail;
+        ESP_RETURN_ON_ERROR(append(dst, dst_gen, dst_tail, name, e.type, val.data(), e.len), TAG, "copy rec");
+        moved[name] = Entry{e.type, e.len, static_cast<uint16_t>(off)};
+    }
+    ESP_RETURN_ON_ERROR(write_bank_header(dst, dst_gen), TAG, "bank hdr");
+
+    ESP_LOGI(TAG, "compacted bank %u -> %u: %u -> %u bytes",
+             bank_, dst, (unsigned)tail_, (unsigned)dst_tail);
+    bank_ = dst;
+    gen_ = dst_gen;
+    tail_ = dst_tail;
+    live_ = dst_tail - sizeof(BankHeader);
+    index_ = std::move(moved);
+    return ESP_OK;
+}
+
+} // namespace fram_store
@@ -0,0 +1,131 @@
+/**
+ * @file fram_kv.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Small log-structured key-value engine on FRAM.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include "fram.h"
+#include "esp_err.h"
+
+namespace fram_store {
+
+/// Value types, numerically identical to nvs_type_t
+enum class KvType : uint8_t {
+    U8   = 0x01,
+    I8   = 0x11,
+    U16  = 0x02,
+    I16  = 0x12,
+    U32  = 0x04,
+    I32  = 0x14,
+    U64  = 0x08,
+    I64  = 0x18,
+    STR  = 0x21,
+    BLOB = 0x42,
+    ERASED = 0x00,   ///< tombstone record
+};
+
+/*
+  KvStore
+  - region [base, base+size) is split into two equal banks
+  - bank layout: [BankHeader][record][record]...
+  - record layout: [RecHeader][namespace '\0' key][value]
+  - every set/erase appends one record in a single SPI write; a torn
+    append fails its CRC and simply ends the log at the next mount
+  - when the active bank is full, live records are copied into the other
+    bank and its header (gen+1) is written last, so compaction is power-safe
+  - RAM index maps (namespace, key) -> value location
+*/
+class KvStore {
+public:
+    /// Maximum length of namespace + key (without separator)
+    static constexpr size_t MAX_NAME_LEN = 30;
+
+    /**
+     * @brief Construct a key-value store over a FRAM region.
+     * @param fram FRAM driver (must be initialized before mount()).
+     * @param base First byte of the region.
+     * @param size Region size in bytes (split into two banks).
+     */
+    KvStore(FRAM &fram, FRAM::addr_t base, size_t size);
+
+    /**
+     * @brief Scan the active bank and build the RAM index.
+     * @return ESP_OK on success. An unformatted region is formatted.
+     */
+    esp_err_t mount();
+
+    /**
+     * @brief Store a value (append a new record).
+     * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_NO_MEM when the value does
+     *         not fit even after compaction, or an SPI error.
+     */
+    esp_err_t set(std::string_view ns, std::string_view key, KvType type, const void *data, size_t len);
+
+    /**
+     * @brief Read a value.
+     * @param[out]   out Destination buffer, may be nullptr to query the length.
+     * @param[inout] len In: buffer size. Out: stored value length.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND, ESP_ERR_INVALID_STATE on type mismatch,
+     *         ESP_ERR_INVALID_SIZE if the buffer is too small.
+     */
+    esp_err_t get(std::string_view ns, std::string_view key, KvType type, void *out, size_t *len);
+
+    /// Remove one key (appends a tombstone). ESP_ERR_NOT_FOUND if missing.
+    esp_err_t erase(std::string_view ns, std::string_view key);
+
+    /// Remove all keys of a namespace.
+    esp_err_t erase_all(std::string_view ns);
+
+    /// true if at least one key exists in the namespace
+    bool has_namespace(std::string_view ns) const;
+
+    /// Visit every live key of a namespace (RAM index only, no SPI traffic).
+    void for_each(std::string_view ns,
+                  const std::function<void(std::string_view key, KvType type, size_t len)> &fn) const;
+
+    /// Copy live records into the other bank and switch to it.
+    esp_err_t compact();
+
+    bool mounted() const { return mounted_; }
+    size_t bank_size() const { return bank_size_; }
+    size_t used_bytes() const { return tail_; }
+    size_t live_bytes() const { return live_; }
+
+private:
+    struct Entry {
+        KvType type;
+        uint16_t len;     ///< value length
+        uint16_t off;     ///< record offset inside the active bank
+    };
+
+    static std::string make_name(std::string_view ns, std::string_view key);
+    FRAM::addr_t bank_addr(uint8_t bank) const;
+    esp_err_t read_bank_gen(uint8_t bank, uint32_t &gen);
+    esp_err_t write_bank_header(uint8_t bank, uint32_t gen);
+    esp_err_t append(uint8_t bank, uint32_t gen, size_t &tail, const std::string &name,
+                     KvType type, const void *data, size_t len);
+    esp_err_t scan();
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    size_t bank_size_;
+    uint8_t bank_{0};
+    uint32_t gen_{0};
+    size_t tail_{0};
+    size_t live_{0};
+    bool mounted_{false};
+    std::map<std::string, Entry> index_;
+};
+
+} // namespace fram_store
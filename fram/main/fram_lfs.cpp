@@ -0,0 +1,455 @@
+/**
+ * @file fram_lfs.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_lfs.h"
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_vfs.h"
+
+static const char *TAG = "FRAM_LFS";
+
+namespace fram_store {
+
+/* ---------------------------------------------------------------------
+ * Block device
+ * ------------------------------------------------------------------*/
+
+int LfsDevice::bd_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    auto *self = static_cast<LfsDevice *>(c->context);
+    FRAM::addr_t a = static_cast<FRAM::addr_t>(self->base_ + block * c->block_size + off);
+    return self->fram_.read(a, buffer, size) == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+int LfsDevice::bd_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    auto *self = static_cast<LfsDevice *>(c->context);
+    FRAM::addr_t a = static_cast<FRAM::addr_t>(self->base_ + block * c->block_size + off);
+    return self->fram_.write(a, buffer, size) == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+int LfsDevice::bd_erase(const struct lfs_config *, lfs_block_t)
+{
+    // FRAM overwrites in place, nothing to erase
+    return LFS_ERR_OK;
+}
+
+int LfsDevice::bd_sync(const struct lfs_config *)
+{
+    // writes are persistent when FRAM::write returns
+    return LFS_ERR_OK;
+}
+
+LfsDevice::LfsDevice(FRAM &fram, FRAM::addr_t base, size_t size, size_t block_size)
+    : fram_(fram), base_(base), size_(size)
+{
+    size_t blocks = block_size ? size / block_size : 0;
+    cfg_.context        = this;
+    cfg_.read           = bd_read;
+    cfg_.prog           = bd_prog;
+    cfg_.erase          = bd_erase;
+    cfg_.sync           = bd_sync;
+    cfg_.read_size      = 16;
+    cfg_.prog_size      = 16;
+    cfg_.block_size     = block_size;
+    cfg_.block_count    = blocks;
+    cfg_.block_cycles   = -1;          // no wear leveling needed
+    cfg_.cache_size     = 64;
+    cfg_.lookahead_size = ((blocks + 63) / 64) * 8;
+}
+
+LfsDevice::~LfsDevice()
+{
+    unregister_vfs();
+    unmount();
+    if (lock_) vSemaphoreDelete(lock_);
+}
+
+esp_err_t LfsDevice::mount(bool format_if_failed)
+{
+    ESP_RETURN_ON_FALSE(!mounted_, ESP_ERR_INVALID_STATE, TAG, "already mounted");
+    ESP_RETURN_ON_FALSE(cfg_.block_size >= 128 && cfg_.block_count >= 2 &&
+                        cfg_.block_size % cfg_.cache_size == 0 &&
+                        (uint32_t)base_ + cfg_.block_size * cfg_.block_count <= FRAM::FRAM_SIZE_BYTES,
+                        ESP_ERR_INVALID_SIZE, TAG, "bad geometry");
+    if (!lock_) {
+        lock_ = xSemaphoreCreateMutex();
+        ESP_RETURN_ON_FALSE(lock_, ESP_ERR_NO_MEM, TAG, "mutex");
+    }
+
+    int err = lfs_mount(&lfs_, &cfg_);
+    if (err != LFS_ERR_OK && format_if_failed) {
+        ESP_LOGW(TAG, "mount failed (%d), formatting %u blocks", err, (unsigned)cfg_.block_count);
+        err = lfs_format(&lfs_, &cfg_);
+        if (err == LFS_ERR_OK) err = lfs_mount(&lfs_, &cfg_);
+    }
+    ESP_RETURN_ON_FALSE(err == LFS_ERR_OK, ESP_FAIL, TAG, "lfs_mount: %d", err);
+    mounted_ = true;
+    return ESP_OK;
+}
+
+esp_err_t LfsDevice::format()
+{
+    ESP_RETURN_ON_FALSE(!mounted_, ESP_ERR_INVALID_STATE, TAG, "mounted");
+    int err = lfs_format(&lfs_, &cfg_);
+    ESP_RETURN_ON_FALSE(err == LFS_ERR_OK, ESP_FAIL, TAG, "lfs_format: %d", err);
+    return ESP_OK;
+}
+
+void LfsDevice::unmount()
+{
+    if (!mounted_) return;
+    for (auto &f : files_) {
+        if (!f) continue;
+        lfs_file_close(&lfs_, f);
+        delete f;
+        f = nullptr;
+    }
+    lfs_unmount(&lfs_);
+    mounted_ = false;
+}
+
+esp_err_t LfsDevice::info(size_t &total, size_t &used)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    lock();
+    lfs_ssize_t blocks = lfs_fs_size(&lfs_);
+    unlock();
+    ESP_RETURN_ON_FALSE(blocks >= 0, ESP_FAIL, TAG, "lfs_fs_size: %d", (int)blocks);
+    total = cfg_.block_size * cfg_.block_count;
+    used = cfg_.block_size * static_cast<size_t>(blocks);
+    return ESP_OK;
+}
+
+/* ---------------------------------------------------------------------
+ * VFS glue
+ * ------------------------------------------------------------------*/
+
+struct LfsDir {
+    DIR dir;            // must stay first, VFS fills dd_vfs_idx
+    lfs_dir_t ldir;
+    struct dirent entry;
+};
+
+struct LfsVfs {
+    static int to_errno(int err)
+    {
+        switch (err) {
+        case LFS_ERR_NOENT:       return ENOENT;
+        case LFS_ERR_EXIST:       return EEXIST;
+        case LFS_ERR_NOTDIR:      return ENOTDIR;
+        case LFS_ERR_ISDIR:       return EISDIR;
+        case LFS_ERR_NOTEMPTY:    return ENOTEMPTY;
+        case LFS_ERR_BADF:        return EBADF;
+        case LFS_ERR_FBIG:        return EFBIG;
+        case LFS_ERR_INVAL:       return EINVAL;
+        case LFS_ERR_NOSPC:       return ENOSPC;
+        case LFS_ERR_NOMEM:       return ENOMEM;
+        case LFS_ERR_NAMETOOLONG: return ENAMETOOLONG;
+        default:                  return EIO;
+        }
+    }
+
+    static int fail(int err)
+    {
+        errno = to_errno(err);
+        return -1;
+    }
+
+    static int to_lfs_flags(int flags)
+    {
+        int lf = 0;
+        switch (flags & O_ACCMODE) {
+        case O_RDONLY: lf = LFS_O_RDONLY; break;
+        case O_WRONLY: lf = LFS_O_WRONLY; break;
+        default:       lf = LFS_O_RDWR;   break;
+        }
+        if (flags & O_CREAT)  lf |= LFS_O_CREAT;
+        if (flags & O_EXCL)   lf |= LFS_O_EXCL;
+        if (flags & O_TRUNC)  lf |= LFS_O_TRUNC;
+        if (flags & O_APPEND) lf |= LFS_O_APPEND;
+        return lf;
+    }
+
+    static lfs_file_t *file(LfsDevice *d, int fd)
+    {
+        return (fd >= 0 && fd < static_cast<int>(LfsDevice::MAX_FILES)) ? d->files_[fd] : nullptr;
+    }
+
+    static int open(void *ctx, const char *path, int flags, int)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        int fd = -1;
+        for (size_t i = 0; i < LfsDevice::MAX_FILES; ++i) {
+            if (!d->files_[i]) {
+                fd = static_cast<int>(i);
+                break;
+            }
+        }
+        if (fd < 0) {
+            d->unlock();
+            errno = ENFILE;
+            return -1;
+        }
+        auto *f = new (std::nothrow) lfs_file_t{};
+        if (!f) {
+            d->unlock();
+            errno = ENOMEM;
+            return -1;
+        }
+        int err = lfs_file_open(&d->lfs_, f, path, to_lfs_flags(flags));
+        if (err < 0) {
+            delete f;
+            d->unlock();
+            return fail(err);
+        }
+        d->files_[fd] = f;
+        d->unlock();
+        return fd;
+    }
+
+    static int close(void *ctx, int fd)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        lfs_file_t *f = file(d, fd);
+        if (!f) {
+            d->unlock();
+            errno = EBADF;
+            return -1;
+        }
+        int err = lfs_file_close(&d->lfs_, f);
+        delete f;
+        d->files_[fd] = nullptr;
+        d->unlock();
+        return err < 0 ? fail(err) : 0;
+    }
+
+    static ssize_t read(void *ctx, int fd, void *dst, size_t size)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        lfs_file_t *f = file(d, fd);
+        lfs_ssize_t n = f ? lfs_file_read(&d->lfs_, f, dst, size) : LFS_ERR_BADF;
+        d->unlock();
+        return n < 0 ? fail(n) : n;
+    }
+
+    static ssize_t write(void *ctx, int fd, const void *data, size_t size)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        lfs_file_t *f = file(d, fd);
+        lfs_ssize_t n = f ? lfs_file_write(&d->lfs_, f, data, size) : LFS_ERR_BADF;
+        d->unlock();
+        return n < 0 ? fail(n) : n;
+    }
+
+    static off_t lseek(void *ctx, int fd, off_t offset, int whence)
+    {
+        int lw = (whence == SEEK_CUR) ? LFS_SEEK_CUR : (whence == SEEK_END) ? LFS_SEEK_END : LFS_SEEK_SET;
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        lfs_file_t *f = file(d, fd);
+        lfs_soff_t pos = f ? lfs_file_seek(&d->lfs_, f, offset, lw) : LFS_ERR_BADF;
+        d->unlock();
+        return pos < 0 ? fail(pos) : pos;
+    }
+
+    static int fsync(void *ctx, int fd)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        lfs_file_t *f = file(d, fd);
+        int err = f ? lfs_file_sync(&d->lfs_, f) : LFS_ERR_BADF;
+        d->unlock();
+        return err < 0 ? fail(err) : 0;
+    }
+
+    static int ftruncate(void *ctx, int fd, off_t length)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        lfs_file_t *f = file(d, fd);
+        int err = f ? lfs_file_truncate(&d->lfs_, f, length) : LFS_ERR_BADF;
+        d->unlock();
+        return err < 0 ? fail(err) : 0;
+    }
+
+    static int fstat(void *ctx, int fd, struct stat *st)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        lfs_file_t *f = file(d, fd);
+        lfs_soff_t size = f ? lfs_file_size(&d->lfs_, f) : LFS_ERR_BADF;
+        d->unlock();
+        if (size < 0) return fail(size);
+        memset(st, 0, sizeof(*st));
+        st->st_mode = S_IFREG | 0666;
+        st->st_size = size;
+        st->st_blksize = d->cfg_.block_size;
+        return 0;
+    }
+
+    static int stat(void *ctx, const char *path, struct stat *st)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        lfs_info info;
+        d->lock();
+        int err = lfs_stat(&d->lfs_, path, &info);
+        d->unlock();
+        if (err < 0) return fail(err);
+        memset(st, 0, sizeof(*st));
+        st->st_mode = (info.type == LFS_TYPE_DIR) ? (S_IFDIR | 0777) : (S_IFREG | 0666);
+        st->st_size = info.size;
+        st->st_blksize = d->cfg_.block_size;
+        return 0;
+    }
+
+    static int unlink(void *ctx, const char *path)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        int err = lfs_remove(&d->lfs_, path);
+        d->unlock();
+        return err < 0 ? fail(err) : 0;
+    }
+
+    static int rename(void *ctx, const char *src, const char *dst)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        int err = lfs_rename(&d->lfs_, src, dst);
+        d->unlock();
+        return err < 0 ? fail(err) : 0;
+    }
+
+    static int mkdir(void *ctx, const char *path, mode_t)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        d->lock();
+        int err = lfs_mkdir(&d->lfs_, path);
+        d->unlock();
+        return err < 0 ? fail(err) : 0;
+    }
+
+    static int rmdir(void *ctx, const char *path)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        lfs_info info;
+        d->lock();
+        // lfs_remove() takes files too; rmdir() must not
+        int err = lfs_stat(&d->lfs_, path, &info);
+        if (err >= 0 && info.type != LFS_TYPE_DIR) err = LFS_ERR_NOTDIR;
+        if (err >= 0) err = lfs_remove(&d->lfs_, path);
+        d->unlock();
+        return err < 0 ? fail(err) : 0;
+    }
+
+    static DIR *opendir(void *ctx, const char *path)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        auto *dir = new (std::nothrow) LfsDir{};
+        if (!dir) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        d->lock();
+        int err = lfs_dir_open(&d->lfs_, &dir->ldir, path);
+        d->unlock();
+        if (err < 0) {
+            delete dir;
+            fail(err);
+            return nullptr;
+        }
+        return &dir->dir;
+    }
+
+    static struct dirent *readdir(void *ctx, DIR *pdir)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        auto *dir = reinterpret_cast<LfsDir *>(pdir);
+        lfs_info info;
+        for (;;) {
+            d->lock();
+            int res = lfs_dir_read(&d->lfs_, &dir->ldir, &info);
+            d->unlock();
+            if (res <= 0) {
+                if (res < 0) fail(res);
+                return nullptr;
+            }
+            // hide the "." and ".." entries LittleFS reports
+            if (strcmp(info.name, ".") != 0 && strcmp(info.name, "..") != 0) break;
+        }
+        dir->entry.d_ino = 0;
+        dir->entry.d_type = (info.type == LFS_TYPE_DIR) ? DT_DIR : DT_REG;
+        strncpy(dir->entry.d_name, info.name, sizeof(dir->entry.d_name) - 1);
+        dir->entry.d_name[sizeof(dir->entry.d_name) - 1] = '\0';
+        return &dir->entry;
+    }
+
+    static int closedir(void *ctx, DIR *pdir)
+    {
+        auto *d = static_cast<LfsDevice *>(ctx);
+        auto *dir = reinterpret_cast<LfsDir *>(pdir);
+        d->lock();
+        int err = lfs_dir_close(&d->lfs_, &dir->ldir);
+        d->unlock();
+        delete dir;
+        return err < 0 ? fail(err) : 0;
+    }
+};
+
+esp_err_t LfsDevice::register_vfs(const char *base_path)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(base_path_.empty(), ESP_ERR_INVALID_STATE, TAG, "already registered");
+    ESP_RETURN_ON_FALSE(base_path && *base_path, ESP_ERR_INVALID_ARG, TAG, "bad args");
+
+    esp_vfs_t vfs = {};
+    vfs.flags       = ESP_VFS_FLAG_CONTEXT_PTR;
+    vfs.open_p      = &LfsVfs::open;
+    vfs.close_p     = &LfsVfs::close;
+    vfs.read_p      = &LfsVfs::read;
+    vfs.write_p     = &LfsVfs::write;
+    vfs.lseek_p     = &LfsVfs::lseek;
+    vfs.fsync_p     = &LfsVfs::fsync;
+    vfs.ftruncate_p = &LfsVfs::ftruncate;
+    vfs.fstat_p     = &LfsVfs::fstat;
+    vfs.stat_p      = &LfsVfs::stat;
+    vfs.unlink_p    = &LfsVfs::unlink;
+    vfs.rename_p    = &LfsVfs::rename;
+    vfs.mkdir_p     = &LfsVfs::mkdir;
+    vfs.rmdir_p     = &LfsVfs::rmdir;
+    vfs.opendir_p   = &LfsVfs::opendir;
+    vfs.readdir_p   = &LfsVfs::readdir;
+    vfs.closedir_p  = &LfsVfs::closedir;
+    ESP_RETURN_ON_ERROR(esp_vfs_register(base_path, &vfs, this), TAG, "esp_vfs_register");
+    base_path_ = base_path;
+    ESP_LOGI(TAG, "mounted at %s: %u blocks of %u bytes", base_path,
+             (unsigned)cfg_.block_count, (unsigned)cfg_.block_size);
+    return ESP_OK;
+}
+
+esp_err_t LfsDevice::unregister_vfs()
+{
+    if (base_path_.empty()) return ESP_OK;
+    ESP_RETURN_ON_ERROR(esp_vfs_unregister(base_path_.c_str()), TAG, "esp_vfs_unregister");
+    base_path_.clear();
+    return ESP_OK;
+}
+
+} // namespace fram_store
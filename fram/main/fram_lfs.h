@@ -0,0 +1,94 @@
+/**
+ * @file fram_lfs.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief LittleFS block device on FRAM with VFS registration.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <string>
+#include "lfs.h"
+#include "fram.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+namespace fram_store {
+
+/*
+  LfsDevice
+  - maps LittleFS blocks linearly onto [base, base+size) of the FRAM
+  - erase is a no-op and block_cycles is disabled: FRAM needs neither
+  - register_vfs() mounts the filesystem under a VFS path so that
+    fopen()/fwrite()/stat()/opendir() work as on esp_littlefs
+*/
+class LfsDevice {
+public:
+    static constexpr size_t MAX_FILES = 8;
+
+    /**
+     * @brief Construct a LittleFS device.
+     * @param fram       FRAM driver (initialized).
+     * @param base       First byte of the region.
+     * @param size       Region size in bytes (multiple of block_size, >= 2 blocks).
+     * @param block_size LittleFS block size (>= 128).
+     */
+    LfsDevice(FRAM &fram, FRAM::addr_t base, size_t size, size_t block_size = 128);
+    ~LfsDevice();
+
+    /**
+     * @brief Mount LittleFS, optionally formatting an unformatted region.
+     * @return ESP_OK, ESP_FAIL if the region holds no valid filesystem.
+     */
+    esp_err_t mount(bool format_if_failed = true);
+
+    /// Create an empty filesystem (unmounted state required).
+    esp_err_t format();
+
+    void unmount();
+
+    /**
+     * @brief Register the mounted filesystem with the VFS.
+     * @param base_path Mount point, e.g. "/fram".
+     * @return ESP_OK on success, otherwise an esp_err_t from esp_vfs_register.
+     */
+    esp_err_t register_vfs(const char *base_path);
+    esp_err_t unregister_vfs();
+
+    /// Filesystem usage in bytes.
+    esp_err_t info(size_t &total, size_t &used);
+
+    /// Raw LittleFS handle for direct lfs_* use (take lock() around calls).
+    lfs_t *fs() { return &lfs_; }
+    void lock() { xSemaphoreTake(lock_, portMAX_DELAY); }
+    void unlock() { xSemaphoreGive(lock_); }
+
+    LfsDevice(const LfsDevice&) = delete;
+    LfsDevice& operator=(const LfsDevice&) = delete;
+
+private:
+    static int bd_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size);
+    static int bd_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size);
+    static int bd_erase(const struct lfs_config *c, lfs_block_t block);
+    static int bd_sync(const struct lfs_config *c);
+
+    friend struct LfsVfs;
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    size_t size_;
+    lfs_config cfg_{};
+    lfs_t lfs_{};
+    bool mounted_{false};
+    SemaphoreHandle_t lock_{nullptr};
+    std::string base_path_;
+    std::array<lfs_file_t *, MAX_FILES> files_{};
+};
+
+} // namespace fram_store
@@ -0,0 +1,278 @@
+/**
+ * @file fram_logfmt.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Binary log record format shared by LogSink and the host decoder.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  Plain C++ without ESP-IDF dependencies, so tools/fram_logdecode.cpp can
+ *  include it on the host.
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace fram_store::logfmt {
+
+/*
+  Ring contents
+  - a sequence of batches, each [BatchHeader][records], never split at the
+    ring end; one batch is one flush window
+  - crc covers the header up to crc and the records, so a batch partially
+    overwritten by newer data simply disappears
+  - readers scan the whole ring for valid batches and order them by seq
+  - record: [u8 len][u16 dt_ms][u32 fmt][args]
+      len   total record bytes
+      dt_ms time since BatchHeader::base_ms
+      fmt   address of the format string in the firmware image, 0 when the
+            record carries already formatted text: [u8 n][n chars]
+      args  in format order: integers 4 or 8 bytes, doubles 8 bytes,
+            '*' width/precision 4 bytes, strings [u8 n][n chars] or
+            [STR_PTR][u32 address] for strings in the firmware image
+*/
+
+#pragma pack(push, 1)
+struct BatchHeader {
+    uint16_t magic;
+    uint16_t len;        ///< bytes of records that follow
+    uint32_t seq;
+    uint32_t base_ms;    ///< timestamp of the first record
+    uint32_t build;      ///< first 4 bytes of the firmware ELF SHA-256
+    uint32_t crc;
+};
+#pragma pack(pop)
+
+static constexpr uint16_t BATCH_MAGIC = 0x4C42;   // 'BL'
+static constexpr size_t RECORD_HDR = 7;
+static constexpr size_t RECORD_MAX = 255;
+static constexpr uint8_t STR_PTR = 0xFF;
+static constexpr size_t STR_MAX = 64;              ///< longest inline string argument
+
+inline uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= p[i];
+        for (int j = 0; j < 8; ++j) crc = (crc & 1) ? (0xEDB88320u ^ (crc >> 1)) : (crc >> 1);
+    }
+    return ~crc;
+}
+
+inline uint32_t batch_crc(const BatchHeader &h, const uint8_t *records)
+{
+    uint32_t crc = crc32_update(0, &h, offsetof(BatchHeader, crc));
+    return crc32_update(crc, records, h.len);
+}
+
+/// argument class of one conversion, as the encoder pulls it from a va_list
+enum class Arg : uint8_t { NONE, INT32, INT64, DOUBLE, STR, PTR };
+
+struct Spec {
+    size_t len;         ///< characters of the conversion including '%'
+    Arg arg;
+    uint8_t stars;      ///< '*' width/precision ints taken before the value
+    char conv;
+};
+
+/**
+ * @brief Parse the conversion starting at @p p (which points at '%').
+ *        Sizes follow the ESP32 ABI: int, long, pointers and size_t are 4 bytes.
+ */
+inline Spec parse_spec(const char *p)
+{
+    Spec s{1, Arg::NONE, 0, 0};
+    const char *q = p + 1;
+    while (*q && strchr("-+ #0'", *q)) ++q;
+    if (*q == '*') { ++s.stars; ++q; } else while (*q >= '0' && *q <= '9') ++q;
+    if (*q == '.') {
+        ++q;
+        if (*q == '*') { ++s.stars; ++q; } else while (*q >= '0' && *q <= '9') ++q;
+    }
+    int longs = 0;
+    while (*q && strchr("hlLqjzt", *q)) {
+        if (*q == 'l' || *q == 'q' || *q == 'j' || *q == 'L') ++longs;
+        if (*q == 'q' || *q == 'j') ++longs;
+        ++q;
+    }
+    if (!*q) {
+        s.len = q - p;
+        return s;
+    }
+    s.conv = *q;
+    s.len = q - p + 1;
+    switch (s.conv) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        s.arg = longs >= 2 ? Arg::INT64 : Arg::INT32;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        s.arg = Arg::DOUBLE;
+        break;
+    case 's':
+        s.arg = Arg::STR;
+        break;
+    case 'p': case 'n':
+        s.arg = Arg::PTR;
+        break;
+    default:   // "%%" and unknown conversions take no argument
+        break;
+    }
+    return s;
+}
+
+/// a decoded batch: header plus its records
+struct Batch {
+    BatchHeader hdr;
+    size_t offset;      ///< position in the ring
+    std::vector<uint8_t> records;
+};
+
+/// Collect the valid batches of a ring image, oldest first.
+inline std::vector<Batch> scan(const uint8_t *ring, size_t size)
+{
+    std::vector<Batch> out;
+    for (size_t o = 0; o + sizeof(BatchHeader) <= size;) {
+        BatchHeader h;
+        memcpy(&h, ring + o, sizeof(h));
+        const uint8_t *rec = ring + o + sizeof(h);
+        if (h.magic == BATCH_MAGIC && o + sizeof(h) + h.len <= size && batch_crc(h, rec) == h.crc) {
+            out.push_back({h, o, std::vector<uint8_t>(rec, rec + h.len)});
+            o += sizeof(h) + h.len;
+        } else {
+            ++o;
+        }
+    }
+    std::sort(out.begin(), out.end(), [](const Batch &a, const Batch &b) { return a.hdr.seq < b.hdr.seq; });
+    return out;
+}
+
+/// Resolves a firmware address to a string (nullptr if unknown).
+using Resolver = const char *(*)(uint32_t addr, void *ctx);
+
+template <typename T>
+inline T take(const uint8_t *&p, const uint8_t *end)
+{
+    T v{};
+    if (p + sizeof(T) <= end) memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return v;
+}
+
+/**
+ * @brief Format one record (without its timestamp) into text.
+ * @param rec     Record bytes starting at the length byte.
+ * @param resolve Maps the format and string addresses to text.
+ * @return The formatted line, or a placeholder when the format is unknown.
+ */
+inline std::string format(const uint8_t *rec, Resolver resolve, void *ctx)
+{
+    const uint8_t *end = rec + rec[0];
+    const uint8_t *p = rec + 3;
+    const uint32_t fmt_addr = take<uint32_t>(p, end);
+    std::string out;
+
+    auto take_str = [&](std::string &s) {
+        uint8_t n = take<uint8_t>(p, end);
+        if (n == STR_PTR) {
+            uint32_t a = take<uint32_t>(p, end);
+            const char *r = resolve(a, ctx);
+            s = r ? r : "<?>";
+        } else {
+            if (p + n > end) n = static_cast<uint8_t>(std::max<ptrdiff_t>(0, end - p));
+            s.assign(reinterpret_cast<const char *>(p), n);
+            p += n;
+        }
+    };
+
+    if (fmt_addr == 0) {
+        take_str(out);
+        return out;
+    }
+    const char *fmt = resolve(fmt_addr, ctx);
+    if (!fmt) {
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), "<fmt 0x%08x>", (unsigned)fmt_addr);
+        return tmp;
+    }
+
+    char buf[128];
+    for (const char *f = fmt; *f;) {
+        if (*f != '%') {
+            out += *f++;
+            continue;
+        }
+        const Spec s = parse_spec(f);
+        if (s.conv == '%') {
+            out += '%';
+            f += s.len;
+            continue;
+        }
+        if (s.arg == Arg::NONE) {
+            out.append(f, s.len);
+            f += s.len;
+            continue;
+        }
+        // rebuild the spec with host length modifiers
+        std::string spec;
+        for (size_t i = 0; i < s.len - 1; ++i) {
+            if (!strchr("hlLqjzt", f[i])) spec += f[i];
+        }
+        int star[2] = {0, 0};
+        for (uint8_t i = 0; i < s.stars && i < 2; ++i) star[i] = take<int32_t>(p, end);
+
+        auto emit = [&](auto v) {
+            if (s.stars == 2) snprintf(buf, sizeof(buf), spec.c_str(), star[0], star[1], v);
+            else if (s.stars == 1) snprintf(buf, sizeof(buf), spec.c_str(), star[0], v);
+            else snprintf(buf, sizeof(buf), spec.c_str(), v);
+            out += buf;
+        };
+        switch (s.arg) {
+        case Arg::INT32: {
+            const uint32_t v = take<uint32_t>(p, end);
+            spec += s.conv;
+            if (s.conv == 'd' || s.conv == 'i') emit(static_cast<int32_t>(v));
+            else emit(v);
+            break;
+        }
+        case Arg::INT64: {
+            const uint64_t v = take<uint64_t>(p, end);
+            spec += "ll";
+            spec += s.conv;
+            if (s.conv == 'd' || s.conv == 'i') emit(static_cast<long long>(v));
+            else emit(static_cast<unsigned long long>(v));
+            break;
+        }
+        case Arg::DOUBLE:
+            spec += s.conv;
+            emit(take<double>(p, end));
+            break;
+        case Arg::PTR: {
+            const uint32_t v = take<uint32_t>(p, end);
+            if (s.conv == 'p') {
+                snprintf(buf, sizeof(buf), "0x%08x", (unsigned)v);
+                out += buf;
+            }
+            break;
+        }
+        case Arg::STR: {
+            std::string str;
+            take_str(str);
+            spec += 's';
+            emit(str.c_str());
+            break;
+        }
+        default:
+            break;
+        }
+        f += s.len;
+    }
+    return out;
+}
+
+} // namespace fram_store::logfmt
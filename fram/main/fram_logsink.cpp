@@ -0,0 +1,355 @@
+/**
+ * @file fram_logsink.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_logsink.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "esp_check.h"
+#include "esp_app_desc.h"
+#include "esp_memory_utils.h"
+
+static const char *TAG = "FRAM_LOG";
+
+namespace fram_store {
+
+using namespace logfmt;
+
+LogSink *LogSink::active_ = nullptr;
+vprintf_like_t LogSink::prev_vprintf_ = nullptr;
+
+static constexpr size_t TEXT_MAX = RECORD_MAX - RECORD_HDR - 1;
+
+template <typename T>
+static inline void put(uint8_t *&p, T v)
+{
+    memcpy(p, &v, sizeof(T));
+    p += sizeof(T);
+}
+
+// format strings and tags in the firmware image are stored by address
+static const char *resolve_local(uint32_t addr, void *)
+{
+    const char *s = reinterpret_cast<const char *>(static_cast<uintptr_t>(addr));
+    return esp_ptr_in_drom(s) ? s : nullptr;
+}
+
+LogSink::LogSink(FRAM &fram, FRAM::addr_t base, size_t size, size_t batch_size)
+    : fram_(fram), base_(base), size_(size), batch_size_(std::min<size_t>(batch_size, UINT16_MAX))
+{
+    flush_lock_ = xSemaphoreCreateMutex();
+
+    char sha[9] = {0};
+    esp_app_get_elf_sha256(sha, sizeof(sha));
+    build_ = static_cast<uint32_t>(strtoul(sha, nullptr, 16));
+}
+
+LogSink::~LogSink()
+{
+    stop();
+    if (flush_lock_) vSemaphoreDelete(flush_lock_);
+}
+
+esp_err_t LogSink::mount()
+{
+    ESP_RETURN_ON_FALSE(flush_lock_, ESP_ERR_NO_MEM, TAG, "no mutex");
+    ESP_RETURN_ON_FALSE(batch_size_ >= RECORD_MAX && HDR + batch_size_ <= size_ &&
+                        (uint32_t)base_ + size_ <= FRAM::FRAM_SIZE_BYTES,
+                        ESP_ERR_INVALID_ARG, TAG, "bad geometry");
+
+    std::vector<uint8_t> ring(size_);
+    ESP_RETURN_ON_ERROR(fram_.read(base_, ring.data(), size_), TAG, "read ring");
+    const std::vector<Batch> batches = scan(ring.data(), size_);
+    if (batches.empty()) {
+        head_ = 0;
+        seq_ = 1;
+    } else {
+        const Batch &last = batches.back();
+        head_ = last.offset + HDR + last.hdr.len;
+        seq_ = last.hdr.seq + 1;
+    }
+
+    for (auto &b : buf_) b.assign(HDR + batch_size_, 0);
+    fill_[0] = fill_[1] = 0;
+    cur_ = 0;
+    mounted_ = true;
+    ESP_LOGI(TAG, "mounted: %u batches, head %u", (unsigned)batches.size(), (unsigned)head_);
+    return ESP_OK;
+}
+
+size_t LogSink::encode(uint8_t *rec, const char *fmt, va_list ap, bool &text)
+{
+    uint8_t *p = rec + RECORD_HDR;
+    uint8_t *const end = rec + RECORD_MAX;
+    text = !esp_ptr_in_drom(fmt);
+
+    if (!text) {
+        va_list args;
+        va_copy(args, ap);
+        for (const char *f = fmt; *f && !text; ++f) {
+            if (*f != '%') continue;
+            const Spec s = parse_spec(f);
+            f += s.len - 1;
+            if (s.arg == Arg::NONE) continue;
+            if (p + 4 * s.stars + 9 > end) {
+                text = true;
+                break;
+            }
+            for (uint8_t i = 0; i < s.stars; ++i) put<int32_t>(p, va_arg(args, int));
+            switch (s.arg) {
+            case Arg::INT32:
+                put<uint32_t>(p, va_arg(args, unsigned));
+                break;
+            case Arg::INT64:
+                put<uint64_t>(p, va_arg(args, unsigned long long));
+                break;
+            case Arg::DOUBLE:
+                put<double>(p, va_arg(args, double));
+                break;
+            case Arg::PTR:
+                put<uint32_t>(p, static_cast<uint32_t>(reinterpret_cast<uintptr_t>(va_arg(args, void *))));
+                break;
+            case Arg::STR: {
+                const char *str = va_arg(args, const char *);
+                if (str && esp_ptr_in_drom(str)) {
+                    put<uint8_t>(p, STR_PTR);
+                    put<uint32_t>(p, static_cast<uint32_t>(reinterpret_cast<uintptr_t>(str)));
+                    break;
+                }
+                if (!str) str = "(null)";
+                const size_t n = strnlen(str, STR_MAX);
+                if (p + 1 + n > end) {
+                    text = true;
+                    break;
+                }
+                put<uint8_t>(p, static_cast<uint8_t>(n));
+                memcpy(p, str, n);
+                p += n;
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        va_end(args);
+    }
+
+    uint32_t fmt_addr = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(fmt));
+    if (text) {
+        // the format itself is not in flash, or the arguments do not fit: keep the text
+        va_list args;
+        va_copy(args, ap);
+        char line[TEXT_MAX + 1];
+        int n = vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+        n = std::clamp<int>(n, 0, TEXT_MAX);
+        p = rec + RECORD_HDR;
+        put<uint8_t>(p, static_cast<uint8_t>(n));
+        memcpy(p, line, n);
+        p += n;
+        fmt_addr = 0;
+    }
+
+    rec[0] = static_cast<uint8_t>(p - rec);
+    memcpy(rec + 3, &fmt_addr, sizeof(fmt_addr));
+    return p - rec;
+}
+
+void LogSink::append(uint8_t *rec, size_t len, bool text)
+{
+    const uint32_t now = esp_log_timestamp();
+    bool wake = false;
+
+    portENTER_CRITICAL(&lock_);
+    // a full buffer or a time delta beyond 16 bits starts the other buffer
+    if (fill_[cur_] && (fill_[cur_] + len > batch_size_ || now - base_ms_[cur_] > UINT16_MAX)) {
+        if (fill_[cur_ ^ 1] == 0) {
+            cur_ ^= 1;
+            wake = true;
+        } else {
+            ++stats_.dropped;
+            portEXIT_CRITICAL(&lock_);
+            return;
+        }
+    }
+    if (fill_[cur_] == 0) base_ms_[cur_] = now;
+    const uint16_t dt = static_cast<uint16_t>(now - base_ms_[cur_]);
+    memcpy(rec + 1, &dt, sizeof(dt));
+    memcpy(buf_[cur_].data() + HDR + fill_[cur_], rec, len);
+    fill_[cur_] += len;
+    ++stats_.records;
+    if (text) ++stats_.text_records;
+    portEXIT_CRITICAL(&lock_);
+
+    if (wake && task_) xTaskNotifyGive(task_);
+}
+
+int LogSink::vprintf_hook(const char *fmt, va_list ap)
+{
+    LogSink *self = active_;
+    if (self && self->mounted_) {
+        uint8_t rec[RECORD_MAX];
+        bool text;
+        const size_t len = self->encode(rec, fmt, ap, text);
+        self->append(rec, len, text);
+    }
+    return prev_vprintf_ ? prev_vprintf_(fmt, ap) : vprintf(fmt, ap);
+}
+
+esp_err_t LogSink::write_batch(int idx)
+{
+    uint8_t *buf = buf_[idx].data();
+    BatchHeader h{};
+    h.magic = BATCH_MAGIC;
+    h.len = static_cast<uint16_t>(fill_[idx]);
+    h.seq = seq_;
+    h.base_ms = base_ms_[idx];
+    h.build = build_;
+    h.crc = batch_crc(h, buf + HDR);
+    memcpy(buf, &h, HDR);
+
+    // batches are never split: wrap early and let the tail keep older data
+    const size_t total = HDR + h.len;
+    if (head_ + total > size_) head_ = 0;
+    ESP_RETURN_ON_ERROR(fram_.write(base_ + head_, buf, total), TAG, "write batch");
+    head_ += total;
+    ++seq_;
+    ++stats_.batches;
+    stats_.bytes += h.len;
+    return ESP_OK;
+}
+
+esp_err_t LogSink::flush()
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    xSemaphoreTake(flush_lock_, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    for (int round = 0; round < 2 && err == ESP_OK; ++round) {
+        // hand the filling buffer over if the other one is free
+        portENTER_CRITICAL(&lock_);
+        if (fill_[cur_] && !fill_[cur_ ^ 1]) cur_ ^= 1;
+        const int idx = cur_ ^ 1;
+        portEXIT_CRITICAL(&lock_);
+        if (!fill_[idx]) break;
+
+        err = write_batch(idx);
+        portENTER_CRITICAL(&lock_);
+        fill_[idx] = 0;   // on error the batch is lost rather than blocking logging
+        portEXIT_CRITICAL(&lock_);
+    }
+    xSemaphoreGive(flush_lock_);
+    return err;
+}
+
+esp_err_t LogSink::read(const Visitor &fn)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    flush();
+
+    std::vector<uint8_t> ring(size_);
+    xSemaphoreTake(flush_lock_, portMAX_DELAY);
+    esp_err_t err = fram_.read(base_, ring.data(), size_);
+    xSemaphoreGive(flush_lock_);
+    ESP_RETURN_ON_ERROR(err, TAG, "read ring");
+
+    for (const Batch &b : scan(ring.data(), size_)) {
+        if (b.hdr.build != build_) {
+            char note[80];
+            snprintf(note, sizeof(note), "<batch %" PRIu32 " from build %08" PRIx32 ", use fram_logdecode>\n",
+                     b.hdr.seq, b.hdr.build);
+            fn(b.hdr.base_ms, note);
+            continue;
+        }
+        for (size_t o = 0; o + RECORD_HDR <= b.records.size();) {
+            const uint8_t *rec = b.records.data() + o;
+            if (rec[0] < RECORD_HDR || o + rec[0] > b.records.size()) break;
+            uint16_t dt;
+            memcpy(&dt, rec + 1, sizeof(dt));
+            fn(b.hdr.base_ms + dt, format(rec, resolve_local, nullptr));
+            o += rec[0];
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t LogSink::dump_hex()
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    flush();
+
+    // printf, not ESP_LOG: the dump must not feed the sink itself
+    uint8_t chunk[32];
+    char line[16 + 2 * sizeof(chunk)];
+    xSemaphoreTake(flush_lock_, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    for (size_t o = 0; o < size_ && err == ESP_OK; o += sizeof(chunk)) {
+        const size_t n = std::min(sizeof(chunk), size_ - o);
+        err = fram_.read(base_ + o, chunk, n);
+        int pos = snprintf(line, sizeof(line), "FRAMLOG %04x ", (unsigned)o);
+        for (size_t i = 0; i < n; ++i) pos += snprintf(line + pos, sizeof(line) - pos, "%02x", chunk[i]);
+        if (err == ESP_OK) printf("%s\n", line);
+    }
+    xSemaphoreGive(flush_lock_);
+    return err;
+}
+
+esp_err_t LogSink::clear()
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    xSemaphoreTake(flush_lock_, portMAX_DELAY);
+    esp_err_t err = fram_.fill(base_, 0, size_);
+    head_ = 0;
+    xSemaphoreGive(flush_lock_);
+    return err;
+}
+
+void LogSink::task_entry(void *arg)
+{
+    auto *self = static_cast<LogSink *>(arg);
+    while (self->running_) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(self->flush_ms_));
+        self->flush();
+    }
+    self->task_ = nullptr;
+    vTaskDelete(nullptr);
+}
+
+esp_err_t LogSink::start(uint32_t flush_ms, UBaseType_t prio, BaseType_t core)
+{
+    ESP_RETURN_ON_FALSE(mounted_ && !task_ && !active_, ESP_ERR_INVALID_STATE, TAG, "bad state");
+    flush_ms_ = flush_ms;
+    running_ = true;
+    BaseType_t ok = xTaskCreatePinnedToCore(task_entry, "fram_log", 3072, this, prio, &task_, core);
+    if (ok != pdPASS) {
+        running_ = false;
+        task_ = nullptr;
+        return ESP_ERR_NO_MEM;
+    }
+    active_ = this;
+    prev_vprintf_ = esp_log_set_vprintf(&LogSink::vprintf_hook);
+    return ESP_OK;
+}
+
+void LogSink::stop()
+{
+    if (active_ == this) {
+        esp_log_set_vprintf(prev_vprintf_);
+        active_ = nullptr;
+    }
+    if (task_) {
+        running_ = false;
+        xTaskNotifyGive(task_);
+        while (task_) vTaskDelay(1);
+    }
+    if (mounted_) flush();
+}
+
+} // namespace fram_store
@@ -0,0 +1,137 @@
+/**
+ * @file fram_logsink.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief esp_log sink that keeps binary log records in a FRAM ring.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstdarg>
+#include <functional>
+#include <string>
+#include <vector>
+#include "fram.h"
+#include "fram_logfmt.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+namespace fram_store {
+
+/*
+  LogSink
+  - hooked in with esp_log_set_vprintf(), forwards every line to the previous
+    sink (console) and keeps a binary copy in FRAM
+  - formatting is deferred: a record holds the format string address, the raw
+    arguments and a 16-bit time delta (fram_logfmt.h), typically 10-20 bytes
+    per line; strings outside the firmware image are copied inline and lines
+    with such a format are stored as text
+  - records collect in one of two RAM batch buffers; the flush task writes a
+    whole buffer as one batch (one SPI transfer) every flush window or when a
+    buffer fills, while logging continues into the other one; when both are
+    full, lines are dropped and counted
+  - the region is a ring of batches; the oldest ones are overwritten and no
+    separate head pointer is stored, mount() finds the newest batch by seq
+  - read() decodes the batches of the running firmware on the device, the
+    raw ring (dump_hex()) is decoded by tools/fram_logdecode with the ELF
+*/
+class LogSink {
+public:
+    struct Stats {
+        uint32_t records;
+        uint32_t text_records;   ///< stored formatted (format not in flash)
+        uint32_t dropped;        ///< both batch buffers were full
+        uint32_t batches;        ///< flushed to FRAM
+        uint32_t bytes;          ///< record bytes flushed
+    };
+
+    /// one decoded line; ms is the log timestamp
+    using Visitor = std::function<void(uint32_t ms, const std::string &line)>;
+
+    /**
+     * @brief Construct a log sink over a FRAM region.
+     * @param fram       FRAM driver (initialized).
+     * @param base       First byte of the ring.
+     * @param size       Ring size in bytes.
+     * @param batch_size Bytes of records per batch (RAM use is twice that).
+     */
+    LogSink(FRAM &fram, FRAM::addr_t base, size_t size, size_t batch_size = 256);
+    ~LogSink();
+
+    /// Find the newest batch so that logging continues after it.
+    esp_err_t mount();
+
+    /**
+     * @brief Install the vprintf hook and start the flush task.
+     * @param flush_ms Flush window; lines reach FRAM at most this late.
+     */
+    esp_err_t start(uint32_t flush_ms = 1000, UBaseType_t prio = tskIDLE_PRIORITY + 2,
+                    BaseType_t core = tskNO_AFFINITY);
+    /// Flush and restore the previous vprintf.
+    void stop();
+
+    /// Write the pending records now.
+    esp_err_t flush();
+
+    /**
+     * @brief Decode the ring, oldest line first.
+     * @note Batches written by another firmware build are reported as one
+     *       placeholder line; decode them with tools/fram_logdecode.
+     */
+    esp_err_t read(const Visitor &fn);
+
+    /// Print the ring as "FRAMLOG <offset> <hex>" lines for tools/fram_logdecode.
+    esp_err_t dump_hex();
+
+    /// Erase all batches.
+    esp_err_t clear();
+
+    Stats stats() const { return stats_; }
+
+    LogSink(const LogSink&) = delete;
+    LogSink& operator=(const LogSink&) = delete;
+
+private:
+    static constexpr size_t HDR = sizeof(logfmt::BatchHeader);
+
+    static int vprintf_hook(const char *fmt, va_list ap);
+    size_t encode(uint8_t *rec, const char *fmt, va_list ap, bool &text);
+    void append(uint8_t *rec, size_t len, bool text);
+    esp_err_t write_batch(int idx);
+    static void task_entry(void *arg);
+
+    static LogSink *active_;
+    static vprintf_like_t prev_vprintf_;
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    size_t size_;
+    size_t batch_size_;
+    uint32_t build_{0};
+
+    size_t head_{0};
+    uint32_t seq_{1};
+    bool mounted_{false};
+
+    // batch buffers, each [BatchHeader][records]
+    std::vector<uint8_t> buf_[2];
+    size_t fill_[2]{0, 0};
+    uint32_t base_ms_[2]{0, 0};
+    int cur_{0};
+    portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+    SemaphoreHandle_t flush_lock_{nullptr};
+    Stats stats_{};
+
+    TaskHandle_t task_{nullptr};
+    uint32_t flush_ms_{1000};
+    volatile bool running_{false};
+};
+
+} // namespace fram_store
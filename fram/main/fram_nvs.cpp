@@ -0,0 +1,221 @@
+/**
+ * @file fram_nvs.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_nvs.h"
+#include <array>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "esp_log.h"
+#include "esp_check.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "FRAM_NVS";
+
+using fram_store::KvStore;
+using fram_store::KvType;
+
+namespace {
+
+struct OpenHandle {
+    bool used;
+    bool read_only;
+    std::string ns;
+};
+
+constexpr size_t MAX_HANDLES = 8;
+
+std::unique_ptr<KvStore> s_store;
+SemaphoreHandle_t s_lock = nullptr;
+std::array<OpenHandle, MAX_HANDLES> s_handles{};
+
+class Lock {
+public:
+    Lock() { xSemaphoreTake(s_lock, portMAX_DELAY); }
+    ~Lock() { xSemaphoreGive(s_lock); }
+};
+
+esp_err_t to_nvs_err(esp_err_t err)
+{
+    switch (err) {
+    case ESP_ERR_NOT_FOUND:     return ESP_ERR_NVS_NOT_FOUND;
+    case ESP_ERR_INVALID_STATE: return ESP_ERR_NVS_TYPE_MISMATCH;
+    case ESP_ERR_INVALID_SIZE:  return ESP_ERR_NVS_INVALID_LENGTH;
+    case ESP_ERR_NO_MEM:        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    default:                    return err;
+    }
+}
+
+// returns the handle slot or nullptr; caller holds the lock
+OpenHandle *lookup(nvs_handle_t handle)
+{
+    if (handle == 0 || handle > MAX_HANDLES) return nullptr;
+    OpenHandle &h = s_handles[handle - 1];
+    return h.used ? &h : nullptr;
+}
+
+esp_err_t check_key(const char *key)
+{
+    if (!key) return ESP_ERR_NVS_INVALID_NAME;
+    if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE) return ESP_ERR_NVS_KEY_TOO_LONG;
+    return ESP_OK;
+}
+
+esp_err_t set_value(nvs_handle_t handle, const char *key, KvType type, const void *data, size_t len)
+{
+    if (!s_store) return ESP_ERR_NVS_NOT_INITIALIZED;
+    ESP_RETURN_ON_ERROR(check_key(key), TAG, "bad key");
+    Lock lock;
+    OpenHandle *h = lookup(handle);
+    if (!h) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (h->read_only) return ESP_ERR_NVS_READ_ONLY;
+    return to_nvs_err(s_store->set(h->ns, key, type, data, len));
+}
+
+esp_err_t get_value(nvs_handle_t handle, const char *key, KvType type, void *out, size_t *len)
+{
+    if (!s_store) return ESP_ERR_NVS_NOT_INITIALIZED;
+    ESP_RETURN_ON_ERROR(check_key(key), TAG, "bad key");
+    Lock lock;
+    OpenHandle *h = lookup(handle);
+    if (!h) return ESP_ERR_NVS_INVALID_HANDLE;
+    return to_nvs_err(s_store->get(h->ns, key, type, out, len));
+}
+
+template<typename V>
+esp_err_t get_int(nvs_handle_t handle, const char *key, KvType type, V *out)
+{
+    if (!out) return ESP_ERR_INVALID_ARG;
+    size_t len = sizeof(V);
+    return get_value(handle, key, type, out, &len);
+}
+
+} // namespace
+
+esp_err_t fram_nvs_init(FRAM &fram, FRAM::addr_t base, size_t size)
+{
+    ESP_RETURN_ON_FALSE(!s_store, ESP_ERR_INVALID_STATE, TAG, "already initialized");
+    if (!s_lock) {
+        s_lock = xSemaphoreCreateMutex();
+        ESP_RETURN_ON_FALSE(s_lock, ESP_ERR_NO_MEM, TAG, "mutex");
+    }
+    auto store = std::make_unique<KvStore>(fram, base, size);
+    ESP_RETURN_ON_ERROR(store->mount(), TAG, "mount");
+    s_store = std::move(store);
+    return ESP_OK;
+}
+
+fram_store::KvStore *fram_nvs_store()
+{
+    return s_store.get();
+}
+
+esp_err_t fram_nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    if (!s_store) return ESP_ERR_NVS_NOT_INITIALIZED;
+    ESP_RETURN_ON_FALSE(name && out_handle, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    size_t ns_len = strlen(name);
+    if (ns_len == 0 || ns_len >= NVS_NS_NAME_MAX_SIZE) return ESP_ERR_NVS_INVALID_NAME;
+
+    Lock lock;
+    if (open_mode == NVS_READONLY && !s_store->has_namespace(name)) return ESP_ERR_NVS_NOT_FOUND;
+    for (size_t i = 0; i < MAX_HANDLES; ++i) {
+        OpenHandle &h = s_handles[i];
+        if (h.used) continue;
+        h.used = true;
+        h.read_only = (open_mode == NVS_READONLY);
+        h.ns = name;
+        *out_handle = static_cast<nvs_handle_t>(i + 1);
+        return ESP_OK;
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void fram_nvs_close(nvs_handle_t handle)
+{
+    if (!s_store) return;
+    Lock lock;
+    if (OpenHandle *h = lookup(handle)) {
+        h->used = false;
+        h->ns.clear();
+    }
+}
+
+esp_err_t fram_nvs_commit(nvs_handle_t handle)
+{
+    if (!s_store) return ESP_ERR_NVS_NOT_INITIALIZED;
+    Lock lock;
+    // every set_* is already durable, nothing is buffered
+    return lookup(handle) ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+esp_err_t fram_nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    if (!s_store) return ESP_ERR_NVS_NOT_INITIALIZED;
+    ESP_RETURN_ON_ERROR(check_key(key), TAG, "bad key");
+    Lock lock;
+    OpenHandle *h = lookup(handle);
+    if (!h) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (h->read_only) return ESP_ERR_NVS_READ_ONLY;
+    return to_nvs_err(s_store->erase(h->ns, key));
+}
+
+esp_err_t fram_nvs_erase_all(nvs_handle_t handle)
+{
+    if (!s_store) return ESP_ERR_NVS_NOT_INITIALIZED;
+    Lock lock;
+    OpenHandle *h = lookup(handle);
+    if (!h) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (h->read_only) return ESP_ERR_NVS_READ_ONLY;
+    return to_nvs_err(s_store->erase_all(h->ns));
+}
+
+esp_err_t fram_nvs_set_i8(nvs_handle_t handle, const char *key, int8_t value)   { return set_value(handle, key, KvType::I8, &value, sizeof value); }
+esp_err_t fram_nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)  { return set_value(handle, key, KvType::U8, &value, sizeof value); }
+esp_err_t fram_nvs_set_i16(nvs_handle_t handle, const char *key, int16_t value) { return set_value(handle, key, KvType::I16, &value, sizeof value); }
+esp_err_t fram_nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value){ return set_value(handle, key, KvType::U16, &value, sizeof value); }
+esp_err_t fram_nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value) { return set_value(handle, key, KvType::I32, &value, sizeof value); }
+esp_err_t fram_nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value){ return set_value(handle, key, KvType::U32, &value, sizeof value); }
+esp_err_t fram_nvs_set_i64(nvs_handle_t handle, const char *key, int64_t value) { return set_value(handle, key, KvType::I64, &value, sizeof value); }
+esp_err_t fram_nvs_set_u64(nvs_handle_t handle, const char *key, uint64_t value){ return set_value(handle, key, KvType::U64, &value, sizeof value); }
+
+esp_err_t fram_nvs_set_str(nvs_handle_t handle, const char *key, const char *value)
+{
+    ESP_RETURN_ON_FALSE(value, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    // stored with the terminating NUL, as flash NVS does
+    return set_value(handle, key, KvType::STR, value, strlen(value) + 1);
+}
+
+esp_err_t fram_nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    ESP_RETURN_ON_FALSE(value || length == 0, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    return set_value(handle, key, KvType::BLOB, value, length);
+}
+
+esp_err_t fram_nvs_get_i8(nvs_handle_t handle, const char *key, int8_t *out_value)   { return get_int(handle, key, KvType::I8, out_value); }
+esp_err_t fram_nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)  { return get_int(handle, key, KvType::U8, out_value); }
+esp_err_t fram_nvs_get_i16(nvs_handle_t handle, const char *key, int16_t *out_value) { return get_int(handle, key, KvType::I16, out_value); }
+esp_err_t fram_nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *out_value){ return get_int(handle, key, KvType::U16, out_value); }
+esp_err_t fram_nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *out_value) { return get_int(handle, key, KvType::I32, out_value); }
+esp_err_t fram_nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value){ return get_int(handle, key, KvType::U32, out_value); }
+esp_err_t fram_nvs_get_i64(nvs_handle_t handle, const char *key, int64_t *out_value) { return get_int(handle, key, KvType::I64, out_value); }
+esp_err_t fram_nvs_get_u64(nvs_handle_t handle, const char *key, uint64_t *out_value){ return get_int(handle, key, KvType::U64, out_value); }
+
+esp_err_t fram_nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length)
+{
+    ESP_RETURN_ON_FALSE(length, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    return get_value(handle, key, KvType::STR, out_value, length);
+}
+
+esp_err_t fram_nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    ESP_RETURN_ON_FALSE(length, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    return get_value(handle, key, KvType::BLOB, out_value, length);
+}
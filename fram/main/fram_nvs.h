@@ -0,0 +1,93 @@
+/**
+ * @file fram_nvs.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief nvs_*-compatible API backed by the FRAM key-value store.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success) and use the
+ *  same error codes as the ESP-IDF NVS library.
+ *
+ *  Signatures mirror nvs.h, so hot keys can be moved to FRAM by renaming
+ *  nvs_* -> fram_nvs_*, or without touching call sites by defining
+ *  FRAM_NVS_REDIRECT before including this header.
+ *
+ *  Differences from flash NVS:
+ *  - set_* is durable when it returns (one SPI write); commit() is a no-op
+ *  - namespace + key together must not exceed fram_store::KvStore::MAX_NAME_LEN
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include "nvs.h"
+#include "fram.h"
+#include "fram_kv.h"
+
+/**
+ * @brief Mount the FRAM key-value store used by the fram_nvs_* API.
+ * @param fram FRAM driver, already initialized.
+ * @param base First byte of the FRAM region reserved for NVS data.
+ * @param size Region size in bytes.
+ * @return ESP_OK on success, otherwise an esp_err_t error code.
+ */
+esp_err_t fram_nvs_init(FRAM &fram, FRAM::addr_t base, size_t size);
+
+/// Access to the underlying store (statistics, compaction).
+fram_store::KvStore *fram_nvs_store();
+
+esp_err_t fram_nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle);
+void fram_nvs_close(nvs_handle_t handle);
+esp_err_t fram_nvs_commit(nvs_handle_t handle);
+esp_err_t fram_nvs_erase_key(nvs_handle_t handle, const char *key);
+esp_err_t fram_nvs_erase_all(nvs_handle_t handle);
+
+esp_err_t fram_nvs_set_i8(nvs_handle_t handle, const char *key, int8_t value);
+esp_err_t fram_nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value);
+esp_err_t fram_nvs_set_i16(nvs_handle_t handle, const char *key, int16_t value);
+esp_err_t fram_nvs_set_u16(nvs_handle_t handle, const char *key, uint16_t value);
+esp_err_t fram_nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value);
+esp_err_t fram_nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value);
+esp_err_t fram_nvs_set_i64(nvs_handle_t handle, const char *key, int64_t value);
+esp_err_t fram_nvs_set_u64(nvs_handle_t handle, const char *key, uint64_t value);
+esp_err_t fram_nvs_set_str(nvs_handle_t handle, const char *key, const char *value);
+esp_err_t fram_nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length);
+
+esp_err_t fram_nvs_get_i8(nvs_handle_t handle, const char *key, int8_t *out_value);
+esp_err_t fram_nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value);
+esp_err_t fram_nvs_get_i16(nvs_handle_t handle, const char *key, int16_t *out_value);
+esp_err_t fram_nvs_get_u16(nvs_handle_t handle, const char *key, uint16_t *out_value);
+esp_err_t fram_nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *out_value);
+esp_err_t fram_nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value);
+esp_err_t fram_nvs_get_i64(nvs_handle_t handle, const char *key, int64_t *out_value);
+esp_err_t fram_nvs_get_u64(nvs_handle_t handle, const char *key, uint64_t *out_value);
+esp_err_t fram_nvs_get_str(nvs_handle_t handle, const char *key, char *out_value, size_t *length);
+esp_err_t fram_nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length);
+
+#ifdef FRAM_NVS_REDIRECT
+#define nvs_open       fram_nvs_open
+#define nvs_close      fram_nvs_close
+#define nvs_commit     fram_nvs_commit
+#define nvs_erase_key  fram_nvs_erase_key
+#define nvs_erase_all  fram_nvs_erase_all
+#define nvs_set_i8     fram_nvs_set_i8
+#define nvs_set_u8     fram_nvs_set_u8
+#define nvs_set_i16    fram_nvs_set_i16
+#define nvs_set_u16    fram_nvs_set_u16
+#define nvs_set_i32    fram_nvs_set_i32
+#define nvs_set_u32    fram_nvs_set_u32
+#define nvs_set_i64    fram_nvs_set_i64
+#define nvs_set_u64    fram_nvs_set_u64
+#define nvs_set_str    fram_nvs_set_str
+#define nvs_set_blob   fram_nvs_set_blob
+#define nvs_get_i8     fram_nvs_get_i8
+#define nvs_get_u8     fram_nvs_get_u8
+#define nvs_get_i16    fram_nvs_get_i16
+#define nvs_get_u16    fram_nvs_get_u16
+#define nvs_get_i32    fram_nvs_get_i32
+#define nvs_get_u32    fram_nvs_get_u32
+#define nvs_get_i64    fram_nvs_get_i64
+#define nvs_get_u64    fram_nvs_get_u64
+#define nvs_get_str    fram_nvs_get_str
+#define nvs_get_blob   fram_nvs_get_blob
+#endif
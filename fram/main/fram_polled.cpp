@@ -0,0 +1,349 @@
+/**
+ * @file fram_polled.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ *  Register-level SPI path that runs from IRAM without the SPI master driver,
+ *  interrupts or the flash cache. Only inline LL accessors, ROM functions and
+ *  DRAM data may be used in here. The exceptions run in tasks only:
+ *  capture_regs(), set_panic_write_hz(), the direct_*() entry points of
+ *  set_direct() and the DriverGuard on the driver side of the bus gate.
+ */
+
+#include "fram.h"
+#include <algorithm>
+#include <cstring>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "hal/spi_ll.h"
+#include "soc/soc.h"
+#include "soc/spi_struct.h"
+
+// one polled transaction is limited to the W0..W15 data registers
+static constexpr size_t POLL_MAX_BYTES = 64;
+static constexpr size_t POLL_HDR = 3;           // opcode + 16-bit address
+static constexpr uint32_t POLL_SPIN_LIMIT = 1000000;
+
+static constexpr uint8_t POLL_CMD_WREN = 0x06;
+static constexpr uint8_t POLL_CMD_WRITE = 0x02;
+static constexpr uint8_t POLL_CMD_READ = 0x03;
+
+// first protected address per BP1:BP0 value, in DRAM for the cache-off path
+static constexpr uint8_t POLL_SR_BP_SHIFT = 2;
+static DRAM_ATTR const uint16_t POLL_PROTECT_START[4] = {
+    FRAM::protect_start(FRAM::Protect::NONE), FRAM::protect_start(FRAM::Protect::UPPER_QUARTER),
+    FRAM::protect_start(FRAM::Protect::UPPER_HALF), FRAM::protect_start(FRAM::Protect::ALL),
+};
+
+// bus gate: driver calls in progress (all instances) and the fast op on the wire
+static portMUX_TYPE s_gate = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_driver_calls;
+static bool s_fast_busy;
+// masks preemption on the calling core during a fast or direct op
+static portMUX_TYPE s_direct = portMUX_INITIALIZER_UNLOCKED;
+
+// the host is idle: cmd.usr clears itself when a transfer ends, whoever started it
+static IRAM_ATTR bool polled_idle(spi_dev_t *hw)
+{
+    for (uint32_t n = 0; hw->cmd.usr; ++n) {
+        if (n > POLL_SPIN_LIMIT) return false;
+    }
+    return true;
+}
+
+// the transfer started after the last spi_ll_clear_int_stat() is done
+// (trans_done is sticky: it stays set from the previous transfer until cleared)
+static IRAM_ATTR bool polled_wait(spi_dev_t *hw)
+{
+    for (uint32_t n = 0; !spi_ll_usr_is_done(hw); ++n) {
+        if (n > POLL_SPIN_LIMIT) return false;
+    }
+    return true;
+}
+
+// one transaction of len bytes from buf; with rx the bytes clocked in replace them
+static IRAM_ATTR bool polled_tx(spi_dev_t *hw, uint8_t *buf, size_t len, bool rx = false)
+{
+    if (!polled_idle(hw)) return false;
+
+    // CPU mode: stop the DMA links so that W0..W15 are the data source
+    hw->dma_out_link.start = 0;
+    hw->dma_in_link.start = 0;
+    hw->dma_conf.out_rst = 1;
+    hw->dma_conf.out_rst = 0;
+    hw->dma_conf.in_rst = 1;
+    hw->dma_conf.in_rst = 0;
+
+    // opcode and address travel in the data phase, CS and clock are the device's (load_regs())
+    spi_ll_set_command_bitlen(hw, 0);
+    spi_ll_set_addr_bitlen(hw, 0);
+    spi_ll_set_dummy(hw, 0);
+    spi_ll_enable_miso(hw, rx);
+    spi_ll_enable_mosi(hw, 1);
+    spi_ll_set_mosi_bitlen(hw, len * 8);
+    if (rx) spi_ll_set_miso_bitlen(hw, len * 8);
+    spi_ll_write_buffer(hw, buf, len * 8);
+    // otherwise the flag of the previous transfer ends the wait at once
+    spi_ll_clear_int_stat(hw);
+    spi_ll_user_start(hw);
+    if (!polled_wait(hw)) return false;
+    // full duplex: the received bytes land in W0..W15 too
+    if (rx) spi_ll_read_buffer(hw, buf, len * 8);
+    // the driver interrupt must not see this transfer as one of its own
+    spi_ll_clear_int_stat(hw);
+    return true;
+}
+
+/* -------------------------------------------------------------------------
+ * Host registers of the device
+ * ----------------------------------------------------------------------*/
+
+void FRAM::capture_regs()
+{
+    // called right after a driver transaction with the bus acquired: the
+    // registers hold exactly what the driver set up for this device
+    spi_dev_t *hw = SPI_LL_GET_HW(host_);
+    regs_ = HostRegs{hw->clock.val, hw->pin.val, hw->user.val, hw->ctrl.val, hw->ctrl2.val};
+    regs_valid_ = true;
+}
+
+esp_err_t FRAM::set_panic_write_hz(int hz)
+{
+    if (!dev_) return ESP_ERR_INVALID_STATE;
+    hz = std::min(hz, FRAM_MAX_CLOCK_HZ);
+    // the divider is worked out here: spi_ll_master_cal_clock() is not in IRAM
+    spi_ll_clock_val_t reg = 0;
+    if (hz > freq_hz_) spi_ll_master_cal_clock(APB_CLK_FREQ, hz, 128, &reg);
+    panic_clock_ = hz > freq_hz_ ? reg : 0;
+    return mirror_ ? mirror_->set_panic_write_hz(hz) : ESP_OK;
+}
+
+IRAM_ATTR bool FRAM::load_regs(HostRegs &saved)
+{
+    spi_dev_t *hw = SPI_LL_GET_HW(host_);
+    // a driver transaction interrupted by the panic still completes in hardware
+    if (!polled_idle(hw)) return false;
+    saved = HostRegs{hw->clock.val, hw->pin.val, hw->user.val, hw->ctrl.val, hw->ctrl2.val};
+    if (regs_valid_) {
+        hw->clock.val = regs_.clock;
+        hw->pin.val = regs_.pin;
+        hw->user.val = regs_.user;
+        hw->ctrl.val = regs_.ctrl;
+        hw->ctrl2.val = regs_.ctrl2;
+    }
+    return true;
+}
+
+IRAM_ATTR void FRAM::restore_regs(const HostRegs &saved)
+{
+    // the driver reloads device settings only when it switches devices, so
+    // whatever device it last set up must find its registers unchanged
+    spi_dev_t *hw = SPI_LL_GET_HW(host_);
+    hw->clock.val = saved.clock;
+    hw->pin.val = saved.pin;
+    hw->user.val = saved.user;
+    hw->ctrl.val = saved.ctrl;
+    hw->ctrl2.val = saved.ctrl2;
+}
+
+/* -------------------------------------------------------------------------
+ * Polled transfers
+ * ----------------------------------------------------------------------*/
+
+IRAM_ATTR esp_err_t FRAM::write_polled(addr_t addr, const void *buf, size_t len, bool panic_clock)
+{
+    if (!buf || !len || !dev_ || (uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    spi_dev_t *hw = SPI_LL_GET_HW(host_);
+    const uint8_t *src = static_cast<const uint8_t *>(buf);
+    uint8_t tx[POLL_MAX_BYTES];
+    HostRegs saved;
+    if (!load_regs(saved)) return ESP_ERR_TIMEOUT;
+    if (panic_clock && panic_clock_) hw->clock.val = panic_clock_;
+
+    esp_err_t err = ESP_OK;
+    for (size_t done = 0; done < len && err == ESP_OK;) {
+        size_t n = len - done;
+        if (n > POLL_MAX_BYTES - POLL_HDR) n = POLL_MAX_BYTES - POLL_HDR;
+        const addr_t a = static_cast<addr_t>(addr + done);
+
+        // WEL is cleared after every WRITE, so each chunk needs its own WREN
+        tx[0] = POLL_CMD_WREN;
+        if (!polled_tx(hw, tx, 1)) err = ESP_ERR_TIMEOUT;
+        tx[0] = POLL_CMD_WRITE;
+        tx[1] = static_cast<uint8_t>(a >> 8);
+        tx[2] = static_cast<uint8_t>(a & 0xFF);
+        memcpy(tx + POLL_HDR, src + done, n);
+        if (err == ESP_OK && !polled_tx(hw, tx, POLL_HDR + n)) err = ESP_ERR_TIMEOUT;
+        done += n;
+    }
+    restore_regs(saved);
+
+    if (err == ESP_OK && mirror_) return mirror_->write_polled(addr, buf, len, panic_clock);
+    return err;
+}
+
+IRAM_ATTR esp_err_t FRAM::read_polled(addr_t addr, void *buf, size_t len)
+{
+    spi_dev_t *hw = SPI_LL_GET_HW(host_);
+    uint8_t *dst = static_cast<uint8_t *>(buf);
+    uint8_t io[POLL_MAX_BYTES];
+    HostRegs saved;
+    if (!load_regs(saved)) return ESP_ERR_TIMEOUT;
+
+    esp_err_t err = ESP_OK;
+    for (size_t done = 0; done < len && err == ESP_OK;) {
+        size_t n = len - done;
+        if (n > POLL_MAX_BYTES - POLL_HDR) n = POLL_MAX_BYTES - POLL_HDR;
+        const addr_t a = static_cast<addr_t>(addr + done);
+        io[0] = POLL_CMD_READ;
+        io[1] = static_cast<uint8_t>(a >> 8);
+        io[2] = static_cast<uint8_t>(a & 0xFF);
+        memset(io + POLL_HDR, 0, n);
+        if (!polled_tx(hw, io, POLL_HDR + n, true)) err = ESP_ERR_TIMEOUT;
+        else memcpy(dst + done, io + POLL_HDR, n);
+        done += n;
+    }
+    restore_regs(saved);
+    return err;
+}
+
+IRAM_ATTR esp_err_t FRAM::xfer_polled(uint8_t *io, size_t n)
+{
+    if (!io || !n || n > POLL_MAX_BYTES) return ESP_ERR_INVALID_ARG;
+    HostRegs saved;
+    if (!load_regs(saved)) return ESP_ERR_TIMEOUT;
+    const bool ok = polled_tx(SPI_LL_GET_HW(host_), io, n, true);
+    restore_regs(saved);
+    return ok ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+IRAM_ATTR esp_err_t FRAM::read_fast(addr_t addr, void *buf, size_t len)
+{
+    if (!buf || !len || !dev_ || (uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    if (shared_ || (mirror_ && mirror_->shared_)) return ESP_ERR_NOT_SUPPORTED;
+    FRAM &f = mirror_ && stale_ == 0 ? *mirror_ : *this;
+    // no task switch while the gate is held: a higher-priority task on this
+    // core would otherwise spin in DriverGuard forever
+    portENTER_CRITICAL_SAFE(&s_direct);
+    esp_err_t err = ESP_ERR_NOT_FINISHED;
+    if (fast_claim()) {
+        err = f.read_polled(addr, buf, len);
+        fast_release();
+    }
+    portEXIT_CRITICAL_SAFE(&s_direct);
+    return err;
+}
+
+IRAM_ATTR esp_err_t FRAM::write_fast(addr_t addr, const void *buf, size_t len)
+{
+    if (!buf || !len || !dev_ || (uint32_t)addr + len > FRAM_SIZE_BYTES) return ESP_ERR_INVALID_ARG;
+    if (shared_ || (mirror_ && mirror_->shared_)) return ESP_ERR_NOT_SUPPORTED;
+    // the chip would drop the data silently (see check_writable())
+    if ((uint32_t)addr + len > POLL_PROTECT_START[(sr_ >> POLL_SR_BP_SHIFT) & 3]) return ESP_ERR_INVALID_STATE;
+    portENTER_CRITICAL_SAFE(&s_direct);
+    esp_err_t err = ESP_ERR_NOT_FINISHED;
+    if (fast_claim()) {
+        err = write_polled(addr, buf, len);
+        fast_release();
+    }
+    portEXIT_CRITICAL_SAFE(&s_direct);
+    return err;
+}
+
+/* -------------------------------------------------------------------------
+ * Direct backend
+ * ----------------------------------------------------------------------*/
+
+bool FRAM::direct_begin(int64_t &t0)
+{
+    // on a shared bus the driver first finishes the other devices'
+    // transactions and holds back new ones until direct_end()
+    if (shared_ && spi_device_acquire_bus(dev_, portMAX_DELAY) != ESP_OK) return false;
+    // preemption off for the whole op: a task never sleeps with the gate
+    // held, so a DriverGuard on the other core can keep spinning on it
+    portENTER_CRITICAL(&s_direct);
+    if (fast_claim()) {
+        t0 = esp_timer_get_time();
+        return true;
+    }
+    portEXIT_CRITICAL(&s_direct);
+    if (shared_) spi_device_release_bus(dev_);
+    return false;
+}
+
+void FRAM::direct_end(int64_t t0)
+{
+    const int64_t us = esp_timer_get_time() - t0;
+    fast_release();
+    portEXIT_CRITICAL(&s_direct);
+    if (shared_) spi_device_release_bus(dev_);
+    account(us, us);
+}
+
+esp_err_t FRAM::direct_read(addr_t addr, void *buf, size_t len)
+{
+    int64_t t0;
+    if (!regs_valid_ || !direct_begin(t0)) return ESP_ERR_NOT_FINISHED;
+    const esp_err_t err = read_polled(addr, buf, len);
+    direct_end(t0);
+    return err;
+}
+
+esp_err_t FRAM::direct_write(addr_t addr, const void *buf, size_t len)
+{
+    int64_t t0;
+    if (!regs_valid_ || !direct_begin(t0)) return ESP_ERR_NOT_FINISHED;
+    const esp_err_t err = write_polled(addr, buf, len);
+    direct_end(t0);
+    return err;
+}
+
+esp_err_t FRAM::direct_xfer(uint8_t *io, size_t n)
+{
+    int64_t t0;
+    if (!regs_valid_ || !direct_begin(t0)) return ESP_ERR_NOT_FINISHED;
+    const esp_err_t err = xfer_polled(io, n);
+    direct_end(t0);
+    return err;
+}
+
+/* -------------------------------------------------------------------------
+ * Bus gate
+ * ----------------------------------------------------------------------*/
+
+IRAM_ATTR bool FRAM::fast_claim()
+{
+    portENTER_CRITICAL_SAFE(&s_gate);
+    const bool ok = s_driver_calls == 0 && !s_fast_busy;
+    if (ok) s_fast_busy = true;
+    portEXIT_CRITICAL_SAFE(&s_gate);
+    return ok;
+}
+
+IRAM_ATTR void FRAM::fast_release()
+{
+    portENTER_CRITICAL_SAFE(&s_gate);
+    s_fast_busy = false;
+    portEXIT_CRITICAL_SAFE(&s_gate);
+}
+
+FRAM::DriverGuard::DriverGuard()
+{
+    // a fast op lasts microseconds: spin rather than block
+    for (;;) {
+        portENTER_CRITICAL(&s_gate);
+        const bool free = !s_fast_busy;
+        if (free) ++s_driver_calls;
+        portEXIT_CRITICAL(&s_gate);
+        if (free) return;
+    }
+}
+
+FRAM::DriverGuard::~DriverGuard()
+{
+    portENTER_CRITICAL(&s_gate);
+    --s_driver_calls;
+    portEXIT_CRITICAL(&s_gate);
+}
@@ -0,0 +1,239 @@
+/**
+ * @file fram_scrub.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_scrub.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+
+static const char *TAG = "FRAM_SCRUB";
+
+// a header magic at most this many bit flips from STORE_MAGIC is a damaged
+// slot; anything further off is a slot never written
+static constexpr int SCRUB_MAGIC_FLIPS = 4;
+
+namespace fram_store {
+
+Scrubber::Scrubber(FRAM &fram)
+    : fram_(fram)
+{
+    step_lock_ = xSemaphoreCreateMutex();
+}
+
+Scrubber::~Scrubber()
+{
+    stop();
+    if (step_lock_) vSemaphoreDelete(step_lock_);
+}
+
+esp_err_t Scrubber::add_persistent(const char *name, FRAM::addr_t base, size_t slots, size_t payload_size,
+                                   SemaphoreHandle_t lock)
+{
+    ESP_RETURN_ON_FALSE(!task_, ESP_ERR_INVALID_STATE, TAG, "scrubber running");
+    ESP_RETURN_ON_FALSE(name && slots > 0 && payload_size > 0 && lock, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    size_t unit = sizeof(Header) + payload_size;
+    ESP_RETURN_ON_FALSE((uint32_t)base + slots * unit <= FRAM::FRAM_SIZE_BYTES, ESP_ERR_INVALID_SIZE, TAG, "bad region");
+    regions_.push_back(Region{name, base, slots * unit, unit, slots, nullptr, lock});
+    return ESP_OK;
+}
+
+esp_err_t Scrubber::add_region(const char *name, FRAM::addr_t base, size_t size, size_t unit,
+                               Checker check, SemaphoreHandle_t lock)
+{
+    ESP_RETURN_ON_FALSE(!task_, ESP_ERR_INVALID_STATE, TAG, "scrubber running");
+    ESP_RETURN_ON_FALSE(name && unit > 0 && size >= unit && size % unit == 0 && check && lock,
+                        ESP_ERR_INVALID_ARG, TAG, "bad args");
+    ESP_RETURN_ON_FALSE((uint32_t)base + size <= FRAM::FRAM_SIZE_BYTES, ESP_ERR_INVALID_SIZE, TAG, "bad region");
+    regions_.push_back(Region{name, base, size, unit, 0, std::move(check), lock});
+    return ESP_OK;
+}
+
+void Scrubber::report(const Region &r, FRAM::addr_t addr, bool repaired)
+{
+    ESP_LOGW(TAG, "%s: damaged unit at 0x%04X%s", r.name, addr, repaired ? ", repaired" : "");
+    if (reporter_) reporter_(Finding{r.name, addr, repaired});
+}
+
+bool Scrubber::slot_intact(const uint8_t *slot, size_t payload)
+{
+    Header h;
+    memcpy(&h, slot, sizeof(h));
+    return h.magic == STORE_MAGIC && h.len == payload && crc32(slot + sizeof(Header), payload) == h.crc;
+}
+
+esp_err_t Scrubber::check_slot(const Region &r, size_t slot, Result &res)
+{
+    const size_t payload = r.unit - sizeof(Header);
+    const FRAM::addr_t addr = static_cast<FRAM::addr_t>(r.base + slot * r.unit);
+    std::vector<uint8_t> buf(r.unit);
+
+    if (fram_.mirrored() && fram_.stale_side() < 0) {
+        // both chips must hold the same bytes; a mismatch is settled by the intact, newer copy
+        std::vector<uint8_t> other(r.unit);
+        ESP_RETURN_ON_ERROR(fram_.read_side(0, addr, buf.data(), buf.size()), TAG, "read side 0");
+        ESP_RETURN_ON_ERROR(fram_.read_side(1, addr, other.data(), other.size()), TAG, "read side 1");
+        stats_.bytes += 2 * r.unit;
+        if (buf != other) {
+            Header ha, hb;
+            memcpy(&ha, buf.data(), sizeof(ha));
+            memcpy(&hb, other.data(), sizeof(hb));
+            bool va = slot_intact(buf.data(), payload), vb = slot_intact(other.data(), payload);
+            if (vb && (!va || hb.seq > ha.seq)) buf.swap(other);
+            if (va || vb) {
+                ESP_RETURN_ON_ERROR(fram_.write(static_cast<FRAM::addr_t>(addr + sizeof(Header)), buf.data() + sizeof(Header), payload),
+                                    TAG, "repair payload");
+                ESP_RETURN_ON_ERROR(fram_.write(addr, buf.data(), sizeof(Header)), TAG, "repair header");
+                ++res.errors;
+                ++res.repaired;
+                return ESP_OK;
+            }
+            // neither chip has it intact: the slot checks below handle it
+        }
+    } else {
+        ESP_RETURN_ON_ERROR(fram_.read(addr, buf.data(), buf.size()), TAG, "read slot");
+        stats_.bytes += buf.size();
+    }
+
+    Header h;
+    memcpy(&h, buf.data(), sizeof(h));
+    // a slot never written (or of another version) is not an error
+    if (std::popcount(h.magic ^ STORE_MAGIC) > SCRUB_MAGIC_FLIPS) return ESP_OK;
+    if (slot_intact(buf.data(), payload)) return ESP_OK;
+    ++res.errors;
+
+    if (h.len == payload && crc32(buf.data() + sizeof(Header), payload) == h.crc) {
+        // only the magic is damaged: the payload is the slot's own
+        h.magic = STORE_MAGIC;
+        ESP_RETURN_ON_ERROR(fram_.write(addr, &h, sizeof(h)), TAG, "repair header");
+        ++res.repaired;
+        return ESP_OK;
+    }
+
+    // newest intact copy among the other slots
+    std::vector<uint8_t> other(r.unit), best;
+    Header best_hdr{};
+    for (size_t i = 0; i < r.slots; ++i) {
+        if (i == slot) continue;
+        ESP_RETURN_ON_ERROR(fram_.read(static_cast<FRAM::addr_t>(r.base + i * r.unit), other.data(), other.size()),
+                            TAG, "read slot");
+        stats_.bytes += other.size();
+        Header oh;
+        memcpy(&oh, other.data(), sizeof(oh));
+        if (oh.version != h.version || !slot_intact(other.data(), payload)) continue;
+        if (best.empty() || oh.seq > best_hdr.seq) {
+            best = other;
+            best_hdr = oh;
+        }
+    }
+    if (best.empty()) return ESP_OK;
+
+    // its payload and CRC under this slot's own seq: a copy of its whole
+    // header would leave two slots with the same seq
+    h.magic = STORE_MAGIC;
+    h.len = static_cast<uint32_t>(payload);
+    h.crc = best_hdr.crc;
+    // payload first, header last, as Persistent::store_immediate() does
+    ESP_RETURN_ON_ERROR(fram_.write(static_cast<FRAM::addr_t>(addr + sizeof(Header)), best.data() + sizeof(Header), payload),
+                        TAG, "repair payload");
+    ESP_RETURN_ON_ERROR(fram_.write(addr, &h, sizeof(h)), TAG, "repair header");
+    ++res.repaired;
+    return ESP_OK;
+}
+
+esp_err_t Scrubber::step(uint32_t budget_us, bool *pass_done)
+{
+    if (pass_done) *pass_done = false;
+    if (regions_.empty()) return ESP_OK;
+
+    xSemaphoreTake(step_lock_, portMAX_DELAY);
+    const int64_t start = esp_timer_get_time();
+    esp_err_t err = ESP_OK;
+    do {
+        const Region &r = regions_[region_];
+        const FRAM::addr_t addr = static_cast<FRAM::addr_t>(r.base + unit_ * r.unit);
+        Result res{0, 0};
+
+        xSemaphoreTake(r.lock, portMAX_DELAY);
+        if (r.slots) {
+            err = check_slot(r, unit_, res);
+        } else {
+            err = r.check(addr, r.unit, res);
+            stats_.bytes += r.unit;
+        }
+        xSemaphoreGive(r.lock);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "%s: check at 0x%04X failed: %s", r.name, addr, esp_err_to_name(err));
+            break;
+        }
+
+        ++stats_.units;
+        stats_.errors += res.errors;
+        stats_.repaired += res.repaired;
+        if (res.errors) report(r, addr, res.repaired >= res.errors);
+
+        if (++unit_ * r.unit >= r.size) {
+            unit_ = 0;
+            if (++region_ == regions_.size()) {
+                region_ = 0;
+                ++stats_.passes;
+                if (pass_done) *pass_done = true;
+                break;
+            }
+        }
+    } while (esp_timer_get_time() - start < budget_us);
+
+    stats_.max_step_us = std::max<uint32_t>(stats_.max_step_us, static_cast<uint32_t>(esp_timer_get_time() - start));
+    xSemaphoreGive(step_lock_);
+    return err;
+}
+
+void Scrubber::task_entry(void *arg)
+{
+    auto *self = static_cast<Scrubber *>(arg);
+    while (self->running_) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(self->period_ms_));
+        if (!self->running_) break;
+        bool done;
+        self->step(self->budget_us_, &done);
+        if (done && self->stats_.errors) {
+            ESP_LOGI(TAG, "pass %u: %u errors, %u repaired", (unsigned)self->stats_.passes,
+                     (unsigned)self->stats_.errors, (unsigned)self->stats_.repaired);
+        }
+    }
+    self->task_ = nullptr;
+    vTaskDelete(nullptr);
+}
+
+esp_err_t Scrubber::start(uint32_t period_ms, uint32_t budget_us, UBaseType_t prio, BaseType_t core)
+{
+    ESP_RETURN_ON_FALSE(step_lock_ && !task_, ESP_ERR_INVALID_STATE, TAG, "bad state");
+    period_ms_ = period_ms;
+    budget_us_ = budget_us;
+    running_ = true;
+    BaseType_t ok = xTaskCreatePinnedToCore(task_entry, "fram_scrub", 3072, this, prio, &task_, core);
+    if (ok != pdPASS) {
+        running_ = false;
+        task_ = nullptr;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void Scrubber::stop()
+{
+    if (!task_) return;
+    running_ = false;
+    xTaskNotifyGive(task_);
+    while (task_) vTaskDelay(1);
+}
+
+} // namespace fram_store
@@ -0,0 +1,153 @@
+/**
+ * @file fram_scrub.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Incremental background integrity scrubber for FRAM store regions.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include "fram.h"
+#include "fram_store.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+namespace fram_store {
+
+/*
+  Scrubber
+  - regions are registered before start(); each one is checked in units
+    (a Persistent slot, or the unit size given to add_region())
+  - step() checks units round-robin until its time budget is used up and
+    resumes where it stopped on the next call
+  - Persistent slots: a slot whose payload CRC does not match, or whose
+    magic is a few bit flips off, is damaged; it gets the payload and CRC of
+    the newest valid slot of the same store and keeps its own seq. On a
+    mirrored FRAM both chips are compared and a differing slot is rewritten
+    from the intact copy
+  - custom regions supply a checker that verifies (and may repair) one unit
+  - the background task runs at low priority, so it only gets the CPU and
+    the bus while the foreground tasks are blocked
+*/
+class Scrubber {
+public:
+    struct Finding {
+        const char *region;
+        FRAM::addr_t addr;
+        bool repaired;
+    };
+
+    struct Stats {
+        uint32_t passes;          ///< complete walks over all regions
+        uint32_t units;           ///< units checked
+        uint32_t bytes;           ///< bytes read
+        uint32_t errors;
+        uint32_t repaired;
+        uint32_t max_step_us;     ///< longest step() seen
+    };
+
+    /// per-unit result of a custom checker
+    struct Result {
+        uint16_t errors;
+        uint16_t repaired;
+    };
+
+    /**
+     * @brief Custom unit checker.
+     * @param addr First byte of the unit.
+     * @param len  Unit size.
+     * @param[out] res Errors found and repaired in the unit.
+     */
+    using Checker = std::function<esp_err_t(FRAM::addr_t addr, size_t len, Result &res)>;
+    using Reporter = std::function<void(const Finding &)>;
+
+    explicit Scrubber(FRAM &fram);
+    ~Scrubber();
+
+    /**
+     * @brief Register the slots of a Persistent<T> store.
+     * @param name         Region name used in reports (must outlive the scrubber).
+     * @param base         Base address passed to Persistent.
+     * @param slots        Slot count passed to Persistent.
+     * @param payload_size sizeof(T).
+     * @param lock         Mutex the application holds around store_*() calls,
+     *                     taken while a slot is checked. Required: a repair
+     *                     racing a store would overwrite the new slot.
+     * @return ESP_ERR_INVALID_ARG without a lock.
+     */
+    esp_err_t add_persistent(const char *name, FRAM::addr_t base, size_t slots, size_t payload_size,
+                             SemaphoreHandle_t lock);
+
+    /**
+     * @brief Register a region checked by a custom checker.
+     * @param unit Bytes handed to the checker per call (size is a multiple of it).
+     * @param lock Mutex the writers of the region hold, taken around each
+     *             checker call. Required, as for add_persistent().
+     */
+    esp_err_t add_region(const char *name, FRAM::addr_t base, size_t size, size_t unit,
+                         Checker check, SemaphoreHandle_t lock);
+
+    /// Called for every damaged unit (from the scrubbing context).
+    void on_finding(Reporter fn) { reporter_ = std::move(fn); }
+
+    /**
+     * @brief Check units until @p budget_us is spent.
+     * @param[out] pass_done Set to true when this call completed a pass.
+     * @return ESP_OK on success, otherwise an esp_err_t error code.
+     */
+    esp_err_t step(uint32_t budget_us, bool *pass_done = nullptr);
+
+    /**
+     * @brief Start the background task.
+     * @param period_ms Pause between steps.
+     * @param budget_us Time budget of one step.
+     */
+    esp_err_t start(uint32_t period_ms = 100, uint32_t budget_us = 2000,
+                    UBaseType_t prio = tskIDLE_PRIORITY + 1, BaseType_t core = tskNO_AFFINITY);
+    void stop();
+
+    Stats stats() const { return stats_; }
+
+    Scrubber(const Scrubber&) = delete;
+    Scrubber& operator=(const Scrubber&) = delete;
+
+private:
+    struct Region {
+        const char *name;
+        FRAM::addr_t base;
+        size_t size;
+        size_t unit;
+        size_t slots;          ///< > 0 for Persistent regions
+        Checker check;
+        SemaphoreHandle_t lock;
+    };
+
+    static bool slot_intact(const uint8_t *slot, size_t payload);
+    esp_err_t check_slot(const Region &r, size_t slot, Result &res);
+    void report(const Region &r, FRAM::addr_t addr, bool repaired);
+    static void task_entry(void *arg);
+
+    FRAM &fram_;
+    std::vector<Region> regions_;
+    size_t region_{0};
+    size_t unit_{0};
+    Reporter reporter_;
+    Stats stats_{};
+
+    SemaphoreHandle_t step_lock_{nullptr};
+    TaskHandle_t task_{nullptr};
+    uint32_t period_ms_{100};
+    uint32_t budget_us_{2000};
+    volatile bool running_{false};
+};
+
+} // namespace fram_store
@@ -0,0 +1,228 @@
+/**
+ * @file fram_serial.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Compile-time field lists and the fixed-size encoding used by Persistent<T>.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  Encoders return false when a value does not fit its field.
+ */
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+namespace fram_store {
+
+/*
+  Fields<T>
+  - describes the stored members of T, in storage order:
+
+      template<> struct fram_store::Fields<Settings> {
+          static constexpr auto list = std::make_tuple(
+              fram_store::field(&Settings::interval),
+              fram_store::text<24>(&Settings::name),   // std::string, at most 24 bytes
+              fram_store::field(&Settings::limits));   // std::array / std::optional / described struct
+      };
+
+  - the encoding is packed (no padding), little-endian on every host and has
+    a fixed size known at compile time (serial::Codec<T>::SIZE): a text field
+    is [length][N bytes], an optional is [present][value]
+  - encode/decode are unrolled over the field list, there is no runtime
+    type information
+*/
+template<typename T> struct Fields {};
+
+template<typename T>
+concept Described = requires { Fields<T>::list; };
+
+template<typename C, typename M>
+struct FieldRef { M C::*member; };
+
+template<size_t N, typename C>
+struct TextRef { std::string C::*member; };
+
+/// A member stored with its own codec.
+template<typename C, typename M>
+constexpr FieldRef<C, M> field(M C::*member) { return {member}; }
+
+/// A std::string member stored in a fixed field of up to N bytes.
+template<size_t N, typename C>
+constexpr TextRef<N, C> text(std::string C::*member) { return {member}; }
+
+namespace serial {
+
+template<typename T> struct Codec {
+    static_assert(sizeof(T) == 0, "no codec for this type: store std::string with fram_store::text<N>(), "
+                                  "other structs need their own Fields<T>");
+};
+
+template<size_t S> struct Unsigned;
+template<> struct Unsigned<1> { using type = uint8_t; };
+template<> struct Unsigned<2> { using type = uint16_t; };
+template<> struct Unsigned<4> { using type = uint32_t; };
+template<> struct Unsigned<8> { using type = uint64_t; };
+
+// integers, enums and floating point: little-endian, sizeof(T) bytes
+template<typename T>
+    requires (std::is_arithmetic_v<T> || std::is_enum_v<T>)
+struct Codec<T> {
+    static constexpr size_t SIZE = sizeof(T);
+    using U = typename Unsigned<SIZE>::type;
+
+    static bool encode(uint8_t *&p, const T &v) {
+        U u = std::bit_cast<U>(v);
+        for (size_t i = 0; i < SIZE; ++i) *p++ = static_cast<uint8_t>(u >> (8 * i));
+        return true;
+    }
+    static bool decode(const uint8_t *&p, T &v) {
+        U u = 0;
+        for (size_t i = 0; i < SIZE; ++i) u |= static_cast<U>(*p++) << (8 * i);
+        if constexpr (std::is_same_v<T, bool>) {
+            v = u != 0;
+        } else {
+            v = std::bit_cast<T>(u);
+        }
+        return true;
+    }
+};
+
+template<typename E, size_t N>
+struct Codec<std::array<E, N>> {
+    static constexpr size_t SIZE = N * Codec<E>::SIZE;
+
+    static bool encode(uint8_t *&p, const std::array<E, N> &v) {
+        for (const E &e : v) {
+            if (!Codec<E>::encode(p, e)) return false;
+        }
+        return true;
+    }
+    static bool decode(const uint8_t *&p, std::array<E, N> &v) {
+        for (E &e : v) {
+            if (!Codec<E>::decode(p, e)) return false;
+        }
+        return true;
+    }
+};
+
+template<typename E>
+struct Codec<std::optional<E>> {
+    static constexpr size_t SIZE = 1 + Codec<E>::SIZE;
+
+    static bool encode(uint8_t *&p, const std::optional<E> &v) {
+        *p++ = v.has_value();
+        if (v) return Codec<E>::encode(p, *v);
+        for (size_t i = 0; i < Codec<E>::SIZE; ++i) *p++ = 0;
+        return true;
+    }
+    static bool decode(const uint8_t *&p, std::optional<E> &v) {
+        const uint8_t present = *p++;
+        if (!present) {
+            v.reset();
+            p += Codec<E>::SIZE;
+            return true;
+        }
+        if (present != 1) return false;
+        return Codec<E>::decode(p, v.emplace());
+    }
+};
+
+// one entry of a field list; value_type is the member type
+template<typename F> struct Member;
+
+template<typename C, typename M>
+struct Member<FieldRef<C, M>> {
+    using value_type = M;
+    static constexpr size_t SIZE = Codec<M>::SIZE;
+    static bool encode_value(uint8_t *&p, const M &v) { return Codec<M>::encode(p, v); }
+    static bool decode_value(const uint8_t *&p, M &v) { return Codec<M>::decode(p, v); }
+    static bool encode(uint8_t *&p, const C &obj, FieldRef<C, M> f) { return encode_value(p, obj.*f.member); }
+    static bool decode(const uint8_t *&p, C &obj, FieldRef<C, M> f) { return decode_value(p, obj.*f.member); }
+};
+
+template<size_t N, typename C>
+struct Member<TextRef<N, C>> {
+    using value_type = std::string;
+    using Len = std::conditional_t<(N <= UINT8_MAX), uint8_t, uint16_t>;
+    static_assert(N <= UINT16_MAX, "text field too long");
+    static constexpr size_t SIZE = sizeof(Len) + N;
+
+    static bool encode_value(uint8_t *&p, const std::string &s) {
+        if (s.size() > N) return false;
+        Codec<Len>::encode(p, static_cast<Len>(s.size()));
+        std::copy(s.begin(), s.end(), p);
+        std::fill(p + s.size(), p + N, 0);
+        p += N;
+        return true;
+    }
+    static bool decode_value(const uint8_t *&p, std::string &s) {
+        Len len = 0;
+        Codec<Len>::decode(p, len);
+        if (len > N) return false;
+        s.assign(reinterpret_cast<const char *>(p), len);
+        p += N;
+        return true;
+    }
+    static bool encode(uint8_t *&p, const C &obj, TextRef<N, C> f) { return encode_value(p, obj.*f.member); }
+    static bool decode(const uint8_t *&p, C &obj, TextRef<N, C> f) { return decode_value(p, obj.*f.member); }
+};
+
+// described structs: the fields in list order
+template<Described T>
+struct Codec<T> {
+    static constexpr auto &list = Fields<T>::list;
+
+    static constexpr size_t SIZE = std::apply([](const auto &...f) {
+        return (size_t{0} + ... + Member<std::remove_cvref_t<decltype(f)>>::SIZE);
+    }, list);
+
+    static bool encode(uint8_t *&p, const T &v) {
+        return std::apply([&](const auto &...f) {
+            return (... && Member<std::remove_cvref_t<decltype(f)>>::encode(p, v, f));
+        }, list);
+    }
+    static bool decode(const uint8_t *&p, T &v) {
+        return std::apply([&](const auto &...f) {
+            return (... && Member<std::remove_cvref_t<decltype(f)>>::decode(p, v, f));
+        }, list);
+    }
+};
+
+/**
+ * @brief Find member @p m in the field list of T.
+ * @param[out] off Offset of its encoding in the payload.
+ * @param fn Called with the Member<> codec of the entry (as a null pointer
+ *           of that type), only if the member is listed.
+ * @return false if @p m is not in Fields<T>::list.
+ */
+template<Described T, typename M, typename Fn>
+bool with_field(M T::*m, size_t &off, Fn &&fn)
+{
+    bool found = false;
+    size_t at = 0;
+    auto visit = [&](const auto &f) {
+        using F = Member<std::remove_cvref_t<decltype(f)>>;
+        if (found) return;
+        if constexpr (std::is_same_v<typename F::value_type, M>) {
+            if (f.member == m) {
+                off = at;
+                found = true;
+                fn(static_cast<const F *>(nullptr));
+                return;
+            }
+        }
+        at += F::SIZE;
+    };
+    std::apply([&](const auto &...f) { (visit(f), ...); }, Codec<T>::list);
+    return found;
+}
+
+} // namespace serial
+} // namespace fram_store
@@ -0,0 +1,175 @@
+/**
+ * @file fram_shadow.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_shadow.h"
+#include "fram_store.h"
+#include <cstring>
+#include <vector>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_rom_crc.h"
+
+static const char *TAG = "FRAM_SHADOW";
+
+namespace fram_store {
+
+ShadowCore::ShadowCore(FRAM &fram, FRAM::addr_t base, uint16_t version, size_t size)
+    : fram_(fram), base_(base), version_(version), size_(size), copy_size_(sizeof(CopyHeader) + size)
+{}
+
+bool ShadowCore::valid(const uint8_t *buf) const
+{
+    CopyHeader h;
+    memcpy(&h, buf, sizeof(h));
+    if (h.version != version_ || h.len != size_) return false;
+    return crc32(buf + sizeof(CopyHeader), size_) == h.crc;
+}
+
+bool ShadowCore::read_copy(int i, uint8_t *buf)
+{
+    if (fram_.read(copy_addr(i), buf, copy_size_) == ESP_OK && valid(buf)) return true;
+    if (!fram_.mirrored()) return false;
+    for (uint8_t side = 0; side < 2; ++side) {
+        if (fram_.read_side(side, copy_addr(i), buf, copy_size_) == ESP_OK && valid(buf)) return true;
+    }
+    return false;
+}
+
+esp_err_t ShadowCore::load(void *dst)
+{
+    uint8_t sel = 0;
+    ESP_RETURN_ON_ERROR(fram_.read(base_, &sel, 1), TAG, "read selector");
+    const int a = sel == SELECT[0] ? 0 : sel == SELECT[1] ? 1 : -1;
+
+    std::vector<uint8_t> buf(2 * copy_size_);
+    uint8_t *cur = buf.data(), *alt = buf.data() + copy_size_;
+    int found = -1;
+    if (a >= 0) {
+        if (read_copy(a, cur)) {
+            found = a;
+        } else if (read_copy(a ^ 1, cur)) {
+            // the next store() overwrites the damaged copy
+            ESP_LOGW(TAG, "0x%04X: copy %d damaged, using the previous commit", (unsigned)base_, a);
+            found = a ^ 1;
+        }
+    } else {
+        // no selector yet (or a damaged one): the newer valid copy
+        const bool v0 = read_copy(0, cur), v1 = read_copy(1, alt);
+        CopyHeader h0, h1;
+        memcpy(&h0, cur, sizeof(h0));
+        memcpy(&h1, alt, sizeof(h1));
+        if (v1 && (!v0 || h1.seq > h0.seq)) {
+            std::swap(cur, alt);
+            found = 1;
+        } else if (v0) {
+            found = 0;
+        }
+    }
+    if (found < 0) return ESP_ERR_NOT_FOUND;
+
+    CopyHeader h;
+    memcpy(&h, cur, sizeof(h));
+    memcpy(dst, cur + sizeof(CopyHeader), size_);
+    active_ = found;
+    seq_ = h.seq;
+    return ESP_OK;
+}
+
+esp_err_t ShadowCore::store(const void *src)
+{
+    if (active_ < 0) {
+        // first commit of this instance: find the active copy and its seq
+        std::vector<uint8_t> tmp(size_);
+        esp_err_t err = load(tmp.data());
+        if (err == ESP_ERR_NOT_FOUND) {
+            active_ = 1;    // the first commit goes to copy 0
+            seq_ = 0;
+        } else if (err != ESP_OK) {
+            return err;
+        }
+    }
+    const int target = active_ ^ 1;
+
+    CopyHeader h;
+    h.seq = seq_ + 1;
+    h.version = version_;
+    h.len = static_cast<uint16_t>(size_);
+    h.crc = crc32(src, size_);
+    std::vector<uint8_t> buf(copy_size_);
+    memcpy(buf.data(), &h, sizeof(h));
+    memcpy(buf.data() + sizeof(h), src, size_);
+
+    // inactive copy, then the 1-byte flip
+    ESP_RETURN_ON_ERROR(fram_.write(copy_addr(target), buf.data(), buf.size()), TAG, "write copy %d", target);
+    ESP_RETURN_ON_ERROR(fram_.write(base_, &SELECT[target], 1), TAG, "write selector");
+    active_ = target;
+    seq_ = h.seq;
+    return ESP_OK;
+}
+
+/* -------------------------------------------------------------------------
+ * Fast path: IRAM, stack buffers, ROM CRC, no inline helpers from flash
+ * ----------------------------------------------------------------------*/
+
+IRAM_ATTR esp_err_t ShadowCore::load_fast(void *dst)
+{
+    if (size_ > FAST_MAX) return ESP_ERR_INVALID_SIZE;
+    uint8_t sel = 0;
+    esp_err_t err = fram_.read_fast(base_, &sel, 1);
+    if (err != ESP_OK) return err;
+    const int a = sel == SELECT[0] ? 0 : sel == SELECT[1] ? 1 : -1;
+    if (a < 0) return ESP_ERR_NOT_FOUND;
+
+    uint8_t buf[sizeof(CopyHeader) + FAST_MAX];
+    CopyHeader h;
+    for (int k = 0; k < 2; ++k) {
+        const int i = a ^ k;
+        err = fram_.read_fast(static_cast<FRAM::addr_t>(base_ + 1 + i * copy_size_), buf, copy_size_);
+        if (err != ESP_OK) return err;
+        memcpy(&h, buf, sizeof(h));
+        if (h.version == version_ && h.len == size_ &&
+            esp_rom_crc32_le(0, buf + sizeof(CopyHeader), size_) == h.crc) {
+            memcpy(dst, buf + sizeof(CopyHeader), size_);
+            active_ = i;
+            seq_ = h.seq;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+IRAM_ATTR esp_err_t ShadowCore::store_fast(const void *src)
+{
+    if (size_ > FAST_MAX) return ESP_ERR_INVALID_SIZE;
+    if (active_ < 0) return ESP_ERR_INVALID_STATE;
+    const int target = active_ ^ 1;
+
+    uint8_t buf[sizeof(CopyHeader) + FAST_MAX];
+    CopyHeader h;
+    h.seq = seq_ + 1;
+    h.version = version_;
+    h.len = static_cast<uint16_t>(size_);
+    h.crc = esp_rom_crc32_le(0, static_cast<const uint8_t *>(src), size_);
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), src, size_);
+
+    // SELECT is in flash: the selector goes out from the stack
+    const uint8_t sel = target ? SELECT[1] : SELECT[0];
+
+    // inactive copy, then the 1-byte flip, as in store()
+    esp_err_t err = fram_.write_fast(static_cast<FRAM::addr_t>(base_ + 1 + target * copy_size_), buf, copy_size_);
+    if (err == ESP_OK) err = fram_.write_fast(base_, &sel, 1);
+    if (err != ESP_OK) return err;
+    active_ = target;
+    seq_ = h.seq;
+    return ESP_OK;
+}
+
+} // namespace fram_store
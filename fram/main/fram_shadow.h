@@ -0,0 +1,193 @@
+/**
+ * @file fram_shadow.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief A/B shadow copies with a one-byte selector.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include "fram.h"
+#include "fram_serial.h"
+#include "esp_err.h"
+
+namespace fram_store {
+
+/*
+  ShadowCore
+  - region layout: [selector][copy 0][copy 1], copy = [CopyHeader{seq,
+    version, len, crc}][payload]
+  - the selector byte names the active copy (SELECT[0] or SELECT[1]); any
+    other value means "not written yet"
+  - commit: the inactive copy is written in one transfer (header and
+    payload), then the selector is flipped with a single 1-byte write. A
+    reset before the flip leaves the old copy active; the flip itself
+    cannot tear
+  - load: the selector, then the active copy: two reads whatever the record
+    size, no header scan. A damaged active copy falls back to the other
+    one (on a mirror, first to the other chip); without a valid selector
+    both copies are read and the newer valid one wins
+  - the untyped engine behind Shadow<T>, like PersistentCore for Persistent<T>
+*/
+class ShadowCore {
+public:
+    struct CopyHeader {
+        uint32_t seq;
+        uint16_t version;
+        uint16_t len;
+        uint32_t crc;       ///< crc32 of the payload
+    };
+
+    static constexpr uint8_t SELECT[2] = {0x5A, 0xA5};
+
+    /// Region bytes for a payload of @p size bytes.
+    static constexpr size_t region_size(size_t size) { return 1 + 2 * (sizeof(CopyHeader) + size); }
+
+    ShadowCore(FRAM &fram, FRAM::addr_t base, uint16_t version, size_t size);
+
+    // load the active copy into dst (size bytes); dst is untouched on error
+    esp_err_t load(void *dst);
+
+    // write src (size bytes) to the inactive copy and select it
+    esp_err_t store(const void *src);
+
+    // load()/store() from IRAM through FRAM::read_fast()/write_fast(), for
+    // records up to FAST_MAX bytes; no mirror-side retries, and store_fast()
+    // needs the active copy known (ESP_ERR_INVALID_STATE before the first
+    // load()/store())
+    static constexpr size_t FAST_MAX = 128;
+    esp_err_t load_fast(void *dst);
+    esp_err_t store_fast(const void *src);
+
+    size_t size() const { return size_; }
+    /// seq of the last copy loaded or stored
+    uint32_t seq() const { return seq_; }
+    /// active copy (0/1), -1 before the first load()/store()
+    int active() const { return active_; }
+
+private:
+    // reads one copy into buf and validates it; retries on each mirror side
+    bool read_copy(int i, uint8_t *buf);
+    bool valid(const uint8_t *buf) const;
+    FRAM::addr_t copy_addr(int i) const { return static_cast<FRAM::addr_t>(base_ + 1 + i * copy_size_); }
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    uint16_t version_;
+    size_t size_;
+    size_t copy_size_;
+    int active_{-1};
+    uint32_t seq_{0};
+};
+
+/*
+  Shadow<T>
+  - typed front end of ShadowCore with the Persistent<T> API: load(),
+    store_immediate(), store_deferred(), flush()
+  - T is stored as raw bytes if trivially copyable, otherwise through its
+    Fields<T> description (fram_serial.h)
+  - suits medium-sized records: a commit costs one write of the record and
+    one byte, a load two reads; Persistent<T> spreads wear over more slots
+*/
+template<typename T>
+class Shadow {
+    static_assert(std::is_trivially_copyable<T>::value || Described<T>,
+                  "T must be trivially_copyable or described by fram_store::Fields<T>");
+public:
+    /// bytes of T in a copy
+    static constexpr size_t PAYLOAD_SIZE = [] {
+        if constexpr (Described<T>) return serial::Codec<T>::SIZE;
+        else return sizeof(T);
+    }();
+    static_assert(PAYLOAD_SIZE <= UINT16_MAX, "record too large");
+
+    /// bytes to reserve at base
+    static constexpr size_t REGION_SIZE = ShadowCore::region_size(PAYLOAD_SIZE);
+
+    Shadow(FRAM &fram, FRAM::addr_t base, uint16_t version = 1)
+        : core_(fram, base, version, PAYLOAD_SIZE)
+    {}
+
+    esp_err_t load(T &dst) {
+        if constexpr (Described<T>) {
+            std::array<uint8_t, PAYLOAD_SIZE> buf;
+            esp_err_t err = core_.load(buf.data());
+            if (err != ESP_OK) return err;
+            const uint8_t *p = buf.data();
+            T tmp{};
+            if (!serial::Codec<T>::decode(p, tmp)) return ESP_ERR_INVALID_SIZE;
+            dst = std::move(tmp);
+            return ESP_OK;
+        } else {
+            return core_.load(&dst);
+        }
+    }
+
+    esp_err_t store_immediate(const T &src) {
+        esp_err_t err;
+        if constexpr (Described<T>) {
+            std::array<uint8_t, PAYLOAD_SIZE> buf;
+            uint8_t *p = buf.data();
+            if (!serial::Codec<T>::encode(p, src)) return ESP_ERR_INVALID_SIZE;
+            err = core_.store(buf.data());
+        } else {
+            err = core_.store(&src);
+        }
+        if (err != ESP_OK) return err;
+        cache_ = src;
+        dirty_ = false;
+        return ESP_OK;
+    }
+
+    void store_deferred(const T &src) {
+        cache_ = src;
+        dirty_ = true;
+    }
+
+    esp_err_t flush() {
+        if (!dirty_) return ESP_OK;
+        return store_immediate(cache_);
+    }
+
+    /**
+     * @brief load() and store_immediate() for IRAM interrupt handlers and cache-off sections.
+     * @return As FRAM::read_fast()/write_fast(); store_fast() returns
+     *         ESP_ERR_INVALID_STATE before the first load() or store_immediate().
+     * @note Two reads or two writes whatever happens, CRC from ROM. The
+     *       caller must be in IRAM too; the store must not be used from
+     *       another context at the same time.
+     */
+    __attribute__((always_inline)) esp_err_t load_fast(T &dst)
+        requires std::is_trivially_copyable_v<T>
+    {
+        static_assert(PAYLOAD_SIZE <= ShadowCore::FAST_MAX, "record too large for the fast path");
+        return core_.load_fast(&dst);
+    }
+
+    __attribute__((always_inline)) esp_err_t store_fast(const T &src)
+        requires std::is_trivially_copyable_v<T>
+    {
+        static_assert(PAYLOAD_SIZE <= ShadowCore::FAST_MAX, "record too large for the fast path");
+        esp_err_t err = core_.store_fast(&src);
+        if (err != ESP_OK) return err;
+        cache_ = src;
+        dirty_ = false;
+        return ESP_OK;
+    }
+
+    bool dirty() const { return dirty_; }
+    uint32_t seq() const { return core_.seq(); }
+
+private:
+    ShadowCore core_;
+    T cache_{};
+    bool dirty_{false};
+};
+
+} // namespace fram_store
@@ -0,0 +1,134 @@
+/**
+ * @file fram_snapshot.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_snapshot.h"
+#include <cinttypes>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include "esp_app_desc.h"
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+static const char *TAG = "FRAM_SNAP";
+
+namespace fram_store {
+
+Snapshot::Snapshot(FRAM &fram, FRAM::addr_t base, size_t size)
+    : fram_(fram), base_(base), size_(size)
+{
+    char sha[9] = {0};
+    esp_app_get_elf_sha256(sha, sizeof(sha));
+    build_ = static_cast<uint32_t>(strtoul(sha, nullptr, 16));
+}
+
+esp_err_t Snapshot::add(void *obj, size_t len)
+{
+    ESP_RETURN_ON_FALSE(obj && len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    ESP_RETURN_ON_FALSE(count_ < MAX_OBJECTS, ESP_ERR_NO_MEM, TAG, "too many objects");
+    ESP_RETURN_ON_FALSE(len_ + len + sizeof(Trailer) <= size_, ESP_ERR_NO_MEM, TAG, "region full (%u bytes)",
+                        (unsigned)size_);
+    iov_[count_++] = FRAM::IoVec{obj, len};
+    len_ += len;
+    const uint32_t l = static_cast<uint32_t>(len);
+    layout_ = esp_rom_crc32_le(layout_, reinterpret_cast<const uint8_t *>(&l), sizeof(l));
+    return ESP_OK;
+}
+
+uint32_t Snapshot::data_crc() const
+{
+    uint32_t crc = 0;
+    for (size_t i = 0; i < count_; ++i) {
+        crc = esp_rom_crc32_le(crc, static_cast<const uint8_t *>(iov_[i].base), iov_[i].len);
+    }
+    return crc;
+}
+
+esp_err_t Snapshot::save()
+{
+    ESP_RETURN_ON_FALSE(count_, ESP_ERR_INVALID_STATE, TAG, "no objects");
+    const int64_t t0 = esp_timer_get_time();
+    trailer_ = Trailer{MAGIC, seq_ + 1, static_cast<uint32_t>(len_), build_, layout_, data_crc()};
+    iov_[count_] = FRAM::IoVec{&trailer_, sizeof(trailer_)};
+
+    FRAM::WriteWindow window(fram_);
+    ESP_RETURN_ON_ERROR(window.status(), TAG, "unlock");
+    ESP_RETURN_ON_ERROR(fram_.writev(base_, iov_, count_ + 1), TAG, "write");
+    ++seq_;
+    timing_.save_us = static_cast<uint32_t>(esp_timer_get_time() - t0);
+    return ESP_OK;
+}
+
+esp_err_t Snapshot::restore(bool any_reset)
+{
+    ESP_RETURN_ON_FALSE(count_, ESP_ERR_INVALID_STATE, TAG, "no objects");
+    if (!any_reset && esp_reset_reason() != ESP_RST_DEEPSLEEP) return ESP_ERR_NOT_FOUND;
+    const int64_t t0 = esp_timer_get_time();
+    // one read into a scratch copy: the objects change only once the snapshot checks out
+    uint8_t *buf = static_cast<uint8_t *>(malloc(len_ + sizeof(Trailer)));
+    ESP_RETURN_ON_FALSE(buf, ESP_ERR_NO_MEM, TAG, "no memory for %u bytes", (unsigned)(len_ + sizeof(Trailer)));
+    esp_err_t err = fram_.read(base_, buf, len_ + sizeof(Trailer));
+
+    Trailer t{};
+    if (err == ESP_OK) {
+        memcpy(&t, buf + len_, sizeof(t));
+        if (t.magic != MAGIC) {
+            err = ESP_ERR_NOT_FOUND;
+        } else if (t.len != len_ || t.build != build_ || t.layout != layout_) {
+            ESP_LOGW(TAG, "snapshot %" PRIu32 " is from another build or object set", t.seq);
+            err = ESP_ERR_INVALID_VERSION;
+        } else if (t.crc != esp_rom_crc32_le(0, buf, len_)) {
+            ESP_LOGW(TAG, "snapshot %" PRIu32 ": CRC mismatch", t.seq);
+            err = ESP_ERR_INVALID_CRC;
+        }
+    }
+    if (err == ESP_OK) {
+        size_t off = 0;
+        for (size_t i = 0; i < count_; ++i) {
+            memcpy(iov_[i].base, buf + off, iov_[i].len);
+            off += iov_[i].len;
+        }
+    }
+    free(buf);
+    const int64_t now = esp_timer_get_time();
+    timing_.restore_us = static_cast<uint32_t>(now - t0);
+    timing_.ready_us = now;
+    if (err != ESP_OK) {
+        seq_ = 0;
+        return err;
+    }
+    seq_ = t.seq;
+    return ESP_OK;
+}
+
+esp_err_t Snapshot::save_and_sleep()
+{
+    esp_err_t err = save();
+    if (err != ESP_OK) {
+        // the previous snapshot must not come back on the next wake
+        (void)invalidate();
+        return err;
+    }
+    esp_deep_sleep_start();
+    return ESP_OK;
+}
+
+esp_err_t Snapshot::invalidate()
+{
+    const uint32_t none = 0;
+    FRAM::WriteWindow window(fram_);
+    ESP_RETURN_ON_ERROR(window.status(), TAG, "unlock");
+    return fram_.write(static_cast<FRAM::addr_t>(base_ + len_ + offsetof(Trailer, magic)), &none, sizeof(none));
+}
+
+} // namespace fram_store
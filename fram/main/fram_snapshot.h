@@ -0,0 +1,124 @@
+/**
+ * @file fram_snapshot.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief RAM state kept in FRAM across deep sleep.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include "fram.h"
+#include "esp_err.h"
+
+namespace fram_store {
+
+/*
+  Snapshot
+  - region layout: [object 0][object 1]...[object n-1][Trailer{magic, seq,
+    len, build, layout, crc}], objects in add() order
+  - save() writes the objects and the trailer with one FRAM::writev(): one
+    WRITE command streamed straight from the objects' RAM, trailer last, so a
+    reset during the write leaves a trailer that does not match the data
+  - restore() reads objects and trailer back with one FRAM::read() into a
+    scratch buffer and checks the trailer: CRC (ROM crc32), byte count,
+    object sizes and firmware build. Only a snapshot that passes is copied
+    into the objects, so an image with another layout never gets the bytes
+    of the previous one and a failed restore leaves them untouched
+  - restore() acts only on a wake from deep sleep; after any other reset the
+    snapshot is stale and the objects keep their initial values
+  - call restore() first in app_main, right after FRAM::init(); timing()
+    reports the cost of both sides and the esp_timer time at which the state
+    was back
+*/
+class Snapshot {
+public:
+    static constexpr size_t MAX_OBJECTS = 16;
+
+    struct Trailer {
+        uint32_t magic;
+        uint32_t seq;       ///< saves since the last failed restore
+        uint32_t len;       ///< object bytes
+        uint32_t build;     ///< first 4 bytes of the ELF SHA-256
+        uint32_t layout;    ///< crc32 of the object sizes
+        uint32_t crc;       ///< crc32 of the object bytes
+    };
+
+    struct Timing {
+        uint32_t save_us;       ///< last save(): CRC and bulk write
+        uint32_t restore_us;    ///< last restore(): bulk read and checks
+        int64_t ready_us;       ///< esp_timer time at the end of the last restore() (wake-to-ready after the bootloader)
+    };
+
+    /**
+     * @brief Construct a snapshot over [base, base + size).
+     * @note Nothing is read here; register the objects, then restore().
+     */
+    Snapshot(FRAM &fram, FRAM::addr_t base, size_t size);
+
+    /**
+     * @brief Register @p len bytes at @p obj (plain data, no pointers into the heap).
+     * @return ESP_OK, ESP_ERR_NO_MEM if the table or the region is full.
+     */
+    esp_err_t add(void *obj, size_t len);
+
+    template<typename T>
+    esp_err_t add(T &obj) {
+        static_assert(std::is_trivially_copyable<T>::value, "T must be trivially_copyable");
+        return add(&obj, sizeof(T));
+    }
+
+    /// Region bytes used by the registered objects and the trailer.
+    size_t bytes() const { return len_ + sizeof(Trailer); }
+
+    /// Write all objects (call just before esp_deep_sleep_start()).
+    esp_err_t save();
+
+    /**
+     * @brief Bring the objects back after a deep-sleep wake.
+     * @param any_reset Also restore after other resets (e.g. a test that
+     *                  skips the actual sleep).
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if this was not a deep-sleep wake or
+     *         there is no snapshot, ESP_ERR_INVALID_VERSION if it was written
+     *         by another build or object set, ESP_ERR_INVALID_CRC if it is
+     *         damaged, ESP_ERR_NO_MEM without room for the scratch buffer.
+     *         The objects are only written on ESP_OK.
+     */
+    esp_err_t restore(bool any_reset = false);
+
+    /// save(), then esp_deep_sleep_start() with the wake sources set up by the caller.
+    /// Returns only if the save failed; the old snapshot is invalidated then.
+    esp_err_t save_and_sleep();
+
+    /// Make the stored snapshot unusable (e.g. when the state was rebuilt).
+    esp_err_t invalidate();
+
+    Timing timing() const { return timing_; }
+    uint32_t seq() const { return seq_; }
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+private:
+    static constexpr uint32_t MAGIC = 0x50414E53; // 'SNAP'
+
+    uint32_t data_crc() const;
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    size_t size_;
+    FRAM::IoVec iov_[MAX_OBJECTS + 1]{};    ///< objects, then the trailer
+    size_t count_{0};
+    size_t len_{0};
+    uint32_t layout_{0};
+    uint32_t build_{0};
+    uint32_t seq_{0};
+    Trailer trailer_{};
+    Timing timing_{};
+};
+
+} // namespace fram_store
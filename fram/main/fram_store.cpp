@@ -0,0 +1,252 @@
+/**
+ * @file fram_store.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_store.h"
+#include "fram_group.h"
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include "esp_attr.h"
+#include "esp_rom_crc.h"
+
+namespace fram_store {
+
+static const uint32_t *crc_table()
+{
+    static uint32_t table[256];
+    static bool init = false;
+    if (!init) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; ++j)
+                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+            table[i] = c;
+        }
+        init = true;
+    }
+    return table;
+}
+
+uint32_t crc32(const void* data, size_t len)
+{
+    const uint32_t *table = crc_table();
+    uint32_t c = 0xFFFFFFFFu;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < len; ++i)
+        c = table[(c ^ p[i]) & 0xFFu] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_patch(uint32_t crc, const void *old_bytes, const void *new_bytes, size_t n, size_t tail)
+{
+    const uint32_t *table = crc_table();
+    const uint8_t *a = reinterpret_cast<const uint8_t *>(old_bytes);
+    const uint8_t *b = reinterpret_cast<const uint8_t *>(new_bytes);
+    // zero init, no final xor: the part of the CRC that depends on the data
+    uint32_t c = 0;
+    for (size_t i = 0; i < n; ++i)
+        c = table[(c ^ a[i] ^ b[i]) & 0xFFu] ^ (c >> 8);
+    for (size_t i = 0; i < tail && c; ++i)
+        c = table[c & 0xFFu] ^ (c >> 8);
+    return crc ^ c;
+}
+
+PersistentCore::PersistentCore(FRAM &fram, FRAM::addr_t base_addr, size_t slots, uint16_t version, size_t size)
+    : fram_(fram), base_(base_addr), slots_(slots), version_(version), size_(size),
+      slot_size_(sizeof(Header) + size)
+{}
+
+esp_err_t PersistentCore::load(void *dst)
+{
+    // two slot buffers: the one being read and the best one so far
+    std::vector<uint8_t> buf(2 * slot_size_);
+    uint8_t *cur = buf.data(), *best = buf.data() + slot_size_;
+    Header best_hdr{0};
+    size_t best_slot = 0;
+    bool found = false;
+
+    for (size_t i = 0; i < slots_; ++i) {
+        FRAM::addr_t a = slot_addr(i);
+        // on a mirrored device a bad copy on one chip is answered by the other
+        if (!read_slot(a, cur, -1) && !(fram_.mirrored() && recover_slot(a, cur))) continue;
+        Header h;
+        memcpy(&h, cur, sizeof(h));
+        if (!found || h.seq > best_hdr.seq) {
+            best_hdr = h;
+            best_slot = i;
+            std::swap(cur, best);
+            found = true;
+        }
+    }
+
+    if (!found) return ESP_ERR_NOT_FOUND;
+    memcpy(dst, best + sizeof(Header), size_);
+    last_seq_ = best_hdr.seq;
+    cur_slot_ = static_cast<int>(best_slot);
+    cur_crc_ = best_hdr.crc;
+    return ESP_OK;
+}
+
+esp_err_t PersistentCore::store(const void *src)
+{
+    return write_slot(src, crc32(src, size_));
+}
+
+esp_err_t PersistentCore::write_slot(const void *src, uint32_t crc)
+{
+    Header cur_best{0};
+    FRAM::addr_t best_addr = base_;
+    bool found = false;
+
+    // newest slot known from the last load()/store(): no header scan
+    const bool known = cur_slot_ >= 0;
+    if (known) {
+        cur_best.seq = last_seq_;
+        best_addr = slot_addr(cur_slot_);
+        found = true;
+    }
+    for (size_t i = 0; !known && i < slots_; ++i) {
+        FRAM::addr_t a = slot_addr(i);
+        Header h;
+        (void)fram_.read(a, &h, sizeof(h));
+        if (h.magic == STORE_MAGIC && h.version == version_) {
+            if (!found || h.seq > cur_best.seq) {
+                cur_best = h;
+                best_addr = a;
+                found = true;
+            }
+        }
+    }
+    uint32_t next_seq = found ? (cur_best.seq + 1) : 1;
+    // pick next slot (circular) after best_addr
+    FRAM::addr_t next = found
+        ? static_cast<FRAM::addr_t>( ((best_addr - base_) / slot_size_ + 1) % slots_ ) * slot_size_ + base_
+        : base_;
+
+    Header h;
+    h.magic = STORE_MAGIC;
+    h.version = version_;
+    h.reserved = 0;
+    h.seq = next_seq;
+    h.len = static_cast<uint32_t>(size_);
+    h.crc = crc;
+
+    FRAM::WriteWindow window(fram_);
+    if (window.status() != ESP_OK) return window.status();
+    // write payload then header (atomicity)
+    esp_err_t err;
+    if (group_) {
+        // the whole slot in one WRITE of the batch: a torn write fails the CRC
+        // and load() keeps the previous slot, like payload-then-header does
+        std::vector<uint8_t> slot(slot_size_);
+        memcpy(slot.data(), &h, sizeof(h));
+        memcpy(slot.data() + sizeof(h), src, size_);
+        const FRAM::Segment w{next, slot.data(), slot.size()};
+        err = group_->commit(&w, 1);
+    } else {
+        err = fram_.write(next + sizeof(Header), src, size_);
+        if (err == ESP_OK) err = fram_.write(next, &h, sizeof(h));
+    }
+    if (err != ESP_OK) return err;
+
+    last_seq_ = next_seq;
+    cur_slot_ = static_cast<int>((next - base_) / slot_size_);
+    cur_crc_ = h.crc;
+    return ESP_OK;
+}
+
+IRAM_ATTR esp_err_t PersistentCore::store_fast(const void *src)
+{
+    if (cur_slot_ < 0) return ESP_ERR_INVALID_STATE;
+    // no inline helpers or crc32() here: they live in flash
+    const size_t slot = (static_cast<size_t>(cur_slot_) + 1) % slots_;
+    const FRAM::addr_t next = static_cast<FRAM::addr_t>(base_ + slot * slot_size_);
+
+    Header h;
+    h.magic = STORE_MAGIC;
+    h.version = version_;
+    h.reserved = 0;
+    h.seq = last_seq_ + 1;
+    h.len = static_cast<uint32_t>(size_);
+    h.crc = esp_rom_crc32_le(0, static_cast<const uint8_t *>(src), size_);
+
+    // payload then header, as in store(); a retry after an error rewrites the same slot
+    esp_err_t err = fram_.write_fast(next + sizeof(Header), src, size_);
+    if (err == ESP_OK) err = fram_.write_fast(next, &h, sizeof(h));
+    if (err != ESP_OK) return err;
+
+    last_seq_ = h.seq;
+    cur_slot_ = static_cast<int>(slot);
+    cur_crc_ = h.crc;
+    return ESP_OK;
+}
+
+esp_err_t PersistentCore::locate()
+{
+    if (cur_slot_ >= 0) return ESP_OK;
+    std::vector<uint8_t> tmp(size_);
+    return load(tmp.data());
+}
+
+esp_err_t PersistentCore::read_at(size_t off, void *dst, size_t n)
+{
+    if (!dst || !n || off + n > size_) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = locate();
+    if (err != ESP_OK) return err;
+    return fram_.read(slot_addr(cur_slot_) + sizeof(Header) + off, dst, n);
+}
+
+esp_err_t PersistentCore::write_at(size_t off, const void *src, size_t n)
+{
+    if (!src || !n || off + n > size_) return ESP_ERR_INVALID_ARG;
+    if (cur_slot_ < 0) return ESP_ERR_INVALID_STATE;
+    std::vector<uint8_t> payload(size_);
+    esp_err_t err = fram_.read(slot_addr(cur_slot_) + sizeof(Header), payload.data(), size_);
+    if (err != ESP_OK) return err;
+    // the CRC is patched from cur_crc_, so it must still describe these
+    // bytes: a bit flip or a scrubber repair since load() would otherwise
+    // end up in a new slot that load() rejects
+    if (crc32(payload.data(), size_) != cur_crc_) {
+        cur_slot_ = -1;
+        return ESP_ERR_INVALID_CRC;
+    }
+    uint8_t *range = payload.data() + off;
+    if (memcmp(range, src, n) == 0) return ESP_OK;
+
+    // the patched image goes to the next slot like a store(); the current
+    // slot stays intact until its header is superseded
+    const uint32_t crc = crc32_patch(cur_crc_, range, src, n, size_ - off - n);
+    memcpy(range, src, n);
+    return write_slot(payload.data(), crc);
+}
+
+bool PersistentCore::read_slot(FRAM::addr_t a, uint8_t *buf, int side)
+{
+    esp_err_t err = side < 0 ? fram_.read(a, buf, slot_size_)
+                             : fram_.read_side(static_cast<uint8_t>(side), a, buf, slot_size_);
+    if (err != ESP_OK) return false;
+    Header h;
+    memcpy(&h, buf, sizeof(h));
+    if (h.magic != STORE_MAGIC || h.version != version_ || h.len != size_) return false;
+    return crc32(buf + sizeof(Header), size_) == h.crc;
+}
+
+bool PersistentCore::recover_slot(FRAM::addr_t a, uint8_t *buf)
+{
+    for (int side = 0; side < 2; ++side) {
+        if (!read_slot(a, buf, side)) continue;
+        FRAM::WriteWindow window(fram_);
+        if (window.status() == ESP_OK && fram_.write(a + sizeof(Header), buf + sizeof(Header), size_) == ESP_OK)
+            (void)fram_.write(a, buf, sizeof(Header));
+        return true;
+    }
+    return false;
+}
+
+} // namespace fram_store
@@ -15,6 +15,7 @@
 #include <vector>
 #include <type_traits>
 #include "fram.h"
+#include "fram_serial.h"
 #include "esp_err.h"
 
 namespace fram_store {
@@ -32,113 +33,181 @@ struct Header {
 
 static constexpr uint32_t STORE_MAGIC = 0x4652414D; // 'FRAM'
 
-static uint32_t crc32(const void* data, size_t len)
-{
-    static uint32_t table[256];
-    static bool init = false;
-    if (!init) {
-        for (uint32_t i = 0; i < 256; ++i) {
-            uint32_t c = i;
-            for (int j = 0; j < 8; ++j)
-                c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
-            table[i] = c;
-        }
-        init = true;
-    }
-    uint32_t c = 0xFFFFFFFFu;
-    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
-    for (size_t i = 0; i < len; ++i)
-        c = table[(c ^ p[i]) & 0xFFu] ^ (c >> 8);
-    return c ^ 0xFFFFFFFFu;
-}
+class GroupCommit;
+
+/// CRC-32 (IEEE 802.3, as zlib) used by all stores.
+uint32_t crc32(const void* data, size_t len);
+
+/**
+ * @brief CRC-32 of a buffer after n bytes in it changed, without the rest of the buffer.
+ * @param crc       crc32() of the buffer before the change.
+ * @param old_bytes Previous content of the changed range.
+ * @param new_bytes New content of the changed range.
+ * @param tail      Bytes that follow the range up to the end of the buffer.
+ * @note CRC-32 is linear: the result is crc ^ the CRC of the XOR difference,
+ *       a register run over the n changed bytes and tail zero bytes.
+ */
+uint32_t crc32_patch(uint32_t crc, const void *old_bytes, const void *new_bytes, size_t n, size_t tail);
 
 /*
-  Persistent<T>
+  PersistentCore
+  - the untyped engine behind Persistent<T>, compiled once in fram_store.cpp;
+    it works on (pointer, size), so another stored type adds no code
   - supports N circular slots starting at base_addr
   - slot layout: [Header][payload]
   - atomic commit: write payload then header
+  - a slot is read with one transfer (header and payload together)
+  - read_at() reads part of the payload of the current slot (the one found
+    by the last load() or written by the last store()); only that range
+    moves over SPI
+  - write_at() is a read-modify-write of the whole slot: it reads the
+    current payload, checks it against the header CRC, patches the range
+    and commits the result to the next slot with seq + 1, like store(). It
+    moves a payload more than store() does; what it saves is encoding all
+    of T. The current slot is never written, so a reset keeps either the
+    old or the new copy.
+  - store() scans the slot headers only while the newest slot is unknown;
+    after a load() or store() it writes the slot after it directly
+  - with a GroupCommit attached, store() hands the slot to it as one write
+    and returns when the batch that carried it is written; the header CRC
+    covers the payload, so a torn slot write is rejected by load()
+*/
+class PersistentCore {
+public:
+    PersistentCore(FRAM &fram, FRAM::addr_t base_addr, size_t slots, uint16_t version, size_t size);
+
+    // load latest valid copy into dst (size bytes); dst is untouched on error
+    esp_err_t load(void *dst);
+
+    // write src (size bytes) to the slot after the newest one, returns when committed
+    esp_err_t store(const void *src);
+
+    // store() from IRAM through FRAM::write_fast(); the slot must be known
+    // (ESP_ERR_INVALID_STATE before the first load()/store())
+    esp_err_t store_fast(const void *src);
+
+    // read n payload bytes at off of the current slot
+    esp_err_t read_at(size_t off, void *dst, size_t n);
+
+    // store the current slot with n payload bytes at off replaced, CRC patched;
+    // ESP_ERR_INVALID_STATE before the first load()/store(), ESP_ERR_INVALID_CRC
+    // if the current slot no longer matches its CRC (load() again)
+    esp_err_t write_at(size_t off, const void *src, size_t n);
+
+    // commit through a shared GroupCommit (nullptr: write directly)
+    void set_group(GroupCommit *group) { group_ = group; }
+
+    size_t size() const { return size_; }
+    /// seq of the last copy loaded or stored
+    uint32_t seq() const { return last_seq_; }
+
+private:
+    // reads and validates one slot into buf; side -1 reads through the normal path
+    bool read_slot(FRAM::addr_t a, uint8_t *buf, int side);
+    // finds an intact copy of the slot on either mirror side and rewrites both
+    bool recover_slot(FRAM::addr_t a, uint8_t *buf);
+    // finds the current slot (a full load) if no load()/store() did yet
+    esp_err_t locate();
+    // writes src with payload CRC crc to the slot after the newest one
+    esp_err_t write_slot(const void *src, uint32_t crc);
+    FRAM::addr_t slot_addr(size_t i) const { return base_ + static_cast<FRAM::addr_t>(i * slot_size_); }
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    size_t slots_;
+    uint16_t version_;
+    size_t size_;
+    size_t slot_size_;
+    uint32_t last_seq_{0};
+    int cur_slot_{-1};          ///< slot of last_seq_
+    uint32_t cur_crc_{0};       ///< payload CRC in its header
+    GroupCommit *group_{nullptr};
+};
+
+/*
+  Persistent<T>
+  - typed front end of PersistentCore; only the inline forwarding and the
+    RAM cache are generated per T
+  - a trivially copyable T is stored as its raw bytes; a T with a
+    Fields<T> list (fram_serial.h) is stored in the packed, padding-free
+    encoding of those fields, which also allows std::string, std::optional
+    and nested described members
   - methods: load(), store_immediate(), store_deferred(), flush()
+  - set_group() lets concurrent store_immediate() calls on different stores
+    share one FRAM batch (fram_group.h)
+  - read_field() transfers one member of the current slot (for a described
+    T, the encoding of that member); update_field() reads the current slot
+    back and stores it again with that member replaced, without encoding
+    all of T
 */
 template<typename T>
 class Persistent {
-    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially_copyable");
+    static_assert(std::is_trivially_copyable<T>::value || Described<T>,
+                  "T must be trivially_copyable or described by fram_store::Fields<T>");
 public:
+    /// bytes of T in a slot
+    static constexpr size_t PAYLOAD_SIZE = [] {
+        if constexpr (Described<T>) return serial::Codec<T>::SIZE;
+        else return sizeof(T);
+    }();
+
     Persistent(FRAM &fram,
                FRAM::addr_t base_addr,
                size_t slots = 2,
                uint16_t version = 1)
-        : fram_(fram), base_(base_addr), slots_(slots), version_(version),
-          slot_size_(sizeof(Header) + sizeof(T)), dirty_(false)
+        : core_(fram, base_addr, slots, version, PAYLOAD_SIZE), dirty_(false)
     {}
 
     // load latest valid copy into dst
     esp_err_t load(T &dst) {
-        Header best_hdr{0};
-        FRAM::addr_t best_addr = 0;
-        bool found = false;
-
-        for (size_t i = 0; i < slots_; ++i) {
-            FRAM::addr_t a = base_ + static_cast<FRAM::addr_t>(i * slot_size_);
-            Header h;
-            if (fram_.read(a, &h, sizeof(h)) != ESP_OK) continue;
-            if (h.magic != STORE_MAGIC || h.version != version_ || h.len != sizeof(T)) continue;
-            std::vector<uint8_t> buf(h.len);
-            if (fram_.read(a + sizeof(Header), buf.data(), buf.size()) != ESP_OK) continue;
-            if (crc32(buf.data(), buf.size()) != h.crc) continue;
-            if (!found || h.seq > best_hdr.seq) {
-                best_hdr = h;
-                best_addr = a;
-                found = true;
-            }
+        if constexpr (Described<T>) {
+            std::array<uint8_t, PAYLOAD_SIZE> buf;
+            esp_err_t err = core_.load(buf.data());
+            if (err != ESP_OK) return err;
+            const uint8_t *p = buf.data();
+            T tmp{};
+            if (!serial::Codec<T>::decode(p, tmp)) return ESP_ERR_INVALID_SIZE;
+            dst = std::move(tmp);
+            return ESP_OK;
+        } else {
+            return core_.load(&dst);
         }
-
-        if (!found) return ESP_ERR_NOT_FOUND;
-        // read payload
-        return fram_.read(best_addr + sizeof(Header), &dst, sizeof(T));
     }
 
     // immediate store: writes to next slot (rotates), returns when committed
     esp_err_t store_immediate(const T &src) {
-        Header cur_best{0};
-        FRAM::addr_t best_addr = base_;
-        bool found = false;
-
-        for (size_t i = 0; i < slots_; ++i) {
-            FRAM::addr_t a = base_ + static_cast<FRAM::addr_t>(i * slot_size_);
-            Header h;
-            (void)fram_.read(a, &h, sizeof(h));
-            if (h.magic == STORE_MAGIC && h.version == version_) {
-                if (!found || h.seq > cur_best.seq) {
-                    cur_best = h;
-                    best_addr = a;
-                    found = true;
-                }
-            }
+        esp_err_t err;
+        if constexpr (Described<T>) {
+            std::array<uint8_t, PAYLOAD_SIZE> buf;
+            uint8_t *p = buf.data();
+            // a text longer than its field
+            if (!serial::Codec<T>::encode(p, src)) return ESP_ERR_INVALID_SIZE;
+            err = core_.store(buf.data());
+        } else {
+            err = core_.store(&src);
         }
-        uint32_t next_seq = found ? (cur_best.seq + 1) : 1;
-        // pick next slot (circular) after best_addr
-        FRAM::addr_t next = found
-            ? static_cast<FRAM::addr_t>( ((best_addr - base_) / slot_size_ + 1) % slots_ ) * slot_size_ + base_
-            : base_;
-
-        Header h;
-        h.magic = STORE_MAGIC;
-        h.version = version_;
-        h.reserved = 0;
-        h.seq = next_seq;
-        h.len = static_cast<uint32_t>(sizeof(T));
-        h.crc = crc32(&src, sizeof(T));
-
-        // write payload then header (atomicity)
-        esp_err_t err = fram_.write(next + sizeof(Header), &src, sizeof(T));
         if (err != ESP_OK) return err;
-        err = fram_.write(next, &h, sizeof(h));
-        if (err != ESP_OK) return err;
-
         // update cache
         cache_ = src;
         dirty_ = false;
-        last_seq_ = next_seq;
+        return ESP_OK;
+    }
+
+    /**
+     * @brief store_immediate() for IRAM interrupt handlers and cache-off sections.
+     * @return As FRAM::write_fast(), ESP_ERR_INVALID_STATE before the first
+     *         load() or store_immediate() (the slot scan is not bounded).
+     * @note Payload then header through FRAM::write_fast(), CRC from ROM. The
+     *       caller must be in IRAM too; the store must not be used from
+     *       another context at the same time.
+     */
+    __attribute__((always_inline)) esp_err_t store_fast(const T &src)
+        requires std::is_trivially_copyable_v<T>
+    {
+        esp_err_t err = core_.store_fast(&src);
+        if (err != ESP_OK) return err;
+        cache_ = src;
+        dirty_ = false;
         return ESP_OK;
     }
 
@@ -156,15 +225,77 @@ public:
 
     bool dirty() const { return dirty_; }
 
+    /// Commit through @p group, batched with other stores (nullptr: write directly).
+    void set_group(GroupCommit *group) { core_.set_group(group); }
+
+    /**
+     * @brief Read one member from the current slot without loading all of T.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if nothing is stored or @p m is not
+     *         in Fields<T>, ESP_ERR_INVALID_SIZE for a corrupt encoding.
+     * @note The slot CRC is not checked here; it was checked by the load()
+     *       or store() that found the slot (the first call does a load()).
+     */
+    template<typename M, typename C>
+        requires std::is_base_of_v<C, T>
+    esp_err_t read_field(M C::*m, M &out) {
+        if constexpr (Described<T>) {
+            esp_err_t err = ESP_ERR_NOT_FOUND;
+            size_t off = 0;
+            serial::with_field<T>(static_cast<M T::*>(m), off, [&](const auto *codec) {
+                using F = std::remove_cvref_t<decltype(*codec)>;
+                std::array<uint8_t, F::SIZE> buf;
+                err = core_.read_at(off, buf.data(), buf.size());
+                const uint8_t *p = buf.data();
+                if (err == ESP_OK && !F::decode_value(p, out)) err = ESP_ERR_INVALID_SIZE;
+            });
+            return err;
+        } else {
+            return core_.read_at(offset_of(m), &out, sizeof(M));
+        }
+    }
+
+    /**
+     * @brief Store the current slot again with one member replaced.
+     * @return ESP_OK, ESP_ERR_INVALID_STATE before the first load() or
+     *         store_immediate(), ESP_ERR_INVALID_CRC if the current slot
+     *         changed under its CRC since then (load() again),
+     *         ESP_ERR_NOT_FOUND if @p m is not in Fields<T>,
+     *         ESP_ERR_INVALID_SIZE if @p v does not fit.
+     * @note Not a partial write: the current payload is read back and
+     *       checked, and the patched payload is written to the next slot
+     *       with the next seq, payload then header, so a reset keeps the
+     *       old or the new copy. The CRC is patched from the old and new
+     *       member bytes (crc32_patch()). The RAM cache is updated too, so
+     *       a later flush() keeps the new value.
+     */
+    template<typename M, typename C>
+        requires std::is_base_of_v<C, T>
+    esp_err_t update_field(M C::*m, const M &v) {
+        esp_err_t err = ESP_ERR_NOT_FOUND;
+        if constexpr (Described<T>) {
+            size_t off = 0;
+            serial::with_field<T>(static_cast<M T::*>(m), off, [&](const auto *codec) {
+                using F = std::remove_cvref_t<decltype(*codec)>;
+                std::array<uint8_t, F::SIZE> buf;
+                uint8_t *p = buf.data();
+                err = F::encode_value(p, v) ? core_.write_at(off, buf.data(), buf.size()) : ESP_ERR_INVALID_SIZE;
+            });
+        } else {
+            err = core_.write_at(offset_of(m), &v, sizeof(M));
+        }
+        if (err == ESP_OK) cache_.*m = v;
+        return err;
+    }
+
 private:
-    FRAM &fram_;
-    FRAM::addr_t base_;
-    size_t slots_;
-    uint16_t version_;
-    size_t slot_size_;
+    template<typename M, typename C>
+    size_t offset_of(M C::*m) const {
+        return reinterpret_cast<const uint8_t *>(&(cache_.*m)) - reinterpret_cast<const uint8_t *>(&cache_);
+    }
+
+    PersistentCore core_;
     T cache_;
     bool dirty_;
-    uint32_t last_seq_{0};
 };
 
 } // namespace fram_store
\ No newline at end of file
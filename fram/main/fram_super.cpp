@@ -0,0 +1,175 @@
+/**
+ * @file fram_super.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_super.h"
+#include <algorithm>
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_SB";
+
+namespace fram_store {
+
+Superblock::Superblock(FRAM &fram) : fram_(fram) {}
+
+esp_err_t Superblock::mount()
+{
+    // both copies in one transfer
+    uint8_t buf[2 * COPY_SIZE];
+    ESP_RETURN_ON_ERROR(fram_.read(BASE, buf, sizeof(buf)), TAG, "read");
+
+    bool found = false;
+    for (uint8_t c = 0; c < 2; ++c) {
+        const uint8_t *p = buf + c * COPY_SIZE;
+        DirHeader h;
+        memcpy(&h, p, sizeof(h));
+        if (h.magic != MAGIC || h.version != FORMAT || h.count > MAX_REGIONS) continue;
+        if (h.len != h.count * sizeof(Region) || crc32(p + sizeof(h), h.len) != h.crc) continue;
+        if (found && h.seq <= seq_) continue;
+        memcpy(table_, p + sizeof(h), h.len);
+        count_ = h.count;
+        seq_ = h.seq;
+        copy_ = c;
+        found = true;
+    }
+    if (!found) return ESP_ERR_NOT_FOUND;
+    mounted_ = true;
+    ESP_LOGI(TAG, "%u regions, generation %u", (unsigned)count_, (unsigned)seq_);
+    return ESP_OK;
+}
+
+esp_err_t Superblock::format()
+{
+    FRAM::WriteWindow window(fram_);
+    ESP_RETURN_ON_ERROR(window.status(), TAG, "write window");
+    // invalidate copy 1 first, then the empty directory goes to copy 0 with seq 1
+    ESP_RETURN_ON_ERROR(fram_.fill(static_cast<FRAM::addr_t>(BASE + COPY_SIZE), 0x00, sizeof(DirHeader)), TAG,
+                        "erase");
+    count_ = 0;
+    seq_ = 0;
+    copy_ = 1;
+    mounted_ = true;
+    return commit();
+}
+
+esp_err_t Superblock::commit()
+{
+    const uint8_t c = copy_ ^ 1;
+    const FRAM::addr_t a = static_cast<FRAM::addr_t>(BASE + c * COPY_SIZE);
+    DirHeader h;
+    h.magic = MAGIC;
+    h.version = FORMAT;
+    h.count = static_cast<uint16_t>(count_);
+    h.seq = seq_ + 1;
+    h.len = static_cast<uint32_t>(count_ * sizeof(Region));
+    h.crc = crc32(table_, h.len);
+
+    FRAM::WriteWindow window(fram_);
+    ESP_RETURN_ON_ERROR(window.status(), TAG, "write window");
+    // entries then header: the other copy stays valid until the header lands
+    if (h.len) ESP_RETURN_ON_ERROR(fram_.write(a + sizeof(h), table_, h.len), TAG, "entries");
+    ESP_RETURN_ON_ERROR(fram_.write(a, &h, sizeof(h)), TAG, "header");
+    seq_ = h.seq;
+    copy_ = c;
+    return ESP_OK;
+}
+
+const Region *Superblock::find(uint16_t id) const
+{
+    for (size_t i = 0; i < count_; ++i) {
+        if (table_[i].id == id) return &table_[i];
+    }
+    return nullptr;
+}
+
+bool Superblock::fits(FRAM::addr_t base, size_t size) const
+{
+    const size_t end = (size_t)base + size;
+    if (size == 0 || base < BASE + REGION_SIZE || end > FRAM::FRAM_SIZE_BYTES) return false;
+    for (size_t i = 0; i < count_; ++i) {
+        if (base < table_[i].base + table_[i].size && table_[i].base < end) return false;
+    }
+    return true;
+}
+
+esp_err_t Superblock::add(const Region &r)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(!find(r.id), ESP_ERR_INVALID_STATE, TAG, "region %u exists", r.id);
+    ESP_RETURN_ON_FALSE(count_ < MAX_REGIONS, ESP_ERR_NO_MEM, TAG, "directory full");
+    ESP_RETURN_ON_FALSE(fits(r.base, r.size), ESP_ERR_INVALID_ARG, TAG, "region %u: 0x%04X+0x%X overlaps",
+                        r.id, r.base, r.size);
+    table_[count_++] = r;
+    esp_err_t err = commit();
+    if (err != ESP_OK) --count_;
+    ESP_RETURN_ON_ERROR(err, TAG, "add %u", r.id);
+    ESP_LOGI(TAG, "region %u: 0x%04X+0x%X type %u v%u", r.id, r.base, r.size, (unsigned)r.type, r.version);
+    return ESP_OK;
+}
+
+esp_err_t Superblock::allocate(uint16_t id, RegionType type, size_t size, uint8_t version, Region &out,
+                               size_t align)
+{
+    ESP_RETURN_ON_FALSE(size && size <= UINT16_MAX && align && !(align & (align - 1)), ESP_ERR_INVALID_ARG,
+                        TAG, "bad args");
+    // candidates: the start of the free area and the end of every region
+    size_t cand[MAX_REGIONS + 1];
+    size_t n = 0;
+    cand[n++] = BASE + REGION_SIZE;
+    for (size_t i = 0; i < count_; ++i) cand[n++] = table_[i].base + table_[i].size;
+    std::sort(cand, cand + n);
+    for (size_t i = 0; i < n; ++i) {
+        const size_t base = (cand[i] + align - 1) & ~(align - 1);
+        if (base + size <= FRAM::FRAM_SIZE_BYTES && fits(static_cast<FRAM::addr_t>(base), size)) {
+            out = Region{id, type, version, static_cast<uint16_t>(base), static_cast<uint16_t>(size)};
+            return add(out);
+        }
+    }
+    ESP_LOGE(TAG, "no gap of 0x%X bytes for region %u", (unsigned)size, id);
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t Superblock::ensure(const Region &want, Region &out)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    if (const Region *r = find(want.id)) {
+        ESP_RETURN_ON_FALSE(r->type == want.type, ESP_ERR_INVALID_STATE, TAG, "region %u has type %u",
+                            want.id, (unsigned)r->type);
+        ESP_RETURN_ON_FALSE(r->size >= want.size, ESP_ERR_INVALID_SIZE, TAG, "region %u: 0x%X < 0x%X",
+                            want.id, r->size, want.size);
+        out = *r;
+        return ESP_OK;
+    }
+    if (fits(want.base, want.size)) {
+        out = want;
+        return add(out);
+    }
+    return allocate(want.id, want.type, want.size, want.version, out);
+}
+
+esp_err_t Superblock::remove(uint16_t id)
+{
+    ESP_RETURN_ON_FALSE(mounted_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    const Region *r = find(id);
+    ESP_RETURN_ON_FALSE(r, ESP_ERR_NOT_FOUND, TAG, "no region %u", id);
+    const size_t i = r - table_;
+    const Region removed = table_[i];
+    std::copy(table_ + i + 1, table_ + count_, table_ + i);
+    --count_;
+    esp_err_t err = commit();
+    if (err != ESP_OK) {
+        std::copy_backward(table_ + i, table_ + count_, table_ + count_ + 1);
+        table_[i] = removed;
+        ++count_;
+    }
+    return err;
+}
+
+} // namespace fram_store
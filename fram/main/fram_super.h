@@ -0,0 +1,149 @@
+/**
+ * @file fram_super.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Superblock with the region directory of the FRAM.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include "fram.h"
+#include "fram_store.h"
+#include "esp_err.h"
+
+namespace fram_store {
+
+/// What a region holds (informational, checked by ensure()).
+enum class RegionType : uint8_t {
+    RAW = 0,
+    PERSISTENT,
+    NVS,
+    JOURNAL,
+    LOG,
+    LFS,
+    CRASH,
+    ID_LEASE,
+    BLOB,
+    HASH,
+    BTREE,
+    SNAPSHOT,
+    SHADOW,
+};
+
+#pragma pack(push,1)
+/// One directory entry.
+struct Region {
+    uint16_t id;
+    RegionType type;
+    uint8_t version;        ///< format version of the store inside
+    uint16_t base;
+    uint16_t size;
+};
+
+/// Header of one directory copy (same size and offsets as fram_store::Header).
+struct DirHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;         ///< entries in the copy
+    uint32_t seq;
+    uint32_t len;           ///< count * sizeof(Region)
+    uint32_t crc;           ///< crc32 of the entries
+};
+#pragma pack(pop)
+static_assert(sizeof(DirHeader) == sizeof(Header), "directory format 1 layout");
+
+/*
+  Superblock
+  - lives at address 0: two copies of [DirHeader][Region x MAX_REGIONS]
+  - mount() gets both copies with one read and takes the valid one with the
+    higher seq; every store is then located from RAM
+  - a change (add/allocate/remove) rewrites the older copy, entries first
+    and header last, so a reset leaves the other copy intact
+  - regions are added in place: existing entries never move, a new one
+    takes its requested base if that is free, otherwise the first gap
+  - the superblock opens a FRAM::WriteWindow for its commits, so it can sit
+    inside a write-protected window
+*/
+class Superblock {
+public:
+    static constexpr size_t MAX_REGIONS = 12;
+    static constexpr FRAM::addr_t BASE = 0x0000;
+    static constexpr size_t COPY_SIZE = sizeof(DirHeader) + MAX_REGIONS * sizeof(Region);
+    /// bytes reserved at BASE; regions start above it
+    static constexpr size_t REGION_SIZE = 0x0100;
+    static_assert(2 * COPY_SIZE <= REGION_SIZE, "superblock copies exceed the reserved area");
+
+    explicit Superblock(FRAM &fram);
+
+    /**
+     * @brief Read the directory.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if neither copy is valid (blank chip,
+     *         call format()), or the FRAM read error.
+     */
+    esp_err_t mount();
+
+    /// Write an empty directory (existing entries are forgotten, data is not touched).
+    esp_err_t format();
+
+    /// Entry with @p id, or nullptr.
+    const Region *find(uint16_t id) const;
+
+    /**
+     * @brief Add a region at r.base.
+     * @return ESP_OK, ESP_ERR_INVALID_STATE if the id exists,
+     *         ESP_ERR_INVALID_ARG if the range overlaps another region or
+     *         leaves the chip, ESP_ERR_NO_MEM if the directory is full.
+     */
+    esp_err_t add(const Region &r);
+
+    /**
+     * @brief Add a region in the first free gap.
+     * @param align Alignment of the base (power of two).
+     * @param[out] out The new entry.
+     * @return as add(), ESP_ERR_NO_MEM if no gap is large enough.
+     */
+    esp_err_t allocate(uint16_t id, RegionType type, size_t size, uint8_t version, Region &out,
+                       size_t align = 16);
+
+    /**
+     * @brief Look up @p want.id; add it if missing.
+     * @param want Region to create: at want.base when free, in the first gap
+     *             otherwise (base 0 always means the first gap).
+     * @param[out] out The directory entry; an existing one keeps its base,
+     *                 size and version (compare out.version to migrate).
+     * @return ESP_OK, ESP_ERR_INVALID_STATE if the existing entry has another
+     *         type, ESP_ERR_INVALID_SIZE if it is smaller than want.size.
+     */
+    esp_err_t ensure(const Region &want, Region &out);
+
+    /// Drop an entry; its space can be allocated again.
+    esp_err_t remove(uint16_t id);
+
+    std::span<const Region> regions() const { return {table_, count_}; }
+    /// Commits since format().
+    uint32_t generation() const { return seq_; }
+
+    Superblock(const Superblock&) = delete;
+    Superblock& operator=(const Superblock&) = delete;
+
+private:
+    static constexpr uint32_t MAGIC = 0x4B425346; // 'FSBK'
+    static constexpr uint16_t FORMAT = 1;
+
+    bool fits(FRAM::addr_t base, size_t size) const;
+    esp_err_t commit();
+
+    FRAM &fram_;
+    Region table_[MAX_REGIONS]{};
+    size_t count_{0};
+    uint32_t seq_{0};
+    uint8_t copy_{0};        ///< copy holding seq_
+    bool mounted_{false};
+};
+
+} // namespace fram_store
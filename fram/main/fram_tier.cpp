@@ -0,0 +1,366 @@
+/**
+ * @file fram_tier.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_tier.h"
+#include "fram_store.h"
+#include <algorithm>
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+#include "spi_flash_mmap.h"
+#include "freertos/task.h"
+
+static const char *TAG = "FRAM_TIER";
+
+namespace fram_store {
+
+#pragma pack(push,1)
+struct SectorHeader {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t seq_inv;   // ~seq, detects a torn header write
+    uint32_t reserved;
+};
+
+struct ColdRec {
+    uint16_t magic;
+    uint8_t  key_len;
+    uint8_t  flags;
+    uint16_t val_len;
+    uint16_t reserved;
+    uint32_t crc;       // crc32 over header (crc=0), key and value
+};
+#pragma pack(pop)
+
+static constexpr uint32_t TIER_SECTOR_MAGIC = 0x54494552; // 'TIER'
+static constexpr uint16_t TIER_REC_MAGIC    = 0x5452;     // 'TR'
+static constexpr uint16_t TIER_ERASED16     = 0xFFFF;
+static constexpr uint8_t  TIER_FLAG_TOMB    = 0x01;
+static constexpr size_t   SECTOR            = SPI_FLASH_SEC_SIZE;
+
+static size_t align4(size_t n) { return (n + 3) & ~size_t(3); }
+
+TieredStore::TieredStore(KvStore &hot, std::string_view ns, const char *partition_label)
+    : hot_(hot), ns_(ns), label_(partition_label)
+{}
+
+esp_err_t TieredStore::mount()
+{
+    ESP_RETURN_ON_FALSE(hot_.mounted(), ESP_ERR_INVALID_STATE, TAG, "hot tier not mounted");
+    part_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label_);
+    ESP_RETURN_ON_FALSE(part_, ESP_ERR_NOT_FOUND, TAG, "partition '%s' not found", label_);
+    ESP_RETURN_ON_FALSE(part_->size / SECTOR >= 3, ESP_ERR_INVALID_SIZE, TAG, "partition too small");
+
+    sectors_.assign(part_->size / SECTOR, Sector{0});
+    cold_.clear();
+
+    std::vector<size_t> used;
+    for (size_t i = 0; i < sectors_.size(); ++i) {
+        SectorHeader h;
+        ESP_RETURN_ON_ERROR(esp_partition_read(part_, i * SECTOR, &h, sizeof(h)), TAG, "read sector hdr");
+        if (h.magic == TIER_SECTOR_MAGIC && h.seq == ~h.seq_inv && h.seq != 0) {
+            sectors_[i].seq = h.seq;
+            used.push_back(i);
+        }
+    }
+    std::sort(used.begin(), used.end(), [this](size_t a, size_t b) { return sectors_[a].seq < sectors_[b].seq; });
+
+    // replay oldest -> newest, later records supersede earlier ones
+    next_seq_ = 1;
+    head_off_ = SECTOR;   // no open sector
+    for (size_t idx : used) {
+        ESP_RETURN_ON_ERROR(scan_sector(idx), TAG, "scan");
+        next_seq_ = sectors_[idx].seq + 1;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    touched_.clear();
+    hot_.for_each(ns_, [&](std::string_view key, KvType, size_t) { touched_[std::string(key)] = now; });
+
+    ESP_LOGI(TAG, "mounted '%s': %u/%u sectors in use, %u cold, %u hot",
+             label_, (unsigned)used.size(), (unsigned)sectors_.size(),
+             (unsigned)cold_.size(), (unsigned)touched_.size());
+    return ESP_OK;
+}
+
+esp_err_t TieredStore::scan_sector(size_t idx)
+{
+    const uint32_t base = idx * SECTOR;
+    size_t off = sizeof(SectorHeader);
+    std::vector<uint8_t> rec;
+    bool clean = true;
+
+    while (off + sizeof(ColdRec) <= SECTOR) {
+        ColdRec h;
+        ESP_RETURN_ON_ERROR(esp_partition_read(part_, base + off, &h, sizeof(h)), TAG, "read rec");
+        if (h.magic == TIER_ERASED16) break;
+        size_t rec_len = sizeof(ColdRec) + h.key_len + h.val_len;
+        if (h.magic != TIER_REC_MAGIC || h.key_len == 0 || off + rec_len > SECTOR) {
+            clean = false;
+            break;
+        }
+        rec.resize(rec_len);
+        ESP_RETURN_ON_ERROR(esp_partition_read(part_, base + off, rec.data(), rec_len), TAG, "read rec");
+        reinterpret_cast<ColdRec *>(rec.data())->crc = 0;
+        if (crc32(rec.data(), rec_len) != h.crc) {
+            clean = false;
+            break;
+        }
+
+        std::string key(reinterpret_cast<const char *>(rec.data() + sizeof(ColdRec)), h.key_len);
+        if (h.flags & TIER_FLAG_TOMB) {
+            cold_.erase(key);
+        } else {
+            cold_[key] = ColdEntry{static_cast<uint32_t>(base + off), h.key_len, h.val_len};
+        }
+        off += align4(rec_len);
+    }
+
+    head_ = idx;
+    // a torn tail record makes the rest of the sector unusable
+    head_off_ = clean ? off : SECTOR;
+    return ESP_OK;
+}
+
+void TieredStore::pack(std::vector<uint8_t> &batch, std::string_view key, const void *data, size_t len, bool tombstone)
+{
+    size_t start = batch.size();
+    size_t rec_len = sizeof(ColdRec) + key.size() + len;
+    batch.resize(start + align4(rec_len), 0xFF);
+
+    ColdRec h;
+    h.magic = TIER_REC_MAGIC;
+    h.key_len = static_cast<uint8_t>(key.size());
+    h.flags = tombstone ? TIER_FLAG_TOMB : 0;
+    h.val_len = static_cast<uint16_t>(len);
+    h.reserved = 0;
+    h.crc = 0;
+    uint8_t *p = batch.data() + start;
+    memcpy(p, &h, sizeof(h));
+    memcpy(p + sizeof(h), key.data(), key.size());
+    if (len) memcpy(p + sizeof(h) + key.size(), data, len);
+    h.crc = crc32(p, rec_len);
+    memcpy(p + offsetof(ColdRec, crc), &h.crc, sizeof(h.crc));
+}
+
+esp_err_t TieredStore::cold_append(const std::vector<uint8_t> &batch,
+                                   const std::vector<std::pair<std::string, ColdEntry>> &entries)
+{
+    if (batch.empty()) return ESP_OK;
+    ESP_RETURN_ON_FALSE(head_off_ + batch.size() <= SECTOR, ESP_ERR_INVALID_SIZE, TAG, "batch overflow");
+    const uint32_t base = head_ * SECTOR + head_off_;
+    ESP_RETURN_ON_ERROR(esp_partition_write(part_, base, batch.data(), batch.size()), TAG, "flash write");
+    head_off_ += batch.size();
+    ++stats_.batches;
+
+    // entries carry batch-relative offsets
+    for (const auto &[key, e] : entries) {
+        cold_[key] = ColdEntry{base + e.off, e.key_len, e.len};
+    }
+    return ESP_OK;
+}
+
+esp_err_t TieredStore::open_sector()
+{
+    const size_t n = sector_count();
+    size_t next = n;
+    for (size_t i = 1; i <= n; ++i) {
+        size_t c = (head_ + i) % n;
+        if (sectors_[c].seq == 0) {
+            next = c;
+            break;
+        }
+    }
+    ESP_RETURN_ON_FALSE(next < n, ESP_ERR_NO_MEM, TAG, "no free sector");
+
+    ESP_RETURN_ON_ERROR(esp_partition_erase_range(part_, next * SECTOR, SECTOR), TAG, "erase");
+    ++stats_.sector_erases;
+    SectorHeader h;
+    h.magic = TIER_SECTOR_MAGIC;
+    h.seq = next_seq_++;
+    h.seq_inv = ~h.seq;
+    h.reserved = 0;
+    ESP_RETURN_ON_ERROR(esp_partition_write(part_, next * SECTOR, &h, sizeof(h)), TAG, "sector hdr");
+    sectors_[next].seq = h.seq;
+    head_ = next;
+    head_off_ = sizeof(SectorHeader);
+
+    // keep one spare sector: when the log is full, recycle the oldest into the new head
+    bool any_free = std::any_of(sectors_.begin(), sectors_.end(), [](const Sector &s) { return s.seq == 0; });
+    if (!any_free) ESP_RETURN_ON_ERROR(reclaim_oldest(), TAG, "reclaim");
+    return ESP_OK;
+}
+
+// opens sectors until n more bytes fit at the head; a reclaim in
+// open_sector() relocates records into the new head and eats into it
+esp_err_t TieredStore::make_room(size_t n)
+{
+    for (size_t i = 0; head_off_ + n > SECTOR; ++i) {
+        ESP_RETURN_ON_FALSE(i < sector_count(), ESP_ERR_NO_MEM, TAG, "cold tier full");
+        ESP_RETURN_ON_ERROR(open_sector(), TAG, "open sector");
+    }
+    return ESP_OK;
+}
+
+esp_err_t TieredStore::reclaim_oldest()
+{
+    size_t oldest = head_;
+    for (size_t i = 0; i < sector_count(); ++i) {
+        if (sectors_[i].seq != 0 && sectors_[i].seq < sectors_[oldest].seq) oldest = i;
+    }
+    ESP_RETURN_ON_FALSE(oldest != head_, ESP_ERR_INVALID_STATE, TAG, "nothing to reclaim");
+
+    // tombstones are dropped: every older sector is already gone
+    const uint32_t lo = oldest * SECTOR, hi = lo + SECTOR;
+    std::vector<uint8_t> batch, val;
+    std::vector<std::pair<std::string, ColdEntry>> entries;
+    for (const auto &[key, e] : cold_) {
+        if (e.off < lo || e.off >= hi) continue;
+        val.resize(e.len);
+        if (e.len) {
+            ESP_RETURN_ON_ERROR(esp_partition_read(part_, e.off + sizeof(ColdRec) + e.key_len, val.data(), e.len), TAG, "read");
+        }
+        entries.emplace_back(key, ColdEntry{static_cast<uint32_t>(batch.size()), e.key_len, e.len});
+        pack(batch, key, val.data(), e.len, false);
+    }
+    ESP_RETURN_ON_ERROR(cold_append(batch, entries), TAG, "relocate");
+
+    ESP_RETURN_ON_ERROR(esp_partition_erase_range(part_, lo, SECTOR), TAG, "erase");
+    ++stats_.sector_erases;
+    sectors_[oldest].seq = 0;
+    ESP_LOGD(TAG, "reclaimed sector %u, relocated %u records", (unsigned)oldest, (unsigned)entries.size());
+    return ESP_OK;
+}
+
+esp_err_t TieredStore::set(std::string_view key, const void *data, size_t len)
+{
+    ESP_RETURN_ON_FALSE(part_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_ERROR(hot_.set(ns_, key, KvType::BLOB, data, len), TAG, "hot set");
+    touched_[std::string(key)] = xTaskGetTickCount();
+    return ESP_OK;
+}
+
+esp_err_t TieredStore::get(std::string_view key, void *out, size_t *len)
+{
+    ESP_RETURN_ON_FALSE(part_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    ESP_RETURN_ON_FALSE(len, ESP_ERR_INVALID_ARG, TAG, "bad args");
+
+    esp_err_t err = hot_.get(ns_, key, KvType::BLOB, out, len);
+    if (err != ESP_ERR_NOT_FOUND) {
+        if (err == ESP_OK && out) touched_[std::string(key)] = xTaskGetTickCount();
+        return err;
+    }
+
+    auto it = cold_.find(std::string(key));
+    if (it == cold_.end()) return ESP_ERR_NOT_FOUND;
+    const ColdEntry &e = it->second;
+    if (!out) {
+        *len = e.len;
+        return ESP_OK;
+    }
+    if (*len < e.len) {
+        *len = e.len;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *len = e.len;
+    if (e.len == 0) return ESP_OK;
+    return esp_partition_read(part_, e.off + sizeof(ColdRec) + e.key_len, out, e.len);
+}
+
+esp_err_t TieredStore::erase(std::string_view key)
+{
+    ESP_RETURN_ON_FALSE(part_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    std::string k(key);
+    esp_err_t hot_err = hot_.erase(ns_, key);
+    if (hot_err != ESP_OK && hot_err != ESP_ERR_NOT_FOUND) return hot_err;
+    touched_.erase(k);
+
+    auto it = cold_.find(k);
+    if (it == cold_.end()) return hot_err;
+
+    std::vector<uint8_t> batch;
+    pack(batch, key, nullptr, 0, true);
+    ESP_RETURN_ON_ERROR(make_room(batch.size()), TAG, "room");
+    ESP_RETURN_ON_ERROR(cold_append(batch, {}), TAG, "tombstone");
+    cold_.erase(k);
+    return ESP_OK;
+}
+
+esp_err_t TieredStore::migrate(TickType_t idle_ticks, size_t max_records)
+{
+    ESP_RETURN_ON_FALSE(part_, ESP_ERR_INVALID_STATE, TAG, "not mounted");
+    TickType_t now = xTaskGetTickCount();
+
+    // oldest first, so max_records cuts off the most recently used ones, not the high keys
+    std::vector<std::pair<TickType_t, std::string>> idle;
+    for (const auto &[key, t] : touched_) {
+        const TickType_t age = now - t;
+        if (age >= idle_ticks) idle.emplace_back(age, key);
+    }
+    const size_t take = std::min(max_records, idle.size());
+    if (take == 0) return ESP_OK;
+    std::partial_sort(idle.begin(), idle.begin() + take, idle.end(),
+                      [](const auto &a, const auto &b) { return a.first > b.first; });
+    std::vector<std::string> victims;
+    victims.reserve(take);
+    for (size_t i = 0; i < take; ++i) victims.push_back(std::move(idle[i].second));
+
+    std::vector<uint8_t> batch, val;
+    std::vector<std::pair<std::string, ColdEntry>> entries;
+
+    // flash first, then drop the FRAM copies of what has landed
+    auto flush = [&]() -> esp_err_t {
+        ESP_RETURN_ON_ERROR(cold_append(batch, entries), TAG, "batch");
+        for (const auto &[key, e] : entries) {
+            ESP_RETURN_ON_ERROR(hot_.erase(ns_, key), TAG, "hot erase");
+            touched_.erase(key);
+            ++stats_.migrated;
+        }
+        batch.clear();
+        entries.clear();
+        return ESP_OK;
+    };
+
+    for (const auto &key : victims) {
+        size_t len = 0;
+        if (hot_.get(ns_, key, KvType::BLOB, nullptr, &len) != ESP_OK) {
+            touched_.erase(key);
+            continue;
+        }
+        size_t rec_len = align4(sizeof(ColdRec) + key.size() + len);
+        if (rec_len > SECTOR - sizeof(SectorHeader)) {
+            // stays in FRAM; untracked, so it is not picked (and warned about) again
+            ESP_LOGW(TAG, "'%s' too large for the cold tier", key.c_str());
+            touched_.erase(key);
+            continue;
+        }
+        val.resize(len);
+        if (len) ESP_RETURN_ON_ERROR(hot_.get(ns_, key, KvType::BLOB, val.data(), &len), TAG, "hot get");
+
+        if (head_off_ + batch.size() + rec_len > SECTOR) {
+            ESP_RETURN_ON_ERROR(flush(), TAG, "flush");
+            ESP_RETURN_ON_ERROR(make_room(rec_len), TAG, "room");
+        }
+        entries.emplace_back(key, ColdEntry{static_cast<uint32_t>(batch.size()),
+                                            static_cast<uint16_t>(key.size()), static_cast<uint16_t>(len)});
+        pack(batch, key, val.data(), len, false);
+    }
+    ESP_RETURN_ON_ERROR(flush(), TAG, "flush");
+    return ESP_OK;
+}
+
+TieredStore::Stats TieredStore::stats() const
+{
+    Stats s = stats_;
+    s.hot_keys = touched_.size();
+    s.cold_keys = cold_.size();
+    return s;
+}
+
+} // namespace fram_store
@@ -0,0 +1,121 @@
+/**
+ * @file fram_tier.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Two-tier record store: hot records in FRAM, cold records in flash.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "fram_kv.h"
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+
+namespace fram_store {
+
+/*
+  TieredStore
+  - writes always go to the hot tier (a KvStore namespace in FRAM)
+  - migrate() moves records not touched for idle_ticks, longest-idle first,
+    into the cold tier, a circular record log on a raw flash data partition
+  - cold log: flash sectors, each [SectorHeader][record][record]...;
+    records never span sectors, one sector is always kept erased as spare
+  - migration writes flash first (one sequential write per sector batch),
+    then erases the FRAM copy, so a crash leaves at worst a duplicate and
+    the hot copy wins
+  - get() looks in FRAM first, then in the cold index (RAM)
+*/
+class TieredStore {
+public:
+    struct Stats {
+        size_t hot_keys;
+        size_t cold_keys;
+        uint32_t migrated;       ///< records moved hot -> cold
+        uint32_t batches;        ///< flash write batches
+        uint32_t sector_erases;  ///< flash sectors erased by the cold log
+    };
+
+    /**
+     * @brief Construct a tiered store.
+     * @param hot   Mounted KvStore used as the hot tier.
+     * @param ns    Namespace inside @p hot reserved for this store.
+     * @param partition_label Label of the flash data partition for the cold tier.
+     * @note The cold partition is used raw; it must not be mounted as a filesystem.
+     */
+    TieredStore(KvStore &hot, std::string_view ns, const char *partition_label = "spiffs");
+
+    /**
+     * @brief Locate the partition and rebuild the cold index from the flash log.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if the partition is missing, or a flash error.
+     */
+    esp_err_t mount();
+
+    /// Write a record to the hot tier and mark it touched.
+    esp_err_t set(std::string_view key, const void *data, size_t len);
+
+    /**
+     * @brief Read a record from whichever tier holds the newest copy.
+     * @param[out]   out Destination buffer, may be nullptr to query the length.
+     * @param[inout] len In: buffer size. Out: record length.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND, ESP_ERR_INVALID_SIZE if the buffer is too small.
+     */
+    esp_err_t get(std::string_view key, void *out, size_t *len);
+
+    /// Remove a record from both tiers.
+    esp_err_t erase(std::string_view key);
+
+    /**
+     * @brief Move cold records from FRAM to flash in batched sequential writes.
+     * @param idle_ticks  Records untouched for at least this long are migrated.
+     * @param max_records Upper bound of records moved by this call; the
+     *                    longest-idle records go first.
+     * @return ESP_OK on success (also when nothing was migrated).
+     */
+    esp_err_t migrate(TickType_t idle_ticks, size_t max_records = SIZE_MAX);
+
+    Stats stats() const;
+
+private:
+    struct ColdEntry {
+        uint32_t off;     ///< record offset inside the partition
+        uint16_t key_len;
+        uint16_t len;     ///< value length
+    };
+
+    struct Sector {
+        uint32_t seq;     ///< 0 = erased / unused
+    };
+
+    size_t sector_count() const { return sectors_.size(); }
+    esp_err_t scan_sector(size_t idx);
+    esp_err_t open_sector();
+    esp_err_t make_room(size_t n);
+    esp_err_t reclaim_oldest();
+    esp_err_t cold_append(const std::vector<uint8_t> &batch, const std::vector<std::pair<std::string, ColdEntry>> &entries);
+    static void pack(std::vector<uint8_t> &batch, std::string_view key, const void *data, size_t len, bool tombstone);
+
+    KvStore &hot_;
+    std::string ns_;
+    const char *label_;
+    const esp_partition_t *part_{nullptr};
+
+    std::vector<Sector> sectors_;
+    size_t head_{0};          ///< sector currently appended to
+    size_t head_off_{0};      ///< write offset inside head sector
+    uint32_t next_seq_{1};
+
+    std::map<std::string, ColdEntry> cold_;
+    std::map<std::string, TickType_t> touched_;
+    Stats stats_{};
+};
+
+} // namespace fram_store
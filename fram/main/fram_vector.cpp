@@ -0,0 +1,154 @@
+/**
+ * @file fram_vector.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ */
+
+#include "fram_vector.h"
+#include <algorithm>
+#include <cstring>
+#include "esp_log.h"
+#include "esp_check.h"
+
+static const char *TAG = "FRAM_VEC";
+
+namespace fram_store {
+
+PageCache::PageCache(FRAM &fram, FRAM::addr_t base, size_t size, size_t page_size, size_t pages, size_t readahead)
+    : fram_(fram), base_(base), size_(size), page_size_(page_size ? page_size : 1),
+      readahead_(std::clamp<size_t>(readahead, 1, pages ? pages : 1))
+{
+    data_.resize(page_size_ * (pages ? pages : 1));
+    frames_.assign(pages ? pages : 1, Frame{-1, false, false});
+    lock_ = xSemaphoreCreateMutex();
+}
+
+PageCache::~PageCache()
+{
+    if (lock_) vSemaphoreDelete(lock_);
+}
+
+void PageCache::invalidate()
+{
+    if (lock_) xSemaphoreTake(lock_, portMAX_DELAY);
+    for (Frame &f : frames_) f = Frame{-1, false, false};
+    last_frame_ = -1;
+    last_page_ = SIZE_MAX;
+    if (lock_) xSemaphoreGive(lock_);
+}
+
+int PageCache::find(size_t page)
+{
+    // most accesses hit the page of the previous one
+    if (last_frame_ >= 0 && frames_[last_frame_].page == static_cast<int32_t>(page)) return last_frame_;
+    for (size_t i = 0; i < frames_.size(); ++i) {
+        if (frames_[i].page == static_cast<int32_t>(page)) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+esp_err_t PageCache::fault(size_t page, int &frame)
+{
+    const size_t pages_total = (size_ + page_size_ - 1) / page_size_;
+    const size_t nframes = frames_.size();
+    size_t k = 1;
+    if (page == last_page_ + 1 && readahead_ > 1) {
+        // sequential: also load the following pages that are not cached yet
+        k = std::min(readahead_, pages_total - page);
+        for (size_t j = 1; j < k; ++j) {
+            if (find(page + j) >= 0) {
+                k = j;
+                break;
+            }
+        }
+    }
+
+    size_t first;
+    if (k == 1) {
+        // clock: skip frames referenced since the hand last passed them
+        while (frames_[hand_].ref) {
+            frames_[hand_].ref = false;
+            hand_ = (hand_ + 1) % nframes;
+        }
+        first = hand_;
+    } else {
+        // consecutive frames so that one read fills them all
+        if (hand_ + k > nframes) hand_ = 0;
+        first = hand_;
+    }
+    hand_ = (first + k) % nframes;
+
+    const size_t off = page * page_size_;
+    const size_t len = std::min(k * page_size_, size_ - off);
+    for (size_t j = 0; j < k; ++j) frames_[first + j].page = -1;
+    ESP_RETURN_ON_ERROR(fram_.read(static_cast<FRAM::addr_t>(base_ + off), &data_[first * page_size_], len), TAG,
+                        "page %u", (unsigned)page);
+    for (size_t j = 0; j < k; ++j) {
+        frames_[first + j] = Frame{static_cast<int32_t>(page + j), j == 0, j > 0};
+    }
+    ++stats_.faults;
+    stats_.prefetched += k - 1;
+    frame = static_cast<int>(first);
+    return ESP_OK;
+}
+
+esp_err_t PageCache::read(size_t off, void *dst, size_t len)
+{
+    ESP_RETURN_ON_FALSE(dst && len && off + len <= size_, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    ESP_RETURN_ON_FALSE(lock_, ESP_ERR_NO_MEM, TAG, "mutex");
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    esp_err_t err = ESP_OK;
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    while (len && err == ESP_OK) {
+        const size_t page = off / page_size_, in = off % page_size_;
+        const size_t n = std::min(len, page_size_ - in);
+        int f = find(page);
+        if (f >= 0) {
+            Frame &fr = frames_[f];
+            fr.ref = true;
+            if (fr.prefetched) {
+                fr.prefetched = false;
+                ++stats_.prefetch_hits;
+            }
+            ++stats_.hits;
+        } else {
+            err = fault(page, f);
+            if (err != ESP_OK) break;
+        }
+        memcpy(out, &data_[f * page_size_ + in], n);
+        last_frame_ = f;
+        last_page_ = page;
+        out += n;
+        off += n;
+        len -= n;
+    }
+    xSemaphoreGive(lock_);
+    return err;
+}
+
+esp_err_t PageCache::write(size_t off, const void *src, size_t len)
+{
+    ESP_RETURN_ON_FALSE(src && len && off + len <= size_, ESP_ERR_INVALID_ARG, TAG, "bad args");
+    ESP_RETURN_ON_FALSE(lock_, ESP_ERR_NO_MEM, TAG, "mutex");
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    esp_err_t err = fram_.write(static_cast<FRAM::addr_t>(base_ + off), src, len);
+    if (err == ESP_OK) {
+        ++stats_.writes;
+        // keep cached copies of the written pages current
+        const uint8_t *in = static_cast<const uint8_t *>(src);
+        for (size_t page = off / page_size_; page * page_size_ < off + len; ++page) {
+            const int f = find(page);
+            if (f < 0) continue;
+            const size_t lo = std::max(off, page * page_size_);
+            const size_t hi = std::min(off + len, (page + 1) * page_size_);
+            memcpy(&data_[f * page_size_ + (lo - page * page_size_)], in + (lo - off), hi - lo);
+        }
+    }
+    xSemaphoreGive(lock_);
+    return err;
+}
+
+} // namespace fram_store
@@ -0,0 +1,193 @@
+/**
+ * @file fram_vector.h
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief FRAM-resident vector with a RAM page cache.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *  All functions return esp_err_t values (ESP_OK on success).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+#include "fram.h"
+#include "fram_store.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+namespace fram_store {
+
+/*
+  PageCache
+  - byte-addressed window onto a FRAM range with `pages` RAM frames of
+    page_size bytes each; the untyped core of PagedVector<T>
+  - a miss (page fault) loads the page into the frame under the clock hand;
+    frames referenced since the hand last passed get a second chance
+  - a fault on the page right after the previously accessed one is treated
+    as a sequential scan: the next readahead - 1 pages are loaded with it, in
+    one SPI transfer straight into consecutive frames
+  - writes go through to FRAM and update cached frames, so the cache never
+    holds data that a reset could lose
+*/
+class PageCache {
+public:
+    struct Stats {
+        uint32_t hits;             ///< page accesses served from RAM
+        uint32_t faults;           ///< page accesses that had to read FRAM (one transfer each)
+        uint32_t prefetched;       ///< pages loaded by read-ahead
+        uint32_t prefetch_hits;    ///< read-ahead pages used before eviction
+        uint32_t writes;           ///< write-through FRAM writes
+    };
+
+    /**
+     * @brief Construct a cache over [base, base + size).
+     * @param page_size Bytes per page.
+     * @param pages     RAM frames (RAM use is pages * page_size).
+     * @param readahead Pages loaded per fault during a sequential scan (1 = off).
+     */
+    PageCache(FRAM &fram, FRAM::addr_t base, size_t size, size_t page_size = 64, size_t pages = 8,
+              size_t readahead = 4);
+    ~PageCache();
+
+    esp_err_t read(size_t off, void *dst, size_t len);
+    esp_err_t write(size_t off, const void *src, size_t len);
+
+    /// Drop all cached pages (e.g. after the range was written behind the cache).
+    void invalidate();
+
+    size_t size() const { return size_; }
+    Stats stats() const { return stats_; }
+    void reset_stats() { stats_ = {}; }
+
+    PageCache(const PageCache&) = delete;
+    PageCache& operator=(const PageCache&) = delete;
+
+private:
+    struct Frame {
+        int32_t page;          ///< -1 = empty
+        bool ref;
+        bool prefetched;
+    };
+
+    int find(size_t page);
+    esp_err_t fault(size_t page, int &frame);
+
+    FRAM &fram_;
+    FRAM::addr_t base_;
+    size_t size_;
+    size_t page_size_;
+    size_t readahead_;
+    std::vector<uint8_t> data_;
+    std::vector<Frame> frames_;
+    size_t hand_{0};
+    size_t last_page_{SIZE_MAX};
+    int last_frame_{-1};
+    Stats stats_{};
+    SemaphoreHandle_t lock_{nullptr};
+};
+
+/*
+  PagedVector<T>
+  - region layout: [Persistent<uint32_t> count x2 slots][T x capacity]
+  - elements live in FRAM and are accessed through a PageCache, so a table
+    larger than the RAM budget costs only pages * page_size bytes of RAM
+  - set()/push_back() are durable when they return; push_back() also
+    commits the new count
+  - scan() visits a range in order and benefits from read-ahead
+*/
+template<typename T>
+class PagedVector {
+    static_assert(std::is_trivially_copyable<T>::value, "T must be trivially_copyable");
+public:
+    static constexpr size_t HEADER_SIZE = 2 * (sizeof(Header) + sizeof(uint32_t));
+
+    /**
+     * @brief Construct a vector over a FRAM region.
+     * @param size      Region size in bytes (HEADER_SIZE + capacity * sizeof(T)).
+     * @param page_size Cache page size in bytes.
+     * @param pages     Cache frames.
+     * @param readahead Pages per fault in sequential scans.
+     */
+    PagedVector(FRAM &fram, FRAM::addr_t base, size_t size, size_t page_size = 64, size_t pages = 8,
+                size_t readahead = 4)
+        : count_store_(fram, base, 2),
+          cache_(fram, static_cast<FRAM::addr_t>(base + HEADER_SIZE), size > HEADER_SIZE ? size - HEADER_SIZE : 0,
+                 page_size, pages, readahead)
+    {}
+
+    /// Load the element count (0 on a blank region).
+    esp_err_t mount() {
+        uint32_t n = 0;
+        esp_err_t err = count_store_.load(n);
+        if (err == ESP_ERR_NOT_FOUND) n = 0;
+        else if (err != ESP_OK) return err;
+        if (n > capacity()) return ESP_ERR_INVALID_SIZE;
+        count_ = n;
+        return ESP_OK;
+    }
+
+    size_t size() const { return count_; }
+    size_t capacity() const { return cache_.size() / sizeof(T); }
+
+    esp_err_t get(size_t i, T &out) {
+        if (i >= count_) return ESP_ERR_INVALID_ARG;
+        return cache_.read(i * sizeof(T), &out, sizeof(T));
+    }
+
+    esp_err_t set(size_t i, const T &v) {
+        if (i >= count_) return ESP_ERR_INVALID_ARG;
+        return cache_.write(i * sizeof(T), &v, sizeof(T));
+    }
+
+    /// Append; the element is written before the count is committed.
+    esp_err_t push_back(const T &v) {
+        if (count_ >= capacity()) return ESP_ERR_NO_MEM;
+        esp_err_t err = cache_.write(count_ * sizeof(T), &v, sizeof(T));
+        if (err == ESP_OK) err = commit_count(count_ + 1);
+        return err;
+    }
+
+    /// Change the element count; new elements keep whatever the region holds.
+    esp_err_t resize(size_t n) {
+        if (n > capacity()) return ESP_ERR_NO_MEM;
+        return commit_count(n);
+    }
+
+    esp_err_t clear() { return resize(0); }
+
+    /**
+     * @brief Visit elements [first, first + n) in order.
+     * @param fn Called as fn(index, const T&); return false to stop.
+     */
+    template<typename Fn>
+    esp_err_t scan(size_t first, size_t n, Fn &&fn) {
+        if (first > count_ || n > count_ - first) return ESP_ERR_INVALID_ARG;
+        T v;
+        for (size_t i = first; i < first + n; ++i) {
+            esp_err_t err = cache_.read(i * sizeof(T), &v, sizeof(T));
+            if (err != ESP_OK) return err;
+            if (!fn(i, static_cast<const T &>(v))) break;
+        }
+        return ESP_OK;
+    }
+
+    PageCache::Stats stats() const { return cache_.stats(); }
+    void reset_stats() { cache_.reset_stats(); }
+
+private:
+    esp_err_t commit_count(size_t n) {
+        esp_err_t err = count_store_.store_immediate(static_cast<uint32_t>(n));
+        if (err == ESP_OK) count_ = n;
+        return err;
+    }
+
+    Persistent<uint32_t> count_store_;
+    PageCache cache_;
+    size_t count_{0};
+};
+
+} // namespace fram_store
@@ -1,11 +1,23 @@
 #include "fram.h"
 #include "fram_store.h"
+#include "fram_nvs.h"
+#include "fram_bench.h"
+#include "fram_lfs.h"
+#include "fram_id.h"
+#include "fram_scrub.h"
+#include "fram_crash.h"
+#include "fram_logsink.h"
+#include "fram_super.h"
+#include "fram_snapshot.h"
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include <cstring>
+#include <iterator>
 #include <inttypes.h>  
 
 static const char *TAG = "MAIN";
@@ -16,31 +28,228 @@ static const char *TAG = "MAIN";
 #define FRAM_PIN_MOSI   GPIO_NUM_15
 #define FRAM_PIN_MISO   GPIO_NUM_32
 
+// optional second chip mirroring the first (RAID-1), on its own host
+#define FRAM_MIRROR_ENABLE 0
+#define FRAM_MIRROR_HOST      HSPI_HOST
+#define FRAM_MIRROR_PIN_CS    GPIO_NUM_27
+#define FRAM_MIRROR_PIN_SCLK  GPIO_NUM_26
+#define FRAM_MIRROR_PIN_MOSI  GPIO_NUM_25
+#define FRAM_MIRROR_PIN_MISO  GPIO_NUM_33
+
 // ===== SPI / FRAM parameters =====
 #define FRAM_SPI_HOST     VSPI_HOST
 #define FRAM_SPI_FREQ_HZ  (1 * 1000 * 1000)
 
+// set to 1 when the host also serves other devices (ADC, display): the bus is
+// set up here as its owner would, FRAM only attaches to it
+#define FRAM_SHARED_BUS 0
+
+// ===== FRAM layout =====
+// Defaults for a blank chip. The superblock at 0x0000 records where each region
+// actually is, so a region placed by an earlier firmware stays where it is.
+#define FRAM_CRASH_BASE   0x0100   // CrashLog record (CrashLog::REGION_SIZE bytes)
+#define FRAM_ID_BASE      0x0300   // IdAllocator lease (IdAllocator::REGION_SIZE bytes)
+#define FRAM_CFG_BASE     0x0330   // Persistent<MyConfig>, 4 slots
+#define FRAM_CFG_V1_BASE  0x0200   // cfg of firmware without the superblock (raw MyConfig, version 1)
+#define FRAM_SNAP_BASE    0x03B0   // Snapshot of the sleep-cycle state
+#define FRAM_SNAP_SIZE    0x0050
+#define FRAM_NVS_BASE     0x0400   // fram_nvs key-value region
+#define FRAM_NVS_SIZE     0x0800
+#define FRAM_JOURNAL_BASE 0x0C00   // AppendJournal ring (benchmark), otherwise the LogSink ring
+#define FRAM_JOURNAL_SIZE 0x0400
+#define FRAM_LFS_BASE     0x1000   // LittleFS mounted at /fram
+#define FRAM_LFS_SIZE     0x1000
+
+// set to 1 to run the storage benchmarks at boot
+#define FRAM_RUN_BENCHMARKS 0
+
+// set to N > 0 to deep-sleep N seconds between measurements; the state survives in the snapshot
+#define FRAM_SLEEP_CYCLE_SEC 0
+
 // example struct to store
 struct MyConfig {
     uint32_t uptime_sec;
     uint32_t counter;
     uint8_t flags;
 };
-static_assert(std::is_trivially_copyable<MyConfig>::value, "POD required");
+// stored field by field: 9 bytes instead of the padded 12
+template<> struct fram_store::Fields<MyConfig> {
+    static constexpr auto list = std::make_tuple(field(&MyConfig::uptime_sec),
+                                                 field(&MyConfig::counter),
+                                                 field(&MyConfig::flags));
+};
+using ConfigStore = fram_store::Persistent<MyConfig>;
+
+static constexpr size_t CFG_SLOTS = 4;
+static constexpr uint16_t CFG_VERSION = 2;
+
+// cfg as firmware before the superblock stored it: the padded struct, version 1, at FRAM_CFG_V1_BASE
+struct MyConfigV1 {
+    uint32_t uptime_sec;
+    uint32_t counter;
+    uint8_t flags;
+};
+
+// RAM state carried across deep sleep
+struct SleepState {
+    uint32_t wakes;
+    int64_t awake_us;   ///< time spent awake over all cycles
+};
+
+// region ids in the superblock directory
+enum : uint16_t { REGION_CRASH = 1, REGION_CFG, REGION_ID, REGION_NVS, REGION_JOURNAL, REGION_LFS, REGION_SNAP };
+
+static const fram_store::Region DEFAULT_LAYOUT[] = {
+    {REGION_CRASH,   fram_store::RegionType::CRASH,      1, FRAM_CRASH_BASE,   fram_store::CrashLog::REGION_SIZE},
+    {REGION_CFG,     fram_store::RegionType::PERSISTENT, CFG_VERSION, FRAM_CFG_BASE,
+     CFG_SLOTS * (sizeof(fram_store::Header) + ConfigStore::PAYLOAD_SIZE)},
+    {REGION_ID,      fram_store::RegionType::ID_LEASE,   1, FRAM_ID_BASE,      fram_store::IdAllocator::REGION_SIZE},
+    {REGION_NVS,     fram_store::RegionType::NVS,        1, FRAM_NVS_BASE,     FRAM_NVS_SIZE},
+    {REGION_JOURNAL, fram_store::RegionType::LOG,        1, FRAM_JOURNAL_BASE, FRAM_JOURNAL_SIZE},
+    {REGION_LFS,     fram_store::RegionType::LFS,        1, FRAM_LFS_BASE,     FRAM_LFS_SIZE},
+    {REGION_SNAP,    fram_store::RegionType::SNAPSHOT,   1, FRAM_SNAP_BASE,    FRAM_SNAP_SIZE},
+};
+static_assert(FRAM_CRASH_BASE >= fram_store::Superblock::REGION_SIZE, "crash record overlaps the superblock");
+static_assert(FRAM_CRASH_BASE + fram_store::CrashLog::REGION_SIZE <= FRAM_ID_BASE, "crash record overlaps the ID lease");
+static_assert(FRAM_ID_BASE + fram_store::IdAllocator::REGION_SIZE <= FRAM_CFG_BASE, "ID lease overlaps cfg");
+static_assert(FRAM_CFG_BASE + CFG_SLOTS * (sizeof(fram_store::Header) + ConfigStore::PAYLOAD_SIZE) <= FRAM_SNAP_BASE,
+              "cfg overlaps the snapshot");
+static_assert(FRAM_SNAP_BASE + FRAM_SNAP_SIZE <= FRAM_NVS_BASE, "snapshot overlaps NVS");
+static_assert(sizeof(SleepState) + sizeof(fram_store::Snapshot::Trailer) <= FRAM_SNAP_SIZE, "snapshot region too small");
+
+// Carry a version 1 cfg over to the new store. The crash record now covers
+// FRAM_CFG_V1_BASE, so this runs once, on the boot that creates the superblock,
+// before anything is written there.
+static void migrate_cfg_v1(FRAM &fram, FRAM::addr_t base)
+{
+    fram_store::Persistent<MyConfigV1> old_store(fram, FRAM_CFG_V1_BASE, CFG_SLOTS, /*version=*/1);
+    MyConfigV1 old_cfg;
+    if (old_store.load(old_cfg) != ESP_OK) return;
+    ConfigStore store(fram, base, CFG_SLOTS, CFG_VERSION);
+    const MyConfig cfg = {old_cfg.uptime_sec, old_cfg.counter, old_cfg.flags};
+    if (store.store_immediate(cfg) == ESP_OK) {
+        ESP_LOGI(TAG, "cfg v1 at 0x%04X migrated to 0x%04X", FRAM_CFG_V1_BASE, (unsigned)base);
+    } else {
+        ESP_LOGW(TAG, "cfg v1 migration failed");
+    }
+}
 
 extern "C" void app_main(void)
 {
+#if FRAM_SHARED_BUS
+    spi_bus_config_t buscfg = {};
+    buscfg.mosi_io_num     = FRAM_PIN_MOSI;
+    buscfg.miso_io_num     = FRAM_PIN_MISO;
+    buscfg.sclk_io_num     = FRAM_PIN_SCLK;
+    buscfg.quadwp_io_num   = -1;
+    buscfg.quadhd_io_num   = -1;
+    buscfg.max_transfer_sz = 4096;
+    buscfg.flags           = SPICOMMON_BUSFLAG_MASTER;
+    ESP_ERROR_CHECK(spi_bus_initialize(FRAM_SPI_HOST, &buscfg, SPI_DMA_CH_AUTO));
+    FRAM fram(FRAM_SPI_HOST, FRAM_PIN_CS, FRAM_SPI_FREQ_HZ);
+#else
     FRAM fram(FRAM_SPI_HOST, FRAM_PIN_CS, FRAM_PIN_SCLK, FRAM_PIN_MOSI, FRAM_PIN_MISO, FRAM_SPI_FREQ_HZ);
+#endif
     ESP_ERROR_CHECK(fram.init());
+#if FRAM_MIRROR_ENABLE
+    FRAM fram_mirror(FRAM_MIRROR_HOST, FRAM_MIRROR_PIN_CS, FRAM_MIRROR_PIN_SCLK, FRAM_MIRROR_PIN_MOSI, FRAM_MIRROR_PIN_MISO, FRAM_SPI_FREQ_HZ);
+    ESP_ERROR_CHECK(fram_mirror.init());
+    ESP_ERROR_CHECK(fram.set_mirror(&fram_mirror));
+#endif
 
-    // choose base address in FRAM (must not overlap other data)
-    constexpr FRAM::addr_t BASE_ADDR = 0x0200;
-    // use 4 rotating slots -> simple wear-leveling
-    fram_store::Persistent<MyConfig> store(fram, BASE_ADDR, /*slots=*/4, /*version=*/1);
+    // locate every store with one read of the superblock; new regions are added in place
+    fram_store::Superblock sb(fram);
+    const bool new_directory = sb.mount() == ESP_ERR_NOT_FOUND;
+    if (new_directory) ESP_ERROR_CHECK(sb.format());
+    fram_store::Region crash_rgn, cfg_rgn, id_rgn, nvs_rgn, journal_rgn, lfs_rgn, snap_rgn;
+    fram_store::Region *layout[] = {&crash_rgn, &cfg_rgn, &id_rgn, &nvs_rgn, &journal_rgn, &lfs_rgn, &snap_rgn};
+    for (size_t i = 0; i < std::size(DEFAULT_LAYOUT); ++i) {
+        ESP_ERROR_CHECK(sb.ensure(DEFAULT_LAYOUT[i], *layout[i]));
+    }
+    if (new_directory) migrate_cfg_v1(fram, cfg_rgn.base);
+
+#if FRAM_SLEEP_CYCLE_SEC
+    // after a deep-sleep wake the state is back before anything else runs
+    SleepState sleep_state = {};
+    fram_store::Snapshot snap(fram, snap_rgn.base, snap_rgn.size);
+    ESP_ERROR_CHECK(snap.add(sleep_state));
+    if (snap.restore() == ESP_OK) {
+        const auto t = snap.timing();
+        ESP_LOGI(TAG, "Wake %" PRIu32 ": state restored in %" PRIu32 " us, ready at %" PRId64 " us",
+                 sleep_state.wakes, t.restore_us, t.ready_us);
+    }
+#endif
+
+    // report the record of the previous crash, then arm the panic hook
+    fram_store::CrashLog::Record crash;
+    if (fram_store::CrashLog::load(fram, crash_rgn.base, crash) == ESP_OK) {
+        fram_store::CrashLog::print(crash);
+        fram_store::CrashLog::clear(fram, crash_rgn.base);
+    }
+    ESP_ERROR_CHECK(fram_store::CrashLog::install(fram, crash_rgn.base));
+
+#if !FRAM_RUN_BENCHMARKS
+    // keep the recent log in FRAM as binary records; dump_hex() + tools/fram_logdecode read it back
+    fram_store::LogSink log_sink(fram, journal_rgn.base, journal_rgn.size);
+    if (log_sink.mount() == ESP_OK) log_sink.start();
+#endif
+
+    ESP_ERROR_CHECK(fram_nvs_init(fram, nvs_rgn.base, nvs_rgn.size));
+
+    // hot key kept in FRAM through the nvs_*-compatible API
+    nvs_handle_t nvs;
+    if (fram_nvs_open("app", NVS_READWRITE, &nvs) == ESP_OK) {
+        uint32_t boots = 0;
+        fram_nvs_get_u32(nvs, "boots", &boots);
+        fram_nvs_set_u32(nvs, "boots", ++boots);
+        fram_nvs_commit(nvs);
+        fram_nvs_close(nvs);
+        ESP_LOGI(TAG, "Boot count: %" PRIu32, boots);
+    }
+
+    // message IDs stay unique across reboots with one FRAM commit per lease
+    fram_store::IdAllocator ids(fram, id_rgn.base, 64);
+    uint32_t msg_id;
+    if (ids.mount() == ESP_OK && ids.next(msg_id) == ESP_OK) {
+        ESP_LOGI(TAG, "First message ID: %" PRIu32, msg_id);
+    }
+
+#if FRAM_RUN_BENCHMARKS
+    fram_bench::nvs_commit_latency(100);
+    if (fram_bench::mount_spiffs() == ESP_OK) {
+        fram_store::AppendJournal journal(fram, journal_rgn.base, journal_rgn.size);
+        journal.add_file(0, "/spiffs/journal.log");
+        if (journal.mount() == ESP_OK) {
+            fram_bench::journal_append_latency(journal, 0, "/spiffs/direct.log", 100);
+        }
+    }
+    // scratch stores in the journal region, after the journal benchmark is done with it
+    for (size_t tasks : {1, 2, 4, 8}) {
+        fram_bench::group_commit_rate(fram, journal_rgn.base, journal_rgn.size, tasks, 200);
+    }
+    fram_bench::fast_path_latency(fram, journal_rgn.base, journal_rgn.size, 200);
+    fram_bench::direct_latency(fram, journal_rgn.base, 200);
+    {
+        fram_store::LfsDevice lfs(fram, lfs_rgn.base, lfs_rgn.size);
+        if (lfs.mount() == ESP_OK && lfs.register_vfs("/fram") == ESP_OK) {
+            fram_bench::file_ops_rate("/fram", 100);
+            fram_bench::file_ops_rate("/spiffs", 100);
+        }
+    }
+#endif
+
+    // base address from the directory; 4 rotating slots -> simple wear-leveling
+    const FRAM::addr_t BASE_ADDR = cfg_rgn.base;
+    ConfigStore store(fram, BASE_ADDR, /*slots=*/CFG_SLOTS, CFG_VERSION);
 
     // mutex to protect store if multiple tasks use it
     SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
 
+    // re-check the config slots in the background, repairing from the other slots
+    fram_store::Scrubber scrubber(fram);
+    scrubber.add_persistent("cfg", BASE_ADDR, CFG_SLOTS, ConfigStore::PAYLOAD_SIZE, mutex);
+    scrubber.start();
+
     // load existing config (if any)
     MyConfig cfg = {0, 0, 0}; // <--- fully initialize to avoid warnings
     if (store.load(cfg) == ESP_OK) {
@@ -55,6 +264,14 @@ extern "C" void app_main(void)
         xSemaphoreGive(mutex);
     }
 
+#if FRAM_SLEEP_CYCLE_SEC
+    // one measurement per wake, then back to sleep with the state in FRAM
+    sleep_state.wakes++;
+    sleep_state.awake_us += esp_timer_get_time();
+    ESP_ERROR_CHECK(esp_sleep_enable_timer_wakeup(FRAM_SLEEP_CYCLE_SEC * 1000000ULL));
+    ESP_ERROR_CHECK(snap.save_and_sleep());
+#endif
+
     // periodic task: update and persist once per minute
     for (;;) {
         vTaskDelay(pdMS_TO_TICKS(60000)); // 60s
@@ -75,5 +292,11 @@ extern "C" void app_main(void)
         } else {
             ESP_LOGW(TAG, "Save failed: %d", err);
         }
+#if FRAM_SHARED_BUS
+        // what FRAM took from the other devices on the bus
+        const FRAM::BusStats bus = fram.bus_stats();
+        ESP_LOGI(TAG, "FRAM bus time: %" PRIu32 " transactions, %" PRIu64 " us, longest hold %" PRIu32 " us",
+                 bus.transactions, bus.busy_us, bus.longest_hold_us);
+#endif
     }
 }
\ No newline at end of file
@@ -0,0 +1,145 @@
+/**
+ * @file fram_logdecode.cpp
+ * @author Petr Vanek (petr@fotoventus.cz)
+ * @brief Host decoder for the binary FRAM log written by fram_store::LogSink.
+ * @date 2025-10-23
+ *
+ * @copyright Copyright (c) 2025 Petr Vanek
+ *
+ *  Build on Linux:
+ *    g++ -std=c++20 -O2 -I../main fram_logdecode.cpp -o fram_logdecode
+ *
+ *  Usage:
+ *    fram_logdecode <firmware.elf> <ring>
+ *
+ *  <ring> is either a raw image of the log region or a console capture that
+ *  contains the "FRAMLOG <offset> <hex>" lines printed by LogSink::dump_hex().
+ *  Format strings and tags are looked up in the allocated sections of the ELF
+ *  the records were written with.
+ */
+
+#include <elf.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "fram_logfmt.h"
+
+using namespace fram_store::logfmt;
+
+struct Image {
+    std::vector<uint8_t> file;
+    std::vector<Elf32_Shdr> sections;
+};
+
+static bool load_file(const char *path, std::vector<uint8_t> &out)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    out.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static bool load_elf(const char *path, Image &img)
+{
+    if (!load_file(path, img.file) || img.file.size() < sizeof(Elf32_Ehdr)) return false;
+    Elf32_Ehdr eh;
+    memcpy(&eh, img.file.data(), sizeof(eh));
+    if (memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 || eh.e_ident[EI_CLASS] != ELFCLASS32) return false;
+    for (unsigned i = 0; i < eh.e_shnum; ++i) {
+        const size_t off = eh.e_shoff + (size_t)i * eh.e_shentsize;
+        if (off + sizeof(Elf32_Shdr) > img.file.size()) return false;
+        Elf32_Shdr sh;
+        memcpy(&sh, img.file.data() + off, sizeof(sh));
+        if ((sh.sh_flags & SHF_ALLOC) && sh.sh_type == SHT_PROGBITS && sh.sh_offset + sh.sh_size <= img.file.size()) {
+            img.sections.push_back(sh);
+        }
+    }
+    return true;
+}
+
+// firmware address -> string inside the ELF file image
+static const char *resolve_elf(uint32_t addr, void *ctx)
+{
+    const Image &img = *static_cast<const Image *>(ctx);
+    for (const Elf32_Shdr &sh : img.sections) {
+        if (addr >= sh.sh_addr && addr < sh.sh_addr + sh.sh_size) {
+            const char *s = reinterpret_cast<const char *>(img.file.data() + sh.sh_offset + (addr - sh.sh_addr));
+            // must be terminated inside the section
+            if (memchr(s, 0, sh.sh_addr + sh.sh_size - addr)) return s;
+            return nullptr;
+        }
+    }
+    return nullptr;
+}
+
+// "FRAMLOG <offset> <hex>" lines anywhere in a console capture
+static bool parse_hex_dump(const std::vector<uint8_t> &text, std::vector<uint8_t> &ring)
+{
+    std::istringstream in(std::string(text.begin(), text.end()));
+    std::string line;
+    bool found = false;
+    while (std::getline(in, line)) {
+        const size_t at = line.find("FRAMLOG ");
+        if (at == std::string::npos) continue;
+        unsigned offset;
+        char hex[256];
+        if (sscanf(line.c_str() + at, "FRAMLOG %x %255s", &offset, hex) != 2) continue;
+        const size_t n = strlen(hex) / 2;
+        if (ring.size() < offset + n) ring.resize(offset + n);
+        for (size_t i = 0; i < n; ++i) {
+            char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+            ring[offset + i] = static_cast<uint8_t>(strtoul(byte, nullptr, 16));
+        }
+        found = true;
+    }
+    return found;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <firmware.elf> <ring.bin | console capture>\n", argv[0]);
+        return 2;
+    }
+    Image img;
+    if (!load_elf(argv[1], img)) {
+        fprintf(stderr, "%s: not a 32-bit ELF file\n", argv[1]);
+        return 1;
+    }
+    std::vector<uint8_t> input, ring;
+    if (!load_file(argv[2], input)) {
+        fprintf(stderr, "%s: cannot read\n", argv[2]);
+        return 1;
+    }
+    if (!parse_hex_dump(input, ring)) ring = std::move(input);
+
+    const std::vector<Batch> batches = scan(ring.data(), ring.size());
+    uint32_t build = batches.empty() ? 0 : batches.front().hdr.build;
+    size_t lines = 0;
+    for (const Batch &b : batches) {
+        if (b.hdr.build != build) {
+            fprintf(stderr, "note: batch %u was written by build %08x\n", (unsigned)b.hdr.seq, (unsigned)b.hdr.build);
+            build = b.hdr.build;
+        }
+        for (size_t o = 0; o + RECORD_HDR <= b.records.size();) {
+            const uint8_t *rec = b.records.data() + o;
+            if (rec[0] < RECORD_HDR || o + rec[0] > b.records.size()) break;
+            uint16_t dt;
+            memcpy(&dt, rec + 1, sizeof(dt));
+            const uint32_t ms = b.hdr.base_ms + dt;
+            const std::string text = format(rec, resolve_elf, &img);
+            printf("[%6u.%03u] %s", ms / 1000, ms % 1000, text.c_str());
+            if (text.empty() || text.back() != '\n') putchar('\n');
+            o += rec[0];
+            ++lines;
+        }
+    }
+    fprintf(stderr, "%zu batches, %zu lines\n", batches.size(), lines);
+    return 0;
+}